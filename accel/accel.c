@@ -34,6 +34,7 @@
 #include "qom/object.h"
 #include "qemu/error-report.h"
 #include "qemu/option.h"
+#include "qemu/config-file.h"
 #include "qapi/error.h"
 
 static const TypeInfo accel_type = {
@@ -52,15 +53,46 @@ static AccelClass *accel_find(const char *opt_name)
     return ac;
 }
 
+/*
+ * Set the -accel options that are properties of the accelerator object.
+ * "accel" and "thread" are handled elsewhere, and options that belong to
+ * another accelerator of a list such as "kvm:tcg" are skipped.
+ */
+static int accel_set_property(void *opaque, const char *name,
+                              const char *value, Error **errp)
+{
+    Object *obj = opaque;
+    Error *local_err = NULL;
+
+    if (!object_property_find(obj, name, NULL)) {
+        return 0;
+    }
+
+    object_property_parse(obj, value, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return -1;
+    }
+    return 0;
+}
+
 static int accel_init_machine(AccelClass *acc, MachineState *ms)
 {
     ObjectClass *oc = OBJECT_CLASS(acc);
     const char *cname = object_class_get_name(oc);
     AccelState *accel = ACCEL(object_new(cname));
+    QemuOpts *opts = qemu_opts_find(qemu_find_opts("accel"), NULL);
+    Error *local_err = NULL;
     int ret;
     ms->accelerator = accel;
     *(acc->allowed) = true;
-    ret = acc->init_machine(ms);
+    if (opts && qemu_opt_foreach(opts, accel_set_property, accel,
+                                 &local_err)) {
+        error_report_err(local_err);
+        ret = -EINVAL;
+    } else {
+        ret = acc->init_machine(ms);
+    }
     if (ret < 0) {
         ms->accelerator = NULL;
         *(acc->allowed) = false;
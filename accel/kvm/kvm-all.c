@@ -23,6 +23,7 @@
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "hw/hw.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
@@ -67,6 +68,7 @@
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    uint32_t kvm_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -92,6 +94,10 @@ struct KVMState
     int intx_set_mask;
     bool sync_mmu;
     bool manual_dirty_log_protect;
+    /* Number of entries of each vCPU dirty ring, 0 if not used */
+    uint32_t kvm_dirty_ring_size;
+    uint32_t kvm_dirty_ring_bytes;
+    QemuThread dirty_ring_reaper;
     /* The man page (and posix) say ioctl numbers are signed int, but
      * they're not.  Linux, glibc and *BSD all treat ioctl numbers as
      * unsigned, and treating them as signed here can break things */
@@ -146,8 +152,17 @@ static const KVMCapabilityInfo kvm_required_capabilites[] = {
     KVM_CAP_LAST_INFO
 };
 
-#define kvm_slots_lock(kml)      qemu_mutex_lock(&(kml)->slots_lock)
-#define kvm_slots_unlock(kml)    qemu_mutex_unlock(&(kml)->slots_lock)
+/*
+ * Protects the slots of all KVMMemoryListeners: the dirty ring of a vCPU
+ * contains pages of any address space, so the rings cannot be collected
+ * with a per-listener lock.
+ */
+static QemuMutex kml_slots_lock;
+
+#define kvm_slots_lock()      qemu_mutex_lock(&kml_slots_lock)
+#define kvm_slots_unlock()    qemu_mutex_unlock(&kml_slots_lock)
+
+static uint64_t kvm_dirty_ring_reap(KVMState *s);
 
 int kvm_get_max_memslots(void)
 {
@@ -176,7 +191,7 @@ int kvm_memcrypt_encrypt_data(uint8_t *ptr, uint64_t len)
     return 1;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kml_slots_lock held */
 static KVMSlot *kvm_get_free_slot(KVMMemoryListener *kml)
 {
     KVMState *s = kvm_state;
@@ -197,14 +212,14 @@ bool kvm_has_free_slot(MachineState *ms)
     bool result;
     KVMMemoryListener *kml = &s->memory_listener;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     result = !!kvm_get_free_slot(kml);
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return result;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kml_slots_lock held */
 static KVMSlot *kvm_alloc_slot(KVMMemoryListener *kml)
 {
     KVMSlot *slot = kvm_get_free_slot(kml);
@@ -265,7 +280,7 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
     KVMMemoryListener *kml = &s->memory_listener;
     int i, ret = 0;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     for (i = 0; i < s->nr_slots; i++) {
         KVMSlot *mem = &kml->slots[i];
 
@@ -275,7 +290,7 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
             break;
         }
     }
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return ret;
 }
@@ -331,15 +346,28 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        /* Collect what is left in the ring before unmapping it */
+        kvm_dirty_ring_reap(s);
+        ret = munmap(cpu->kvm_dirty_gfns, s->kvm_dirty_ring_bytes);
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    /* The kernel keeps its ring position when the vCPU is reused */
+    vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id,
+                        uint32_t *fetch_index)
 {
     struct KVMParkedVcpu *cpu;
 
@@ -349,11 +377,13 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            *fetch_index = cpu->kvm_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
     }
 
+    *fetch_index = 0;
     return kvm_vm_ioctl(s, KVM_CREATE_VCPU, (void *)vcpu_id);
 }
 
@@ -365,7 +395,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu), &cpu->kvm_fetch_index);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -395,6 +425,19 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_bytes,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            ret = -errno;
+            cpu->kvm_dirty_gfns = NULL;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -418,7 +461,7 @@ static int kvm_mem_flags(MemoryRegion *mr)
     return flags;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kml_slots_lock held */
 static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
                                  MemoryRegion *mr)
 {
@@ -444,7 +487,7 @@ static int kvm_section_update_flags(KVMMemoryListener *kml,
         return 0;
     }
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     mem = kvm_lookup_matching_slot(kml, start_addr, size);
     if (!mem) {
@@ -455,7 +498,7 @@ static int kvm_section_update_flags(KVMMemoryListener *kml,
     ret = kvm_slot_update_flags(kml, mem, section->mr);
 
 out:
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
     return ret;
 }
 
@@ -507,13 +550,49 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
 
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
+/* Allocate the dirty bitmap of a slot, called with kml_slots_lock held */
+static void kvm_slot_init_dirty_bitmap(KVMSlot *mem)
+{
+    hwaddr bitmap_size;
+
+    if (mem->dirty_bmap) {
+        return;
+    }
+
+    /* XXX bad kernel interface alert
+     * For dirty bitmap, kernel allocates array of size aligned to
+     * bits-per-long.  But for case when the kernel is 64bits and
+     * the userspace is 32bits, userspace can't align to the same
+     * bits-per-long, since sizeof(long) is different between kernel
+     * and user space.  This way, userspace will provide buffer which
+     * may be 4 bytes less than the kernel will use, resulting in
+     * userspace memory corruption (which is not detectable by valgrind
+     * too, in most cases).
+     * So for now, let's align to 64 instead of HOST_LONG_BITS here, in
+     * a hope that sizeof(long) won't become >8 any time soon.
+     */
+    bitmap_size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
+                        /*HOST_LONG_BITS*/ 64) / 8;
+    /* Allocate on the first use, once and for all */
+    mem->dirty_bmap = g_malloc0(bitmap_size);
+}
+
+/* Push the dirty bitmap of a slot into the RAMBlock dirty bitmaps */
+static void kvm_slot_sync_dirty_pages(KVMSlot *mem)
+{
+    ram_addr_t pages = mem->memory_size / qemu_real_host_page_size;
+
+    cpu_physical_memory_set_dirty_lebitmap(mem->dirty_bmap,
+                                           mem->ram_start_offset, pages);
+}
+
 /**
  * kvm_physical_sync_dirty_bitmap - Sync dirty bitmap from kernel space
  *
  * This function will first try to fetch dirty bitmap from the kernel,
  * and then updates qemu's dirty bitmap.
  *
- * NOTE: caller must be with kml->slots_lock held.
+ * NOTE: caller must be with kml_slots_lock held.
  *
  * @kml: the KVM memory listener object
  * @section: the memory section to sync the dirty bitmap with
@@ -535,24 +614,7 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
             goto out;
         }
 
-        /* XXX bad kernel interface alert
-         * For dirty bitmap, kernel allocates array of size aligned to
-         * bits-per-long.  But for case when the kernel is 64bits and
-         * the userspace is 32bits, userspace can't align to the same
-         * bits-per-long, since sizeof(long) is different between kernel
-         * and user space.  This way, userspace will provide buffer which
-         * may be 4 bytes less than the kernel will use, resulting in
-         * userspace memory corruption (which is not detectable by valgrind
-         * too, in most cases).
-         * So for now, let's align to 64 instead of HOST_LONG_BITS here, in
-         * a hope that sizeof(long) won't become >8 any time soon.
-         */
-        size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
-                     /*HOST_LONG_BITS*/ 64) / 8;
-        if (!mem->dirty_bmap) {
-            /* Allocate on the first log_sync, once and for all */
-            mem->dirty_bmap = g_malloc0(size);
-        }
+        kvm_slot_init_dirty_bitmap(mem);
 
         d.dirty_bitmap = mem->dirty_bmap;
         d.slot = mem->slot | (kml->as_id << 16);
@@ -606,7 +668,7 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
         return 0;
     }
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     /* Find any possible slot that covers the section */
     for (i = 0; i < s->nr_slots; i++) {
@@ -716,11 +778,174 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
     /* This handles the NULL case well */
     g_free(bmap_clear);
 
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return ret;
 }
 
+/*
+ * KVM dirty ring
+ *
+ * With KVM_CAP_DIRTY_LOG_RING the kernel reports the pages dirtied by
+ * each vCPU in a ring shared with QEMU, instead of in a bitmap per slot
+ * that has to be fetched as a whole.  The rings are collected into the
+ * slot dirty bitmaps by a reaper thread, by vCPUs whose ring is full and
+ * on every log sync, so the cost of a sync depends on the number of dirty
+ * pages rather than on the size of the guest.
+ */
+
+static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
+{
+    return atomic_load_acquire(&gfn->flags) == KVM_DIRTY_GFN_F_DIRTY;
+}
+
+static void dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
+{
+    atomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+}
+
+/* Called with kml_slots_lock held */
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset)
+{
+    KVMMemoryListener *kml = NULL;
+    KVMSlot *mem;
+    int i;
+
+    for (i = 0; i < s->nr_as; i++) {
+        if (s->as[i].ml && s->as[i].ml->as_id == as_id) {
+            kml = s->as[i].ml;
+            break;
+        }
+    }
+    if (!kml || slot_id >= s->nr_slots) {
+        return;
+    }
+
+    mem = &kml->slots[slot_id];
+    if (!mem->memory_size ||
+        offset >= (mem->memory_size >> TARGET_PAGE_BITS)) {
+        return;
+    }
+
+    kvm_slot_init_dirty_bitmap(mem);
+    set_bit(offset, mem->dirty_bmap);
+}
+
+/* Called with the iothread lock and kml_slots_lock held */
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns, *cur;
+    uint32_t ring_size = s->kvm_dirty_ring_size;
+    uint32_t count = 0, fetch = cpu->kvm_fetch_index;
+
+    if (!dirty_gfns) {
+        /* The vCPU is not created yet */
+        return 0;
+    }
+
+    while (true) {
+        cur = &dirty_gfns[fetch % ring_size];
+        if (!dirty_gfn_is_dirtied(cur)) {
+            break;
+        }
+        kvm_dirty_ring_mark_page(s, cur->slot >> 16, cur->slot & 0xffff,
+                                 cur->offset);
+        dirty_gfn_set_collected(cur);
+        fetch++;
+        count++;
+    }
+    cpu->kvm_fetch_index = fetch;
+    cpu->dirty_pages += count;
+
+    return count;
+}
+
+/* Called with the iothread lock and kml_slots_lock held */
+static uint64_t kvm_dirty_ring_reap_locked(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int64_t stamp = get_clock();
+    int ret;
+
+    CPU_FOREACH(cpu) {
+        total += kvm_dirty_ring_reap_one(s, cpu);
+    }
+
+    if (total) {
+        /* Let the kernel write-protect the collected pages again */
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        assert(ret == total);
+    }
+
+    trace_kvm_dirty_ring_reap(total, get_clock() - stamp);
+    return total;
+}
+
+/* Called with the iothread lock held */
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    uint64_t total;
+
+    kvm_slots_lock();
+    total = kvm_dirty_ring_reap_locked(s);
+    kvm_slots_unlock();
+
+    return total;
+}
+
+static void do_kvm_cpu_synchronize_kick(CPUState *cpu, run_on_cpu_data arg)
+{
+    /* No need to do anything */
+}
+
+/*
+ * Collect the dirty rings.  While global dirty logging is on (i.e. for
+ * migration) all vCPUs are kicked out of the guest first, so that pages
+ * which are still in hardware buffers such as Intel PML reach the rings.
+ *
+ * Called with the iothread lock held
+ */
+static void kvm_dirty_ring_flush(KVMState *s)
+{
+    CPUState *cpu;
+
+    if (global_dirty_log) {
+        CPU_FOREACH(cpu) {
+            run_on_cpu(cpu, do_kvm_cpu_synchronize_kick, RUN_ON_CPU_NULL);
+        }
+    }
+
+    kvm_dirty_ring_reap(s);
+}
+
+/*
+ * Collect the rings regularly, so that vCPUs rarely have to exit because
+ * their ring is full.
+ */
+static void *kvm_dirty_ring_reaper_thread(void *data)
+{
+    KVMState *s = data;
+
+    trace_kvm_dirty_ring_reaper("init");
+
+    while (true) {
+        g_usleep(G_USEC_PER_SEC);
+
+        qemu_mutex_lock_iothread();
+        kvm_dirty_ring_reap(s);
+        qemu_mutex_unlock_iothread();
+    }
+
+    return NULL;
+}
+
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state && kvm_state->kvm_dirty_ring_size;
+}
+
 static void kvm_coalesce_mmio_region(MemoryListener *listener,
                                      MemoryRegionSection *secion,
                                      hwaddr start, hwaddr size)
@@ -980,7 +1205,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     ram = memory_region_get_ram_ptr(mr) + section->offset_within_region +
           (start_addr - section->offset_within_address_space);
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     if (!add) {
         mem = kvm_lookup_matching_slot(kml, start_addr, size);
@@ -988,7 +1213,19 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             goto out;
         }
         if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-            kvm_physical_sync_dirty_bitmap(kml, section);
+            if (kvm_state->kvm_dirty_ring_size) {
+                /*
+                 * vCPUs cannot be kicked with kml_slots_lock held, so
+                 * pages still in hardware buffers are lost, as with
+                 * KVM_GET_DIRTY_LOG while vCPUs are running.
+                 */
+                kvm_dirty_ring_reap_locked(kvm_state);
+                if (mem->dirty_bmap) {
+                    kvm_slot_sync_dirty_pages(mem);
+                }
+            } else {
+                kvm_physical_sync_dirty_bitmap(kml, section);
+            }
         }
 
         /* unregister the slot */
@@ -1010,6 +1247,9 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     mem->memory_size = size;
     mem->start_addr = start_addr;
     mem->ram = ram;
+    mem->ram_start_offset = memory_region_get_ram_addr(mr) +
+        section->offset_within_region +
+        (start_addr - section->offset_within_address_space);
     mem->flags = kvm_mem_flags(mr);
 
     err = kvm_set_user_memory_region(kml, mem, true);
@@ -1020,7 +1260,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     }
 
 out:
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 }
 
 static void kvm_region_add(MemoryListener *listener,
@@ -1047,14 +1287,37 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     r = kvm_physical_sync_dirty_bitmap(kml, section);
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
     if (r < 0) {
         abort();
     }
 }
 
+static void kvm_log_sync_global(MemoryListener *listener)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    KVMState *s = kvm_state;
+    KVMSlot *mem;
+    int i;
+
+    /* Flush all kernel dirty addresses into the slot dirty bitmaps */
+    kvm_dirty_ring_flush(s);
+
+    kvm_slots_lock();
+    for (i = 0; i < s->nr_slots; i++) {
+        mem = &kml->slots[i];
+        if (mem->memory_size && mem->flags & KVM_MEM_LOG_DIRTY_PAGES &&
+            mem->dirty_bmap) {
+            kvm_slot_sync_dirty_pages(mem);
+            bitmap_zero(mem->dirty_bmap,
+                        mem->memory_size >> TARGET_PAGE_BITS);
+        }
+    }
+    kvm_slots_unlock();
+}
+
 static void kvm_log_clear(MemoryListener *listener,
                           MemoryRegionSection *section)
 {
@@ -1149,7 +1412,6 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 {
     int i;
 
-    qemu_mutex_init(&kml->slots_lock);
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
 
@@ -1161,8 +1423,12 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.region_del = kvm_region_del;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
-    kml->listener.log_sync = kvm_log_sync;
-    kml->listener.log_clear = kvm_log_clear;
+    if (s->kvm_dirty_ring_size) {
+        kml->listener.log_sync_global = kvm_log_sync_global;
+    } else {
+        kml->listener.log_sync = kvm_log_sync;
+        kml->listener.log_clear = kvm_log_clear;
+    }
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1793,6 +2059,7 @@ static int kvm_init(MachineState *ms)
     QTAILQ_INIT(&s->kvm_sw_breakpoints);
 #endif
     QLIST_INIT(&s->kvm_parked_vcpus);
+    qemu_mutex_init(&kml_slots_lock);
     s->vmfd = -1;
     s->fd = qemu_open("/dev/kvm", O_RDWR);
     if (s->fd == -1) {
@@ -1901,7 +2168,40 @@ static int kvm_init(MachineState *ms)
     s->coalesced_pio = s->coalesced_mmio &&
                        kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
-    s->manual_dirty_log_protect =
+    /*
+     * The dirty ring has to be enabled before any vCPU is created.  It
+     * replaces KVM_GET_DIRTY_LOG and KVM_CLEAR_DIRTY_LOG, so manual dirty
+     * log protection is not used with it.
+     */
+    if (s->kvm_dirty_ring_size) {
+        uint32_t ring_bytes =
+            s->kvm_dirty_ring_size * sizeof(struct kvm_dirty_gfn);
+        int max_bytes = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+
+        if (max_bytes <= 0) {
+            error_report("KVM dirty ring not available, "
+                         "use dirty-ring-size=0 or a newer host kernel");
+            ret = -EINVAL;
+            goto err;
+        }
+        if (ring_bytes > max_bytes) {
+            error_report("KVM dirty ring size %" PRIu32 " too big "
+                         "(maximum is %zu)", s->kvm_dirty_ring_size,
+                         max_bytes / sizeof(struct kvm_dirty_gfn));
+            ret = -EINVAL;
+            goto err;
+        }
+
+        ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+        if (ret) {
+            error_report("Enabling of KVM dirty ring failed: %s",
+                         strerror(-ret));
+            goto err;
+        }
+        s->kvm_dirty_ring_bytes = ring_bytes;
+    }
+
+    s->manual_dirty_log_protect = !s->kvm_dirty_ring_size &&
         kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
     if (s->manual_dirty_log_protect) {
         ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0, 1);
@@ -2000,6 +2300,12 @@ static int kvm_init(MachineState *ms)
         qemu_balloon_inhibit(true);
     }
 
+    if (s->kvm_dirty_ring_size) {
+        qemu_thread_create(&s->dirty_ring_reaper, "kvm-reaper",
+                           kvm_dirty_ring_reaper_thread, s,
+                           QEMU_THREAD_DETACHED);
+    }
+
     return 0;
 
 err:
@@ -2307,6 +2613,17 @@ int kvm_cpu_exec(CPUState *cpu)
         case KVM_EXIT_INTERNAL_ERROR:
             ret = kvm_handle_internal_error(cpu, run);
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /*
+             * Collecting the rings also resets them, so the vCPU can
+             * continue afterwards.
+             */
+            trace_kvm_dirty_ring_full(cpu->cpu_index);
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SYSTEM_EVENT:
             switch (run->system_event.type) {
             case KVM_SYSTEM_EVENT_SHUTDOWN:
@@ -2865,6 +3182,37 @@ static bool kvm_accel_has_memory(MachineState *ms, AddressSpace *as,
     return false;
 }
 
+static void kvm_get_dirty_ring_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value = s->kvm_dirty_ring_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void kvm_set_dirty_ring_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (value & (value - 1)) {
+        error_setg(errp, "dirty-ring-size must be a power of two");
+        return;
+    }
+
+    s->kvm_dirty_ring_size = value;
+}
+
 static void kvm_accel_class_init(ObjectClass *oc, void *data)
 {
     AccelClass *ac = ACCEL_CLASS(oc);
@@ -2872,6 +3220,14 @@ static void kvm_accel_class_init(ObjectClass *oc, void *data)
     ac->init_machine = kvm_init;
     ac->has_memory = kvm_accel_has_memory;
     ac->allowed = &kvm_allowed;
+
+    object_class_property_add(oc, "dirty-ring-size", "uint32",
+                              kvm_get_dirty_ring_size,
+                              kvm_set_dirty_ring_size,
+                              NULL, NULL, &error_abort);
+    object_class_property_set_description(oc, "dirty-ring-size",
+        "Number of entries of the per-vCPU dirty rings (0 = use dirty "
+        "log bitmaps)", &error_abort);
 }
 
 static const TypeInfo kvm_accel_type = {
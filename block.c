@@ -864,6 +864,28 @@ int bdrv_parse_discard_flags(const char *mode, int *flags)
     return 0;
 }
 
+/**
+ * Set open flags for a given AIO mode
+ *
+ * Return 0 on success, -1 if the AIO mode was invalid.
+ */
+int bdrv_parse_aio(const char *mode, int *flags)
+{
+    if (!strcmp(mode, "threads")) {
+        /* do nothing, default */
+    } else if (!strcmp(mode, "native")) {
+        *flags |= BDRV_O_NATIVE_AIO;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (!strcmp(mode, "io_uring")) {
+        *flags |= BDRV_O_IO_URING;
+#endif
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 /**
  * Set open flags for a given cache mode
  *
@@ -971,7 +993,7 @@ static void bdrv_temp_snapshot_options(int *child_flags, QDict *child_options,
 
     /* aio=native doesn't work for cache.direct=off, so disable it for the
      * temporary snapshot */
-    *child_flags &= ~BDRV_O_NATIVE_AIO;
+    *child_flags &= ~(BDRV_O_NATIVE_AIO | BDRV_O_IO_URING);
 }
 
 /*
@@ -4274,7 +4296,9 @@ static void bdrv_delete(BlockDriverState *bs)
  * check are stored in res.
  */
 static int coroutine_fn bdrv_co_check(BlockDriverState *bs,
-                                      BdrvCheckResult *res, BdrvCheckMode fix)
+                                      BdrvCheckResult *res, BdrvCheckMode fix,
+                                      BlockDriverCheckStatusCB *status_cb,
+                                      void *cb_opaque)
 {
     if (bs->drv == NULL) {
         return -ENOMEDIUM;
@@ -4284,25 +4308,29 @@ static int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_co_check(bs, res, fix);
+    return bs->drv->bdrv_co_check(bs, res, fix, status_cb, cb_opaque);
 }
 
 typedef struct CheckCo {
     BlockDriverState *bs;
     BdrvCheckResult *res;
     BdrvCheckMode fix;
+    BlockDriverCheckStatusCB *status_cb;
+    void *cb_opaque;
     int ret;
 } CheckCo;
 
 static void coroutine_fn bdrv_check_co_entry(void *opaque)
 {
     CheckCo *cco = opaque;
-    cco->ret = bdrv_co_check(cco->bs, cco->res, cco->fix);
+    cco->ret = bdrv_co_check(cco->bs, cco->res, cco->fix, cco->status_cb,
+                             cco->cb_opaque);
     aio_wait_kick();
 }
 
 int bdrv_check(BlockDriverState *bs,
-               BdrvCheckResult *res, BdrvCheckMode fix)
+               BdrvCheckResult *res, BdrvCheckMode fix,
+               BlockDriverCheckStatusCB *status_cb, void *cb_opaque)
 {
     Coroutine *co;
     CheckCo cco = {
@@ -4310,6 +4338,8 @@ int bdrv_check(BlockDriverState *bs,
         .res = res,
         .ret = -EINPROGRESS,
         .fix = fix,
+        .status_cb = status_cb,
+        .cb_opaque = cb_opaque,
     };
 
     if (qemu_in_coroutine()) {
@@ -5123,6 +5153,38 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs,
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv || !drv->bdrv_get_specific_stats) {
+        return NULL;
+    }
+    return drv->bdrv_get_specific_stats(bs);
+}
+
+/*
+ * Look up the host file that holds [@offset, @offset + @bytes) of @bs, so
+ * that the data can be read without going through the block layer.  The
+ * caller must keep @bs busy with bdrv_inc_in_flight() while it uses the
+ * file descriptor.  Returns the file descriptor and sets *@host_offset to
+ * the offset of the data in the file, or returns -ENOTSUP if reads have to
+ * go through the block layer.
+ */
+int bdrv_get_host_fd(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     int64_t *host_offset)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    /* Copy-on-read has to see every read request */
+    if (!drv->bdrv_get_host_fd || atomic_read(&bs->copy_on_read)) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_get_host_fd(bs, offset, bytes, host_offset);
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -5849,6 +5911,42 @@ void bdrv_coroutine_enter(BlockDriverState *bs, Coroutine *co)
     aio_co_enter(bdrv_get_aio_context(bs), co);
 }
 
+bool bdrv_supports_multiqueue(BlockDriverState *bs, bool write)
+{
+    BdrvChild *child;
+
+    if (!bs->drv) {
+        return false;
+    }
+    if (write ? !bs->drv->supports_multiqueue_write
+              : !bs->drv->supports_multiqueue_read) {
+        return false;
+    }
+    /* Copy-on-read turns reads into writes */
+    if (!write && atomic_read(&bs->copy_on_read)) {
+        write = true;
+        if (!bs->drv->supports_multiqueue_write) {
+            return false;
+        }
+    }
+
+    /*
+     * Before-write notifiers (backup) and block jobs expect the writes to
+     * their nodes to come from the node's AioContext.
+     */
+    if (write && (!QLIST_EMPTY(&bs->before_write_notifiers.notifiers) ||
+                  block_job_uses_bdrv(bs))) {
+        return false;
+    }
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        if (!bdrv_supports_multiqueue(child->bs, write)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void bdrv_do_remove_aio_context_notifier(BdrvAioNotifier *ban)
 {
     QLIST_REMOVE(ban, list);
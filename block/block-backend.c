@@ -75,6 +75,9 @@ struct BlockBackend {
     bool allow_aio_context_change;
     bool allow_write_beyond_eof;
 
+    /* Accept aio requests from any AioContext, see blk_set_multiqueue() */
+    bool multiqueue;
+
     NotifierList remove_bs_notifiers, insert_bs_notifiers;
     QLIST_HEAD(, BlockBackendAioNotifier) aio_notifiers;
 
@@ -1096,6 +1099,19 @@ void blk_set_allow_aio_context_change(BlockBackend *blk, bool allow)
     blk->allow_aio_context_change = allow;
 }
 
+/*
+ * In multiqueue mode, aio requests whose processing the whole graph below
+ * @blk supports from any AioContext (see bdrv_supports_multiqueue()) run and
+ * complete in the AioContext of the submitting thread instead of being
+ * forwarded to the AioContext of @blk.  This lets a device serve its queues
+ * from several IOThreads.  Callers must still hold the AioContext lock of
+ * @blk while submitting requests.
+ */
+void blk_set_multiqueue(BlockBackend *blk, bool enable)
+{
+    blk->multiqueue = enable;
+}
+
 static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
                                   size_t size)
 {
@@ -1305,6 +1321,7 @@ typedef struct BlkAioEmAIOCB {
     BlkRwCo rwco;
     int bytes;
     bool has_returned;
+    AioContext *ctx;    /* where the request coroutine runs */
 } BlkAioEmAIOCB;
 
 static const AIOCBInfo blk_aio_em_aiocb_info = {
@@ -1327,6 +1344,25 @@ static void blk_aio_complete_bh(void *opaque)
     blk_aio_complete(acb);
 }
 
+static void blk_aio_read_entry(void *opaque);
+
+/*
+ * Returns the AioContext in which a new aio request coroutine for @blk runs:
+ * the submitting thread's one if multiqueue mode allows it, otherwise the
+ * one of @blk.
+ */
+static AioContext *blk_aio_request_context(BlockBackend *blk, bool write)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    if (blk->multiqueue && bs &&
+        !blk->public.throttle_group_member.throttle_state &&
+        bdrv_supports_multiqueue(bs, write)) {
+        return qemu_get_current_aio_context();
+    }
+    return blk_get_aio_context(blk);
+}
+
 static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
                                 void *iobuf, CoroutineEntry co_entry,
                                 BdrvRequestFlags flags,
@@ -1346,14 +1382,14 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     };
     acb->bytes = bytes;
     acb->has_returned = false;
+    acb->ctx = blk_aio_request_context(blk, co_entry != blk_aio_read_entry);
 
     co = qemu_coroutine_create(co_entry, acb);
-    bdrv_coroutine_enter(blk_bs(blk), co);
+    aio_co_enter(acb->ctx, co);
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        aio_bh_schedule_oneshot(blk_get_aio_context(blk),
-                                blk_aio_complete_bh, acb);
+        aio_bh_schedule_oneshot(acb->ctx, blk_aio_complete_bh, acb);
     }
 
     return &acb->common;
@@ -1795,6 +1831,28 @@ uint32_t blk_get_max_transfer(BlockBackend *blk)
     return MIN_NON_ZERO(max, INT_MAX);
 }
 
+/*
+ * Like bdrv_get_host_fd(), but also checks that the request is valid for
+ * @blk and that reads do not need to be throttled.  The caller must hold
+ * a blk_inc_in_flight() reference while it uses the file descriptor.
+ */
+int blk_get_host_fd(BlockBackend *blk, int64_t offset, int64_t bytes,
+                    int64_t *host_offset)
+{
+    int ret;
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (blk->public.throttle_group_member.throttle_state) {
+        return -ENOTSUP;
+    }
+
+    return bdrv_get_host_fd(blk_bs(blk), offset, bytes, host_offset);
+}
+
 int blk_get_max_iov(BlockBackend *blk)
 {
     return blk->root->bs->bl.max_iov;
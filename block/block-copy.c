@@ -0,0 +1,372 @@
+/*
+ * block_copy API
+ *
+ * Copyright (C) 2013 Proxmox Server Solutions
+ *
+ * Authors:
+ *  Dietmar Maurer (dietmar@proxmox.com)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "trace.h"
+#include "qapi/error.h"
+#include "block/block-copy.h"
+#include "sysemu/block-backend.h"
+#include "qemu/cutils.h"
+#include "qemu/units.h"
+
+#define BLOCK_COPY_MAX_WORKERS 16
+#define BLOCK_COPY_MAX_BUFFER (1 * MiB)
+#define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
+
+/* State of one block_copy() call */
+typedef struct BlockCopyCallState {
+    BlockCopyState *s;
+    Coroutine *co;
+    int read_flags;
+
+    /* Number of running workers, and whether co waits for one to finish */
+    int in_flight;
+    bool waiting;
+
+    /* First error of any worker */
+    int ret;
+    bool error_is_read;
+} BlockCopyCallState;
+
+typedef struct BlockCopyTask {
+    BlockCopyCallState *call;
+    BlockCopyInFlightReq req;
+} BlockCopyTask;
+
+/*
+ * Wait for in-flight requests that overlap [@start, @end) to complete.
+ * Returns whether it had to wait.
+ */
+static bool coroutine_fn block_copy_wait_inflight_reqs(BlockCopyState *s,
+                                                       int64_t start,
+                                                       int64_t end)
+{
+    BlockCopyInFlightReq *req;
+    bool waited = false;
+    bool retry;
+
+    do {
+        retry = false;
+        QLIST_FOREACH(req, &s->inflight_reqs, list) {
+            if (end > req->start_byte && start < req->end_byte) {
+                qemu_co_queue_wait(&req->wait_queue, NULL);
+                waited = retry = true;
+                break;
+            }
+        }
+    } while (retry);
+
+    return waited;
+}
+
+/* Keep track of an in-flight request */
+static void block_copy_inflight_req_begin(BlockCopyState *s,
+                                          BlockCopyInFlightReq *req,
+                                          int64_t start, int64_t end)
+{
+    req->start_byte = start;
+    req->end_byte = end;
+    qemu_co_queue_init(&req->wait_queue);
+    QLIST_INSERT_HEAD(&s->inflight_reqs, req, list);
+}
+
+/* Forget about a completed request */
+static void coroutine_fn block_copy_inflight_req_end(BlockCopyInFlightReq *req)
+{
+    QLIST_REMOVE(req, list);
+    qemu_co_queue_restart_all(&req->wait_queue);
+}
+
+BlockCopyState *block_copy_state_new(BlockBackend *source,
+                                     BlockBackend *target,
+                                     int64_t cluster_size,
+                                     BdrvRequestFlags write_flags,
+                                     Error **errp)
+{
+    BlockCopyState *s;
+    int64_t len;
+    int64_t max_transfer;
+
+    assert(is_power_of_2(cluster_size));
+
+    len = blk_getlength(source);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "unable to get length of the source");
+        return NULL;
+    }
+
+    s = g_new(BlockCopyState, 1);
+    *s = (BlockCopyState) {
+        .source = source,
+        .target = target,
+        .copy_bitmap = hbitmap_alloc(len, ctz64(cluster_size)),
+        .cluster_size = cluster_size,
+        .len = len,
+        .write_flags = write_flags,
+        .skip_zeroes = true,
+        .chunk_size = cluster_size,
+    };
+    QLIST_INIT(&s->inflight_reqs);
+
+    max_transfer = MIN_NON_ZERO(blk_get_max_transfer(source),
+                                blk_get_max_transfer(target));
+    max_transfer = MIN_NON_ZERO(max_transfer, BLOCK_COPY_MAX_COPY_RANGE);
+    s->copy_range_size = QEMU_ALIGN_DOWN(max_transfer, cluster_size);
+
+    /*
+     * Compressed writes are not supported by copy_range, and offloading
+     * requests smaller than a cluster is not worth the trouble.
+     */
+    s->use_copy_range = !(write_flags & BDRV_REQ_WRITE_COMPRESSED) &&
+                        s->copy_range_size > 0;
+
+    return s;
+}
+
+void block_copy_state_free(BlockCopyState *s)
+{
+    if (!s) {
+        return;
+    }
+
+    assert(QLIST_EMPTY(&s->inflight_reqs));
+    hbitmap_free(s->copy_bitmap);
+    g_free(s);
+}
+
+void block_copy_set_callbacks(BlockCopyState *s,
+                              ProgressBytesCallbackFunc progress_bytes_callback,
+                              ChunkStartedCallbackFunc chunk_started_callback,
+                              void *progress_opaque)
+{
+    s->progress_bytes_callback = progress_bytes_callback;
+    s->chunk_started_callback = chunk_started_callback;
+    s->progress_opaque = progress_opaque;
+}
+
+/* Largest chunk that a worker copies at once */
+static int64_t block_copy_max_chunk(BlockCopyState *s)
+{
+    if (s->write_flags & BDRV_REQ_WRITE_COMPRESSED) {
+        /* Compressed writes must not be larger than one target cluster */
+        return s->cluster_size;
+    } else if (s->use_copy_range) {
+        return s->copy_range_size;
+    }
+    return MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER);
+}
+
+/*
+ * Copies [@offset, @offset + @bytes) from the source to the target without
+ * looking at s->copy_bitmap, using copy_range offload if possible.
+ *
+ * Returns 0 on success and -errno on failure, in which case
+ * *@error_is_read (if not NULL) says whether reading failed.
+ */
+static int coroutine_fn block_copy_range(BlockCopyState *s, int64_t offset,
+                                         int64_t bytes, int read_flags,
+                                         bool *error_is_read)
+{
+    QEMUIOVector qiov;
+    void *bounce_buffer;
+    int ret;
+
+    assert(bytes > 0 && bytes <= BDRV_REQUEST_MAX_BYTES);
+
+    if (s->use_copy_range) {
+        ret = blk_co_copy_range(s->source, offset, s->target, offset, bytes,
+                                read_flags, s->write_flags);
+        if (ret >= 0) {
+            return 0;
+        }
+
+        /* Fall back to copying through a buffer from now on */
+        trace_block_copy_copy_range_fail(s, offset, ret);
+        s->use_copy_range = false;
+        s->chunk_size = s->cluster_size;
+    }
+
+    bounce_buffer = blk_try_blockalign(s->source, bytes);
+    if (!bounce_buffer) {
+        if (error_is_read) {
+            *error_is_read = true;
+        }
+        return -ENOMEM;
+    }
+    qemu_iovec_init_buf(&qiov, bounce_buffer, bytes);
+
+    ret = blk_co_preadv(s->source, offset, bytes, &qiov, read_flags);
+    if (ret < 0) {
+        trace_block_copy_read_fail(s, offset, ret);
+        if (error_is_read) {
+            *error_is_read = true;
+        }
+        goto out;
+    }
+
+    if (s->skip_zeroes && qemu_iovec_is_zero(&qiov)) {
+        ret = blk_co_pwrite_zeroes(s->target, offset, bytes,
+                                   (s->write_flags &
+                                    ~BDRV_REQ_WRITE_COMPRESSED) |
+                                   BDRV_REQ_MAY_UNMAP);
+    } else {
+        ret = blk_co_pwritev(s->target, offset, bytes, &qiov, s->write_flags);
+    }
+    if (ret < 0) {
+        trace_block_copy_write_fail(s, offset, ret);
+        if (error_is_read) {
+            *error_is_read = false;
+        }
+        goto out;
+    }
+
+    ret = 0;
+out:
+    qemu_vfree(bounce_buffer);
+    return ret;
+}
+
+static void coroutine_fn block_copy_task_entry(void *opaque)
+{
+    BlockCopyTask *t = opaque;
+    BlockCopyCallState *call = t->call;
+    BlockCopyState *s = call->s;
+    int64_t offset = t->req.start_byte;
+    int64_t bytes = t->req.end_byte - t->req.start_byte;
+    bool error_is_read = false;
+    int ret;
+
+    ret = block_copy_range(s, offset, bytes, call->read_flags,
+                           &error_is_read);
+    if (ret < 0) {
+        hbitmap_set(s->copy_bitmap, offset, bytes);
+        s->chunk_size = s->cluster_size;
+        if (!call->ret) {
+            call->ret = ret;
+            call->error_is_read = error_is_read;
+        }
+    } else {
+        /* Use larger chunks as long as copying succeeds */
+        s->chunk_size = MIN(s->chunk_size * 2, block_copy_max_chunk(s));
+        if (s->progress_bytes_callback) {
+            s->progress_bytes_callback(bytes, s->progress_opaque);
+        }
+    }
+
+    block_copy_inflight_req_end(&t->req);
+    g_free(t);
+
+    call->in_flight--;
+    if (call->waiting) {
+        call->waiting = false;
+        aio_co_wake(call->co);
+    }
+}
+
+/* Wait until at most @max workers of @call are running */
+static void coroutine_fn block_copy_wait_workers(BlockCopyCallState *call,
+                                                 int max)
+{
+    while (call->in_flight > max) {
+        call->waiting = true;
+        qemu_coroutine_yield();
+    }
+}
+
+int coroutine_fn block_copy(BlockCopyState *s, int64_t offset, uint64_t bytes,
+                            bool *error_is_read, bool is_write_notifier)
+{
+    BlockCopyCallState call = {
+        .s          = s,
+        .co         = qemu_coroutine_self(),
+        .read_flags = is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0,
+    };
+    int64_t start = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+    int64_t end = MIN(QEMU_ALIGN_UP(offset + bytes, s->cluster_size), s->len);
+    int64_t pos = start;
+
+    while (true) {
+        uint64_t chunk_start = pos;
+        uint64_t chunk_bytes = end - pos;
+        BlockCopyTask *t;
+
+        block_copy_wait_workers(&call, BLOCK_COPY_MAX_WORKERS - 1);
+        if (call.ret < 0) {
+            break;
+        }
+
+        if (pos >= end || !hbitmap_next_dirty_area(s->copy_bitmap,
+                                                   &chunk_start,
+                                                   &chunk_bytes))
+        {
+            /*
+             * Everything in the range has been claimed. Wait until our own
+             * workers and any other requests that copy parts of the range
+             * are done; if one of the latter failed, its clusters are dirty
+             * again and we have to retry them.
+             */
+            bool waited;
+
+            block_copy_wait_workers(&call, 0);
+            if (call.ret < 0) {
+                break;
+            }
+
+            waited = block_copy_wait_inflight_reqs(s, start, end);
+            chunk_start = start;
+            chunk_bytes = end - start;
+            if (!waited && !hbitmap_next_dirty_area(s->copy_bitmap,
+                                                    &chunk_start,
+                                                    &chunk_bytes))
+            {
+                break;
+            }
+            pos = start;
+            continue;
+        }
+
+        chunk_bytes = MIN(chunk_bytes,
+                          MIN(s->chunk_size, block_copy_max_chunk(s)));
+        if (block_copy_wait_inflight_reqs(s, chunk_start,
+                                          chunk_start + chunk_bytes)) {
+            /* The chunk may have been copied in the meantime */
+            continue;
+        }
+
+        trace_block_copy_process(s, chunk_start, chunk_bytes);
+
+        t = g_new(BlockCopyTask, 1);
+        t->call = &call;
+        hbitmap_reset(s->copy_bitmap, chunk_start, chunk_bytes);
+        block_copy_inflight_req_begin(s, &t->req, chunk_start,
+                                      chunk_start + chunk_bytes);
+
+        call.in_flight++;
+        qemu_coroutine_enter(qemu_coroutine_create(block_copy_task_entry, t));
+
+        pos = chunk_start + chunk_bytes;
+
+        if (!is_write_notifier && s->chunk_started_callback &&
+            !s->chunk_started_callback(chunk_bytes, s->progress_opaque))
+        {
+            break;
+        }
+    }
+
+    block_copy_wait_workers(&call, 0);
+
+    if (call.ret < 0 && error_is_read) {
+        *error_is_read = call.error_is_read;
+    }
+    return call.ret;
+}
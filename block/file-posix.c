@@ -156,6 +156,7 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
     bool use_linux_aio:1;
+    bool use_linux_io_uring:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
@@ -174,6 +175,8 @@ typedef struct BDRVRawReopenState {
 
 static int fd_open(BlockDriverState *bs);
 static int64_t raw_getlength(BlockDriverState *bs);
+static void raw_io_uring_register_fd(BlockDriverState *bs);
+static void raw_io_uring_unregister_fd(BlockDriverState *bs);
 
 typedef struct RawPosixAIOData {
     BlockDriverState *bs;
@@ -469,6 +472,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     struct stat st;
     OnOffAuto locking;
 
+    s->fd = -1;
     opts = qemu_opts_create(&raw_runtime_opts, NULL, 0, &error_abort);
     qemu_opts_absorb_qdict(opts, options, &local_err);
     if (local_err) {
@@ -484,9 +488,16 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
-    aio_default = (bdrv_flags & BDRV_O_NATIVE_AIO)
-                  ? BLOCKDEV_AIO_OPTIONS_NATIVE
-                  : BLOCKDEV_AIO_OPTIONS_THREADS;
+    if (bdrv_flags & BDRV_O_NATIVE_AIO) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_NATIVE;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (bdrv_flags & BDRV_O_IO_URING) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_IO_URING;
+#endif
+    } else {
+        aio_default = BLOCKDEV_AIO_OPTIONS_THREADS;
+    }
+
     aio = qapi_enum_parse(&BlockdevAioOptions_lookup,
                           qemu_opt_get(opts, "aio"),
                           aio_default, &local_err);
@@ -496,6 +507,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+#endif
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
@@ -542,7 +556,6 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->open_flags = open_flags;
     raw_parse_flags(bdrv_flags, &s->open_flags, false);
 
-    s->fd = -1;
     fd = qemu_open(filename, s->open_flags, 0644);
     ret = fd < 0 ? -errno : 0;
 
@@ -581,6 +594,18 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
+            error_prepend(errp, "Unable to use io_uring: ");
+            s->use_linux_io_uring = false;
+            ret = -EINVAL;
+            goto fail;
+        }
+        raw_io_uring_register_fd(bs);
+    }
+#endif
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     if ((bs->open_flags & BDRV_O_NOCACHE) != 0) {
@@ -657,6 +682,11 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK;
     ret = 0;
 fail:
+    if (ret < 0 && s->fd >= 0) {
+        raw_io_uring_unregister_fd(bs);
+        qemu_close(s->fd);
+        s->fd = -1;
+    }
     if (filename && (bdrv_flags & BDRV_O_TEMPORARY)) {
         unlink(filename);
     }
@@ -1006,8 +1036,10 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->check_cache_dropped = rs->check_cache_dropped;
     s->open_flags = rs->open_flags;
 
+    raw_io_uring_unregister_fd(state->bs);
     qemu_close(s->fd);
     s->fd = rs->fd;
+    raw_io_uring_register_fd(state->bs);
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1856,14 +1888,64 @@ out:
     return result;
 }
 
+/*
+ * Requests run in the AioContext of the calling coroutine rather than the one
+ * of @bs: with multiqueue BlockBackends (see blk_set_multiqueue()) they may be
+ * submitted from several IOThreads at once.  Each AioContext has its own
+ * thread pool, Linux AIO context and io_uring, so these helpers use the
+ * current one and set it up on first use.
+ *
+ * use_linux_aio and use_linux_io_uring are only changed while the node is
+ * opened or attached to a new AioContext, i.e. when no requests run.  If
+ * setting up another AioContext fails, only the requests submitted from
+ * there fall back to the thread pool.
+ */
 static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
                                                ThreadPoolFunc func, void *arg)
 {
-    /* @bs can be NULL, bdrv_get_aio_context() returns the main context then */
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_current_aio_context());
     return thread_pool_submit_co(pool, func, arg);
 }
 
+#ifdef CONFIG_LINUX_AIO
+static bool raw_check_linux_aio(BDRVRawState *s)
+{
+    Error *local_err = NULL;
+
+    if (!s->use_linux_aio) {
+        return false;
+    }
+    if (!aio_setup_linux_aio(qemu_get_current_aio_context(), &local_err)) {
+        warn_report_once("Unable to use native AIO in this thread, "
+                         "falling back to thread pool: %s",
+                         error_get_pretty(local_err));
+        error_free(local_err);
+        return false;
+    }
+    return true;
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+static bool raw_check_linux_io_uring(BDRVRawState *s)
+{
+    Error *local_err = NULL;
+
+    if (!s->use_linux_io_uring) {
+        return false;
+    }
+    if (!aio_setup_linux_io_uring(qemu_get_current_aio_context(),
+                                  &local_err)) {
+        warn_report_once("Unable to use linux io_uring in this thread, "
+                         "falling back to thread pool: %s",
+                         error_get_pretty(local_err));
+        error_free(local_err);
+        return false;
+    }
+    return true;
+}
+#endif
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
@@ -1882,13 +1964,29 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
     if (s->needs_alignment) {
         if (!bdrv_qiov_is_aligned(bs, qiov)) {
             type |= QEMU_AIO_MISALIGNED;
+#ifdef CONFIG_LINUX_IO_URING
+        } else if (raw_check_linux_io_uring(s)) {
+            LuringState *aio =
+                aio_get_linux_io_uring(qemu_get_current_aio_context());
+            assert(qiov->size == bytes);
+            return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+#endif
 #ifdef CONFIG_LINUX_AIO
-        } else if (s->use_linux_aio) {
-            LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+        } else if (raw_check_linux_aio(s)) {
+            LinuxAioState *aio =
+                aio_get_linux_aio(qemu_get_current_aio_context());
             assert(qiov->size == bytes);
             return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
         }
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (raw_check_linux_io_uring(s)) {
+        /* Unlike linux-aio, io_uring is asynchronous for buffered I/O too */
+        LuringState *aio =
+            aio_get_linux_io_uring(qemu_get_current_aio_context());
+        assert(qiov->size == bytes);
+        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+#endif
     }
 
     acb = (RawPosixAIOData) {
@@ -1924,24 +2022,38 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
-    if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+    if (raw_check_linux_aio(s)) {
+        LinuxAioState *aio = aio_get_linux_aio(qemu_get_current_aio_context());
         laio_io_plug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_check_linux_io_uring(s)) {
+        LuringState *aio =
+            aio_get_linux_io_uring(qemu_get_current_aio_context());
+        luring_io_plug(bs, aio);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
-    if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+    if (raw_check_linux_aio(s)) {
+        LinuxAioState *aio = aio_get_linux_aio(qemu_get_current_aio_context());
         laio_io_unplug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_check_linux_io_uring(s)) {
+        LuringState *aio =
+            aio_get_linux_io_uring(qemu_get_current_aio_context());
+        luring_io_unplug(bs, aio);
+    }
+#endif
 }
 
 static int raw_co_flush_to_disk(BlockDriverState *bs)
@@ -1955,6 +2067,14 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
         return ret;
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_check_linux_io_uring(s)) {
+        LuringState *aio =
+            aio_get_linux_io_uring(qemu_get_current_aio_context());
+        return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+    }
+#endif
+
     acb = (RawPosixAIOData) {
         .bs             = bs,
         .aio_fildes     = s->fd,
@@ -1967,8 +2087,8 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
 static void raw_aio_attach_aio_context(BlockDriverState *bs,
                                        AioContext *new_context)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
     if (s->use_linux_aio) {
         Error *local_err;
         if (!aio_setup_linux_aio(new_context, &local_err)) {
@@ -1978,6 +2098,51 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
         }
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        Error *local_err = NULL;
+        if (!aio_setup_linux_io_uring(new_context, &local_err)) {
+            error_reportf_err(local_err, "Unable to use linux io_uring, "
+                                         "falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+        } else {
+            raw_io_uring_register_fd(bs);
+        }
+    }
+#endif
+}
+
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    raw_io_uring_unregister_fd(bs);
+}
+
+/*
+ * Registers s->fd with the io_uring of the node's AioContext so that requests
+ * can be submitted with IOSQE_FIXED_FILE.  Every file descriptor registered
+ * here must be unregistered with raw_io_uring_unregister_fd() before it is
+ * closed or the node moves to another AioContext.
+ */
+static void raw_io_uring_register_fd(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring && s->fd >= 0) {
+        luring_register_fd(aio_get_linux_io_uring(bdrv_get_aio_context(bs)),
+                           s->fd);
+    }
+#endif
+}
+
+static void raw_io_uring_unregister_fd(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring && s->fd >= 0) {
+        luring_unregister_fd(aio_get_linux_io_uring(bdrv_get_aio_context(bs)),
+                             s->fd);
+    }
+#endif
 }
 
 static void raw_close(BlockDriverState *bs)
@@ -1985,6 +2150,7 @@ static void raw_close(BlockDriverState *bs)
     BDRVRawState *s = bs->opaque;
 
     if (s->fd >= 0) {
+        raw_io_uring_unregister_fd(bs);
         qemu_close(s->fd);
         s->fd = -1;
     }
@@ -2837,8 +3003,10 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_io_uring_unregister_fd(bs);
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
+        raw_io_uring_register_fd(bs);
         s->open_flags = s->perm_change_flags;
     }
     s->perm_change_fd = 0;
@@ -2909,6 +3077,35 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
     return raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
 }
 
+static int raw_get_host_fd(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes, int64_t *host_offset)
+{
+    BDRVRawState *s = bs->opaque;
+    struct stat st;
+
+    /* Only buffered data can be passed on without alignment restrictions */
+    if (s->open_flags & O_DIRECT) {
+        return -ENOTSUP;
+    }
+    if (fd_open(bs) < 0) {
+        return -EIO;
+    }
+
+    /*
+     * The node's length is rounded up to whole sectors; the part after the
+     * end of the file reads as zeroes through the block layer only.
+     */
+    if (fstat(s->fd, &st) < 0) {
+        return -errno;
+    }
+    if (S_ISREG(st.st_mode) && offset + bytes > st.st_size) {
+        return -ENOTSUP;
+    }
+
+    *host_offset = offset;
+    return s->fd;
+}
+
 BlockDriver bdrv_file = {
     .format_name = "file",
     .protocol_name = "file",
@@ -2931,13 +3128,17 @@ BlockDriver bdrv_file = {
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
+    .supports_multiqueue_read = true,
+    .supports_multiqueue_write = true,
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+    .bdrv_get_host_fd       = raw_get_host_fd,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3407,13 +3608,17 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
+    .supports_multiqueue_read = true,
+    .supports_multiqueue_write = true,
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+    .bdrv_get_host_fd       = raw_get_host_fd,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3538,6 +3743,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3670,6 +3876,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -0,0 +1,641 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/coroutine.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+/* io_uring ring size */
+#define MAX_ENTRIES 128
+
+/*
+ * Number of slots in the registered file table.  Requests on a file that
+ * has a slot are submitted with IOSQE_FIXED_FILE, which saves the kernel a
+ * fget()/fput() pair per request.
+ */
+#define MAX_REGISTERED_FILES 16
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /* Slot in the submission ring while the kernel has not consumed it */
+    struct io_uring_sqe *sqe;
+
+    /*
+     * Buffered reads may require resubmission, see
+     * luring_resubmit_short_read().
+     */
+    int total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+
+    /*
+     * Requests whose sqes are in the submission ring but have not been
+     * consumed by the kernel yet, in ring order.  They are preceded in the
+     * ring by sq_nops no-op sqes left behind by failed submissions.
+     */
+    QSIMPLEQ_HEAD(, LuringAIOCB) sq_ring;
+    unsigned int sq_nops;
+} LuringQueue;
+
+typedef struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+
+    /* io queue for submit at batch.  Protected by AioContext lock. */
+    LuringQueue io_q;
+
+    /* I/O completion processing.  Only runs in I/O thread.  */
+    QEMUBH *completion_bh;
+
+    /* Registered file table, -1 marks a free slot */
+    int fixed_fds[MAX_REGISTERED_FILES];
+    bool files_registered;
+} LuringState;
+
+/**
+ * luring_resubmit:
+ *
+ * Resubmit a request by appending it to submit_queue.  The caller must ensure
+ * that ioq_submit() is called later so that submit_queue requests are started.
+ */
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/**
+ * luring_resubmit_short_read:
+ *
+ * Before Linux commit 9d93a3f5a0c ("io_uring: punt short reads to async
+ * context") a buffered I/O request with the start of the file range in the
+ * page cache could result in a short read.  Applications need to resubmit the
+ * remaining read request.
+ *
+ * This is a slow path but recent kernels never take it.
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov;
+    size_t remaining;
+
+    trace_luring_resubmit_short_read(s, luringcb, nread);
+
+    /* Update read position */
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    /* Shorten qiov */
+    resubmit_qiov = &luringcb->resubmit_qiov;
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      remaining);
+
+    /* Update sqe */
+    luringcb->sqeq.off += nread;
+    luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
+    luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+
+    luring_resubmit(s, luringcb);
+}
+
+/**
+ * luring_complete:
+ *
+ * Completes a request with @ret and wakes up its coroutine.
+ */
+static void luring_complete(LuringAIOCB *luringcb, int ret)
+{
+    luringcb->ret = ret;
+    qemu_iovec_destroy(&luringcb->resubmit_qiov);
+
+    /*
+     * If the coroutine is already entered it must be in ioq_submit()
+     * and will notice luringcb->ret has been filled in when it
+     * eventually runs later. Coroutines cannot be entered recursively
+     * so avoid doing that!
+     */
+    if (!qemu_coroutine_entered(luringcb->co)) {
+        aio_co_wake(luringcb->co);
+    }
+}
+
+/**
+ * luring_process_completions:
+ * @s: AIO state
+ *
+ * Fetches completed I/O requests, consumes cqes and invokes their callbacks
+ * The function is somewhat tricky because it supports nested event loops, for
+ * example when a request callback invokes aio_poll().
+ *
+ * Function schedules BH completion so it  can be called again in a nested
+ * event loop.  When there are no events left  to complete the BH is being
+ * canceled.
+ *
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqes;
+    int total_bytes;
+    bool resubmitted = false;
+    /*
+     * Request completion callbacks can run the nested event loop.
+     * Schedule ourselves so the nested event loop will "see" remaining
+     * completed requests and process them.  Without this, completion
+     * callbacks that wait for other requests using a nested event loop
+     * would hang forever.
+     *
+     * This workaround is needed because io_uring uses poll_wait, which
+     * is woken up when new events are added to the uring, thus polling on
+     * the same uring fd will block unless more events are received.
+     *
+     * Other leaf block drivers (drivers that access the data themselves)
+     * are networking based, so they poll sockets for data and run the
+     * correct coroutine.
+     */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqes) == 0) {
+        LuringAIOCB *luringcb;
+        int ret;
+
+        if (!cqes) {
+            break;
+        }
+
+        luringcb = io_uring_cqe_get_data(cqes);
+        ret = cqes->res;
+        io_uring_cqe_seen(&s->ring, cqes);
+        cqes = NULL;
+
+        /* Change counters one-by-one because we can be nested. */
+        s->io_q.in_flight--;
+        trace_luring_process_completion(s, luringcb, ret);
+
+        /* No-op left behind by a failed submission, see ioq_submit() */
+        if (!luringcb) {
+            continue;
+        }
+
+        /* total_read is non-zero only for resubmitted read requests */
+        total_bytes = ret + luringcb->total_read;
+
+        if (ret < 0) {
+            /* -EAGAIN is a transient shortage of resources in the kernel */
+            if (ret == -EINTR || ret == -EAGAIN) {
+                luring_resubmit(s, luringcb);
+                resubmitted = true;
+                continue;
+            }
+        } else if (!luringcb->qiov) {
+            goto end;
+        } else if (total_bytes == luringcb->qiov->size) {
+            ret = 0;
+        /* Only read/write */
+        } else {
+            /* Short Read/Write */
+            if (luringcb->is_read) {
+                if (ret > 0) {
+                    luring_resubmit_short_read(s, luringcb, ret);
+                    resubmitted = true;
+                    continue;
+                } else {
+                    /* Pad with zeroes */
+                    qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                                      luringcb->qiov->size - total_bytes);
+                    ret = 0;
+                }
+            } else {
+                ret = -ENOSPC;
+            }
+        }
+end:
+        luring_complete(luringcb, ret);
+    }
+
+    /*
+     * Resubmitted requests are only queued.  Keep the BH scheduled so that
+     * it submits them even if no other completion arrives.
+     */
+    if (!resubmitted || s->io_q.plugged) {
+        qemu_bh_cancel(s->completion_bh);
+    }
+}
+
+/*
+ * Account for @n sqes that the kernel consumed from the submission ring.
+ */
+static void luring_consume_sqes(LuringState *s, unsigned int n)
+{
+    unsigned int nops = MIN(n, s->io_q.sq_nops);
+
+    s->io_q.sq_nops -= nops;
+    for (n -= nops; n > 0; n--) {
+        LuringAIOCB *luringcb = QSIMPLEQ_FIRST(&s->io_q.sq_ring);
+
+        assert(luringcb);
+        luringcb->sqe = NULL;
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.sq_ring, next);
+    }
+}
+
+/*
+ * Fail all requests that have not been submitted yet.  The kernel did not
+ * consume the sqes that are already in the ring, but they stay there and
+ * would be picked up by the next io_uring_submit().  Turn them into no-ops,
+ * because their LuringAIOCBs live on the stack of the coroutines that are
+ * about to see the error.
+ */
+static void luring_fail_unsubmitted(LuringState *s, int ret)
+{
+    LuringAIOCB *luringcb;
+
+    while ((luringcb = QSIMPLEQ_FIRST(&s->io_q.sq_ring))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.sq_ring, next);
+        io_uring_prep_nop(luringcb->sqe);
+        io_uring_sqe_set_data(luringcb->sqe, NULL);
+        luringcb->sqe = NULL;
+        s->io_q.sq_nops++;
+        luring_complete(luringcb, ret);
+    }
+
+    while ((luringcb = QSIMPLEQ_FIRST(&s->io_q.submit_queue))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        s->io_q.in_queue--;
+        luring_complete(luringcb, ret);
+    }
+}
+
+static int ioq_submit(LuringState *s)
+{
+    int ret = 0;
+    LuringAIOCB *luringcb, *luringcb_next;
+
+    while (s->io_q.in_queue > 0) {
+        /*
+         * Try to fetch sqes from the ring for requests waiting in
+         * the overflow queue
+         */
+        QSIMPLEQ_FOREACH_SAFE(luringcb, &s->io_q.submit_queue, next,
+                              luringcb_next) {
+            struct io_uring_sqe *sqes = io_uring_get_sqe(&s->ring);
+            if (!sqes) {
+                break;
+            }
+            /* Prep sqe for submission */
+            *sqes = luringcb->sqeq;
+            luringcb->sqe = sqes;
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+            QSIMPLEQ_INSERT_TAIL(&s->io_q.sq_ring, luringcb, next);
+        }
+        ret = io_uring_submit(&s->ring);
+        trace_luring_io_uring_submit(s, ret);
+        /* Prevent infinite loop if submission is refused */
+        if (ret <= 0) {
+            if (ret == -EAGAIN || ret == -EINTR) {
+                continue;
+            }
+            if (ret < 0) {
+                luring_fail_unsubmitted(s, ret);
+            }
+            break;
+        }
+        luring_consume_sqes(s, ret);
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue  -= ret;
+    }
+    /* No-ops left in the ring go out with the next submission */
+    s->io_q.blocked = (s->io_q.in_queue > s->io_q.sq_nops);
+
+    if (s->io_q.in_flight) {
+        /*
+         * We can try to complete something just right away if there are
+         * still requests in-flight.
+         */
+        luring_process_completions(s);
+    }
+    return ret;
+}
+
+static void luring_process_completions_and_submit(LuringState *s)
+{
+    aio_context_acquire(s->aio_context);
+    luring_process_completions(s);
+
+    if (!s->io_q.plugged && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+    luring_process_completions_and_submit(s);
+}
+
+static void qemu_luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+    luring_process_completions_and_submit(s);
+}
+
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    LuringState *s = opaque;
+    struct io_uring_cqe *cqes;
+
+    if (io_uring_peek_cqe(&s->ring, &cqes) == 0) {
+        if (cqes) {
+            luring_process_completions_and_submit(s);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    QSIMPLEQ_INIT(&io_q->sq_ring);
+    io_q->sq_nops = 0;
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    trace_luring_io_plug(s);
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    trace_luring_io_unplug(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+/**
+ * luring_fixed_file:
+ * @s: AIO state
+ * @fd: file descriptor
+ *
+ * Returns the index of @fd in the registered file table, or -1 if @fd has
+ * not been registered with luring_register_fd().
+ */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->files_registered) {
+        return -1;
+    }
+    for (i = 0; i < MAX_REGISTERED_FILES; i++) {
+        if (s->fixed_fds[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int luring_update_files(LuringState *s)
+{
+    int ret;
+
+    if (s->files_registered) {
+        ret = io_uring_register_files_update(&s->ring, 0, s->fixed_fds,
+                                             MAX_REGISTERED_FILES);
+        return ret < 0 ? ret : 0;
+    }
+
+    ret = io_uring_register_files(&s->ring, s->fixed_fds,
+                                  MAX_REGISTERED_FILES);
+    if (ret == 0) {
+        s->files_registered = true;
+    }
+    return ret;
+}
+
+/**
+ * luring_register_fd:
+ * @s: AIO state
+ * @fd: file descriptor
+ *
+ * Adds @fd to the registered file table of the ring.  Registration is a pure
+ * optimization, so running out of slots or running on a kernel without
+ * IORING_REGISTER_FILES is not an error; requests on unregistered files are
+ * simply submitted by file descriptor.
+ */
+void luring_register_fd(LuringState *s, int fd)
+{
+    int i, ret;
+
+    if (luring_fixed_file(s, fd) >= 0) {
+        return;
+    }
+    for (i = 0; i < MAX_REGISTERED_FILES; i++) {
+        if (s->fixed_fds[i] == -1) {
+            break;
+        }
+    }
+    if (i == MAX_REGISTERED_FILES) {
+        return;
+    }
+
+    s->fixed_fds[i] = fd;
+    ret = luring_update_files(s);
+    trace_luring_register_fd(s, fd, i, ret);
+    if (ret < 0) {
+        s->fixed_fds[i] = -1;
+    }
+}
+
+/**
+ * luring_unregister_fd:
+ * @s: AIO state
+ * @fd: file descriptor
+ *
+ * Removes @fd from the registered file table.  Must be called before @fd is
+ * closed, otherwise the ring keeps a reference to the file.
+ */
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int i = luring_fixed_file(s, fd);
+
+    if (i < 0) {
+        return;
+    }
+    s->fixed_fds[i] = -1;
+    luring_update_files(s);
+    trace_luring_unregister_fd(s, fd, i);
+}
+
+/**
+ * luring_do_submit:
+ * @fd: file descriptor for I/O
+ * @luringcb: AIO control block
+ * @s: AIO state
+ * @offset: offset for request
+ * @type: type of request
+ *
+ * Fetches sqes from ring, adds to pending queue and preps them
+ *
+ */
+static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
+                            uint64_t offset, int type)
+{
+    int ret;
+    int fixed = luring_fixed_file(s, fd);
+    struct io_uring_sqe *sqes = &luringcb->sqeq;
+
+    if (fixed >= 0) {
+        fd = fixed;
+    }
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+                             luringcb->qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                            luringcb->qiov->niov, offset);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type, aborting 0x%x.\n",
+                        __func__, type);
+        abort();
+    }
+    if (fixed >= 0) {
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
+    io_uring_sqe_set_data(sqes, luringcb);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ret = ioq_submit(s);
+        trace_luring_do_submit_done(s, ret);
+        return ret;
+    }
+    return 0;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov, int type)
+{
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+    trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
+                           type);
+
+    /*
+     * Even if the submission fails, luringcb must not go out of scope before
+     * it has completed: it may already be in flight from an earlier round of
+     * ioq_submit().  Requests that were not submitted are completed with the
+     * error.
+     */
+    luring_do_submit(fd, &luringcb, s, offset, type);
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_fd_handler(old_context, s->ring.ring_fd, false,
+                       NULL, NULL, NULL, s);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_fd_handler(s->aio_context, s->ring.ring_fd, false,
+                       qemu_luring_completion_cb, NULL,
+                       qemu_luring_poll_cb, s);
+}
+
+LuringState *luring_init(Error **errp)
+{
+    int rc, i;
+    LuringState *s = g_new0(LuringState, 1);
+    struct io_uring *ring = &s->ring;
+
+    trace_luring_init_state(s, sizeof(*s));
+
+    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
+        g_free(s);
+        return NULL;
+    }
+
+    ioq_init(&s->io_q);
+    for (i = 0; i < MAX_REGISTERED_FILES; i++) {
+        s->fixed_fds[i] = -1;
+    }
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    if (s->files_registered) {
+        io_uring_unregister_files(&s->ring);
+    }
+    io_uring_queue_exit(&s->ring);
+    trace_luring_cleanup_state(s);
+    g_free(s);
+}
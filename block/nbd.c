@@ -43,6 +43,7 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
@@ -53,7 +54,7 @@ typedef struct {
     bool receiving;         /* waiting for connection_co? */
 } NBDClientRequest;
 
-typedef struct BDRVNBDState {
+typedef struct NBDConnection {
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
     NBDExportInfo info;
@@ -67,13 +68,24 @@ typedef struct BDRVNBDState {
     NBDReply reply;
     BlockDriverState *bs;
     bool quit;
+} NBDConnection;
+
+typedef struct BDRVNBDState {
+    /*
+     * Connections to the export.  There is more than one only if the
+     * server advertises NBD_FLAG_CAN_MULTI_CONN, in which case requests
+     * are spread over all of them.
+     */
+    NBDConnection *conns[MAX_NBD_CONNECTIONS];
+    int num_conns;
+    int next_conn;
 
     /* For nbd_refresh_filename() */
     SocketAddress *saddr;
     char *export, *tlscredsid;
 } BDRVNBDState;
 
-static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
+static void nbd_recv_coroutines_wake_all(NBDConnection *s)
 {
     int i;
 
@@ -89,14 +101,17 @@ static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
 static void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
+    for (i = 0; i < s->num_conns; i++) {
+        qio_channel_detach_aio_context(QIO_CHANNEL(s->conns[i]->ioc));
+    }
 }
 
-static void nbd_client_attach_aio_context_bh(void *opaque)
+static void nbd_connection_attach_aio_context_bh(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *s = opaque;
+    BlockDriverState *bs = s->bs;
 
     /*
      * The node is still drained, so we know the coroutine has yielded in
@@ -108,36 +123,43 @@ static void nbd_client_attach_aio_context_bh(void *opaque)
     bdrv_dec_in_flight(bs);
 }
 
-static void nbd_client_attach_aio_context(BlockDriverState *bs,
-                                          AioContext *new_context)
+static void nbd_connection_attach_aio_context(NBDConnection *s,
+                                              AioContext *new_context)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
-
     qio_channel_attach_aio_context(QIO_CHANNEL(s->ioc), new_context);
 
-    bdrv_inc_in_flight(bs);
+    bdrv_inc_in_flight(s->bs);
 
     /*
      * Need to wait here for the BH to run because the BH must run while the
      * node is still drained.
      */
-    aio_wait_bh_oneshot(new_context, nbd_client_attach_aio_context_bh, bs);
+    aio_wait_bh_oneshot(new_context, nbd_connection_attach_aio_context_bh, s);
 }
 
-
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_client_attach_aio_context(BlockDriverState *bs,
+                                          AioContext *new_context)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
+
+    for (i = 0; i < s->num_conns; i++) {
+        nbd_connection_attach_aio_context(s->conns[i], new_context);
+    }
+}
+
 
+static void nbd_teardown_connection(NBDConnection *s)
+{
     assert(s->ioc);
 
     /* finish any pending coroutines */
     qio_channel_shutdown(s->ioc,
                          QIO_CHANNEL_SHUTDOWN_BOTH,
                          NULL);
-    BDRV_POLL_WHILE(bs, s->connection_co);
+    BDRV_POLL_WHILE(s->bs, s->connection_co);
 
-    nbd_client_detach_aio_context(bs);
+    qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
     object_unref(OBJECT(s->sioc));
     s->sioc = NULL;
     object_unref(OBJECT(s->ioc));
@@ -146,7 +168,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
 
 static coroutine_fn void nbd_connection_entry(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *s = opaque;
     uint64_t i;
     int ret = 0;
     Error *local_err = NULL;
@@ -210,11 +232,10 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
     aio_wait_kick();
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NBDConnection *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     int rc, i;
 
     qemu_co_mutex_lock(&s->send_mutex);
@@ -289,7 +310,7 @@ static inline uint64_t payload_advance64(uint8_t **payload)
     return ldq_be_p(*payload - 8);
 }
 
-static int nbd_parse_offset_hole_payload(BDRVNBDState *s,
+static int nbd_parse_offset_hole_payload(NBDConnection *s,
                                          NBDStructuredReplyChunk *chunk,
                                          uint8_t *payload, uint64_t orig_offset,
                                          QEMUIOVector *qiov, Error **errp)
@@ -327,7 +348,7 @@ static int nbd_parse_offset_hole_payload(BDRVNBDState *s,
  * Based on our request, we expect only one extent in reply, for the
  * base:allocation context.
  */
-static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
+static int nbd_parse_blockstatus_payload(NBDConnection *s,
                                          NBDStructuredReplyChunk *chunk,
                                          uint8_t *payload, uint64_t orig_length,
                                          NBDExtent *extent, Error **errp)
@@ -444,7 +465,7 @@ static int nbd_parse_error_payload(NBDStructuredReplyChunk *chunk,
     return 0;
 }
 
-static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
+static int nbd_co_receive_offset_data_payload(NBDConnection *s,
                                               uint64_t orig_offset,
                                               QEMUIOVector *qiov, Error **errp)
 {
@@ -489,7 +510,7 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
 
 #define NBD_MAX_MALLOC_PAYLOAD 1000
 static coroutine_fn int nbd_co_receive_structured_payload(
-        BDRVNBDState *s, void **payload, Error **errp)
+        NBDConnection *s, void **payload, Error **errp)
 {
     int ret;
     uint32_t len;
@@ -539,7 +560,7 @@ static coroutine_fn int nbd_co_receive_structured_payload(
  * corresponding to the server's error reply), and errp is unchanged.
  */
 static coroutine_fn int nbd_co_do_receive_one_chunk(
-        BDRVNBDState *s, uint64_t handle, bool only_structured,
+        NBDConnection *s, uint64_t handle, bool only_structured,
         int *request_ret, QEMUIOVector *qiov, void **payload, Error **errp)
 {
     int ret;
@@ -632,7 +653,7 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
  * Return value is a fatal error code or normal nbd reply error code
  */
 static coroutine_fn int nbd_co_receive_one_chunk(
-        BDRVNBDState *s, uint64_t handle, bool only_structured,
+        NBDConnection *s, uint64_t handle, bool only_structured,
         int *request_ret, QEMUIOVector *qiov, NBDReply *reply, void **payload,
         Error **errp)
 {
@@ -699,7 +720,7 @@ static void nbd_iter_request_error(NBDReplyChunkIter *iter, int ret)
  * nbd_reply_chunk_iter_receive
  * The pointer stored in @payload requires g_free() to free it.
  */
-static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
+static bool nbd_reply_chunk_iter_receive(NBDConnection *s,
                                          NBDReplyChunkIter *iter,
                                          uint64_t handle,
                                          QEMUIOVector *qiov, NBDReply *reply,
@@ -766,7 +787,7 @@ break_loop:
     return false;
 }
 
-static int nbd_co_receive_return_code(BDRVNBDState *s, uint64_t handle,
+static int nbd_co_receive_return_code(NBDConnection *s, uint64_t handle,
                                       int *request_ret, Error **errp)
 {
     NBDReplyChunkIter iter;
@@ -780,7 +801,7 @@ static int nbd_co_receive_return_code(BDRVNBDState *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
+static int nbd_co_receive_cmdread_reply(NBDConnection *s, uint64_t handle,
                                         uint64_t offset, QEMUIOVector *qiov,
                                         int *request_ret, Error **errp)
 {
@@ -832,7 +853,7 @@ static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
+static int nbd_co_receive_blockstatus_reply(NBDConnection *s,
                                             uint64_t handle, uint64_t length,
                                             NBDExtent *extent,
                                             int *request_ret, Error **errp)
@@ -892,12 +913,34 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
     return iter.ret;
 }
 
-static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
+/*
+ * Choose the connection for a new request: the one with the fewest
+ * requests in flight, starting the search after the one that was chosen
+ * last time so that requests are spread evenly over idle connections.
+ */
+static NBDConnection *nbd_choose_connection(BDRVNBDState *s)
+{
+    NBDConnection *best = NULL;
+    int i;
+
+    for (i = 0; i < s->num_conns; i++) {
+        NBDConnection *conn = s->conns[(s->next_conn + i) % s->num_conns];
+
+        if (!conn->quit && (!best || conn->in_flight < best->in_flight)) {
+            best = conn;
+        }
+    }
+    s->next_conn = (s->next_conn + 1) % s->num_conns;
+
+    /* If all connections are closed, the request fails on any of them */
+    return best ?: s->conns[0];
+}
+
+static int nbd_co_request(NBDConnection *s, NBDRequest *request,
                           QEMUIOVector *write_qiov)
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -906,7 +949,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     } else {
         assert(request->type != NBD_CMD_WRITE);
     }
-    ret = nbd_co_send_request(bs, request, write_qiov);
+    ret = nbd_co_send_request(s, request, write_qiov);
     if (ret < 0) {
         return ret;
     }
@@ -928,7 +971,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *s = nbd_choose_connection(bs->opaque);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -960,7 +1003,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
         request.len -= slop;
     }
 
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(s, &request, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -980,7 +1023,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                  uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *s = nbd_choose_connection(bs->opaque);
     NBDRequest request = {
         .type = NBD_CMD_WRITE,
         .from = offset,
@@ -998,13 +1041,13 @@ static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, qiov);
+    return nbd_co_request(s, &request, qiov);
 }
 
 static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                        int bytes, BdrvRequestFlags flags)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *s = nbd_choose_connection(bs->opaque);
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
@@ -1027,28 +1070,82 @@ static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(s, &request, NULL);
+}
+
+typedef struct NBDFlushState {
+    Coroutine *co;
+    int in_flight;
+    int ret;
+} NBDFlushState;
+
+typedef struct NBDFlushTask {
+    NBDFlushState *state;
+    NBDConnection *conn;
+} NBDFlushTask;
+
+static coroutine_fn void nbd_flush_entry(void *opaque)
+{
+    NBDFlushTask *task = opaque;
+    NBDFlushState *state = task->state;
+    NBDRequest request = { .type = NBD_CMD_FLUSH };
+    int ret;
+
+    request.from = 0;
+    request.len = 0;
+
+    ret = nbd_co_request(task->conn, &request, NULL);
+    if (ret < 0 && !state->ret) {
+        state->ret = ret;
+    }
+
+    if (--state->in_flight == 0) {
+        aio_co_wake(state->co);
+    }
 }
 
 static int nbd_client_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
-    NBDRequest request = { .type = NBD_CMD_FLUSH };
+    NBDFlushTask tasks[MAX_NBD_CONNECTIONS];
+    NBDFlushState state = {
+        .co         = qemu_coroutine_self(),
+        .in_flight  = 1,
+    };
+    int i;
 
-    if (!(s->info.flags & NBD_FLAG_SEND_FLUSH)) {
+    if (!(s->conns[0]->info.flags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
     }
 
-    request.from = 0;
-    request.len = 0;
+    /*
+     * NBD_FLAG_CAN_MULTI_CONN promises that a flush on one connection
+     * covers the writes completed on all of them, but flush every
+     * connection (in parallel) so that we do not depend on how exactly
+     * the server implements this.
+     */
+    for (i = 0; i < s->num_conns; i++) {
+        tasks[i] = (NBDFlushTask) {
+            .state  = &state,
+            .conn   = s->conns[i],
+        };
+        state.in_flight++;
+        qemu_coroutine_enter(qemu_coroutine_create(nbd_flush_entry,
+                                                   &tasks[i]));
+    }
+
+    /* Drop the reference that kept the tasks from waking us up early */
+    if (--state.in_flight > 0) {
+        qemu_coroutine_yield();
+    }
 
-    return nbd_co_request(bs, &request, NULL);
+    return state.ret;
 }
 
 static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
                                   int bytes)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *s = nbd_choose_connection(bs->opaque);
     NBDRequest request = {
         .type = NBD_CMD_TRIM,
         .from = offset,
@@ -1060,7 +1157,7 @@ static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
         return 0;
     }
 
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(s, &request, NULL);
 }
 
 static int coroutine_fn nbd_client_co_block_status(
@@ -1069,7 +1166,7 @@ static int coroutine_fn nbd_client_co_block_status(
 {
     int ret, request_ret;
     NBDExtent extent = { 0 };
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *s = nbd_choose_connection(bs->opaque);
     Error *local_err = NULL;
 
     NBDRequest request = {
@@ -1106,7 +1203,7 @@ static int coroutine_fn nbd_client_co_block_status(
     if (s->info.min_block) {
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(s, &request, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -1137,12 +1234,20 @@ static void nbd_client_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i;
 
-    assert(s->ioc);
+    for (i = 0; i < s->num_conns; i++) {
+        NBDConnection *conn = s->conns[i];
+
+        assert(conn->ioc);
 
-    nbd_send_request(s->ioc, &request);
+        nbd_send_request(conn->ioc, &request);
 
-    nbd_teardown_connection(bs);
+        nbd_teardown_connection(conn);
+        g_free(conn);
+        s->conns[i] = NULL;
+    }
+    s->num_conns = 0;
 }
 
 static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
@@ -1167,6 +1272,7 @@ static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
 }
 
 static int nbd_client_connect(BlockDriverState *bs,
+                              NBDConnection *s,
                               SocketAddress *saddr,
                               const char *export,
                               QCryptoTLSCreds *tlscreds,
@@ -1174,7 +1280,6 @@ static int nbd_client_connect(BlockDriverState *bs,
                               const char *x_dirty_bitmap,
                               Error **errp)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     int ret;
 
     /*
@@ -1238,7 +1343,7 @@ static int nbd_client_connect(BlockDriverState *bs,
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
     s->connection_co = qemu_coroutine_create(nbd_connection_entry, s);
     bdrv_inc_in_flight(bs);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    nbd_connection_attach_aio_context(s, bdrv_get_aio_context(bs));
 
     trace_nbd_client_connect_success(export);
 
@@ -1267,16 +1372,59 @@ static int nbd_client_init(BlockDriverState *bs,
                            QCryptoTLSCreds *tlscreds,
                            const char *hostname,
                            const char *x_dirty_bitmap,
+                           int multi_conn,
                            Error **errp)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDExportInfo *first_info;
+    int ret;
+
+    assert(multi_conn >= 1 && multi_conn <= MAX_NBD_CONNECTIONS);
 
-    s->bs = bs;
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_queue_init(&s->free_sema);
+    while (s->num_conns < multi_conn) {
+        NBDConnection *conn = g_new0(NBDConnection, 1);
 
-    return nbd_client_connect(bs, saddr, export, tlscreds, hostname,
-                              x_dirty_bitmap, errp);
+        conn->bs = bs;
+        qemu_co_mutex_init(&conn->send_mutex);
+        qemu_co_queue_init(&conn->free_sema);
+
+        ret = nbd_client_connect(bs, conn, saddr, export, tlscreds, hostname,
+                                 x_dirty_bitmap, errp);
+        if (ret < 0) {
+            g_free(conn);
+            goto fail;
+        }
+        s->conns[s->num_conns++] = conn;
+
+        first_info = &s->conns[0]->info;
+        if (s->num_conns == 1) {
+            /*
+             * Without NBD_FLAG_CAN_MULTI_CONN, writes and flushes on one
+             * connection are not guaranteed to be visible on the others.
+             */
+            if (!(first_info->flags & NBD_FLAG_CAN_MULTI_CONN)) {
+                if (multi_conn > 1) {
+                    trace_nbd_client_multi_conn_unsupported(export);
+                }
+                break;
+            }
+        } else if (conn->info.size != first_info->size ||
+                   conn->info.flags != first_info->flags ||
+                   conn->info.min_block != first_info->min_block ||
+                   conn->info.max_block != first_info->max_block)
+        {
+            error_setg(errp, "NBD server reported different export "
+                       "properties on connection %d", s->num_conns);
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    nbd_client_close(bs);
+    return ret;
 }
 
 static int nbd_parse_uri(const char *filename, QDict *options)
@@ -1582,6 +1730,12 @@ static QemuOptsList nbd_runtime_opts = {
             .help = "experimental: expose named dirty bitmap in place of "
                     "block status",
         },
+        {
+            .name = "multi-conn",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server allows "
+                    "multiple connections (default: 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -1594,6 +1748,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     Error *local_err = NULL;
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
+    uint64_t multi_conn;
     int ret = -EINVAL;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
@@ -1631,9 +1786,17 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         hostname = s->saddr->u.inet.host;
     }
 
+    multi_conn = qemu_opt_get_number(opts, "multi-conn", 1);
+    if (multi_conn < 1 || multi_conn > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "multi-conn must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
     /* NBD handshake */
     ret = nbd_client_init(bs, s->saddr, s->export, tlscreds, hostname,
-                          qemu_opt_get(opts, "x-dirty-bitmap"), errp);
+                          qemu_opt_get(opts, "x-dirty-bitmap"), multi_conn,
+                          errp);
 
  error:
     if (tlscreds) {
@@ -1655,7 +1818,7 @@ static int nbd_co_flush(BlockDriverState *bs)
 
 static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *s = ((BDRVNBDState *)bs->opaque)->conns[0];
     uint32_t min = s->info.min_block;
     uint32_t max = MIN_NON_ZERO(NBD_MAX_BUFFER_SIZE, s->info.max_block);
 
@@ -1702,7 +1865,7 @@ static int64_t nbd_getlength(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return s->info.size;
+    return s->conns[0]->info.size;
 }
 
 static void nbd_refresh_filename(BlockDriverState *bs)
@@ -26,11 +26,29 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are found through a hash table indexed by their offset in the
+ * image file (chained through Qcow2CachedTable.hash_next), so lookups don't
+ * need to scan the whole cache. Victims for replacement are chosen with the
+ * CLOCK (second chance) algorithm: every access sets the referenced bit of a
+ * table, and the clock hand only evicts tables whose bit is already clear,
+ * clearing it on all tables it passes.
+ *
+ * Callers that pass their lock to qcow2_cache_co_get() drop it while the
+ * table is read from disk, so several tables can be loaded at the same time.
+ * Such a table stays in the hash table with Qcow2CachedTable.loading set, and
+ * other requests for it wait for the running read instead of issuing another
+ * one. A table is pinned while it is loading, so when more tables are being
+ * loaded than the cache holds, further misses wait until a table is released.
+ */
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
-    uint64_t lru_counter;
+    int      hash_next;
     int      ref;
     bool     dirty;
+    bool     referenced;
+    bool     loading;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -40,8 +58,14 @@ struct Qcow2Cache {
     int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
-    uint64_t                lru_counter;
-    uint64_t                cache_clean_lru_counter;
+    int                    *hash_buckets;
+    unsigned                hash_mask;
+    int                     clock_hand;
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
+    CoQueue                 loading_queue;
+    CoQueue                 free_queue;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -69,6 +93,55 @@ static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
     }
 }
 
+static inline int *qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    return &c->hash_buckets[(offset / c->table_size) & c->hash_mask];
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = *qcow2_cache_bucket(c, offset); i >= 0;
+         i = c->entries[i].hash_next)
+    {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i, uint64_t offset)
+{
+    int *bucket = qcow2_cache_bucket(c, offset);
+
+    assert(c->entries[i].offset == 0);
+    c->entries[i].offset = offset;
+    c->entries[i].hash_next = *bucket;
+    *bucket = i;
+}
+
+/* Drops table @i from the cache index; its contents become invalid */
+static void qcow2_cache_entry_invalidate(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    int *p;
+
+    if (t->offset) {
+        for (p = qcow2_cache_bucket(c, t->offset); *p != i;
+             p = &c->entries[*p].hash_next)
+        {
+            assert(*p >= 0);
+        }
+        *p = t->hash_next;
+    }
+
+    t->offset = 0;
+    t->hash_next = -1;
+    t->referenced = false;
+}
+
 static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 {
 /* Using MADV_DONTNEED to discard memory is a Linux-specific feature */
@@ -87,8 +160,7 @@ static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
-    return t->ref == 0 && !t->dirty && t->offset != 0 &&
-        t->lru_counter <= c->cache_clean_lru_counter;
+    return t->ref == 0 && !t->dirty && t->offset != 0 && !t->referenced;
 }
 
 void qcow2_cache_clean_unused(Qcow2Cache *c)
@@ -104,8 +176,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_invalidate(c, i);
             i++;
             to_clean++;
         }
@@ -115,7 +186,10 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
         }
     }
 
-    c->cache_clean_lru_counter = c->lru_counter;
+    /* Tables that are not used until the next call will be cleaned then */
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].referenced = false;
+    }
 }
 
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
@@ -123,6 +197,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -135,13 +210,25 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
+    c->hash_mask = pow2ceil(num_tables) - 1;
+    c->hash_buckets = g_try_new(int, c->hash_mask + 1);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->table_array || !c->hash_buckets) {
         qemu_vfree(c->table_array);
+        g_free(c->hash_buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    for (i = 0; i <= c->hash_mask; i++) {
+        c->hash_buckets[i] = -1;
+    }
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].hash_next = -1;
     }
+    qemu_co_queue_init(&c->loading_queue);
+    qemu_co_queue_init(&c->free_queue);
 
     return c;
 }
@@ -155,6 +242,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->hash_buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -294,6 +382,18 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
+static void qcow2_cache_wait_loading(BlockDriverState *bs, Qcow2Cache *c,
+                                     int i, CoMutex *lock)
+{
+    if (qemu_in_coroutine()) {
+        while (c->entries[i].loading) {
+            qemu_co_queue_wait(&c->loading_queue, lock);
+        }
+    } else {
+        BDRV_POLL_WHILE(bs, c->entries[i].loading);
+    }
+}
+
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret, i;
@@ -303,28 +403,114 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
         return ret;
     }
 
+    /* Tables that are being read are pinned until the read completes */
+    for (i = 0; i < c->size; i++) {
+        qcow2_cache_wait_loading(bs, c, i, NULL);
+    }
+
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_invalidate(c, i);
     }
 
     qcow2_cache_table_release(c, 0, c->size);
 
-    c->lru_counter = 0;
+    c->clock_hand = 0;
 
     return 0;
 }
 
+static bool qcow2_cache_has_unused(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].ref == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Waits until a table of @c is released */
+static void qcow2_cache_wait_unused(BlockDriverState *bs, Qcow2Cache *c,
+                                    CoMutex *lock)
+{
+    if (qemu_in_coroutine()) {
+        qemu_co_queue_wait(&c->free_queue, lock);
+    } else {
+        BDRV_POLL_WHILE(bs, !qcow2_cache_has_unused(c));
+    }
+}
+
+static void qcow2_cache_wake_all(CoQueue *queue)
+{
+    if (qemu_in_coroutine()) {
+        qemu_co_queue_restart_all(queue);
+    } else {
+        while (qemu_co_enter_next(queue, NULL)) {
+            /* No action needed */
+        }
+    }
+}
+
+static void qcow2_cache_unref(Qcow2Cache *c, int i)
+{
+    c->entries[i].ref--;
+    assert(c->entries[i].ref >= 0);
+
+    if (c->entries[i].ref == 0 && !qemu_co_queue_empty(&c->free_queue)) {
+        qcow2_cache_wake_all(&c->free_queue);
+    }
+}
+
+/*
+ * Reads table @i from @offset. If @lock is not NULL, it is dropped during the
+ * read, so the table is marked as loading and referenced until it is done.
+ * The reference is dropped before @lock is taken again, so that callers that
+ * hold the lock can wait for the read; the table may thus be evicted again
+ * by the time this function returns.
+ */
+static int qcow2_cache_load(BlockDriverState *bs, Qcow2Cache *c, int i,
+                            uint64_t offset, CoMutex *lock)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    }
+
+    qcow2_cache_hash_insert(c, i, offset);
+    c->entries[i].loading = true;
+    c->entries[i].ref++;
+
+    if (lock) {
+        qemu_co_mutex_unlock(lock);
+    }
+    ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                     c->table_size);
+
+    c->entries[i].loading = false;
+    if (ret < 0) {
+        qcow2_cache_entry_invalidate(c, i);
+    }
+    qcow2_cache_unref(c, i);
+    qcow2_cache_wake_all(&c->loading_queue);
+
+    if (lock) {
+        qemu_co_mutex_lock(lock);
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
-    uint64_t offset, void **table, bool read_from_disk)
+    uint64_t offset, void **table, bool read_from_disk, CoMutex *lock)
 {
     BDRVQcow2State *s = bs->opaque;
-    int i;
+    int i, n;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -338,30 +524,51 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         return -EIO;
     }
 
+retry:
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        if (c->entries[i].loading) {
+            /*
+             * Share the read that another request started. The table may be
+             * gone when it is done (failed read, eviction), so look again.
+             */
+            qcow2_cache_wait_loading(bs, c, i, lock);
+            goto retry;
         }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
+        c->hits++;
+        goto found;
+    }
+    c->misses++;
+
+    /*
+     * Cache miss: advance the clock hand to an unused table that was not
+     * referenced since the hand last passed it. Two rounds are enough to
+     * find one if any table is unused.
+     */
+    for (n = 0; n < 2 * c->size; n++) {
+        Qcow2CachedTable *t = &c->entries[c->clock_hand];
+
+        i = c->clock_hand;
+        if (++c->clock_hand == c->size) {
+            c->clock_hand = 0;
         }
-        if (++i == c->size) {
-            i = 0;
+
+        if (t->ref == 0) {
+            if (!t->referenced) {
+                break;
+            }
+            t->referenced = false;
         }
-    } while (i != lookup_index);
+    }
 
-    if (min_lru_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+    if (n == 2 * c->size) {
+        /* All tables are pinned by reads that run with the lock dropped */
+        qcow2_cache_wait_unused(bs, c, lock);
+        goto retry;
     }
 
-    /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    /* Write the table back and replace it */
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -372,25 +579,27 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        c->evictions++;
+    }
+    qcow2_cache_entry_invalidate(c, i);
     if (read_from_disk) {
-        if (c == s->l2_table_cache) {
-            BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
-        }
-
-        ret = bdrv_pread(bs->file, offset,
-                         qcow2_cache_get_table_addr(c, i),
-                         c->table_size);
+        ret = qcow2_cache_load(bs, c, i, offset, lock);
         if (ret < 0) {
             return ret;
         }
+        if (c->entries[i].offset != offset) {
+            /* Evicted again while we waited for the lock */
+            goto retry;
+        }
+    } else {
+        qcow2_cache_hash_insert(c, i, offset);
     }
 
-    c->entries[i].offset = offset;
-
     /* And return the right table */
 found:
     c->entries[i].ref++;
+    c->entries[i].referenced = true;
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -402,27 +611,28 @@ found:
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
-    return qcow2_cache_do_get(bs, c, offset, table, true);
+    return qcow2_cache_do_get(bs, c, offset, table, true, NULL);
+}
+
+int coroutine_fn qcow2_cache_co_get(BlockDriverState *bs, Qcow2Cache *c,
+                                    uint64_t offset, void **table,
+                                    CoMutex *lock)
+{
+    return qcow2_cache_do_get(bs, c, offset, table, true, lock);
 }
 
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
-    return qcow2_cache_do_get(bs, c, offset, table, false);
+    return qcow2_cache_do_get(bs, c, offset, table, false, NULL);
 }
 
 void qcow2_cache_put(Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(c, *table);
 
-    c->entries[i].ref--;
+    qcow2_cache_unref(c, i);
     *table = NULL;
-
-    if (c->entries[i].ref == 0) {
-        c->entries[i].lru_counter = ++c->lru_counter;
-    }
-
-    assert(c->entries[i].ref >= 0);
 }
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
@@ -432,27 +642,50 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
     c->entries[i].dirty = true;
 }
 
+/* Tables that are still being loaded are returned as well */
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    int i = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
+    if (i < 0) {
+        return NULL;
     }
-    return NULL;
+    return qcow2_cache_get_table_addr(c, i);
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
 
+    if (c->entries[i].loading) {
+        /*
+         * Only drop the table from the hash table.  The read keeps the
+         * buffer pinned until it completes; qcow2_cache_do_get() then sees
+         * that the table is gone and looks it up again, and so do the
+         * requests that wait for the read.
+         */
+        assert(c->entries[i].ref == 1);
+        qcow2_cache_entry_invalidate(c, i);
+        c->entries[i].dirty = false;
+        return;
+    }
+
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_entry_invalidate(c, i);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c)
+{
+    Qcow2CacheStats *stats = g_new0(Qcow2CacheStats, 1);
+
+    stats->size = c->size;
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->evictions = c->evictions;
+
+    return stats;
+}
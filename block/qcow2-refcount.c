@@ -1253,7 +1253,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
@@ -1309,7 +1309,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                     uint64_t cluster_index;
                     uint64_t offset;
 
-                    entry = be64_to_cpu(l2_slice[j]);
+                    entry = get_l2_entry(s, l2_slice, j);
                     old_entry = entry;
                     entry &= ~QCOW_OFLAG_COPIED;
                     offset = entry & L2E_OFFSET_MASK;
@@ -1383,7 +1383,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                                        s->refcount_block_cache);
                         }
-                        l2_slice[j] = cpu_to_be64(entry);
+                        set_l2_entry(s, l2_slice, j, entry);
                         qcow2_cache_entry_mark_dirty(s->l2_table_cache,
                                                      l2_slice);
                     }
@@ -1587,8 +1587,8 @@ enum {
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table @l2_table, which has been read from @l2_offset.
+ * While doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1596,29 +1596,29 @@ enum {
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
                               int64_t *refcount_table_size, int64_t l2_offset,
-                              int flags, BdrvCheckMode fix, bool active)
+                              uint64_t *l2_table, int flags, BdrvCheckMode fix,
+                              bool active)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        QCow2ClusterType type;
+
+        l2_entry = get_l2_entry(s, l2_table, i);
+        l2_bitmap = get_l2_bitmap(s, l2_table, i);
+        type = qcow2_get_cluster_type(bs, l2_entry);
 
-        switch (qcow2_get_cluster_type(bs, l2_entry)) {
+        if (qcow2_get_subcluster_type(bs, l2_entry, l2_bitmap, 0) < 0) {
+            fprintf(stderr, "ERROR invalid L2 entry %d: entry=0x%" PRIx64
+                    " bitmap=0x%" PRIx64 "\n", i, l2_entry, l2_bitmap);
+            res->corruptions++;
+        }
+
+        switch (type) {
         case QCOW2_CLUSTER_COMPRESSED:
             /* Compressed clusters don't have QCOW_OFLAG_COPIED */
             if (l2_entry & QCOW_OFLAG_COPIED) {
@@ -1679,15 +1679,22 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                             fix & BDRV_FIX_ERRORS ? "Repairing" : "ERROR",
                             offset);
                     if (fix & BDRV_FIX_ERRORS) {
+                        int idx = i * (l2_entry_size(s) / sizeof(uint64_t));
                         uint64_t l2e_offset =
-                            l2_offset + (uint64_t)i * sizeof(uint64_t);
+                            l2_offset + (uint64_t)i * l2_entry_size(s);
                         int ign = active ? QCOW2_OL_ACTIVE_L2 :
                                            QCOW2_OL_INACTIVE_L2;
 
-                        l2_entry = QCOW_OFLAG_ZERO;
-                        l2_table[i] = cpu_to_be64(l2_entry);
+                        if (has_subclusters(s)) {
+                            l2_entry = 0;
+                            set_l2_bitmap(s, l2_table, i,
+                                          QCOW_L2_BITMAP_ALL_ZEROES);
+                        } else {
+                            l2_entry = QCOW_OFLAG_ZERO;
+                        }
+                        set_l2_entry(s, l2_table, i, l2_entry);
                         ret = qcow2_pre_write_overlap_check(bs, ign,
-                                l2e_offset, sizeof(uint64_t), false);
+                                l2e_offset, l2_entry_size(s), false);
                         if (ret < 0) {
                             fprintf(stderr, "ERROR: Overlap check failed\n");
                             res->check_errors++;
@@ -1697,7 +1704,8 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                         }
 
                         ret = bdrv_pwrite_sync(bs->file, l2e_offset,
-                                               &l2_table[i], sizeof(uint64_t));
+                                               &l2_table[idx],
+                                               l2_entry_size(s));
                         if (ret < 0) {
                             fprintf(stderr, "ERROR: Failed to overwrite L2 "
                                     "table entry: %s\n", strerror(-ret));
@@ -1748,14 +1756,113 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
 
 fail:
-    g_free(l2_table);
     return ret;
 }
 
+/*
+ * L2 tables of an L1 table are read ahead by up to this many coroutines while
+ * the tables before them are checked. Checking an L2 table is cheap compared
+ * to reading it, so this is what makes the check of large images fast.
+ */
+#define QCOW2_CHECK_L2_READAHEAD 16
+
+typedef struct Qcow2CheckL2Read {
+    BlockDriverState *bs;
+    int64_t l2_offset;
+    uint64_t *l2_table;
+
+    /* res->corruptions_fixed when the read was issued */
+    int corruptions_fixed;
+
+    int ret;
+    bool done;
+    Coroutine *waiter;
+} Qcow2CheckL2Read;
+
+static void coroutine_fn check_l2_read_entry(void *opaque)
+{
+    Qcow2CheckL2Read *r = opaque;
+    BDRVQcow2State *s = r->bs->opaque;
+
+    r->ret = bdrv_co_pread(r->bs->file, r->l2_offset,
+                           s->l2_size * l2_entry_size(s), r->l2_table, 0);
+    r->done = true;
+    if (r->waiter) {
+        aio_co_wake(r->waiter);
+    }
+}
+
+static void check_l2_read_start(BlockDriverState *bs, BdrvCheckResult *res,
+                                Qcow2CheckL2Read *r, int64_t l2_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    r->bs = bs;
+    r->l2_offset = l2_offset;
+    r->corruptions_fixed = res->corruptions_fixed;
+    r->done = false;
+    r->waiter = NULL;
+
+    if (qemu_in_coroutine()) {
+        Coroutine *co = qemu_coroutine_create(check_l2_read_entry, r);
+        qemu_coroutine_enter(co);
+    } else {
+        r->ret = bdrv_pread(bs->file, l2_offset, r->l2_table,
+                            s->l2_size * l2_entry_size(s));
+        r->done = true;
+    }
+}
+
+static void check_l2_read_drain(Qcow2CheckL2Read *r)
+{
+    while (!r->done) {
+        r->waiter = qemu_coroutine_self();
+        qemu_coroutine_yield();
+        r->waiter = NULL;
+    }
+}
+
+static int check_l2_read_wait(BlockDriverState *bs, BdrvCheckResult *res,
+                              Qcow2CheckL2Read *r)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    check_l2_read_drain(r);
+
+    /* A table read ahead may have been changed by a repair since */
+    if (r->ret >= 0 && res->corruptions_fixed != r->corruptions_fixed) {
+        r->ret = bdrv_pread(bs->file, r->l2_offset, r->l2_table,
+                            s->l2_size * l2_entry_size(s));
+    }
+
+    return r->ret;
+}
+
+/*
+ * Progress of qcow2_check_refcounts(), counted in L1 entries: those of the
+ * active L1 table and of all snapshots for check_refcounts_l1(), and those of
+ * the active L1 table once more for check_oflag_copied().
+ */
+typedef struct Qcow2CheckProgress {
+    BlockDriverCheckStatusCB *status_cb;
+    void *cb_opaque;
+    int64_t done;
+    int64_t total;
+} Qcow2CheckProgress;
+
+/* Reports that @done L1 entries after @progress->done have been processed */
+static void check_progress_report(BlockDriverState *bs,
+                                  Qcow2CheckProgress *progress, int64_t done)
+{
+    if (progress && progress->status_cb) {
+        progress->status_cb(bs, progress->done + done, progress->total,
+                            progress->cb_opaque);
+    }
+}
+
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
@@ -1769,11 +1876,14 @@ static int check_refcounts_l1(BlockDriverState *bs,
                               void **refcount_table,
                               int64_t *refcount_table_size,
                               int64_t l1_table_offset, int l1_size,
-                              int flags, BdrvCheckMode fix, bool active)
+                              int flags, BdrvCheckMode fix, bool active,
+                              Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l1_table = NULL, l2_offset, l1_size2;
-    int i, ret;
+    Qcow2CheckL2Read *reads = NULL;
+    int *l2_indices = NULL;
+    int i, j, nb_l2, nb_reads = 0, ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1802,39 +1912,89 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
+    /* Find the L2 tables to check and start reading the first ones */
+    l2_indices = g_new(int, l1_size);
+    for (i = 0, nb_l2 = 0; i < l1_size; i++) {
+        if (l1_table[i]) {
+            l2_indices[nb_l2++] = i;
+        }
+    }
+
+    reads = g_new0(Qcow2CheckL2Read, QCOW2_CHECK_L2_READAHEAD);
+    for (j = 0; j < MIN(nb_l2, QCOW2_CHECK_L2_READAHEAD); j++) {
+        reads[j].l2_table = g_malloc(s->l2_size * l2_entry_size(s));
+    }
+    for (nb_reads = 0; nb_reads < MIN(nb_l2, QCOW2_CHECK_L2_READAHEAD);
+         nb_reads++)
+    {
+        l2_offset = l1_table[l2_indices[nb_reads]] & L1E_OFFSET_MASK;
+        check_l2_read_start(bs, res, &reads[nb_reads], l2_offset);
+    }
+
     /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
+    for (j = 0; j < nb_l2; j++) {
+        Qcow2CheckL2Read *r = &reads[j % QCOW2_CHECK_L2_READAHEAD];
+
+        i = l2_indices[j];
         l2_offset = l1_table[i];
-        if (l2_offset) {
-            /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
-            ret = qcow2_inc_refcounts_imrt(bs, res,
-                                           refcount_table, refcount_table_size,
-                                           l2_offset, s->cluster_size);
-            if (ret < 0) {
-                goto fail;
-            }
 
-            /* L2 tables are cluster aligned */
-            if (offset_into_cluster(s, l2_offset)) {
-                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                    "cluster aligned; L1 entry corrupted\n", l2_offset);
-                res->corruptions++;
-            }
+        /* Mark L2 table as used */
+        l2_offset &= L1E_OFFSET_MASK;
+        ret = qcow2_inc_refcounts_imrt(bs, res,
+                                       refcount_table, refcount_table_size,
+                                       l2_offset, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
 
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags,
-                                     fix, active);
-            if (ret < 0) {
-                goto fail;
-            }
+        /* L2 tables are cluster aligned */
+        if (offset_into_cluster(s, l2_offset)) {
+            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                "cluster aligned; L1 entry corrupted\n", l2_offset);
+            res->corruptions++;
         }
+
+        /* Read L2 table from disk */
+        ret = check_l2_read_wait(bs, res, r);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            res->check_errors++;
+            goto fail;
+        }
+
+        /* Process and check L2 entries */
+        ret = check_refcounts_l2(bs, res, refcount_table,
+                                 refcount_table_size, l2_offset, r->l2_table,
+                                 flags, fix, active);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* Reuse the buffer for the next table to be read ahead */
+        if (nb_reads < nb_l2) {
+            l2_offset = l1_table[l2_indices[nb_reads]] & L1E_OFFSET_MASK;
+            check_l2_read_start(bs, res, r, l2_offset);
+            nb_reads++;
+        }
+
+        check_progress_report(bs, progress, i + 1);
     }
-    g_free(l1_table);
-    return 0;
+    check_progress_report(bs, progress, l1_size);
+    if (progress) {
+        progress->done += l1_size;
+    }
+    ret = 0;
 
 fail:
+    /* Wait for reads that are still in flight before freeing their buffers */
+    for (j = 0; j < MIN(nb_reads, QCOW2_CHECK_L2_READAHEAD); j++) {
+        check_l2_read_drain(&reads[j]);
+    }
+    for (j = 0; reads && j < QCOW2_CHECK_L2_READAHEAD; j++) {
+        g_free(reads[j].l2_table);
+    }
+    g_free(reads);
+    g_free(l2_indices);
     g_free(l1_table);
     return ret;
 }
@@ -1848,7 +2008,7 @@ fail:
  * (qcow2_check_refcounts) by the time this function is called).
  */
 static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
-                              BdrvCheckMode fix)
+                              BdrvCheckMode fix, Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l2_table = qemu_blockalign(bs, s->cluster_size);
@@ -1877,6 +2037,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         if (!l2_offset) {
             continue;
         }
+        check_progress_report(bs, progress, i);
 
         ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
                                  &refcount);
@@ -1904,7 +2065,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1913,7 +2074,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             QCow2ClusterType cluster_type = qcow2_get_cluster_type(bs, l2_entry);
 
@@ -1936,9 +2097,10 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                             "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
                             repair ? "Repairing" : "ERROR", l2_entry, refcount);
                     if (repair) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j,
+                                     refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty++;
                     }
                 }
@@ -2088,7 +2250,8 @@ resize_fail:
  */
 static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                BdrvCheckMode fix, bool *rebuild,
-                               void **refcount_table, int64_t *nb_clusters)
+                               void **refcount_table, int64_t *nb_clusters,
+                               Qcow2CheckProgress *progress)
 {
     BDRVQcow2State *s = bs->opaque;
     int64_t i;
@@ -2115,7 +2278,7 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     /* current L1 table */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
                              s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO,
-                             fix, true);
+                             fix, true, progress);
     if (ret < 0) {
         return ret;
     }
@@ -2145,7 +2308,7 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
                                  sn->l1_table_offset, sn->l1_size, 0, fix,
-                                 false);
+                                 false, progress);
         if (ret < 0) {
             return ret;
         }
@@ -2525,14 +2688,25 @@ fail:
  * detected as corrupted, and -errno when an internal error occurred.
  */
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
-                          BdrvCheckMode fix)
+                          BdrvCheckMode fix,
+                          BlockDriverCheckStatusCB *status_cb,
+                          void *cb_opaque)
 {
     BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult pre_compare_res;
+    Qcow2CheckProgress progress = {
+        .status_cb = status_cb,
+        .cb_opaque = cb_opaque,
+        .total = 2 * (int64_t)s->l1_size,
+    };
     int64_t size, highest_cluster, nb_clusters;
     void *refcount_table = NULL;
     bool rebuild = false;
-    int ret;
+    int i, ret;
+
+    for (i = 0; i < s->nb_snapshots; i++) {
+        progress.total += s->snapshots[i].l1_size;
+    }
 
     size = bdrv_getlength(bs->file->bs);
     if (size < 0) {
@@ -2550,7 +2724,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
     ret = calculate_refcounts(bs, res, fix, &rebuild, &refcount_table,
-                              &nb_clusters);
+                              &nb_clusters, &progress);
     if (ret < 0) {
         goto fail;
     }
@@ -2581,7 +2755,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         rebuild = false;
         memset(refcount_table, 0, refcount_array_byte_size(s, nb_clusters));
         ret = calculate_refcounts(bs, res, 0, &rebuild, &refcount_table,
-                                  &nb_clusters);
+                                  &nb_clusters, NULL);
         if (ret < 0) {
             goto fail;
         }
@@ -2630,7 +2804,8 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     /* check OFLAG_COPIED */
-    ret = check_oflag_copied(bs, res, fix);
+    progress.done = progress.total - s->l1_size;
+    ret = check_oflag_copied(bs, res, fix, &progress);
     if (ret < 0) {
         goto fail;
     }
@@ -28,6 +28,11 @@
 #define ZLIB_CONST
 #include <zlib.h>
 
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
 #include "qcow2.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
@@ -37,7 +42,8 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    /* Multiqueue reads may run in any AioContext, see qcow2_co_preadv() */
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_current_aio_context());
 
     qemu_co_mutex_lock(&s->lock);
     while (s->nb_threads >= QCOW2_MAX_THREADS) {
@@ -62,36 +68,40 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
  */
 
 typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size);
+                                     const void *src, size_t src_size,
+                                     int level);
 typedef struct Qcow2CompressData {
     void *dest;
     size_t dest_size;
     const void *src;
     size_t src_size;
+    int level;
     ssize_t ret;
 
     Qcow2CompressFunc func;
 } Qcow2CompressData;
 
 /*
- * qcow2_compress()
+ * qcow2_zlib_compress()
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @level - zlib compression level, 0 for the zlib default
  *
  * Returns: compressed size on success
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
-static ssize_t qcow2_compress(void *dest, size_t dest_size,
-                              const void *src, size_t src_size)
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size,
+                                   int level)
 {
     ssize_t ret;
     z_stream strm;
 
-    /* best compression, small window, no zlib header */
+    /* small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+    ret = deflateInit2(&strm, level ?: Z_DEFAULT_COMPRESSION, Z_DEFLATED,
                        -12, 9, Z_DEFAULT_STRATEGY);
     if (ret != Z_OK) {
         return -EIO;
@@ -119,19 +129,21 @@ static ssize_t qcow2_compress(void *dest, size_t dest_size,
 }
 
 /*
- * qcow2_decompress()
+ * qcow2_zlib_decompress()
  *
  * Decompress some data (not more than @src_size bytes) to produce exactly
  * @dest_size bytes.
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @level - unused
  *
  * Returns: 0 on success
- *          -1 on fail
+ *          -EIO on fail
  */
-static ssize_t qcow2_decompress(void *dest, size_t dest_size,
-                                const void *src, size_t src_size)
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size,
+                                     int level)
 {
     int ret = 0;
     z_stream strm;
@@ -144,7 +156,7 @@ static ssize_t qcow2_decompress(void *dest, size_t dest_size,
 
     ret = inflateInit2(&strm, -12);
     if (ret != Z_OK) {
-        return -1;
+        return -EIO;
     }
 
     ret = inflate(&strm, Z_FINISH);
@@ -154,7 +166,9 @@ static ssize_t qcow2_decompress(void *dest, size_t dest_size,
          * @src buffer may be processed partly (because in qcow2 we know size of
          * compressed data with precision of one sector)
          */
-        ret = -1;
+        ret = -EIO;
+    } else {
+        ret = 0;
     }
 
     inflateEnd(&strm);
@@ -162,12 +176,115 @@ static ssize_t qcow2_decompress(void *dest, size_t dest_size,
     return ret;
 }
 
+#ifdef CONFIG_ZSTD
+
+/*
+ * qcow2_zstd_compress()
+ *
+ * Compress @src_size bytes of @src into a single zstd frame.
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ * @level - zstd compression level, 0 for the zstd default
+ *
+ * Returns: compressed size on success
+ *          -ENOMEM destination buffer is not enough to store compressed data
+ *          -EIO    on any other error
+ */
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size,
+                                   int level)
+{
+    size_t ret;
+
+    /* zstd itself maps level 0 to its default level */
+    ret = ZSTD_compress(dest, dest_size, src, src_size, level);
+    if (ZSTD_isError(ret)) {
+        if (ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall) {
+            return -ENOMEM;
+        }
+        return -EIO;
+    }
+
+    return ret;
+}
+
+/*
+ * qcow2_zstd_decompress()
+ *
+ * Decompress some data (not more than @src_size bytes) to produce exactly
+ * @dest_size bytes.  As with zlib, the compressed size is only known with
+ * sector precision, so decoding stops as soon as @dest is full and any
+ * trailing bytes of @src are ignored.
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ * @level - unused
+ *
+ * Returns: 0 on success
+ *          -EIO on fail
+ */
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size,
+                                     int level)
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_outBuffer output = { .dst = dest, .size = dest_size, .pos = 0 };
+    ZSTD_inBuffer input = { .src = src, .size = src_size, .pos = 0 };
+    ssize_t ret = -EIO;
+
+    dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        return -EIO;
+    }
+
+    while (output.pos < output.size) {
+        size_t zret = ZSTD_decompressStream(dctx, &output, &input);
+
+        if (ZSTD_isError(zret)) {
+            break;
+        }
+        if (output.pos == output.size) {
+            ret = 0;
+            break;
+        }
+        if (zret == 0 || input.pos == input.size) {
+            /* Frame ended or input exhausted before @dest was filled */
+            break;
+        }
+    }
+
+    ZSTD_freeDCtx(dctx);
+
+    return ret;
+}
+
+#endif /* CONFIG_ZSTD */
+
+/*
+ * Highest compression level accepted for @type; 0 always selects the
+ * algorithm's default.
+ */
+int qcow2_compression_max_level(Qcow2CompressionType type)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return Z_BEST_COMPRESSION;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return ZSTD_maxCLevel();
+#endif
+    default:
+        abort();
+    }
+}
+
 static int qcow2_compress_pool_func(void *opaque)
 {
     Qcow2CompressData *data = opaque;
 
     data->ret = data->func(data->dest, data->dest_size,
-                           data->src, data->src_size);
+                           data->src, data->src_size, data->level);
 
     return 0;
 }
@@ -176,11 +293,13 @@ static ssize_t coroutine_fn
 qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                      const void *src, size_t src_size, Qcow2CompressFunc func)
 {
+    BDRVQcow2State *s = bs->opaque;
     Qcow2CompressData arg = {
         .dest = dest,
         .dest_size = dest_size,
         .src = src,
         .src_size = src_size,
+        .level = s->compression_level,
         .func = func,
     };
 
@@ -189,20 +308,68 @@ qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
     return arg.ret;
 }
 
+/*
+ * qcow2_co_compress()
+ *
+ * Compress @src_size bytes of @src with the image's compression type.
+ *
+ * Returns: compressed size on success
+ *          -ENOMEM destination buffer is not enough to store compressed data
+ *          -EIO    on any other error
+ */
 ssize_t coroutine_fn
 qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                   const void *src, size_t src_size)
 {
-    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size,
-                                qcow2_compress);
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc fn;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        fn = qcow2_zlib_compress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        fn = qcow2_zstd_compress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
 }
 
+/*
+ * qcow2_co_decompress()
+ *
+ * Decompress data compressed with the image's compression type into exactly
+ * @dest_size bytes of @dest.
+ *
+ * Returns: 0 on success
+ *          -EIO on fail
+ */
 ssize_t coroutine_fn
 qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
                     const void *src, size_t src_size)
 {
-    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size,
-                                qcow2_decompress);
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc fn;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        fn = qcow2_zlib_decompress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        fn = qcow2_zstd_decompress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
 }
 
 
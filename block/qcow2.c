@@ -69,6 +69,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_COMPRESSION 0x436f6d70
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -408,6 +409,60 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_COMPRESSION:
+        {
+            Qcow2CompressionHeaderExt compression_ext;
+
+            if (ext.len != sizeof(compression_ext)) {
+                error_setg(errp, "compression_ext: "
+                           "Invalid extension length");
+                return -EINVAL;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &compression_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "compression_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            if (!buffer_is_zero(compression_ext.reserved,
+                                sizeof(compression_ext.reserved))) {
+                error_setg(errp, "compression_ext: "
+                           "Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            if (compression_ext.compression_type >=
+                QCOW2_COMPRESSION_TYPE__MAX) {
+                error_setg(errp, "compression_ext: Unknown compression type "
+                           "%" PRIu8 " (this QEMU build may lack support for "
+                           "it)", compression_ext.compression_type);
+                return -ENOTSUP;
+            }
+
+            if (compression_ext.compression_level >
+                qcow2_compression_max_level(compression_ext.compression_type)) {
+                error_setg(errp, "compression_ext: Invalid compression level "
+                           "%" PRIu8 " for compression type '%s' (maximum is "
+                           "%d)", compression_ext.compression_level,
+                           Qcow2CompressionType_str(
+                               compression_ext.compression_type),
+                           qcow2_compression_max_level(
+                               compression_ext.compression_type));
+                return -EINVAL;
+            }
+
+            s->compression_type = compression_ext.compression_type;
+            s->compression_level = compression_ext.compression_level;
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got compression extension: type=%s level=%d\n",
+                   Qcow2CompressionType_str(s->compression_type),
+                   s->compression_level);
+#endif
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -567,11 +622,12 @@ int qcow2_mark_consistent(BlockDriverState *bs)
     return 0;
 }
 
-static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
-                                              BdrvCheckResult *result,
-                                              BdrvCheckMode fix)
+static int coroutine_fn
+qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
+                      BdrvCheckMode fix, BlockDriverCheckStatusCB *status_cb,
+                      void *cb_opaque)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret = qcow2_check_refcounts(bs, result, fix, status_cb, cb_opaque);
     if (ret < 0) {
         return ret;
     }
@@ -588,13 +644,15 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
 
 static int coroutine_fn qcow2_co_check(BlockDriverState *bs,
                                        BdrvCheckResult *result,
-                                       BdrvCheckMode fix)
+                                       BdrvCheckMode fix,
+                                       BlockDriverCheckStatusCB *status_cb,
+                                       void *cb_opaque)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_co_check_locked(bs, result, fix);
+    ret = qcow2_co_check_locked(bs, result, fix, status_cb, cb_opaque);
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -772,12 +830,32 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_BITMAP_DIRECTORY_BITNR] = QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
 };
 
-static void cache_clean_timer_cb(void *opaque)
+static void coroutine_fn cache_clean_timer_co(void *opaque)
 {
     BlockDriverState *bs = opaque;
     BDRVQcow2State *s = bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
     qcow2_cache_clean_unused(s->l2_table_cache);
     qcow2_cache_clean_unused(s->refcount_block_cache);
+    qemu_co_mutex_unlock(&s->lock);
+    bdrv_dec_in_flight(bs);
+}
+
+static void cache_clean_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    Coroutine *co;
+
+    /*
+     * Multiqueue readers look up the caches from other AioContexts while
+     * holding s->lock, so the caches may only be cleaned under that lock.
+     */
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(cache_clean_timer_co, bs);
+    qemu_coroutine_enter(co);
+
     timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
               (int64_t) s->cache_clean_interval * 1000);
 }
@@ -826,7 +904,8 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     bool l2_cache_entry_size_set;
     int min_refcount_cache = MIN_REFCOUNT_CACHE_SIZE * s->cluster_size;
     uint64_t virtual_disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
-    uint64_t max_l2_cache = virtual_disk_size / (s->cluster_size / 8);
+    uint64_t max_l2_cache =
+        virtual_disk_size / (s->cluster_size / l2_entry_size(s));
 
     combined_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_CACHE_SIZE);
     l2_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_L2_CACHE_SIZE);
@@ -986,7 +1065,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
     r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
                                            l2_cache_entry_size);
     r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
@@ -1375,7 +1454,22 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (has_subclusters(s)) {
+        if (s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+            error_setg(errp, "Extended L2 entries require a cluster size of "
+                       "at least %d bytes", 1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->subclusters_per_cluster = QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+    } else {
+        s->subclusters_per_cluster = 1;
+    }
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -1486,6 +1580,16 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
+    /* Anything but zlib must be flagged so that older versions refuse to
+     * decompress clusters they do not understand */
+    if (!!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) !=
+        (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB)) {
+        error_setg(errp, "qcow2: Compression type incompatible feature bit "
+                   "does not match the compression type header extension");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* Open external data file */
     s->data_file = bdrv_open_child(NULL, options, "data-file", bs, &child_file,
                                    true, &local_err);
@@ -1677,7 +1781,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         BdrvCheckResult result = {0};
 
         ret = qcow2_co_check_locked(bs, &result,
-                                    BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+                                    BDRV_FIX_ERRORS | BDRV_FIX_LEAKS,
+                                    NULL, NULL);
         if (ret < 0 || result.check_errors) {
             if (ret >= 0) {
                 ret = -EIO;
@@ -1690,7 +1795,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
-        qcow2_check_refcounts(bs, &result, 0);
+        qcow2_check_refcounts(bs, &result, 0, NULL, NULL);
     }
 #endif
 
@@ -1780,7 +1885,7 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
         /* Encryption works on a sector granularity */
         bs->bl.request_alignment = qcrypto_block_get_sector_size(s->crypto);
     }
-    bs->bl.pwrite_zeroes_alignment = s->cluster_size;
+    bs->bl.pwrite_zeroes_alignment = s->subcluster_size;
     bs->bl.pdiscard_alignment = s->cluster_size;
 }
 
@@ -2186,6 +2291,11 @@ static int handle_alloc_space(BlockDriverState *bs, QCowL2Meta *l2meta)
             continue;
         }
 
+        /* Clusters that are kept may still contain allocated subclusters */
+        if (m->keep_old_clusters && has_subclusters(s)) {
+            continue;
+        }
+
         if (!is_zero_cow(bs, m)) {
             continue;
         }
@@ -2612,6 +2722,23 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Compression type header extension */
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB ||
+        s->compression_level != 0) {
+        Qcow2CompressionHeaderExt compression_header = {
+            .compression_type   = s->compression_type,
+            .compression_level  = s->compression_level,
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION,
+                             &compression_header, sizeof(compression_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     if (s->qcow_version >= 3) {
         Qcow2Feature features[] = {
@@ -2630,6 +2757,16 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_DATA_FILE_BITNR,
                 .name = "external data file",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+                .name = "compression type",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -2829,6 +2966,7 @@ static int coroutine_fn preallocate_co(BlockDriverState *bs, uint64_t offset,
         while (meta) {
             QCowL2Meta *next = meta->next;
 
+            meta->prealloc = true;
             ret = qcow2_alloc_cluster_link_l2(bs, meta);
             if (ret < 0) {
                 error_setg_errno(errp, -ret, "Mapping clusters failed");
@@ -2930,28 +3068,31 @@ int64_t qcow2_refcount_metadata_size(int64_t clusters, size_t cluster_size,
  * @total_size: virtual disk size in bytes
  * @cluster_size: cluster size in bytes
  * @refcount_order: refcount bits power-of-2 exponent
+ * @extended_l2: true if the image has extended L2 entries
  *
  * Returns: Total number of bytes required for the fully allocated image
  * (including metadata).
  */
 static int64_t qcow2_calc_prealloc_size(int64_t total_size,
                                         size_t cluster_size,
-                                        int refcount_order)
+                                        int refcount_order,
+                                        bool extended_l2)
 {
     int64_t meta_size = 0;
     uint64_t nl1e, nl2e;
     int64_t aligned_total_size = ROUND_UP(total_size, cluster_size);
+    size_t l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
 
     /* header: 1 cluster */
     meta_size += cluster_size;
 
     /* total size of L2 tables */
     nl2e = aligned_total_size / cluster_size;
-    nl2e = ROUND_UP(nl2e, cluster_size / sizeof(uint64_t));
-    meta_size += nl2e * sizeof(uint64_t);
+    nl2e = ROUND_UP(nl2e, cluster_size / l2e_size);
+    meta_size += nl2e * l2e_size;
 
     /* total size of L1 tables */
-    nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+    nl1e = nl2e * l2e_size / cluster_size;
     nl1e = ROUND_UP(nl1e, cluster_size / sizeof(uint64_t));
     meta_size += nl1e * sizeof(uint64_t);
 
@@ -3100,6 +3241,26 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         goto out;
     }
 
+    if (!qcow2_opts->has_extended_l2) {
+        qcow2_opts->extended_l2 = false;
+    }
+    if (qcow2_opts->extended_l2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "compatibility level 1.1 and above (use version=v3 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+        if (cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "cluster sizes of at least %d bytes",
+                       1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
     if (!qcow2_opts->has_preallocation) {
         qcow2_opts->preallocation = PREALLOC_MODE_OFF;
     }
@@ -3159,6 +3320,39 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         goto out;
     }
 
+    if (!qcow2_opts->has_compression_type) {
+        qcow2_opts->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    }
+    if (version < 3 &&
+        qcow2_opts->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB)
+    {
+        error_setg(errp, "Non-zlib compression types are only supported with "
+                   "compatibility level 1.1 and above (use version=v3 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto out;
+    }
+    if (!qcow2_opts->has_compression_level) {
+        qcow2_opts->compression_level = 0;
+    }
+    if (qcow2_opts->compression_level < 0 ||
+        qcow2_opts->compression_level >
+        qcow2_compression_max_level(qcow2_opts->compression_type))
+    {
+        error_setg(errp, "Compression level for %s must be between 0 and %d",
+                   Qcow2CompressionType_str(qcow2_opts->compression_type),
+                   qcow2_compression_max_level(qcow2_opts->compression_type));
+        ret = -EINVAL;
+        goto out;
+    }
+    if (version < 3 && qcow2_opts->compression_level != 0) {
+        error_setg(errp, "Compression levels are only supported with "
+                   "compatibility level 1.1 and above (use version=v3 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto out;
+    }
+
     if (qcow2_opts->data_file) {
         if (version < 3) {
             error_setg(errp, "External data files are only supported with "
@@ -3216,6 +3410,10 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         header->incompatible_features |=
             cpu_to_be64(QCOW2_INCOMPAT_DATA_FILE);
     }
+    if (qcow2_opts->extended_l2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
     if (qcow2_opts->data_file_raw) {
         header->autoclear_features |=
             cpu_to_be64(QCOW2_AUTOCLEAR_DATA_FILE_RAW);
@@ -3279,6 +3477,18 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         s->image_data_file = g_strdup(data_bs->filename);
     }
 
+    /* Set the compression type if necessary */
+    if (qcow2_opts->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB ||
+        qcow2_opts->compression_level != 0)
+    {
+        BDRVQcow2State *s = blk_bs(blk)->opaque;
+        s->compression_type = qcow2_opts->compression_type;
+        s->compression_level = qcow2_opts->compression_level;
+        if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+            s->incompatible_features |= QCOW2_INCOMPAT_COMPRESSION;
+        }
+    }
+
     /* Create a full header (including things like feature table) */
     ret = qcow2_update_header(blk_bs(blk));
     if (ret < 0) {
@@ -3402,6 +3612,9 @@ static int coroutine_fn qcow2_co_create_opts(const char *filename, QemuOpts *opt
         { BLOCK_OPT_ENCRYPT,            BLOCK_OPT_ENCRYPT_FORMAT },
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
         { BLOCK_OPT_DATA_FILE_RAW,      "data-file-raw" },
+        { BLOCK_OPT_COMPRESSION_TYPE,   "compression-type" },
+        { BLOCK_OPT_COMPRESSION_LEVEL,  "compression-level" },
+        { BLOCK_OPT_EXTL2,              "extended-l2" },
         { NULL, NULL },
     };
 
@@ -3506,8 +3719,8 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
     int ret;
     BDRVQcow2State *s = bs->opaque;
 
-    uint32_t head = offset % s->cluster_size;
-    uint32_t tail = (offset + bytes) % s->cluster_size;
+    uint32_t head = offset_into_subcluster(s, offset);
+    uint32_t tail = offset_into_subcluster(s, offset + bytes);
 
     trace_qcow2_pwrite_zeroes_start_req(qemu_coroutine_self(), offset, bytes);
     if (offset + bytes == bs->total_sectors * BDRV_SECTOR_SIZE) {
@@ -3518,20 +3731,20 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
         uint64_t off;
         unsigned int nr;
 
-        assert(head + bytes <= s->cluster_size);
+        assert(head + bytes <= s->subcluster_size);
 
-        /* check whether remainder of cluster already reads as zero */
+        /* check whether remainder of (sub)cluster already reads as zero */
         if (!(is_zero(bs, offset - head, head) &&
               is_zero(bs, offset + bytes,
-                      tail ? s->cluster_size - tail : 0))) {
+                      tail ? s->subcluster_size - tail : 0))) {
             return -ENOTSUP;
         }
 
         qemu_co_mutex_lock(&s->lock);
         /* We can have new write after previous check */
-        offset = QEMU_ALIGN_DOWN(offset, s->cluster_size);
-        bytes = s->cluster_size;
-        nr = s->cluster_size;
+        offset -= head;
+        bytes = s->subcluster_size;
+        nr = s->subcluster_size;
         ret = qcow2_get_cluster_offset(bs, offset, &nr, &off);
         if (ret != QCOW2_CLUSTER_UNALLOCATED &&
             ret != QCOW2_CLUSTER_ZERO_PLAIN &&
@@ -3896,7 +4109,7 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
          *  preallocation. All that matters is that we will not have to allocate
          *  new refcount structures for them.) */
         nb_new_l2_tables = DIV_ROUND_UP(nb_new_data_clusters,
-                                        s->cluster_size / sizeof(uint64_t));
+                                        s->cluster_size / l2_entry_size(s));
         /* The cluster range may not be aligned to L2 boundaries, so add one L2
          * table for a potential head/tail */
         nb_new_l2_tables++;
@@ -3946,6 +4159,7 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
                 .offset       = guest_offset,
                 .alloc_offset = host_offset,
                 .nb_clusters  = nb_clusters,
+                .prealloc     = true,
             };
             qemu_co_queue_init(&allocation.dependent_requests);
 
@@ -4413,8 +4627,12 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     PreallocMode prealloc;
     bool has_backing_file;
     bool has_luks;
+    bool extended_l2;
+    size_t l2e_size;
 
     /* Parse image creation options */
+    extended_l2 = qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false);
+
     cluster_size = qcow2_opt_get_cluster_size_del(opts, &local_err);
     if (local_err) {
         goto err;
@@ -4460,8 +4678,9 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     virtual_size = ROUND_UP(virtual_size, cluster_size);
 
     /* Check that virtual disk size is valid */
+    l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
     l2_tables = DIV_ROUND_UP(virtual_size / cluster_size,
-                             cluster_size / sizeof(uint64_t));
+                             cluster_size / l2e_size);
     if (l2_tables * sizeof(uint64_t) > QCOW_MAX_L1_SIZE) {
         error_setg(&local_err, "The image size is too large "
                                "(try using a larger cluster size)");
@@ -4526,7 +4745,8 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     info = g_new(BlockMeasureInfo, 1);
     info->fully_allocated =
         qcow2_calc_prealloc_size(virtual_size, cluster_size,
-                                 ctz32(refcount_bits)) + luks_payload_size;
+                                 ctz32(refcount_bits), extended_l2) +
+        luks_payload_size;
 
     /* Remove data clusters that are not required.  This overestimates the
      * required size because metadata needed for the fully allocated file is
@@ -4599,6 +4819,18 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
             .has_data_file_raw  = has_data_file(bs),
             .data_file_raw      = data_file_is_raw(bs),
         };
+        if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB ||
+            s->compression_level != 0)
+        {
+            spec_info->u.qcow2.data->has_compression_type = true;
+            spec_info->u.qcow2.data->compression_type = s->compression_type;
+            spec_info->u.qcow2.data->has_compression_level = true;
+            spec_info->u.qcow2.data->compression_level = s->compression_level;
+        }
+        if (has_subclusters(s)) {
+            spec_info->u.qcow2.data->has_extended_l2 = true;
+            spec_info->u.qcow2.data->extended_l2 = true;
+        }
     } else {
         /* if this assertion fails, this probably means a new version was
          * added without having it covered here */
@@ -4631,6 +4863,22 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    *stats = (BlockStatsSpecific){
+        .driver = BLOCKDEV_DRIVER_QCOW2,
+        .u.qcow2 = {
+            .l2_cache = qcow2_cache_get_stats(s->l2_table_cache),
+            .refcount_cache = qcow2_cache_get_stats(s->refcount_block_cache),
+        },
+    };
+
+    return stats;
+}
+
 static int qcow2_save_vmstate(BlockDriverState *bs, QEMUIOVector *qiov,
                               int64_t pos)
 {
@@ -4898,6 +5146,35 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                                  "images");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            const char *type = qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+
+            if (type && strcmp(type,
+                               Qcow2CompressionType_str(s->compression_type)))
+            {
+                error_setg(errp, "Changing the compression type "
+                           "is not supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_LEVEL)) {
+            uint64_t level = qemu_opt_get_number(opts,
+                                                 BLOCK_OPT_COMPRESSION_LEVEL,
+                                                 s->compression_level);
+
+            if (level != s->compression_level) {
+                error_setg(errp, "Changing the compression level "
+                           "is not supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            bool extended_l2 = qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2,
+                                                 has_subclusters(s));
+
+            if (extended_l2 != has_subclusters(s)) {
+                error_setg(errp, "Toggling extended L2 entries "
+                           "is not supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -5157,12 +5434,28 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Postpone refcount updates",
             .def_value_str = "off"
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 tables",
+        },
         {
             .name = BLOCK_OPT_REFCOUNT_BITS,
             .type = QEMU_OPT_NUMBER,
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method used for image cluster "
+                    "compression (zlib or zstd, default: zlib)",
+        },
+        {
+            .name = BLOCK_OPT_COMPRESSION_LEVEL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Compression level (0 selects the method's default)",
+        },
         { /* end of list */ }
     }
 };
@@ -5209,6 +5502,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure           = qcow2_measure,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
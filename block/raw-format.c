@@ -535,6 +535,19 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
                                  read_flags, write_flags);
 }
 
+static int raw_get_host_fd(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes, int64_t *host_offset)
+{
+    uint64_t file_offset = offset;
+    int ret;
+
+    ret = raw_adjust_offset(bs, &file_offset, bytes, false);
+    if (ret) {
+        return ret;
+    }
+    return bdrv_get_host_fd(bs->file->bs, file_offset, bytes, host_offset);
+}
+
 static const char *const raw_strong_runtime_opts[] = {
     "offset",
     "size",
@@ -554,11 +567,14 @@ BlockDriver bdrv_raw = {
     .bdrv_co_create_opts  = &raw_co_create_opts,
     .bdrv_co_preadv       = &raw_co_preadv,
     .bdrv_co_pwritev      = &raw_co_pwritev,
+    .supports_multiqueue_read = true,
+    .supports_multiqueue_write = true,
     .bdrv_co_pwrite_zeroes = &raw_co_pwrite_zeroes,
     .bdrv_co_pdiscard     = &raw_co_pdiscard,
     .bdrv_co_block_status = &raw_co_block_status,
     .bdrv_co_copy_range_from = &raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = &raw_co_copy_range_to,
+    .bdrv_get_host_fd     = &raw_get_host_fd,
     .bdrv_co_truncate     = &raw_co_truncate,
     .bdrv_getlength       = &raw_getlength,
     .has_variable_length  = true,
@@ -0,0 +1,916 @@
+/*
+ * Persistent read cache filter block driver
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "qemu/bswap.h"
+#include "qemu/hbitmap.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "trace.h"
+
+/*
+ * On-disk layout of the cache file:
+ *
+ *   0                 header (READ_CACHE_HEADER_SIZE bytes)
+ *   bitmap_offset     serialized hit bitmap, one bit per cluster
+ *   data_offset       cached data; guest offset X is stored at
+ *                     data_offset + X, so the file is sparse
+ *
+ * The bitmap is only written when the cache is closed. Before the cache
+ * file is modified for the first time, READ_CACHE_FLAG_IN_USE is set in
+ * the header, so after an unclean shutdown the cache is simply started
+ * from scratch.
+ *
+ * All header fields are big-endian.
+ */
+
+#define READ_CACHE_MAGIC            0x52444341 /* "RDCA" */
+#define READ_CACHE_VERSION          1
+#define READ_CACHE_HEADER_SIZE      4096
+
+#define READ_CACHE_FLAG_IN_USE      (1ULL << 0)
+
+#define READ_CACHE_DEFAULT_CLUSTER_SIZE (64 * 1024)
+#define READ_CACHE_MIN_CLUSTER_BITS 9
+#define READ_CACHE_MAX_CLUSTER_BITS 21
+
+typedef struct ReadCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t flags;
+    uint32_t cluster_bits;
+    uint32_t reserved;
+    uint64_t image_size;
+    uint64_t bitmap_offset;
+    uint64_t bitmap_size;
+    uint64_t data_offset;
+} QEMU_PACKED ReadCacheHeader;
+
+typedef struct ReadCachePopulate {
+    uint64_t offset;
+    uint64_t bytes;
+    QLIST_ENTRY(ReadCachePopulate) next;
+} ReadCachePopulate;
+
+typedef struct BDRVReadCacheState {
+    BdrvChild *cache;
+
+    /* Whether new data may be added to the cache file */
+    bool populate;
+    /* Whether READ_CACHE_FLAG_IN_USE has been written to the header */
+    bool in_use;
+    /* Data of an unusable old cache that starts at data_offset */
+    uint64_t stale_bytes;
+    CoMutex header_lock;
+
+    uint64_t image_size;
+    uint32_t cluster_size;
+    uint64_t max_size;
+    uint64_t bitmap_offset;
+    uint64_t bitmap_size;
+    uint64_t data_offset;
+
+    /* Clusters whose data is present in the cache file */
+    HBitmap *bitmap;
+    /* Clusters that were hit since the clock hand last passed them */
+    HBitmap *referenced;
+    uint64_t clock_hand;
+
+    /*
+     * Readers and writers of cached data take this lock shared, eviction
+     * takes it exclusively before discarding clusters from the cache file.
+     */
+    CoRwlock lock;
+
+    /*
+     * Incremented before and after every guest write. Data read from the
+     * file child is only added to the cache if no write happened in
+     * between.
+     */
+    uint64_t write_gen;
+
+    /*
+     * Writes to the cache file that are in flight. Only one populate may
+     * write a given cluster at a time, otherwise a request that read old
+     * data from the file child could overwrite the newer data of another
+     * one after that had already marked the cluster as cached.
+     */
+    QLIST_HEAD(, ReadCachePopulate) populates;
+
+    uint64_t hit_bytes;
+    uint64_t miss_bytes;
+    uint64_t evictions;
+} BDRVReadCacheState;
+
+static QemuOptsList read_cache_runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(read_cache_runtime_opts.head),
+    .desc = {
+        {
+            .name = "cluster-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of the cache (used when a new cache is "
+                    "initialized)",
+        },
+        {
+            .name = "max-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of cached data (0 = unlimited)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void read_cache_init_layout(BDRVReadCacheState *s, int cluster_bits)
+{
+    s->cluster_size = 1U << cluster_bits;
+    s->bitmap = hbitmap_alloc(s->image_size, cluster_bits);
+    s->referenced = hbitmap_alloc(s->image_size, cluster_bits);
+
+    s->bitmap_offset = READ_CACHE_HEADER_SIZE;
+    s->bitmap_size = hbitmap_serialization_size(s->bitmap, 0, s->image_size);
+    s->data_offset = ROUND_UP(s->bitmap_offset + s->bitmap_size,
+                              s->cluster_size);
+}
+
+static int read_cache_write_header(BlockDriverState *bs, uint64_t flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header = {
+        .magic          = cpu_to_be32(READ_CACHE_MAGIC),
+        .version        = cpu_to_be32(READ_CACHE_VERSION),
+        .flags          = cpu_to_be64(flags),
+        .cluster_bits   = cpu_to_be32(ctz32(s->cluster_size)),
+        .image_size     = cpu_to_be64(s->image_size),
+        .bitmap_offset  = cpu_to_be64(s->bitmap_offset),
+        .bitmap_size    = cpu_to_be64(s->bitmap_size),
+        .data_offset    = cpu_to_be64(s->data_offset),
+    };
+    int ret;
+
+    ret = bdrv_pwrite(s->cache, 0, &header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_flush(s->cache->bs);
+}
+
+/* Whether the cache file may currently be modified */
+static bool read_cache_writable(BDRVReadCacheState *s)
+{
+    return s->populate && (s->cache->perm & BLK_PERM_WRITE);
+}
+
+/*
+ * Marks the cache file as in use before it is modified for the first
+ * time. On failure the cache stops adding new data.
+ */
+static int coroutine_fn read_cache_co_mark_in_use(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret = 0;
+
+    if (s->in_use) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&s->header_lock);
+    if (!s->in_use && read_cache_writable(s)) {
+        if (s->stale_bytes) {
+            /* Drop the data of the previous cache, ignoring any errors */
+            bdrv_co_pdiscard(s->cache, s->data_offset, s->stale_bytes);
+            s->stale_bytes = 0;
+        }
+
+        ret = read_cache_write_header(bs, READ_CACHE_FLAG_IN_USE);
+        if (ret < 0) {
+            trace_read_cache_header_failed(bs, ret);
+            s->populate = false;
+        } else {
+            s->in_use = true;
+        }
+    }
+    qemu_co_mutex_unlock(&s->header_lock);
+
+    return s->in_use ? 0 : (ret < 0 ? ret : -EACCES);
+}
+
+/*
+ * Reads the header and the hit bitmap from the cache file. If the cache
+ * file does not contain a usable cache for this image, an empty cache is
+ * set up instead. @cluster_size is 0 if the user did not request a
+ * specific cluster size.
+ */
+static int read_cache_load(BlockDriverState *bs, uint64_t cluster_size,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header;
+    int64_t cache_len;
+    bool valid = false;
+    int cluster_bits;
+    int ret;
+
+    cache_len = bdrv_getlength(s->cache->bs);
+    if (cache_len < 0) {
+        error_setg_errno(errp, -cache_len, "Could not get cache file length");
+        return cache_len;
+    }
+
+    if (cache_len >= sizeof(header)) {
+        ret = bdrv_pread(s->cache, 0, &header, sizeof(header));
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read cache header");
+            return ret;
+        }
+
+        header.magic = be32_to_cpu(header.magic);
+        header.version = be32_to_cpu(header.version);
+        header.flags = be64_to_cpu(header.flags);
+        header.cluster_bits = be32_to_cpu(header.cluster_bits);
+        header.image_size = be64_to_cpu(header.image_size);
+        header.bitmap_offset = be64_to_cpu(header.bitmap_offset);
+        header.bitmap_size = be64_to_cpu(header.bitmap_size);
+        header.data_offset = be64_to_cpu(header.data_offset);
+
+        valid = header.magic == READ_CACHE_MAGIC &&
+                header.version == READ_CACHE_VERSION &&
+                !(header.flags & READ_CACHE_FLAG_IN_USE) &&
+                header.image_size == s->image_size &&
+                header.cluster_bits >= READ_CACHE_MIN_CLUSTER_BITS &&
+                header.cluster_bits <= READ_CACHE_MAX_CLUSTER_BITS &&
+                (!cluster_size || cluster_size == 1ULL << header.cluster_bits);
+    }
+
+    if (valid) {
+        cluster_bits = header.cluster_bits;
+    } else {
+        cluster_bits = ctz64(cluster_size ?: READ_CACHE_DEFAULT_CLUSTER_SIZE);
+    }
+    read_cache_init_layout(s, cluster_bits);
+
+    if (valid && (header.bitmap_offset != s->bitmap_offset ||
+                  header.bitmap_size != s->bitmap_size ||
+                  header.data_offset != s->data_offset))
+    {
+        valid = false;
+    }
+
+    if (valid && s->bitmap_size) {
+        uint8_t *buf = g_try_malloc(s->bitmap_size);
+
+        if (!buf) {
+            error_setg(errp, "Could not allocate cache bitmap");
+            return -ENOMEM;
+        }
+
+        ret = bdrv_pread(s->cache, s->bitmap_offset, buf, s->bitmap_size);
+        if (ret < 0) {
+            g_free(buf);
+            error_setg_errno(errp, -ret, "Could not read cache bitmap");
+            return ret;
+        }
+
+        hbitmap_deserialize_part(s->bitmap, buf, 0, s->image_size, true);
+        g_free(buf);
+    }
+
+    if (!valid && cache_len > s->data_offset) {
+        s->stale_bytes = cache_len - s->data_offset;
+    }
+
+    trace_read_cache_load(bs, valid, s->cluster_size,
+                          hbitmap_count(s->bitmap));
+    return 0;
+}
+
+static int read_cache_store(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint8_t *buf;
+    int ret;
+
+    buf = g_try_malloc(s->bitmap_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    hbitmap_serialize_part(s->bitmap, buf, 0, s->image_size);
+    ret = bdrv_pwrite(s->cache, s->bitmap_offset, buf, s->bitmap_size);
+    g_free(buf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The cached data and the bitmap must be stable before the flag is */
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return read_cache_write_header(bs, 0);
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t cluster_size;
+    int64_t image_size;
+    int ret;
+
+    opts = qemu_opts_create(&read_cache_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    cluster_size = qemu_opt_get_size(opts, "cluster-size", 0);
+    if (cluster_size &&
+        (!is_power_of_2(cluster_size) ||
+         cluster_size < (1 << READ_CACHE_MIN_CLUSTER_BITS) ||
+         cluster_size > (1 << READ_CACHE_MAX_CLUSTER_BITS)))
+    {
+        ret = -EINVAL;
+        error_setg(errp, "Cluster size must be a power of two between %d "
+                   "and %dk", 1 << READ_CACHE_MIN_CLUSTER_BITS,
+                   1 << (READ_CACHE_MAX_CLUSTER_BITS - 10));
+        goto fail;
+    }
+    s->max_size = qemu_opt_get_size(opts, "max-size", 0);
+
+    /* Open the cached image */
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    /* Open the cache file */
+    s->cache = bdrv_open_child(NULL, options, "cache-file", bs, &child_file,
+                               false, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    image_size = bdrv_getlength(bs->file->bs);
+    if (image_size < 0) {
+        ret = image_size;
+        error_setg_errno(errp, -ret, "Could not get image length");
+        goto fail;
+    }
+    s->image_size = image_size;
+    s->populate = !bdrv_is_read_only(s->cache->bs) && s->image_size > 0;
+    QLIST_INIT(&s->populates);
+
+    ret = read_cache_load(bs, cluster_size, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    qemu_co_rwlock_init(&s->lock);
+    qemu_co_mutex_init(&s->header_lock);
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        if (s->bitmap) {
+            hbitmap_free(s->bitmap);
+            hbitmap_free(s->referenced);
+            s->bitmap = NULL;
+            s->referenced = NULL;
+        }
+        bdrv_unref_child(bs, s->cache);
+        s->cache = NULL;
+        bdrv_unref_child(bs, bs->file);
+        bs->file = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (s->in_use && read_cache_writable(s)) {
+        int ret = read_cache_store(bs);
+        if (ret < 0) {
+            /* The cache stays marked as in use and is reset on next open */
+            trace_read_cache_store_failed(bs, ret);
+        }
+    }
+
+    hbitmap_free(s->bitmap);
+    hbitmap_free(s->referenced);
+    s->bitmap = NULL;
+    s->referenced = NULL;
+
+    bdrv_unref_child(bs, s->cache);
+    s->cache = NULL;
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  const BdrvChildRole *role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (c && c == s->cache) {
+        /*
+         * The cache file is private to this node and written independently
+         * of what the parents do.
+         */
+        if (s->populate && bdrv_is_writable(c->bs)) {
+            *nperm = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE |
+                     BLK_PERM_RESIZE;
+            *nshared = BLK_PERM_WRITE_UNCHANGED;
+        } else {
+            *nperm = BLK_PERM_CONSISTENT_READ;
+            *nshared = BLK_PERM_ALL & ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+        }
+        return;
+    }
+
+    bdrv_filter_default_perms(bs, c, role, reopen_queue, perm, shared,
+                              nperm, nshared);
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+/*
+ * Makes room for @bytes of new data by evicting clusters using the CLOCK
+ * algorithm: clusters that were hit since the clock hand last passed them
+ * get a second chance, all others are dropped from the cache.
+ */
+static void coroutine_fn read_cache_co_evict(BlockDriverState *bs,
+                                             uint64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t cached = hbitmap_count(s->bitmap);
+    uint64_t steps, nb_victims, i = 0;
+    uint64_t *victims;
+
+    if (!s->max_size || cached + bytes <= s->max_size) {
+        return;
+    }
+
+    nb_victims = DIV_ROUND_UP(cached + bytes - s->max_size, s->cluster_size);
+    victims = g_new(uint64_t, nb_victims);
+
+    /* Two rounds are enough to clear every referenced bit once */
+    steps = 2 * DIV_ROUND_UP(s->image_size, s->cluster_size);
+    while (i < nb_victims && steps--) {
+        HBitmapIter hbi;
+        int64_t offset;
+
+        hbitmap_iter_init(&hbi, s->bitmap, s->clock_hand);
+        offset = hbitmap_iter_next(&hbi);
+        if (offset < 0) {
+            if (s->clock_hand == 0) {
+                break;
+            }
+            s->clock_hand = 0;
+            continue;
+        }
+
+        s->clock_hand = offset + s->cluster_size;
+        if (s->clock_hand >= s->image_size) {
+            s->clock_hand = 0;
+        }
+
+        if (hbitmap_get(s->referenced, offset)) {
+            hbitmap_reset(s->referenced, offset, 1);
+            continue;
+        }
+
+        hbitmap_reset(s->bitmap, offset, 1);
+        victims[i++] = offset;
+        s->evictions++;
+        trace_read_cache_evict(bs, offset);
+    }
+
+    if (i && read_cache_co_mark_in_use(bs) == 0) {
+        /*
+         * Wait until nobody reads the victims any more. A concurrent request
+         * may have cached them again in the meantime, so check the bitmap.
+         */
+        qemu_co_rwlock_wrlock(&s->lock);
+        while (i--) {
+            if (!hbitmap_get(s->bitmap, victims[i])) {
+                bdrv_co_pdiscard(s->cache, s->data_offset + victims[i],
+                                 MIN(s->cluster_size,
+                                     s->image_size - victims[i]));
+            }
+        }
+        qemu_co_rwlock_unlock(&s->lock);
+    }
+
+    g_free(victims);
+}
+
+/*
+ * Returns whether [@offset, @offset + @bytes) may be written to the cache
+ * file: none of it may be cached already and no other populate may be
+ * writing to it.
+ */
+static bool read_cache_can_populate(BDRVReadCacheState *s, uint64_t offset,
+                                    uint64_t bytes)
+{
+    ReadCachePopulate *p;
+    uint64_t start = offset;
+    uint64_t count = bytes;
+
+    if (hbitmap_next_dirty_area(s->bitmap, &start, &count)) {
+        return false;
+    }
+
+    QLIST_FOREACH(p, &s->populates, next) {
+        if (offset < p->offset + p->bytes && p->offset < offset + bytes) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Adds the data in @qiov, which was read from the file child while
+ * s->write_gen was @write_gen, to the cache. @offset and @bytes must be
+ * cluster aligned, except at the end of the image. Errors are ignored,
+ * the data is just not cached then. The same goes for data that another
+ * request has cached or is caching in the meantime.
+ */
+static void coroutine_fn read_cache_co_populate(BlockDriverState *bs,
+                                                uint64_t offset,
+                                                uint64_t bytes,
+                                                QEMUIOVector *qiov,
+                                                uint64_t write_gen)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCachePopulate p = {
+        .offset = offset,
+        .bytes  = bytes,
+    };
+    int ret;
+
+    if (s->max_size && bytes > s->max_size) {
+        return;
+    }
+
+    if (!read_cache_can_populate(s, offset, bytes)) {
+        trace_read_cache_populate_skipped(bs, offset, bytes);
+        return;
+    }
+
+    if (read_cache_co_mark_in_use(bs) < 0) {
+        return;
+    }
+    read_cache_co_evict(bs, bytes);
+
+    /* Check again, the coroutine may have yielded since the first check */
+    qemu_co_rwlock_rdlock(&s->lock);
+    if (s->write_gen != write_gen || !read_cache_can_populate(s, offset, bytes))
+    {
+        qemu_co_rwlock_unlock(&s->lock);
+        trace_read_cache_populate_skipped(bs, offset, bytes);
+        return;
+    }
+
+    QLIST_INSERT_HEAD(&s->populates, &p, next);
+    ret = bdrv_co_pwritev(s->cache, s->data_offset + offset, bytes, qiov, 0);
+    QLIST_REMOVE(&p, next);
+
+    if (ret >= 0 && s->write_gen == write_gen) {
+        hbitmap_set(s->bitmap, offset, bytes);
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+
+    trace_read_cache_populate(bs, offset, bytes, ret);
+}
+
+/*
+ * Reads [@offset, @offset + @bytes), which is not cached, from the file
+ * child into @qiov at @qiov_offset, and adds it to the cache.
+ */
+static int coroutine_fn read_cache_co_read_miss(BlockDriverState *bs,
+                                                uint64_t offset,
+                                                uint64_t bytes,
+                                                QEMUIOVector *qiov,
+                                                size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t start = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+    uint64_t end = MIN(QEMU_ALIGN_UP(offset + bytes, s->cluster_size),
+                       s->image_size);
+    uint64_t write_gen = s->write_gen;
+    QEMUIOVector local_qiov;
+    void *buf = NULL;
+    int ret;
+
+    s->miss_bytes += bytes;
+
+    if (read_cache_writable(s) && (start != offset || end != offset + bytes)) {
+        /* Read whole clusters so that they can be cached */
+        buf = qemu_try_blockalign(bs->file->bs, end - start);
+    }
+
+    if (!buf) {
+        qemu_iovec_init(&local_qiov, qiov->niov);
+        qemu_iovec_concat(&local_qiov, qiov, qiov_offset, bytes);
+
+        ret = bdrv_co_preadv(bs->file, offset, bytes, &local_qiov, 0);
+        if (ret >= 0 && read_cache_writable(s) && start == offset &&
+            end == offset + bytes)
+        {
+            read_cache_co_populate(bs, offset, bytes, &local_qiov, write_gen);
+        }
+
+        qemu_iovec_destroy(&local_qiov);
+        return ret;
+    }
+
+    qemu_iovec_init_buf(&local_qiov, buf, end - start);
+    ret = bdrv_co_preadv(bs->file, start, end - start, &local_qiov, 0);
+    if (ret >= 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - start), bytes);
+        read_cache_co_populate(bs, start, end - start, &local_qiov, write_gen);
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_preadv(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    uint64_t pos = offset;
+    int ret;
+
+    if (offset >= s->image_size) {
+        return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    }
+    end = MIN(end, s->image_size);
+
+    while (pos < end) {
+        QEMUIOVector local_qiov;
+        uint64_t run_start = pos;
+        uint64_t run_bytes = end - pos;
+        int64_t next_zero;
+
+        /* Cached data must not be evicted while it is being read */
+        qemu_co_rwlock_rdlock(&s->lock);
+
+        if (!hbitmap_get(s->bitmap, pos)) {
+            qemu_co_rwlock_unlock(&s->lock);
+
+            if (hbitmap_next_dirty_area(s->bitmap, &run_start, &run_bytes)) {
+                run_bytes = run_start - pos;
+            } else {
+                run_bytes = end - pos;
+            }
+
+            ret = read_cache_co_read_miss(bs, pos, run_bytes, qiov,
+                                          pos - offset);
+            if (ret < 0) {
+                return ret;
+            }
+            pos += run_bytes;
+            continue;
+        }
+
+        next_zero = hbitmap_next_zero(s->bitmap, pos, end - pos);
+        run_bytes = (next_zero < 0 ? end : next_zero) - pos;
+
+        qemu_iovec_init(&local_qiov, qiov->niov);
+        qemu_iovec_concat(&local_qiov, qiov, pos - offset, run_bytes);
+        ret = bdrv_co_preadv(s->cache, s->data_offset + pos, run_bytes,
+                             &local_qiov, 0);
+        qemu_iovec_destroy(&local_qiov);
+
+        if (ret >= 0) {
+            hbitmap_set(s->referenced, pos, run_bytes);
+            s->hit_bytes += run_bytes;
+        }
+        qemu_co_rwlock_unlock(&s->lock);
+
+        if (ret < 0) {
+            /* Fall back to the file child */
+            trace_read_cache_read_failed(bs, pos, run_bytes, ret);
+            ret = read_cache_co_read_miss(bs, pos, run_bytes, qiov,
+                                          pos - offset);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        pos += run_bytes;
+    }
+
+    if (end < offset + bytes) {
+        QEMUIOVector local_qiov;
+
+        qemu_iovec_init(&local_qiov, qiov->niov);
+        qemu_iovec_concat(&local_qiov, qiov, end - offset,
+                          offset + bytes - end);
+        ret = bdrv_co_preadv(bs->file, end, offset + bytes - end,
+                             &local_qiov, flags);
+        qemu_iovec_destroy(&local_qiov);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Must be called before a guest write. Cached clusters that the write
+ * touches become invalid, so the bitmap that is stored in the cache file
+ * must not be trusted any more after this point.
+ */
+static int coroutine_fn read_cache_co_prepare_write(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (read_cache_co_mark_in_use(bs) < 0 && !hbitmap_empty(s->bitmap)) {
+        /* The stored bitmap can't be updated, so refuse to make it stale */
+        return -EACCES;
+    }
+
+    return 0;
+}
+
+/* Drops [@offset, @offset + @bytes) from the cache before and after writes */
+static void read_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    s->write_gen++;
+    if (offset < s->image_size && bytes) {
+        hbitmap_reset(s->bitmap, offset, MIN(bytes, s->image_size - offset));
+    }
+}
+
+static int coroutine_fn read_cache_co_pwritev(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    int ret;
+
+    ret = read_cache_co_prepare_write(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    read_cache_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    read_cache_invalidate(bs, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = read_cache_co_prepare_write(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    read_cache_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_invalidate(bs, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    int ret;
+
+    ret = read_cache_co_prepare_write(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    read_cache_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    read_cache_invalidate(bs, offset, bytes);
+
+    return ret;
+}
+
+static BlockStatsSpecific *read_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    *stats = (BlockStatsSpecific){
+        .driver = BLOCKDEV_DRIVER_READ_CACHE,
+        .u.read_cache = {
+            .hit_bytes      = s->hit_bytes,
+            .miss_bytes     = s->miss_bytes,
+            .evictions      = s->evictions,
+            .cached_bytes   = hbitmap_count(s->bitmap),
+            .max_size       = s->max_size,
+            .cluster_size   = s->cluster_size,
+        },
+    };
+
+    return stats;
+}
+
+static void read_cache_eject(BlockDriverState *bs, bool eject_flag)
+{
+    bdrv_eject(bs->file->bs, eject_flag);
+}
+
+static void read_cache_lock_medium(BlockDriverState *bs, bool locked)
+{
+    bdrv_lock_medium(bs->file->bs, locked);
+}
+
+static bool read_cache_is_first_non_filter(BlockDriverState *bs,
+                                           BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                        = "read-cache",
+    .instance_size                      = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                          = read_cache_open,
+    .bdrv_close                         = read_cache_close,
+    .bdrv_child_perm                    = read_cache_child_perm,
+
+    .bdrv_getlength                     = read_cache_getlength,
+
+    .bdrv_co_preadv                     = read_cache_co_preadv,
+    .bdrv_co_pwritev                    = read_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = read_cache_co_pdiscard,
+
+    .bdrv_get_specific_stats            = read_cache_get_specific_stats,
+
+    .bdrv_eject                         = read_cache_eject,
+    .bdrv_lock_medium                   = read_cache_lock_medium,
+
+    .bdrv_co_block_status               = bdrv_co_block_status_from_file,
+
+    .bdrv_recurse_is_first_non_filter   = read_cache_is_first_non_filter,
+
+    .is_filter                          = true,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
@@ -2825,7 +2825,9 @@ static ImageInfo *vmdk_get_extent_info(VmdkExtent *extent)
 
 static int coroutine_fn vmdk_co_check(BlockDriverState *bs,
                                       BdrvCheckResult *result,
-                                      BdrvCheckMode fix)
+                                      BdrvCheckMode fix,
+                                      BlockDriverCheckStatusCB *status_cb,
+                                      void *cb_opaque)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
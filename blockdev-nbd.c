@@ -188,8 +188,13 @@ void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
         writable = false;
     }
 
+    /*
+     * All clients of the export share its BlockBackend, so a flush on one
+     * connection covers writes that completed on the others.
+     */
     exp = nbd_export_new(bs, 0, len, name, NULL, bitmap,
-                         writable ? 0 : NBD_FLAG_READ_ONLY,
+                         NBD_FLAG_CAN_MULTI_CONN |
+                         (writable ? 0 : NBD_FLAG_READ_ONLY),
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
         return;
@@ -1110,6 +1110,29 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "dirty_bitmap:-b,dirty_ring:-r,second:l,regions:l?",
+        .params     = "[-b|-r] second [regions]",
+        .help       = "start measuring the dirty rate of the guest memory "
+                      "for 'second' seconds (-b to use dirty logging "
+                      "instead of page sampling, -r to also measure each "
+                      "vCPU with the KVM dirty ring, 'regions' for a "
+                      "heatmap)",
+        .cmd        = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate [-b|-r] @var{second} [@var{regions}]
+@findex calc_dirty_rate
+Start measuring the dirty rate of the guest memory for @var{second}
+seconds.  With @code{-b}, dirty logging is used instead of page sampling.
+With @code{-r}, the dirty rate of each vCPU is measured as well; this needs
+the KVM dirty ring.
+If @var{regions} is given, each RAM block is split in this many regions
+and a heatmap is reported.  Use @code{info dirty_rate} for the result.
 ETEXI
 
     {
@@ -42,6 +42,13 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /* IOThreads named by the iothread-vq-mapping property */
+    IOThread **iothreads;
+    unsigned num_iothreads;
+
+    /* AioContext serving each virtqueue, all equal to ctx without mapping */
+    AioContext **vq_aio_context;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -87,10 +94,17 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->num_iothread_vq_mapping) {
+        error_setg(errp, "iothread and iothread-vq-mapping properties cannot "
+                   "be set at the same time");
+        return false;
+    }
+
+    if (conf->iothread || conf->num_iothread_vq_mapping) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -118,13 +132,43 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
+    s->vq_aio_context = g_new(AioContext *, conf->num_queues);
+
+    if (conf->num_iothread_vq_mapping) {
+        s->iothreads = g_new0(IOThread *, conf->num_iothread_vq_mapping);
+        for (i = 0; i < conf->num_iothread_vq_mapping; i++) {
+            const char *id = conf->iothread_vq_mapping[i];
+            IOThread *iothread = id ? iothread_by_id(id) : NULL;
+
+            if (!iothread) {
+                error_setg(errp, "IOThread '%s' not found", id ? id : "");
+                virtio_blk_data_plane_destroy(s);
+                return false;
+            }
+            object_ref(OBJECT(iothread));
+            s->iothreads[s->num_iothreads++] = iothread;
+        }
 
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
-        s->ctx = iothread_get_aio_context(s->iothread);
+        /*
+         * Virtqueues are assigned round-robin.  The BlockBackend lives in
+         * the first IOThread and accepts requests from all of them.
+         */
+        for (i = 0; i < conf->num_queues; i++) {
+            IOThread *iothread = s->iothreads[i % s->num_iothreads];
+            s->vq_aio_context[i] = iothread_get_aio_context(iothread);
+        }
+        s->ctx = s->vq_aio_context[0];
     } else {
-        s->ctx = qemu_get_aio_context();
+        if (conf->iothread) {
+            s->iothread = conf->iothread;
+            object_ref(OBJECT(s->iothread));
+            s->ctx = iothread_get_aio_context(s->iothread);
+        } else {
+            s->ctx = qemu_get_aio_context();
+        }
+        for (i = 0; i < conf->num_queues; i++) {
+            s->vq_aio_context[i] = s->ctx;
+        }
     }
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
@@ -138,6 +182,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -146,10 +191,17 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
     g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
+    if (s->bh) {
+        qemu_bh_delete(s->bh);
+    }
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
     }
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
+    g_free(s->vq_aio_context);
     g_free(s);
 }
 
@@ -182,7 +234,12 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
     s->starting = true;
 
-    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    /*
+     * notify_guest_bh() runs in s->ctx, so batching would race with
+     * completions in the other IOThreads of an iothread-vq-mapping.
+     */
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX) &&
+        !s->num_iothreads) {
         s->batch_notifications = true;
     } else {
         s->batch_notifications = false;
@@ -218,6 +275,9 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
         error_report_err(local_err);
         goto fail_guest_notifiers;
     }
+    if (s->num_iothreads > 1) {
+        blk_set_multiqueue(s->conf->conf.blk, true);
+    }
 
     /* Kick right away to begin processing requests already in vring */
     for (i = 0; i < nvqs; i++) {
@@ -227,14 +287,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = s->vq_aio_context[i];
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -246,17 +307,28 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
 /* Stop notifications for new requests from guest.
  *
- * Context: BH in IOThread
+ * Context: BH in the IOThread serving @opaque
  */
-static void virtio_blk_data_plane_stop_bh(void *opaque)
+static void virtio_blk_data_plane_stop_vq_bh(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    virtio_queue_aio_set_host_notifier_handler(vq,
+            qemu_get_current_aio_context(), NULL);
+}
+
+/* Resume processing of requests that arrived while the device was drained.
+ *
+ * Context: QEMU global mutex held
+ */
+void virtio_blk_data_plane_kick(VirtIOBlockDataPlane *s)
 {
-    VirtIOBlockDataPlane *s = opaque;
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
     }
 }
 
@@ -283,11 +355,20 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    for (i = 0; i < nvqs; i++) {
+        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = s->vq_aio_context[i];
+
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_vq_bh, vq);
+        aio_context_release(ctx);
+    }
+
     aio_context_acquire(s->ctx);
-    aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
     /* Drain and try to switch bs back to the QEMU main loop. If other users
      * keep the BlockBackend in the iothread, that's ok */
+    blk_set_multiqueue(s->conf->conf.blk, false);
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context(), NULL);
 
     aio_context_release(s->ctx);
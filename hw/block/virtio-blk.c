@@ -28,6 +28,9 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
+/* Number of requests that are popped from a virtqueue at once */
+#define VIRTIO_BLK_POP_BATCH 16
+
 /* Config size before the discard support (hide associated config fields) */
 #define VIRTIO_BLK_CFG_SIZE offsetof(struct virtio_blk_config, \
                                      max_discard_sectors)
@@ -64,7 +67,7 @@ static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
 
 static void virtio_blk_free_request(VirtIOBlockReq *req)
 {
-    g_free(req);
+    virtqueue_element_free(req->vq, req);
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
@@ -246,14 +249,17 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
+static unsigned int virtio_blk_get_requests(VirtIOBlock *s, VirtQueue *vq,
+                                            VirtIOBlockReq **reqs,
+                                            unsigned int max)
 {
-    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
+    unsigned int i, n;
 
-    if (req) {
-        virtio_blk_init_request(s, vq, req);
+    n = virtqueue_pop_batch(vq, sizeof(VirtIOBlockReq), (void **)reqs, max);
+    for (i = 0; i < n; i++) {
+        virtio_blk_init_request(s, vq, reqs[i]);
     }
-    return req;
+    return n;
 }
 
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
@@ -757,21 +763,36 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
+    VirtIOBlockReq *reqs[VIRTIO_BLK_POP_BATCH];
+    unsigned int i, num_reqs;
     MultiReqBuffer mrb = {};
     bool progress = false;
 
     aio_context_acquire(blk_get_aio_context(s->blk));
+    if (s->dataplane_quiesced) {
+        /* virtio_blk_drained_end() kicks the virtqueues again */
+        aio_context_release(blk_get_aio_context(s->blk));
+        return false;
+    }
     blk_io_plug(s->blk);
 
     do {
         virtio_queue_set_notification(vq, 0);
 
-        while ((req = virtio_blk_get_request(s, vq))) {
+        while ((num_reqs = virtio_blk_get_requests(s, vq, reqs,
+                                                   ARRAY_SIZE(reqs)))) {
             progress = true;
-            if (virtio_blk_handle_request(req, &mrb)) {
-                virtqueue_detach_element(req->vq, &req->elem, 0);
-                virtio_blk_free_request(req);
+            for (i = 0; i < num_reqs; i++) {
+                if (virtio_blk_handle_request(reqs[i], &mrb)) {
+                    break;
+                }
+            }
+            if (i < num_reqs) {
+                /* The device is broken, drop the remaining requests */
+                for (; i < num_reqs; i++) {
+                    virtqueue_detach_element(vq, &reqs[i]->elem, 0);
+                    virtio_blk_free_request(reqs[i]);
+                }
                 break;
             }
         }
@@ -1047,7 +1068,7 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
             qemu_put_be32(f, virtio_get_queue_index(req->vq));
         }
 
-        qemu_put_virtqueue_element(f, &req->elem);
+        qemu_put_virtqueue_element(vdev, f, &req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -1089,8 +1110,38 @@ static void virtio_blk_resize(void *opaque)
     virtio_notify_config(vdev);
 }
 
+/*
+ * With an iothread-vq-mapping, virtqueues are also served by IOThreads other
+ * than the one of the BlockBackend, which the block layer does not disable
+ * while the device is drained.  Their handlers check dataplane_quiesced under
+ * the BlockBackend's AioContext lock instead.
+ */
+static void virtio_blk_drained_begin(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    if (s->conf.num_iothread_vq_mapping &&
+        s->dataplane_started && !s->dataplane_disabled) {
+        s->dataplane_quiesced = true;
+    }
+}
+
+static void virtio_blk_drained_end(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    if (s->dataplane_quiesced) {
+        s->dataplane_quiesced = false;
+        if (s->dataplane_started && !s->dataplane_disabled) {
+            virtio_blk_data_plane_kick(s->dataplane);
+        }
+    }
+}
+
 static const BlockDevOps virtio_block_ops = {
     .resize_cb = virtio_blk_resize,
+    .drained_begin = virtio_blk_drained_begin,
+    .drained_end = virtio_blk_drained_end,
 };
 
 static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
@@ -1168,7 +1219,10 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
     for (i = 0; i < conf->num_queues; i++) {
-        virtio_add_queue(vdev, conf->queue_size, virtio_blk_handle_output);
+        VirtQueue *vq = virtio_add_queue(vdev, conf->queue_size,
+                                         virtio_blk_handle_output);
+
+        virtio_queue_set_element_pool(vq, sizeof(VirtIOBlockReq));
     }
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
@@ -1205,6 +1259,13 @@ static void virtio_blk_instance_init(Object *obj)
                                   DEVICE(obj), NULL);
 }
 
+static void virtio_blk_instance_finalize(Object *obj)
+{
+    VirtIOBlock *s = VIRTIO_BLK(obj);
+
+    g_free(s->conf.iothread_vq_mapping);
+}
+
 static const VMStateDescription vmstate_virtio_blk = {
     .name = "virtio-blk",
     .minimum_version_id = 2,
@@ -1232,6 +1293,9 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_UINT16("queue-size", VirtIOBlock, conf.queue_size, 128),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_ARRAY("iothread-vq-mapping", VirtIOBlock,
+                      conf.num_iothread_vq_mapping, conf.iothread_vq_mapping,
+                      qdev_prop_string, char *),
     DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_DISCARD, true),
     DEFINE_PROP_BIT64("write-zeroes", VirtIOBlock, host_features,
@@ -1269,6 +1333,7 @@ static const TypeInfo virtio_blk_info = {
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(VirtIOBlock),
     .instance_init = virtio_blk_instance_init,
+    .instance_finalize = virtio_blk_instance_finalize,
     .class_init = virtio_blk_class_init,
 };
 
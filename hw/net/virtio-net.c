@@ -30,12 +30,16 @@
 #include "migration/misc.h"
 #include "standard-headers/linux/ethtool.h"
 #include "trace.h"
+#include "net_rx_pkt.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/* Number of TX packets that are popped from the virtqueue at once */
+#define VIRTIO_NET_TX_BATCH 32
+
 /* previously fixed value */
 #define VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE 256
 #define VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE 256
@@ -65,6 +69,16 @@
    tso/gso/gro 'off'. */
 #define VIRTIO_NET_RSC_DEFAULT_INTERVAL 300000
 
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)
+
 /* temporary until standard header include it */
 #if !defined(VIRTIO_NET_HDR_F_RSC_INFO)
 
@@ -96,6 +110,8 @@ static VirtIOFeature feature_sizes[] = {
      .end = virtio_endof(struct virtio_net_config, mtu)},
     {.flags = 1ULL << VIRTIO_NET_F_SPEED_DUPLEX,
      .end = virtio_endof(struct virtio_net_config, duplex)},
+    {.flags = (1ULL << VIRTIO_NET_F_RSS) | (1ULL << VIRTIO_NET_F_HASH_REPORT),
+     .end = virtio_endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
@@ -126,6 +142,11 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
     virtio_stl_p(vdev, &netcfg.speed, n->net_conf.speed);
     netcfg.duplex = n->net_conf.duplex;
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
@@ -484,6 +505,14 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+static void virtio_net_disable_rss(VirtIONet *n)
+{
+    if (n->rss_data.enabled) {
+        trace_virtio_net_rss_disable();
+    }
+    n->rss_data.enabled = false;
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -498,6 +527,7 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->nobcast = 0;
     /* multiqueue is disabled by default */
     n->curr_queues = 1;
+    virtio_net_disable_rss(n);
     timer_del(n->announce_timer.tm);
     n->announce_timer.round = 0;
     n->status &= ~VIRTIO_NET_S_ANNOUNCE;
@@ -549,7 +579,7 @@ static int peer_has_ufo(VirtIONet *n)
 }
 
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
     int i;
     NetClientState *nc;
@@ -557,7 +587,9 @@ static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
     n->mergeable_rx_bufs = mergeable_rx_bufs;
 
     if (version_1) {
-        n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        n->guest_hdr_len = hash_report ?
+            sizeof(struct virtio_net_hdr_v1_hash) :
+            sizeof(struct virtio_net_hdr_mrg_rxbuf);
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
             sizeof(struct virtio_net_hdr_mrg_rxbuf) :
@@ -685,10 +717,22 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_UFO);
     }
 
+    if (!virtio_has_feature(features, VIRTIO_NET_F_CTRL_VQ)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+        virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+    }
+
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
 
+    /*
+     * RSS steering and the hash report are implemented in the QEMU receive
+     * path, which vhost bypasses.
+     */
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+
     features = vhost_net_get_features(get_vhost_net(nc->peer), features);
     vdev->backend_features = features;
 
@@ -760,7 +804,9 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_MRG_RXBUF),
                                virtio_has_feature(features,
-                                                  VIRTIO_F_VERSION_1));
+                                                  VIRTIO_F_VERSION_1),
+                               virtio_has_feature(features,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
     n->rsc4_enabled = virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT) &&
         virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO4);
@@ -1008,6 +1054,141 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/*
+ * Parses a struct virtio_net_rss_config (@do_rss) or a struct
+ * virtio_net_hash_config and updates n->rss_data accordingly.
+ * Returns the number of queue pairs to use, or 0 if the configuration is
+ * invalid; RSS is disabled in that case.
+ */
+static uint16_t virtio_net_handle_rss(VirtIONet *n,
+                                      struct iovec *iov,
+                                      unsigned int iov_cnt,
+                                      bool do_rss)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRssData *rss = &n->rss_data;
+    struct virtio_net_rss_config cfg;
+    size_t s, offset = 0, size_get;
+    uint16_t queues, i;
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED temp;
+    const char *err_msg = "";
+    uint32_t err_value = 0;
+
+    if (do_rss && !virtio_vdev_has_feature(vdev, VIRTIO_NET_F_RSS)) {
+        err_msg = "RSS is not negotiated";
+        goto error;
+    }
+    if (!do_rss && !virtio_vdev_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+        err_msg = "Hash report is not negotiated";
+        goto error;
+    }
+
+    size_get = offsetof(struct virtio_net_rss_config, indirection_table);
+    s = iov_to_buf(iov, iov_cnt, offset, &cfg, size_get);
+    if (s != size_get) {
+        err_msg = "Short command buffer";
+        err_value = (uint32_t)s;
+        goto error;
+    }
+    rss->hash_types = virtio_ldl_p(vdev, &cfg.hash_types);
+    if (do_rss) {
+        rss->indirections_len =
+            virtio_lduw_p(vdev, &cfg.indirection_table_mask) + 1;
+        rss->default_queue = virtio_lduw_p(vdev, &cfg.unclassified_queue);
+    } else {
+        rss->indirections_len = 1;
+        rss->default_queue = 0;
+    }
+    if (!is_power_of_2(rss->indirections_len)) {
+        err_msg = "Invalid size of indirection table";
+        err_value = rss->indirections_len;
+        goto error;
+    }
+    if (rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN) {
+        err_msg = "Too large indirection table";
+        err_value = rss->indirections_len;
+        goto error;
+    }
+    if (rss->default_queue >= n->max_queues) {
+        err_msg = "Invalid default queue";
+        err_value = rss->default_queue;
+        goto error;
+    }
+    offset += size_get;
+
+    size_get = sizeof(uint16_t) * rss->indirections_len;
+    s = iov_to_buf(iov, iov_cnt, offset, rss->indirections_table, size_get);
+    if (s != size_get) {
+        err_msg = "Short indirection table buffer";
+        err_value = (uint32_t)s;
+        goto error;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        uint16_t val = rss->indirections_table[i];
+
+        rss->indirections_table[i] = virtio_lduw_p(vdev, &val);
+        if (do_rss && rss->indirections_table[i] >= n->max_queues) {
+            err_msg = "Invalid queue in indirection table";
+            err_value = rss->indirections_table[i];
+            goto error;
+        }
+    }
+    offset += size_get;
+
+    size_get = sizeof(temp);
+    s = iov_to_buf(iov, iov_cnt, offset, &temp, size_get);
+    if (s != size_get) {
+        err_msg = "Can't get queues";
+        err_value = (uint32_t)s;
+        goto error;
+    }
+    queues = do_rss ? virtio_lduw_p(vdev, &temp.max_tx_vq) : n->curr_queues;
+    if (queues == 0 || queues > n->max_queues) {
+        err_msg = "Invalid number of queues";
+        err_value = queues;
+        goto error;
+    }
+    if (temp.hash_key_length > VIRTIO_NET_RSS_MAX_KEY_SIZE) {
+        err_msg = "Invalid key size";
+        err_value = temp.hash_key_length;
+        goto error;
+    }
+    if (!temp.hash_key_length && rss->hash_types) {
+        err_msg = "No key provided";
+        err_value = 0;
+        goto error;
+    }
+    if (!temp.hash_key_length && !rss->hash_types) {
+        virtio_net_disable_rss(n);
+        return queues;
+    }
+    offset += size_get;
+
+    /* Keys shorter than the maximum are padded with zeroes */
+    memset(rss->key, 0, sizeof(rss->key));
+    size_get = temp.hash_key_length;
+    s = iov_to_buf(iov, iov_cnt, offset, rss->key, size_get);
+    if (s != size_get) {
+        err_msg = "Can't get key buffer";
+        err_value = (uint32_t)s;
+        goto error;
+    }
+
+    rss->redirect = do_rss;
+    rss->enabled = true;
+    trace_virtio_net_rss_enable(rss->hash_types, rss->indirections_len,
+                                temp.hash_key_length, rss->redirect);
+    return queues;
+
+error:
+    trace_virtio_net_rss_error(err_msg, err_value);
+    virtio_net_disable_rss(n);
+    return 0;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -1016,24 +1197,33 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
-    s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
-    if (s != sizeof(mq)) {
-        return VIRTIO_NET_ERR;
-    }
-
-    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, true);
+    } else if (cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, false);
+    } else if (cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
+        if (s != sizeof(mq)) {
+            return VIRTIO_NET_ERR;
+        }
+        queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
+        virtio_net_disable_rss(n);
+    } else {
         return VIRTIO_NET_ERR;
     }
 
-    queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
-
     if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
         queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
         queues > n->max_queues ||
-        !n->multiqueue) {
+        (!n->multiqueue && queues > 1)) {
         return VIRTIO_NET_ERR;
     }
 
+    if (queues == n->curr_queues && cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        /* Only the RSS or hash configuration has changed */
+        return VIRTIO_NET_OK;
+    }
+
     n->curr_queues = queues;
     /* stop the backend before changing the number of queues to avoid handling a
      * disabled queue */
@@ -1102,8 +1292,20 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    int i;
 
-    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    if (!n->rss_data.redirect || !n->rss_data.enabled) {
+        qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+        return;
+    }
+
+    /*
+     * With RSS, packets that are waiting on any queue may be steered to
+     * this one.
+     */
+    for (i = 0; i < n->curr_queues; i++) {
+        qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+    }
 }
 
 static int virtio_net_can_receive(NetClientState *nc)
@@ -1259,8 +1461,118 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size)
+/* Hash that is reported to the guest in struct virtio_net_hdr_v1_hash */
+typedef struct VirtIONetRxHash {
+    uint32_t value;
+    uint16_t report;
+} VirtIONetRxHash;
+
+static int virtio_net_get_hash_type(struct NetRxPkt *pkt, uint32_t types)
+{
+    bool isip4, isip6, isudp, istcp;
+
+    net_rx_pkt_get_protocols(pkt, &isip4, &isip6, &isudp, &istcp);
+
+    if (isip4) {
+        if (net_rx_pkt_get_ip4_info(pkt)->fragment) {
+            isudp = istcp = false;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+            return NetPktRssIpV4Tcp;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+            return NetPktRssIpV4Udp;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv4) {
+            return NetPktRssIpV4;
+        }
+    } else if (isip6) {
+        if (net_rx_pkt_get_ip6_info(pkt)->fragment) {
+            isudp = istcp = false;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCP_EX)) {
+            return NetPktRssIpV6TcpEx;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) {
+            return NetPktRssIpV6Tcp;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)) {
+            return NetPktRssIpV6UdpEx;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)) {
+            return NetPktRssIpV6Udp;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IP_EX) {
+            return NetPktRssIpV6Ex;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv6) {
+            return NetPktRssIpV6;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Computes the hash of a received packet as configured by the guest.
+ * Returns the queue that RSS steers the packet to, or -1 if the packet
+ * stays on the queue it was received on.
+ */
+static int virtio_net_process_rss(VirtIONet *n, const uint8_t *buf,
+                                  size_t size, VirtIONetRxHash *hash)
+{
+    static const uint8_t reports[] = {
+        [NetPktRssIpV4]      = VIRTIO_NET_HASH_REPORT_IPv4,
+        [NetPktRssIpV4Tcp]   = VIRTIO_NET_HASH_REPORT_TCPv4,
+        [NetPktRssIpV4Udp]   = VIRTIO_NET_HASH_REPORT_UDPv4,
+        [NetPktRssIpV6]      = VIRTIO_NET_HASH_REPORT_IPv6,
+        [NetPktRssIpV6Tcp]   = VIRTIO_NET_HASH_REPORT_TCPv6,
+        [NetPktRssIpV6Udp]   = VIRTIO_NET_HASH_REPORT_UDPv6,
+        [NetPktRssIpV6Ex]    = VIRTIO_NET_HASH_REPORT_IPv6_EX,
+        [NetPktRssIpV6TcpEx] = VIRTIO_NET_HASH_REPORT_TCPv6_EX,
+        [NetPktRssIpV6UdpEx] = VIRTIO_NET_HASH_REPORT_UDPv6_EX,
+    };
+    VirtioNetRssData *rss = &n->rss_data;
+    int type;
+
+    if (size < n->host_hdr_len) {
+        return -1;
+    }
+
+    net_rx_pkt_set_protocols(n->rx_pkt, buf + n->host_hdr_len,
+                             size - n->host_hdr_len);
+    type = virtio_net_get_hash_type(n->rx_pkt, rss->hash_types);
+    if (type < 0) {
+        return rss->redirect ? rss->default_queue : -1;
+    }
+
+    hash->value = net_rx_pkt_calc_rss_hash(n->rx_pkt, type, rss->key);
+    hash->report = reports[type];
+    if (!rss->redirect) {
+        return -1;
+    }
+    return rss->indirections_table[hash->value & (rss->indirections_len - 1)];
+}
+
+static void receive_hash(const struct iovec *iov, int iov_cnt,
+                         const VirtIONetRxHash *hash)
+{
+    struct {
+        uint32_t hash_value;
+        uint16_t hash_report;
+        uint16_t padding;
+    } QEMU_PACKED hdr;
+
+    stl_le_p(&hdr.hash_value, hash->value);
+    stw_le_p(&hdr.hash_report, hash->report);
+    hdr.padding = 0;
+    iov_from_buf(iov, iov_cnt,
+                 offsetof(struct virtio_net_hdr_v1_hash, hash_value),
+                 &hdr, sizeof(hdr));
+}
+
+static ssize_t virtio_net_receive_queue(NetClientState *nc,
+                                        const uint8_t *buf, size_t size,
+                                        const VirtIONetRxHash *hash)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1309,7 +1621,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             virtio_error(vdev,
                          "virtio-net receive queue contains no in buffers");
             virtqueue_detach_element(q->rx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_element_free(q->rx_vq, elem);
             return -1;
         }
 
@@ -1324,6 +1636,9 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             }
 
             receive_header(n, sg, elem->in_num, buf, size);
+            if (n->guest_hdr_len == sizeof(struct virtio_net_hdr_v1_hash)) {
+                receive_hash(sg, elem->in_num, hash);
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1341,13 +1656,13 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_unpop(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_element_free(q->rx_vq, elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elem, total, i++);
-        g_free(elem);
+        virtqueue_fill(q->rx_vq, elem, total, q->rx_pending + i++);
+        virtqueue_element_free(q->rx_vq, elem);
     }
 
     if (mhdr_cnt) {
@@ -1357,12 +1672,36 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (q->rx_batch) {
+        /* Completed by virtio_net_receive_batch() */
+        q->rx_pending += i;
+    } else {
+        virtqueue_flush(q->rx_vq, i);
+        virtio_notify(vdev, q->rx_vq);
+    }
 
     return size;
 }
 
+static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
+                                      size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetRxHash hash = { .report = VIRTIO_NET_HASH_REPORT_NONE };
+
+    if (n->rss_data.enabled && virtio_net_can_receive(nc)) {
+        int index = virtio_net_process_rss(n, buf, size, &hash);
+
+        if (index >= 0 && index < n->curr_queues &&
+            index != nc->queue_index) {
+            trace_virtio_net_rss_steer(nc->queue_index, index, hash.value);
+            nc = qemu_get_subqueue(n->nic, index);
+        }
+    }
+
+    return virtio_net_receive_queue(nc, buf, size, &hash);
+}
+
 static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
@@ -1374,6 +1713,23 @@ static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
     return r;
 }
 
+static void virtio_net_receive_batch(NetClientState *nc, bool start)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    q->rx_batch = start;
+    if (start || !q->rx_pending) {
+        return;
+    }
+
+    rcu_read_lock();
+    virtqueue_flush(q->rx_vq, q->rx_pending);
+    rcu_read_unlock();
+    virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    q->rx_pending = 0;
+}
+
 static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
                                          const uint8_t *buf,
                                          VirtioNetRscUnit *unit)
@@ -1991,7 +2347,7 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
     virtio_notify(vdev, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_element_free(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -1999,13 +2355,81 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
+
+/*
+ * Send the packet in @elem.  Returns 0 if @elem can be returned to the
+ * guest, -EBUSY if the peer queued the packet (virtio_net_tx_complete()
+ * returns @elem once it is sent) and -EINVAL if the device is broken.
+ */
+static int virtio_net_tx_one(VirtIONetQueue *q, VirtQueueElement *elem)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    ssize_t ret;
+    unsigned int out_num;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+
+    out_num = elem->out_num;
+    out_sg = elem->out_sg;
+    if (out_num < 1) {
+        virtio_error(vdev, "virtio-net header not in first element");
+        return -EINVAL;
+    }
+
+    if (n->has_vnet_hdr) {
+        if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            n->guest_hdr_len) {
+            virtio_error(vdev, "virtio-net header incorrect");
+            return -EINVAL;
+        }
+        if (n->needs_vnet_hdr_swap) {
+            virtio_net_hdr_swap(vdev, (void *) &mhdr);
+            sg2[0].iov_base = &mhdr;
+            sg2[0].iov_len = n->guest_hdr_len;
+            out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
+                               out_sg, out_num,
+                               n->guest_hdr_len, -1);
+            if (out_num == VIRTQUEUE_MAX_SIZE) {
+                /* Drop the packet */
+                return 0;
+            }
+            out_num += 1;
+            out_sg = sg2;
+        }
+    }
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+    }
+
+    ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+                                  out_sg, out_num, virtio_net_tx_complete);
+    return ret == 0 ? -EBUSY : 0;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    unsigned int i, j, num_elems;
     int32_t num_packets = 0;
-    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    int ret = 0;
+
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -2015,80 +2439,49 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
-
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+    while (num_packets < n->tx_burst) {
+        num_elems = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                        (void **)elems,
+                                        MIN(ARRAY_SIZE(elems),
+                                            n->tx_burst - num_packets));
+        if (!num_elems) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            virtio_error(vdev, "virtio-net header not in first element");
-            virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
-            return -EINVAL;
+        for (i = 0; i < num_elems; i++) {
+            ret = virtio_net_tx_one(q, elems[i]);
+            if (ret < 0) {
+                break;
+            }
         }
 
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                virtio_error(vdev, "virtio-net header incorrect");
-                virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
-                return -EINVAL;
-            }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-                }
-                out_num += 1;
-                out_sg = sg2;
+        if (ret == -EBUSY) {
+            /* Give back what was popped after the queued packet */
+            for (j = num_elems; j > i + 1; j--) {
+                virtqueue_unpop(q->tx_vq, elems[j - 1], 0);
+                virtqueue_element_free(q->tx_vq, elems[j - 1]);
             }
-        }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
-
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            return -EBUSY;
+            q->async_tx.elem = elems[i];
+        } else if (ret < 0) {
+            for (j = i; j < num_elems; j++) {
+                virtqueue_detach_element(q->tx_vq, elems[j], 0);
+                virtqueue_element_free(q->tx_vq, elems[j]);
+            }
         }
 
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        /* Return all sent packets with a single used index update */
+        if (i) {
+            virtqueue_push_batch(q->tx_vq, elems, NULL, i);
+            virtio_notify(vdev, q->tx_vq);
+            for (j = 0; j < i; j++) {
+                virtqueue_element_free(q->tx_vq, elems[j]);
+            }
+            num_packets += i;
+        }
 
-        if (++num_packets >= n->tx_burst) {
-            break;
+        if (ret < 0) {
+            return ret;
         }
     }
     return num_packets;
@@ -2225,6 +2618,8 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 
     n->vqs[index].rx_vq = virtio_add_queue(vdev, n->net_conf.rx_queue_size,
                                            virtio_net_handle_rx);
+    virtio_queue_set_element_pool(n->vqs[index].rx_vq,
+                                  sizeof(VirtQueueElement));
 
     if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
         n->vqs[index].tx_vq =
@@ -2239,6 +2634,8 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
                              virtio_net_handle_tx_bh);
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
+    virtio_queue_set_element_pool(n->vqs[index].tx_vq,
+                                  sizeof(VirtQueueElement));
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
@@ -2319,7 +2716,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
     trace_virtio_net_post_load_device();
     virtio_net_set_mrg_rx_bufs(n, n->mergeable_rx_bufs,
                                virtio_vdev_has_feature(vdev,
-                                                       VIRTIO_F_VERSION_1));
+                                                       VIRTIO_F_VERSION_1),
+                               virtio_vdev_has_feature(vdev,
+                                                   VIRTIO_NET_F_HASH_REPORT));
 
     /* MAC_TABLE_ENTRIES may be different from the saved image */
     if (n->mac_table.in_use > MAC_TABLE_ENTRIES) {
@@ -2525,6 +2924,50 @@ static const VMStateDescription vmstate_virtio_net_has_vnet = {
     },
 };
 
+static bool virtio_net_rss_needed(void *opaque)
+{
+    return VIRTIO_NET(opaque)->rss_data.enabled;
+}
+
+static int virtio_net_rss_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+    VirtioNetRssData *rss = &n->rss_data;
+    int i;
+
+    if (!is_power_of_2(rss->indirections_len) ||
+        rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        rss->default_queue >= n->max_queues) {
+        return -EINVAL;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        if (rss->indirections_table[i] >= n->max_queues) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net_rss = {
+    .name = "virtio-net-device/rss",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_net_rss_needed,
+    .post_load = virtio_net_rss_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rss_data.enabled, VirtIONet),
+        VMSTATE_BOOL(rss_data.redirect, VirtIONet),
+        VMSTATE_UINT32(rss_data.hash_types, VirtIONet),
+        VMSTATE_UINT16(rss_data.indirections_len, VirtIONet),
+        VMSTATE_UINT16(rss_data.default_queue, VirtIONet),
+        VMSTATE_UINT8_ARRAY(rss_data.key, VirtIONet,
+                            VIRTIO_NET_RSS_MAX_KEY_SIZE),
+        VMSTATE_UINT16_ARRAY(rss_data.indirections_table, VirtIONet,
+                             VIRTIO_NET_RSS_MAX_TABLE_LEN),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_virtio_net_device = {
     .name = "virtio-net-device",
     .version_id = VIRTIO_NET_VM_VERSION,
@@ -2575,6 +3018,10 @@ static const VMStateDescription vmstate_virtio_net_device = {
                             has_ctrl_guest_offloads),
         VMSTATE_END_OF_LIST()
    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_virtio_net_rss,
+        NULL
+    },
 };
 
 static NetClientInfo net_virtio_info = {
@@ -2585,6 +3032,7 @@ static NetClientInfo net_virtio_info = {
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
+    .receive_batch = virtio_net_receive_batch,
 };
 
 static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
@@ -2748,7 +3196,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
@@ -2760,6 +3208,8 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     QTAILQ_INIT(&n->rsc_chains);
     n->qdev = dev;
+
+    net_rx_pkt_init(&n->rx_pkt, false);
 }
 
 static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
@@ -2788,6 +3238,7 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     g_free(n->vqs);
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
+    net_rx_pkt_uninit(n->rx_pkt);
     virtio_cleanup(vdev);
 }
 
@@ -2870,6 +3321,10 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
     DEFINE_PROP_BIT64("guest_rsc_ext", VirtIONet, host_features,
                     VIRTIO_NET_F_RSC_EXT, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                    VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                    VIRTIO_NET_F_HASH_REPORT, false),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
                        VIRTIO_NET_RSC_DEFAULT_INTERVAL),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
@@ -59,6 +59,18 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent {
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
 typedef struct VRingMemoryRegionCaches {
     struct rcu_head rcu;
     MemoryRegionCache desc;
@@ -66,6 +78,30 @@ typedef struct VRingMemoryRegionCaches {
     MemoryRegionCache used;
 } VRingMemoryRegionCaches;
 
+/*
+ * Elements whose scatter/gather lists have at most this many entries in
+ * total are allocated from the element pool of their virtqueue.
+ */
+#define VIRTQUEUE_POOL_MAX_SG 32
+
+typedef struct VirtQueuePoolEntry {
+    QSLIST_ENTRY(VirtQueuePoolEntry) next;
+} VirtQueuePoolEntry;
+
+/*
+ * Freed elements that are kept for reuse, so that popping an element does
+ * not need to allocate memory.  Elements can be freed from a different
+ * thread than the one that pops them, hence the lock.
+ */
+typedef struct VirtQueueElementPool {
+    QemuSpin lock;
+    QSLIST_HEAD(, VirtQueuePoolEntry) free;
+    unsigned int nfree;
+    unsigned int max;
+    size_t elem_size;   /* @sz of the pooled elements, 0 if disabled */
+    size_t slot_size;   /* allocation size of the pooled elements */
+} VirtQueueElementPool;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -83,11 +119,14 @@ struct VirtQueue
 
     /* Next head to pop */
     uint16_t last_avail_idx;
+    bool last_avail_wrap_counter;
 
     /* Last avail_idx read from VQ. */
     uint16_t shadow_avail_idx;
+    bool shadow_avail_wrap_counter;
 
     uint16_t used_idx;
+    bool used_wrap_counter;
 
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
@@ -100,8 +139,17 @@ struct VirtQueue
 
     uint16_t queue_index;
 
+    /*
+     * Elements in use by the device.  For packed virtqueues this counts
+     * descriptors rather than elements.
+     */
     unsigned int inuse;
 
+    /* Elements filled since the last flush, packed virtqueues only */
+    VirtQueueElement *used_elems;
+
+    VirtQueueElementPool pool;
+
     uint16_t vector;
     VirtIOHandleOutput handle_output;
     VirtIOHandleAIOOutput handle_aio_output;
@@ -142,8 +190,12 @@ static void virtio_init_region_cache(VirtIODevice *vdev, int n)
     hwaddr addr, size;
     int event_size;
     int64_t len;
+    bool packed;
 
-    event_size = virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
+    packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+    /* The packed layout has fixed-size event suppression structures. */
+    event_size = !packed &&
+        virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
 
     addr = vq->vring.desc;
     if (!addr) {
@@ -152,7 +204,7 @@ static void virtio_init_region_cache(VirtIODevice *vdev, int n)
     new = g_new0(VRingMemoryRegionCaches, 1);
     size = virtio_queue_get_desc_size(vdev, n);
     len = address_space_cache_init(&new->desc, vdev->dma_as,
-                                   addr, size, false);
+                                   addr, size, packed);
     if (len < size) {
         virtio_error(vdev, "Cannot map desc");
         goto err_desc;
@@ -219,6 +271,111 @@ static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
     virtio_tswap16s(vdev, &desc->next);
 }
 
+static void vring_packed_event_read(VirtIODevice *vdev,
+                                    MemoryRegionCache *cache,
+                                    VRingPackedDescEvent *e)
+{
+    hwaddr off_off = offsetof(VRingPackedDescEvent, off_wrap);
+    hwaddr off_flags = offsetof(VRingPackedDescEvent, flags);
+
+    address_space_read_cached(cache, off_flags, &e->flags,
+                              sizeof(e->flags));
+    /* Make sure flags is seen before off_wrap */
+    smp_rmb();
+    address_space_read_cached(cache, off_off, &e->off_wrap,
+                              sizeof(e->off_wrap));
+    virtio_tswap16s(vdev, &e->off_wrap);
+    virtio_tswap16s(vdev, &e->flags);
+}
+
+static void vring_packed_off_wrap_write(VirtIODevice *vdev,
+                                        MemoryRegionCache *cache,
+                                        uint16_t off_wrap)
+{
+    hwaddr off = offsetof(VRingPackedDescEvent, off_wrap);
+
+    virtio_stw_phys_cached(vdev, cache, off, off_wrap);
+    address_space_cache_invalidate(cache, off, sizeof(off_wrap));
+}
+
+static void vring_packed_flags_write(VirtIODevice *vdev,
+                                     MemoryRegionCache *cache, uint16_t flags)
+{
+    hwaddr off = offsetof(VRingPackedDescEvent, flags);
+
+    virtio_stw_phys_cached(vdev, cache, off, flags);
+    address_space_cache_invalidate(cache, off, sizeof(flags));
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_desc_read_flags(VirtIODevice *vdev, uint16_t *flags,
+                                         MemoryRegionCache *cache, int i)
+{
+    *flags = virtio_lduw_phys_cached(vdev, cache,
+                                     i * sizeof(VRingPackedDesc) +
+                                     offsetof(VRingPackedDesc, flags));
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_desc_read(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                   MemoryRegionCache *cache, int i,
+                                   bool strict_order)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    vring_packed_desc_read_flags(vdev, &desc->flags, cache, i);
+
+    if (strict_order) {
+        /* Make sure flags is read before the rest of the descriptor. */
+        smp_rmb();
+    }
+
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, addr),
+                              &desc->addr, sizeof(desc->addr));
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, id),
+                              &desc->id, sizeof(desc->id));
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, len),
+                              &desc->len, sizeof(desc->len));
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap32s(vdev, &desc->len);
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_desc_write(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                    MemoryRegionCache *cache, int i,
+                                    bool strict_order)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+    hwaddr off_id = off + offsetof(VRingPackedDesc, id);
+    hwaddr off_len = off + offsetof(VRingPackedDesc, len);
+    hwaddr off_flags = off + offsetof(VRingPackedDesc, flags);
+
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+    address_space_write_cached(cache, off_id, &desc->id, sizeof(desc->id));
+    address_space_cache_invalidate(cache, off_id, sizeof(desc->id));
+    address_space_write_cached(cache, off_len, &desc->len, sizeof(desc->len));
+    address_space_cache_invalidate(cache, off_len, sizeof(desc->len));
+
+    if (strict_order) {
+        /* Make sure id and len are written before flags. */
+        smp_wmb();
+    }
+
+    virtio_stw_phys_cached(vdev, cache, off_flags, desc->flags);
+    address_space_cache_invalidate(cache, off_flags, sizeof(desc->flags));
+}
+
+static inline bool is_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail, used;
+
+    avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+    return (avail != used) && (avail == wrap_counter);
+}
+
 static VRingMemoryRegionCaches *vring_get_region_caches(struct VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches = atomic_rcu_read(&vq->vring.caches);
@@ -325,6 +482,40 @@ static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
     address_space_cache_invalidate(&caches->used, pa, sizeof(val));
 }
 
+/* Called within rcu_read_lock().  */
+static void virtio_queue_split_set_notification(VirtQueue *vq, int enable)
+{
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vring_avail_idx(vq));
+    } else if (enable) {
+        vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
+    } else {
+        vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
+    }
+}
+
+/* Called within rcu_read_lock().  */
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    uint16_t off_wrap, flags;
+
+    if (!enable) {
+        flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        off_wrap = vq->shadow_avail_idx |
+            vq->shadow_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+        vring_packed_off_wrap_write(vq->vdev, &caches->used, off_wrap);
+        /* Make sure off_wrap is written before flags */
+        smp_wmb();
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+
+    vring_packed_flags_write(vq->vdev, &caches->used, flags);
+}
+
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
@@ -334,12 +525,10 @@ void virtio_queue_set_notification(VirtQueue *vq, int enable)
     }
 
     rcu_read_lock();
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vring_avail_idx(vq));
-    } else if (enable) {
-        vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtio_queue_packed_set_notification(vq, enable);
     } else {
-        vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
+        virtio_queue_split_set_notification(vq, enable);
     }
     if (enable) {
         /* Expose avail event/used flags before caller checks the avail idx. */
@@ -356,12 +545,8 @@ int virtio_queue_ready(VirtQueue *vq)
 /* Fetch avail_idx from VQ memory only when we really need to know if
  * guest has added some buffers.
  * Called within rcu_read_lock().  */
-static int virtio_queue_empty_rcu(VirtQueue *vq)
+static int virtio_queue_split_empty_rcu(VirtQueue *vq)
 {
-    if (unlikely(vq->vdev->broken)) {
-        return 1;
-    }
-
     if (unlikely(!vq->vring.avail)) {
         return 1;
     }
@@ -373,24 +558,53 @@ static int virtio_queue_empty_rcu(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
-int virtio_queue_empty(VirtQueue *vq)
+/* Called within rcu_read_lock().  */
+static int virtio_queue_packed_empty_rcu(VirtQueue *vq)
 {
-    bool empty;
+    VRingMemoryRegionCaches *caches;
+    uint16_t flags;
+
+    if (unlikely(!vq->vring.desc)) {
+        return 1;
+    }
 
+    caches = vring_get_region_caches(vq);
+    vring_packed_desc_read_flags(vq->vdev, &flags, &caches->desc,
+                                 vq->last_avail_idx);
+
+    return !is_desc_avail(flags, vq->last_avail_wrap_counter);
+}
+
+/* Called within rcu_read_lock().  */
+static int virtio_queue_empty_rcu(VirtQueue *vq)
+{
     if (unlikely(vq->vdev->broken)) {
         return 1;
     }
 
-    if (unlikely(!vq->vring.avail)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_queue_packed_empty_rcu(vq);
+    } else {
+        return virtio_queue_split_empty_rcu(vq);
+    }
+}
+
+int virtio_queue_empty(VirtQueue *vq)
+{
+    bool empty;
+
+    if (unlikely(vq->vdev->broken)) {
         return 1;
     }
 
-    if (vq->shadow_avail_idx != vq->last_avail_idx) {
+    /* Avoid the RCU critical section if the shadow index has news. */
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED) &&
+        vq->vring.avail && vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
 
     rcu_read_lock();
-    empty = vring_avail_idx(vq) == vq->last_avail_idx;
+    empty = virtio_queue_empty_rcu(vq);
     rcu_read_unlock();
     return empty;
 }
@@ -432,10 +646,29 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
                               unsigned int len)
 {
-    vq->inuse--;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        vq->inuse -= elem->ndescs;
+    } else {
+        vq->inuse--;
+    }
     virtqueue_unmap_sg(vq, elem, len);
 }
 
+static void virtqueue_split_rewind(VirtQueue *vq, unsigned int num)
+{
+    vq->last_avail_idx -= num;
+}
+
+static void virtqueue_packed_rewind(VirtQueue *vq, unsigned int num)
+{
+    if (vq->last_avail_idx < num) {
+        vq->last_avail_idx = vq->vring.num + vq->last_avail_idx - num;
+        vq->last_avail_wrap_counter ^= 1;
+    } else {
+        vq->last_avail_idx -= num;
+    }
+}
+
 /* virtqueue_unpop:
  * @vq: The #VirtQueue
  * @elem: The #VirtQueueElement
@@ -447,7 +680,11 @@ void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
                      unsigned int len)
 {
-    vq->last_avail_idx--;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_rewind(vq, elem->ndescs);
+    } else {
+        virtqueue_split_rewind(vq, 1);
+    }
     virtqueue_detach_element(vq, elem, len);
 }
 
@@ -458,7 +695,9 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
  * Pretend that elements weren't popped from the virtqueue.  The next
  * virtqueue_pop() will refetch the oldest element.
  *
- * Use virtqueue_unpop() instead if you have a VirtQueueElement.
+ * Use virtqueue_unpop() instead if you have a VirtQueueElement.  For packed
+ * virtqueues, @num counts descriptors, which only matches the number of
+ * elements if each of them used a single (possibly indirect) descriptor.
  *
  * Returns: true on success, false if @num is greater than the number of in use
  * elements.
@@ -468,25 +707,21 @@ bool virtqueue_rewind(VirtQueue *vq, unsigned int num)
     if (num > vq->inuse) {
         return false;
     }
-    vq->last_avail_idx -= num;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_rewind(vq, num);
+    } else {
+        virtqueue_split_rewind(vq, num);
+    }
     vq->inuse -= num;
     return true;
 }
 
 /* Called within rcu_read_lock().  */
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_split_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                 unsigned int len, unsigned int idx)
 {
     VRingUsedElem uelem;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
-    virtqueue_unmap_sg(vq, elem, len);
-
-    if (unlikely(vq->vdev->broken)) {
-        return;
-    }
-
     if (unlikely(!vq->vring.used)) {
         return;
     }
@@ -498,16 +733,70 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_write(vq, &uelem, idx);
 }
 
+/*
+ * Used descriptors of a packed virtqueue are written by virtqueue_flush(),
+ * so that the flags of the first one can be made visible to the guest last.
+ */
+static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                  unsigned int len, unsigned int idx)
+{
+    if (unlikely(idx >= vq->vring.num)) {
+        virtio_error(vq->vdev, "Too many used elements in one batch");
+        return;
+    }
+
+    vq->used_elems[idx].index = elem->index;
+    vq->used_elems[idx].len = len;
+    vq->used_elems[idx].ndescs = elem->ndescs;
+}
+
 /* Called within rcu_read_lock().  */
-void virtqueue_flush(VirtQueue *vq, unsigned int count)
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
 {
-    uint16_t old, new;
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(vq, elem, len);
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        /* Recorded even if broken, virtqueue_flush() needs ndescs. */
+        virtqueue_packed_fill(vq, elem, len, idx);
+        return;
+    }
 
     if (unlikely(vq->vdev->broken)) {
-        vq->inuse -= count;
         return;
     }
 
+    virtqueue_split_fill(vq, elem, len, idx);
+}
+
+/* Called within rcu_read_lock().  */
+static void virtqueue_packed_fill_desc(VirtQueue *vq,
+                                       const VirtQueueElement *elem,
+                                       unsigned int head, bool wrap_counter,
+                                       bool strict_order)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    VRingPackedDesc desc = {
+        .id = elem->index,
+        .len = elem->len,
+    };
+
+    if (wrap_counter) {
+        desc.flags |= (1 << VRING_PACKED_DESC_F_AVAIL);
+        desc.flags |= (1 << VRING_PACKED_DESC_F_USED);
+    }
+
+    vring_packed_desc_write(vq->vdev, &desc, &caches->desc, head,
+                            strict_order);
+}
+
+/* Called within rcu_read_lock().  */
+static void virtqueue_split_flush(VirtQueue *vq, unsigned int count)
+{
+    uint16_t old, new;
+
     if (unlikely(!vq->vring.used)) {
         return;
     }
@@ -523,6 +812,72 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
         vq->signalled_used_valid = false;
 }
 
+/* Called within rcu_read_lock().  */
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    unsigned int i, head, ndescs;
+    bool wrap_counter;
+
+    if (unlikely(!vq->vring.desc)) {
+        return;
+    }
+
+    trace_virtqueue_flush(vq, count);
+
+    /*
+     * Each used descriptor takes the place of the first descriptor of its
+     * buffer, so the ring advances by the number of descriptors that the
+     * buffer used.  The first used descriptor is made available last, so
+     * that the guest sees the whole batch at once.
+     */
+    ndescs = count ? vq->used_elems[0].ndescs : 0;
+    for (i = 1; i < count; i++) {
+        head = vq->used_idx + ndescs;
+        wrap_counter = vq->used_wrap_counter;
+        if (head >= vq->vring.num) {
+            head -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+        virtqueue_packed_fill_desc(vq, &vq->used_elems[i], head,
+                                   wrap_counter, false);
+        ndescs += vq->used_elems[i].ndescs;
+    }
+    if (count) {
+        virtqueue_packed_fill_desc(vq, &vq->used_elems[0], vq->used_idx,
+                                   vq->used_wrap_counter, true);
+    }
+
+    vq->inuse -= ndescs;
+    vq->used_idx += ndescs;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter ^= 1;
+    }
+}
+
+/* Called within rcu_read_lock().  */
+void virtqueue_flush(VirtQueue *vq, unsigned int count)
+{
+    if (unlikely(vq->vdev->broken)) {
+        if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+            unsigned int i;
+
+            for (i = 0; i < MIN(count, vq->vring.num); i++) {
+                vq->inuse -= vq->used_elems[i].ndescs;
+            }
+        } else {
+            vq->inuse -= count;
+        }
+        return;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_flush(vq, count);
+    } else {
+        virtqueue_split_flush(vq, count);
+    }
+}
+
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len)
 {
@@ -532,6 +887,35 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     rcu_read_unlock();
 }
 
+/* virtqueue_push_batch:
+ * @vq: The #VirtQueue
+ * @elems: The elements to return to the guest
+ * @lens: The number of bytes written to each element, or NULL if no data
+ *        was written to any of them
+ * @count: The number of elements
+ *
+ * Return @count elements to the guest, with a single update of the used
+ * index (or of the first used descriptor for packed virtqueues).
+ */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          const unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+
+    trace_virtqueue_push_batch(vq, count);
+
+    rcu_read_lock();
+    for (i = 0; i < count; i++) {
+        virtqueue_fill(vq, elems[i], lens ? lens[i] : 0, i);
+    }
+    virtqueue_flush(vq, count);
+    rcu_read_unlock();
+}
+
 /* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
@@ -598,9 +982,36 @@ static int virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
     return VIRTQUEUE_READ_DESC_MORE;
 }
 
-void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
-                               unsigned int *out_bytes,
-                               unsigned max_in_bytes, unsigned max_out_bytes)
+static int virtqueue_packed_read_next_desc(VirtQueue *vq,
+                                           VRingPackedDesc *desc,
+                                           MemoryRegionCache *desc_cache,
+                                           unsigned int max,
+                                           unsigned int *next,
+                                           bool indirect)
+{
+    /* If this descriptor says it doesn't chain, we're done. */
+    if (!indirect && !(desc->flags & VRING_DESC_F_NEXT)) {
+        return VIRTQUEUE_READ_DESC_DONE;
+    }
+
+    ++*next;
+    if (*next == max) {
+        if (indirect) {
+            return VIRTQUEUE_READ_DESC_DONE;
+        } else {
+            (*next) -= vq->vring.num;
+        }
+    }
+
+    vring_packed_desc_read(vq->vdev, desc, desc_cache, *next, false);
+    return VIRTQUEUE_READ_DESC_MORE;
+}
+
+static void virtqueue_split_get_avail_bytes(VirtQueue *vq,
+                                            unsigned int *in_bytes,
+                                            unsigned int *out_bytes,
+                                            unsigned max_in_bytes,
+                                            unsigned max_out_bytes)
 {
     VirtIODevice *vdev = vq->vdev;
     unsigned int max, idx;
@@ -610,16 +1021,6 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     int64_t len = 0;
     int rc;
 
-    if (unlikely(!vq->vring.desc)) {
-        if (in_bytes) {
-            *in_bytes = 0;
-        }
-        if (out_bytes) {
-            *out_bytes = 0;
-        }
-        return;
-    }
-
     rcu_read_lock();
     idx = vq->last_avail_idx;
     total_bufs = in_total = out_total = 0;
@@ -723,12 +1124,156 @@ err:
     goto done;
 }
 
-int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
-                          unsigned int out_bytes)
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
 {
-    unsigned int in_total, out_total;
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int max, idx;
+    unsigned int total_bufs, in_total, out_total;
+    MemoryRegionCache *desc_cache;
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    int64_t len = 0;
+    VRingPackedDesc desc;
+    bool wrap_counter;
 
-    virtqueue_get_avail_bytes(vq, &in_total, &out_total, in_bytes, out_bytes);
+    rcu_read_lock();
+    idx = vq->last_avail_idx;
+    wrap_counter = vq->last_avail_wrap_counter;
+    total_bufs = in_total = out_total = 0;
+
+    caches = vring_get_region_caches(vq);
+    if (caches->desc.len < vq->vring.num * sizeof(VRingPackedDesc)) {
+        virtio_error(vdev, "Cannot map descriptor ring");
+        goto err;
+    }
+
+    for (;;) {
+        unsigned int num_bufs = total_bufs;
+        unsigned int i = idx;
+        int rc;
+
+        max = vq->vring.num;
+        desc_cache = &caches->desc;
+        vring_packed_desc_read(vdev, &desc, desc_cache, idx, true);
+        if (!is_desc_avail(desc.flags, wrap_counter)) {
+            break;
+        }
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (!desc.len || (desc.len % sizeof(VRingPackedDesc))) {
+                virtio_error(vdev, "Invalid size for indirect buffer table");
+                goto err;
+            }
+
+            /* If we've got too many, that implies a descriptor loop. */
+            if (num_bufs >= max) {
+                virtio_error(vdev, "Looped descriptor");
+                goto err;
+            }
+
+            /* loop over the indirect descriptor table */
+            len = address_space_cache_init(&indirect_desc_cache,
+                                           vdev->dma_as,
+                                           desc.addr, desc.len, false);
+            desc_cache = &indirect_desc_cache;
+            if (len < desc.len) {
+                virtio_error(vdev, "Cannot map indirect buffer");
+                goto err;
+            }
+
+            max = desc.len / sizeof(VRingPackedDesc);
+            num_bufs = i = 0;
+            vring_packed_desc_read(vdev, &desc, desc_cache, i, false);
+        }
+
+        do {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs > max) {
+                virtio_error(vdev, "Looped descriptor");
+                goto err;
+            }
+
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+
+            rc = virtqueue_packed_read_next_desc(vq, &desc, desc_cache, max,
+                                                 &i, desc_cache ==
+                                                 &indirect_desc_cache);
+        } while (rc == VIRTQUEUE_READ_DESC_MORE);
+
+        if (desc_cache == &indirect_desc_cache) {
+            address_space_cache_destroy(&indirect_desc_cache);
+            total_bufs++;
+            idx++;
+        } else {
+            idx += num_bufs - total_bufs;
+            total_bufs = num_bufs;
+        }
+
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+
+    /* Record the index and wrap counter for a kick we want */
+    vq->shadow_avail_idx = idx;
+    vq->shadow_avail_wrap_counter = wrap_counter;
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+    rcu_read_unlock();
+    return;
+
+err:
+    in_total = out_total = 0;
+    goto done;
+}
+
+void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
+                               unsigned int *out_bytes,
+                               unsigned max_in_bytes, unsigned max_out_bytes)
+{
+    if (unlikely(!vq->vring.desc)) {
+        if (in_bytes) {
+            *in_bytes = 0;
+        }
+        if (out_bytes) {
+            *out_bytes = 0;
+        }
+        return;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_get_avail_bytes(vq, in_bytes, out_bytes,
+                                         max_in_bytes, max_out_bytes);
+    } else {
+        virtqueue_split_get_avail_bytes(vq, in_bytes, out_bytes,
+                                        max_in_bytes, max_out_bytes);
+    }
+}
+
+int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
+                          unsigned int out_bytes)
+{
+    unsigned int in_total, out_total;
+
+    virtqueue_get_avail_bytes(vq, &in_total, &out_total, in_bytes, out_bytes);
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
@@ -817,39 +1362,288 @@ static void virtqueue_map_iovec(VirtIODevice *vdev, struct iovec *sg,
             exit(1);
         }
     }
-}
+}
+
+void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
+{
+    virtqueue_map_iovec(vdev, elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_iovec(vdev, elem->out_sg, elem->out_addr, elem->out_num, 0);
+}
+
+/*
+ * Lay out an element with room for @out_num and @in_num scatter/gather
+ * entries in @buf, which must be large enough.  If @buf is NULL, memory of
+ * the right size is allocated.
+ */
+static void *virtqueue_setup_element(void *buf, size_t sz,
+                                     unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
+    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
+    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
+    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
+    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
+    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+
+    assert(sz >= sizeof(VirtQueueElement));
+    elem = buf ? buf : g_malloc(out_sg_end);
+    trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
+    elem->pooled = false;
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->in_addr = (void *)elem + in_addr_ofs;
+    elem->out_addr = (void *)elem + out_addr_ofs;
+    elem->in_sg = (void *)elem + in_sg_ofs;
+    elem->out_sg = (void *)elem + out_sg_ofs;
+    return elem;
+}
+
+static void *virtqueue_alloc_element(size_t sz, unsigned out_num,
+                                     unsigned in_num)
+{
+    return virtqueue_setup_element(NULL, sz, out_num, in_num);
+}
+
+static void *virtqueue_pool_alloc_element(VirtQueue *vq, size_t sz,
+                                          unsigned out_num, unsigned in_num)
+{
+    VirtQueueElementPool *pool = &vq->pool;
+    VirtQueuePoolEntry *entry;
+    VirtQueueElement *elem;
+    size_t slot_size;
+
+    if (out_num + in_num > VIRTQUEUE_POOL_MAX_SG) {
+        return virtqueue_alloc_element(sz, out_num, in_num);
+    }
+
+    qemu_spin_lock(&pool->lock);
+    if (pool->elem_size != sz) {
+        qemu_spin_unlock(&pool->lock);
+        return virtqueue_alloc_element(sz, out_num, in_num);
+    }
+    entry = QSLIST_FIRST(&pool->free);
+    if (entry) {
+        QSLIST_REMOVE_HEAD(&pool->free, next);
+        pool->nfree--;
+    }
+    slot_size = pool->slot_size;
+    qemu_spin_unlock(&pool->lock);
+
+    elem = virtqueue_setup_element(entry ? (void *)entry : g_malloc(slot_size),
+                                   sz, out_num, in_num);
+    elem->pooled = true;
+    return elem;
+}
+
+static void virtqueue_pool_drain(VirtQueueElementPool *pool)
+{
+    VirtQueuePoolEntry *entry;
+
+    while ((entry = QSLIST_FIRST(&pool->free))) {
+        QSLIST_REMOVE_HEAD(&pool->free, next);
+        g_free(entry);
+    }
+    pool->nfree = 0;
+}
+
+/* virtio_queue_set_element_pool:
+ * @vq: The #VirtQueue
+ * @sz: The size of the elements that the device pops from @vq
+ *
+ * Keep elements of size @sz that are freed with virtqueue_element_free()
+ * for reuse by later virtqueue_pop() and virtqueue_pop_batch() calls,
+ * up to the size of the virtqueue.  Elements with large scatter/gather
+ * lists are allocated and freed as usual.
+ */
+void virtio_queue_set_element_pool(VirtQueue *vq, size_t sz)
+{
+    VirtQueueElementPool *pool = &vq->pool;
+    VirtQueueElement *elem;
+
+    assert(sz >= sizeof(VirtQueueElement));
+
+    qemu_spin_lock(&pool->lock);
+    virtqueue_pool_drain(pool);
+    pool->elem_size = sz;
+    pool->slot_size = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0])) +
+                      VIRTQUEUE_POOL_MAX_SG * sizeof(elem->in_addr[0]);
+    pool->slot_size = QEMU_ALIGN_UP(pool->slot_size,
+                                    __alignof__(elem->in_sg[0])) +
+                      VIRTQUEUE_POOL_MAX_SG * sizeof(elem->in_sg[0]);
+    pool->max = vq->vring.num_default;
+    qemu_spin_unlock(&pool->lock);
+}
+
+static void virtio_queue_disable_element_pool(VirtQueue *vq)
+{
+    qemu_spin_lock(&vq->pool.lock);
+    virtqueue_pool_drain(&vq->pool);
+    vq->pool.elem_size = 0;
+    qemu_spin_unlock(&vq->pool.lock);
+}
+
+/* virtqueue_element_free:
+ * @vq: The #VirtQueue that @elem was popped from
+ * @elem: The #VirtQueueElement, or the structure that it is embedded in
+ *
+ * Free an element, keeping it in the element pool of @vq if possible.
+ * Elements that do not come from the pool are simply freed, so this can
+ * be used for all elements of a virtqueue.
+ */
+void virtqueue_element_free(VirtQueue *vq, void *elem)
+{
+    VirtQueueElementPool *pool = &vq->pool;
+    VirtQueueElement *e = elem;
+
+    if (e && e->pooled) {
+        qemu_spin_lock(&pool->lock);
+        if (pool->elem_size && pool->nfree < pool->max) {
+            QSLIST_INSERT_HEAD(&pool->free, (VirtQueuePoolEntry *)e, next);
+            pool->nfree++;
+            e = NULL;
+        }
+        qemu_spin_unlock(&pool->lock);
+    }
+    g_free(e);
+}
+
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz, bool update_event)
+{
+    unsigned int i, head, max;
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    MemoryRegionCache *desc_cache;
+    int64_t len;
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem = NULL;
+    unsigned out_num, in_num, elem_entries;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingDesc desc;
+    int rc;
+
+    rcu_read_lock();
+    if (virtio_queue_split_empty_rcu(vq)) {
+        goto done;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    /* When we start there are none of either input nor output. */
+    out_num = in_num = elem_entries = 0;
+
+    max = vq->vring.num;
+
+    if (vq->inuse >= vq->vring.num) {
+        virtio_error(vdev, "Virtqueue size exceeded");
+        goto done;
+    }
+
+    if (!virtqueue_get_head(vq, vq->last_avail_idx++, &head)) {
+        goto done;
+    }
+
+    if (update_event &&
+        virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    i = head;
+
+    caches = vring_get_region_caches(vq);
+    if (caches->desc.len < max * sizeof(VRingDesc)) {
+        virtio_error(vdev, "Cannot map descriptor ring");
+        goto done;
+    }
+
+    desc_cache = &caches->desc;
+    vring_desc_read(vdev, &desc, desc_cache, i);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (!desc.len || (desc.len % sizeof(VRingDesc))) {
+            virtio_error(vdev, "Invalid size for indirect buffer table");
+            goto done;
+        }
+
+        /* loop over the indirect descriptor table */
+        len = address_space_cache_init(&indirect_desc_cache, vdev->dma_as,
+                                       desc.addr, desc.len, false);
+        desc_cache = &indirect_desc_cache;
+        if (len < desc.len) {
+            virtio_error(vdev, "Cannot map indirect buffer");
+            goto done;
+        }
+
+        max = desc.len / sizeof(VRingDesc);
+        i = 0;
+        vring_desc_read(vdev, &desc, desc_cache, i);
+    }
+
+    /* Collect all the descriptors */
+    do {
+        bool map_ok;
+
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+                                        iov + out_num,
+                                        VIRTQUEUE_MAX_SIZE - out_num, true,
+                                        desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                virtio_error(vdev, "Incorrect order for descriptors");
+                goto err_undo_map;
+            }
+            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+                                        VIRTQUEUE_MAX_SIZE, false,
+                                        desc.addr, desc.len);
+        }
+        if (!map_ok) {
+            goto err_undo_map;
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if (++elem_entries > max) {
+            virtio_error(vdev, "Looped descriptor");
+            goto err_undo_map;
+        }
+
+        rc = virtqueue_read_next_desc(vdev, &desc, desc_cache, max, &i);
+    } while (rc == VIRTQUEUE_READ_DESC_MORE);
+
+    if (rc == VIRTQUEUE_READ_DESC_ERROR) {
+        goto err_undo_map;
+    }
 
-void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
-{
-    virtqueue_map_iovec(vdev, elem->in_sg, elem->in_addr, elem->in_num, 1);
-    virtqueue_map_iovec(vdev, elem->out_sg, elem->out_addr, elem->out_num, 0);
-}
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_pool_alloc_element(vq, sz, out_num, in_num);
+    elem->index = head;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
 
-static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
-{
-    VirtQueueElement *elem;
-    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
-    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
-    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
-    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
-    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
-    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    rcu_read_unlock();
 
-    assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
-    trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
-    elem->out_num = out_num;
-    elem->in_num = in_num;
-    elem->in_addr = (void *)elem + in_addr_ofs;
-    elem->out_addr = (void *)elem + out_addr_ofs;
-    elem->in_sg = (void *)elem + in_sg_ofs;
-    elem->out_sg = (void *)elem + out_sg_ofs;
     return elem;
+
+err_undo_map:
+    virtqueue_undo_map_desc(out_num, in_num, iov);
+    goto done;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 {
-    unsigned int i, head, max;
+    unsigned int i, max;
     VRingMemoryRegionCaches *caches;
     MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
     MemoryRegionCache *desc_cache;
@@ -859,19 +1653,14 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     unsigned out_num, in_num, elem_entries;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
-    VRingDesc desc;
+    VRingPackedDesc desc;
+    uint16_t id;
     int rc;
 
-    if (unlikely(vdev->broken)) {
-        return NULL;
-    }
     rcu_read_lock();
-    if (virtio_queue_empty_rcu(vq)) {
+    if (virtio_queue_packed_empty_rcu(vq)) {
         goto done;
     }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
 
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
@@ -883,26 +1672,19 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (!virtqueue_get_head(vq, vq->last_avail_idx++, &head)) {
-        goto done;
-    }
-
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
-    i = head;
+    i = vq->last_avail_idx;
 
     caches = vring_get_region_caches(vq);
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
+    if (caches->desc.len < max * sizeof(VRingPackedDesc)) {
         virtio_error(vdev, "Cannot map descriptor ring");
         goto done;
     }
 
     desc_cache = &caches->desc;
-    vring_desc_read(vdev, &desc, desc_cache, i);
+    vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
+    id = desc.id;
     if (desc.flags & VRING_DESC_F_INDIRECT) {
-        if (!desc.len || (desc.len % sizeof(VRingDesc))) {
+        if (!desc.len || (desc.len % sizeof(VRingPackedDesc))) {
             virtio_error(vdev, "Invalid size for indirect buffer table");
             goto done;
         }
@@ -916,9 +1698,9 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             goto done;
         }
 
-        max = desc.len / sizeof(VRingDesc);
+        max = desc.len / sizeof(VRingPackedDesc);
         i = 0;
-        vring_desc_read(vdev, &desc, desc_cache, i);
+        vring_packed_desc_read(vdev, &desc, desc_cache, i, false);
     }
 
     /* Collect all the descriptors */
@@ -949,16 +1731,13 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             goto err_undo_map;
         }
 
-        rc = virtqueue_read_next_desc(vdev, &desc, desc_cache, max, &i);
+        rc = virtqueue_packed_read_next_desc(vq, &desc, desc_cache, max, &i,
+                                             desc_cache ==
+                                             &indirect_desc_cache);
     } while (rc == VIRTQUEUE_READ_DESC_MORE);
 
-    if (rc == VIRTQUEUE_READ_DESC_ERROR) {
-        goto err_undo_map;
-    }
-
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
-    elem->index = head;
+    elem = virtqueue_pool_alloc_element(vq, sz, out_num, in_num);
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -968,7 +1747,18 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         elem->in_sg[i] = iov[out_num + i];
     }
 
-    vq->inuse++;
+    elem->index = id;
+    elem->ndescs = (desc_cache == &indirect_desc_cache) ? 1 : elem_entries;
+    vq->last_avail_idx += elem->ndescs;
+    vq->inuse += elem->ndescs;
+
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+
+    vq->shadow_avail_idx = vq->last_avail_idx;
+    vq->shadow_avail_wrap_counter = vq->last_avail_wrap_counter;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
 done:
@@ -982,23 +1772,67 @@ err_undo_map:
     goto done;
 }
 
-/* virtqueue_drop_all:
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    if (unlikely(vq->vdev->broken)) {
+        return NULL;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_pop(vq, sz);
+    } else {
+        return virtqueue_split_pop(vq, sz, true);
+    }
+}
+
+/* virtqueue_pop_batch:
  * @vq: The #VirtQueue
- * Drops all queued buffers and indicates them to the guest
- * as if they are done. Useful when buffers can not be
- * processed but must be returned to the guest.
+ * @sz: The size of each element, as for virtqueue_pop()
+ * @elems: Array that receives the elements
+ * @max: The maximum number of elements to pop
+ *
+ * Pop up to @max elements from @vq at once.  This is equivalent to calling
+ * virtqueue_pop() repeatedly, but the ring is accessed in a single RCU
+ * critical section and the avail event is only published once.
+ *
+ * Returns: the number of elements stored in @elems.
  */
-unsigned int virtqueue_drop_all(VirtQueue *vq)
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
 {
-    unsigned int dropped = 0;
-    VirtQueueElement elem = {};
     VirtIODevice *vdev = vq->vdev;
-    bool fEventIdx = virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
+    bool packed = virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+    unsigned int n;
 
     if (unlikely(vdev->broken)) {
         return 0;
     }
 
+    rcu_read_lock();
+    for (n = 0; n < max; n++) {
+        elems[n] = packed ? virtqueue_packed_pop(vq, sz) :
+                            virtqueue_split_pop(vq, sz, false);
+        if (!elems[n]) {
+            break;
+        }
+    }
+    if (n && !packed && !vdev->broken &&
+        virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    rcu_read_unlock();
+
+    trace_virtqueue_pop_batch(vq, max, n);
+    return n;
+}
+
+static unsigned int virtqueue_split_drop_all(VirtQueue *vq)
+{
+    unsigned int dropped = 0;
+    VirtQueueElement elem = {};
+    VirtIODevice *vdev = vq->vdev;
+    bool fEventIdx = virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
+
     while (!virtio_queue_empty(vq) && vq->inuse < vq->vring.num) {
         /* works similar to virtqueue_pop but does not map buffers
         * and does not allocate any memory */
@@ -1020,6 +1854,83 @@ unsigned int virtqueue_drop_all(VirtQueue *vq)
     return dropped;
 }
 
+static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache *desc_cache;
+    unsigned int dropped = 0;
+    VirtQueueElement elem = {};
+    VirtIODevice *vdev = vq->vdev;
+    VRingPackedDesc desc;
+
+    if (unlikely(!vq->vring.desc)) {
+        return 0;
+    }
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    desc_cache = &caches->desc;
+
+    while (vq->inuse < vq->vring.num) {
+        unsigned int idx = vq->last_avail_idx;
+
+        /*
+         * works similar to virtqueue_pop but does not map buffers
+         * and does not allocate any memory.
+         */
+        vring_packed_desc_read(vdev, &desc, desc_cache, idx, true);
+        if (!is_desc_avail(desc.flags, vq->last_avail_wrap_counter)) {
+            break;
+        }
+        elem.index = desc.id;
+        elem.ndescs = 1;
+        while (virtqueue_packed_read_next_desc(vq, &desc, desc_cache,
+                                               vq->vring.num, &idx, false)) {
+            if (++elem.ndescs > vq->vring.num) {
+                virtio_error(vdev, "Looped descriptor");
+                goto out;
+            }
+        }
+
+        vq->inuse += elem.ndescs;
+        vq->last_avail_idx += elem.ndescs;
+        if (vq->last_avail_idx >= vq->vring.num) {
+            vq->last_avail_idx -= vq->vring.num;
+            vq->last_avail_wrap_counter ^= 1;
+        }
+
+        /*
+         * immediately push the element, nothing to unmap
+         * as both in_num and out_num are set to 0.
+         */
+        virtqueue_push(vq, &elem, 0);
+        dropped++;
+    }
+
+out:
+    rcu_read_unlock();
+    return dropped;
+}
+
+/* virtqueue_drop_all:
+ * @vq: The #VirtQueue
+ * Drops all queued buffers and indicates them to the guest
+ * as if they are done. Useful when buffers can not be
+ * processed but must be returned to the guest.
+ */
+unsigned int virtqueue_drop_all(VirtQueue *vq)
+{
+    if (unlikely(vq->vdev->broken)) {
+        return 0;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_drop_all(vq);
+    } else {
+        return virtqueue_split_drop_all(vq);
+    }
+}
+
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
  * it is what QEMU has always done by mistake.  We can change it sooner
  * or later by bumping the version number of the affected vm states.
@@ -1056,6 +1967,11 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
     elem->index = data.index;
 
+    /* The number of descriptors cannot be recomputed for packed rings. */
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_get_be32s(f, &elem->ndescs);
+    }
+
     for (i = 0; i < elem->in_num; i++) {
         elem->in_addr[i] = data.in_addr[i];
     }
@@ -1080,7 +1996,8 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     return elem;
 }
 
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem)
 {
     VirtQueueElementOld data;
     int i;
@@ -1108,7 +2025,12 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
         /* Do not save iov_base as above.  */
         data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
     }
+
     qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_put_be32s(f, &elem->ndescs);
+    }
 }
 
 /* virtio device */
@@ -1232,6 +2154,9 @@ void virtio_reset(void *opaque)
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].shadow_avail_idx = 0;
         vdev->vq[i].used_idx = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].shadow_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
@@ -1622,6 +2547,9 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].handle_aio_output = NULL;
+    /* The guest may resize the ring up to VIRTQUEUE_MAX_SIZE */
+    vdev->vq[i].used_elems = g_new0(VirtQueueElement, VIRTQUEUE_MAX_SIZE);
+    qemu_spin_init(&vdev->vq[i].pool.lock);
 
     return &vdev->vq[i];
 }
@@ -1636,6 +2564,9 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     vdev->vq[n].vring.num_default = 0;
     vdev->vq[n].handle_output = NULL;
     vdev->vq[n].handle_aio_output = NULL;
+    g_free(vdev->vq[n].used_elems);
+    vdev->vq[n].used_elems = NULL;
+    virtio_queue_disable_element_pool(&vdev->vq[n]);
 }
 
 static void virtio_set_isr(VirtIODevice *vdev, int value)
@@ -1651,7 +2582,7 @@ static void virtio_set_isr(VirtIODevice *vdev, int value)
 }
 
 /* Called within rcu_read_lock().  */
-static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+static bool virtio_split_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
     bool v;
@@ -1674,6 +2605,65 @@ static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
     return !v || vring_need_event(vring_get_used_event(vq), new, old);
 }
 
+/*
+ * Unlike the split layout, packed indices wrap at the ring size, so the
+ * event index and the previously signalled index are moved back by one
+ * ring size if they belong to the previous lap.
+ */
+static bool vring_packed_need_event(VirtQueue *vq, bool wrap,
+                                    uint16_t off_wrap, uint16_t new,
+                                    uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    if (wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+    if (old > new) {
+        return vring_need_event(off, new, old - vq->vring.num);
+    }
+
+    return vring_need_event(off, new, old);
+}
+
+/* Called within rcu_read_lock().  */
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    uint16_t old, new;
+    bool v;
+    VRingPackedDescEvent e;
+    VRingMemoryRegionCaches *caches;
+
+    /* We need to expose used descriptors before checking the event. */
+    smp_mb();
+    caches = vring_get_region_caches(vq);
+    vring_packed_event_read(vdev, &caches->avail, &e);
+
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags == VRING_PACKED_EVENT_FLAG_ENABLE) {
+        return true;
+    }
+
+    return !v || vring_packed_need_event(vq, vq->used_wrap_counter,
+                                         e.off_wrap, new, old);
+}
+
+/* Called within rcu_read_lock().  */
+static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_packed_should_notify(vdev, vq);
+    } else {
+        return virtio_split_should_notify(vdev, vq);
+    }
+}
+
 void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
 {
     bool should_notify;
@@ -1763,6 +2753,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1823,6 +2820,32 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(last_avail_idx, struct VirtQueue),
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT32(inuse, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1955,6 +2978,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_broken,
         &vmstate_virtio_extra_state,
         &vmstate_virtio_started,
+        &vmstate_virtio_packed_virtqueues,
         NULL
     }
 };
@@ -2067,8 +3091,12 @@ int virtio_set_features(VirtIODevice *vdev, uint64_t val)
     }
     ret = virtio_set_features_nocheck(vdev, val);
     if (!ret) {
-        if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-            /* VIRTIO_RING_F_EVENT_IDX changes the size of the caches.  */
+        if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX) ||
+            virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+            /*
+             * VIRTIO_RING_F_EVENT_IDX and VIRTIO_F_RING_PACKED change the
+             * size and layout of the caches.
+             */
             int i;
             for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
                 if (vdev->vq[i].vring.num != 0) {
@@ -2254,6 +3282,18 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                 virtio_queue_update_rings(vdev, i);
             }
 
+            /*
+             * The packed layout has no avail and used indices in guest
+             * memory; the state comes from the packed_virtqueues
+             * subsection instead.
+             */
+            if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+                vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
+                vdev->vq[i].shadow_avail_wrap_counter =
+                                        vdev->vq[i].last_avail_wrap_counter;
+                continue;
+            }
+
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
             if (nheads > vdev->vq[i].vring.num) {
@@ -2390,34 +3430,82 @@ hwaddr virtio_queue_get_used_addr(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDesc) * vdev->vq[n].vring.num;
+    }
     return sizeof(VRingDesc) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    /* The driver event suppression structure */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    /* The device event suppression structure */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
 
-uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
+/*
+ * For packed virtqueues, the wrap counters are passed in bit 15 of the
+ * indices, and the used index is passed in the upper 16 bits.
+ */
+unsigned int virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 {
-    return vdev->vq[n].last_avail_idx;
+    unsigned int avail, used;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return vdev->vq[n].last_avail_idx;
+    }
+
+    avail = vdev->vq[n].last_avail_idx;
+    avail |= ((uint16_t)vdev->vq[n].last_avail_wrap_counter) << 15;
+
+    used = vdev->vq[n].used_idx;
+    used |= ((uint16_t)vdev->vq[n].used_wrap_counter) << 15;
+
+    return avail | used << 16;
 }
 
-void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
+void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n,
+                                     unsigned int idx)
 {
-    vdev->vq[n].last_avail_idx = idx;
-    vdev->vq[n].shadow_avail_idx = idx;
+    struct VirtQueue *vq = &vdev->vq[n];
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        vq->last_avail_idx = idx;
+        vq->shadow_avail_idx = idx;
+        return;
+    }
+
+    vq->last_avail_idx = vq->shadow_avail_idx = idx & 0x7fff;
+    vq->last_avail_wrap_counter =
+        vq->shadow_avail_wrap_counter = !!(idx & 0x8000);
+    idx >>= 16;
+    vq->used_idx = idx & 0x7fff;
+    vq->used_wrap_counter = !!(idx & 0x8000);
 }
 
 void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
 {
+    /*
+     * Packed virtqueues have no used index in guest memory, the state
+     * is kept in vq->used_idx and vq->used_wrap_counter.
+     */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return;
+    }
+
     rcu_read_lock();
     if (vdev->vq[n].vring.desc) {
         vdev->vq[n].last_avail_idx = vring_used_idx(&vdev->vq[n]);
@@ -2428,6 +3516,10 @@ void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
 
 void virtio_queue_update_used_idx(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return;
+    }
+
     rcu_read_lock();
     if (vdev->vq[n].vring.desc) {
         vdev->vq[n].used_idx = vring_used_idx(&vdev->vq[n]);
@@ -2660,6 +3752,8 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
             break;
         }
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
+        g_free(vdev->vq[i].used_elems);
+        virtqueue_pool_drain(&vdev->vq[i].pool);
     }
     g_free(vdev->vq);
 }
@@ -49,6 +49,7 @@ typedef void IOHandler(void *opaque);
 struct Coroutine;
 struct ThreadPool;
 struct LinuxAioState;
+struct LuringState;
 
 struct AioContext {
     GSource source;
@@ -122,6 +123,13 @@ struct AioContext {
      */
     struct LinuxAioState *linux_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /*
+     * State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+#endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
      * locking.
@@ -386,6 +394,12 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Setup the LuringState bound to this AioContext */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+
+/* Return the LuringState bound to this AioContext */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -572,6 +586,15 @@ void aio_co_wake(struct Coroutine *co);
  */
 void aio_co_enter(AioContext *ctx, struct Coroutine *co);
 
+/**
+ * aio_co_reschedule_self:
+ * @new_ctx: the new context
+ *
+ * Move the currently running coroutine to new_ctx.  If the coroutine is
+ * already running in new_ctx, do nothing.
+ */
+void aio_co_reschedule_self(AioContext *new_ctx);
+
 /**
  * Return the AioContext whose event loop runs in the current thread.
  *
@@ -580,6 +603,16 @@ void aio_co_enter(AioContext *ctx, struct Coroutine *co);
  */
 AioContext *qemu_get_current_aio_context(void);
 
+/**
+ * qemu_set_current_aio_context:
+ * @ctx: the AioContext whose event loop runs in the current thread
+ *
+ * Programs without IOThread objects, such as qemu-nbd, call this from the
+ * threads that run their own AioContexts.  It must not be used in threads
+ * that belong to an IOThread.
+ */
+void qemu_set_current_aio_context(AioContext *ctx);
+
 /**
  * in_aio_context_home_thread:
  * @ctx: the aio context
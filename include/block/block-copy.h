@@ -0,0 +1,108 @@
+/*
+ * block_copy API
+ *
+ * Copyright (C) 2013 Proxmox Server Solutions
+ *
+ * Authors:
+ *  Dietmar Maurer (dietmar@proxmox.com)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_COPY_H
+#define BLOCK_COPY_H
+
+#include "block/block.h"
+#include "qemu/hbitmap.h"
+
+typedef struct BlockCopyInFlightReq {
+    int64_t start_byte;
+    int64_t end_byte;
+    QLIST_ENTRY(BlockCopyInFlightReq) list;
+    CoQueue wait_queue; /* coroutines blocked on this request */
+} BlockCopyInFlightReq;
+
+/*
+ * Called with the number of bytes that were copied each time a chunk of
+ * data has successfully been written to the target.
+ */
+typedef void (*ProgressBytesCallbackFunc)(int64_t bytes, void *opaque);
+
+/*
+ * Called by block_copy() in coroutine context each time it has started
+ * copying a chunk of @bytes, unless it was called from a write notifier.
+ * May yield. Returns false if block_copy() should not start any further
+ * chunks.
+ */
+typedef bool (*ChunkStartedCallbackFunc)(int64_t bytes, void *opaque);
+
+typedef struct BlockCopyState {
+    BlockBackend *source;
+    BlockBackend *target;
+
+    /* Clusters that still need to be copied by block_copy() */
+    HBitmap *copy_bitmap;
+    int64_t cluster_size;
+    int64_t len;
+    QLIST_HEAD(, BlockCopyInFlightReq) inflight_reqs;
+
+    BdrvRequestFlags write_flags;
+
+    /*
+     * Whether zeroed areas of the source are written to the target with
+     * write_zeroes requests instead of being copied.
+     */
+    bool skip_zeroes;
+
+    /*
+     * copy_range offload is tried first and disabled for good after the
+     * first failure. copy_range_size is the maximum size of one offloaded
+     * request.
+     */
+    bool use_copy_range;
+    int64_t copy_range_size;
+
+    /*
+     * block_copy() splits the work into chunks that are copied by up to
+     * BLOCK_COPY_MAX_WORKERS coroutines in parallel. The chunk size grows
+     * while copying succeeds, up to a limit that depends on whether
+     * copy_range offload is used. Compressed writes always use chunks of
+     * one cluster.
+     */
+    int64_t chunk_size;
+
+    ProgressBytesCallbackFunc progress_bytes_callback;
+    ChunkStartedCallbackFunc chunk_started_callback;
+    void *progress_opaque;
+} BlockCopyState;
+
+BlockCopyState *block_copy_state_new(BlockBackend *source,
+                                     BlockBackend *target,
+                                     int64_t cluster_size,
+                                     BdrvRequestFlags write_flags,
+                                     Error **errp);
+void block_copy_state_free(BlockCopyState *s);
+
+void block_copy_set_callbacks(BlockCopyState *s,
+                              ProgressBytesCallbackFunc progress_bytes_callback,
+                              ChunkStartedCallbackFunc chunk_started_callback,
+                              void *progress_opaque);
+
+/*
+ * Copies all clusters in [@offset, @offset + @bytes) that are set in
+ * s->copy_bitmap, clearing their bits. Concurrent callers that overlap
+ * this range wait until the copy is finished.
+ *
+ * Returns 0 on success. On failure, the bits of the clusters that could
+ * not be copied are set again, -errno is returned and *@error_is_read (if
+ * not NULL) says whether reading from the source failed.
+ *
+ * If s->chunk_started_callback asks to stop, block_copy() waits for the
+ * chunks that it has already started and returns 0 without copying the
+ * rest of the range.
+ */
+int coroutine_fn block_copy(BlockCopyState *s, int64_t offset, uint64_t bytes,
+                            bool *error_is_read, bool is_write_notifier);
+
+#endif /* BLOCK_COPY_H */
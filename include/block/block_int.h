@@ -58,6 +58,9 @@
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
 #define BLOCK_OPT_DATA_FILE         "data_file"
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
+#define BLOCK_OPT_COMPRESSION_LEVEL "compression_level"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -120,6 +123,17 @@ struct BlockDriver {
     /* Set if a driver can support backing files */
     bool supports_backing;
 
+    /*
+     * Set if read (resp. write, flush and discard) requests may be
+     * submitted to the driver from several AioContexts at the same time,
+     * see bdrv_supports_multiqueue().  Such requests run in the submitting
+     * AioContext and resume after yielding without the AioContext lock of
+     * the node, so the driver must protect any state that they touch with
+     * CoMutexes or atomic operations.
+     */
+    bool supports_multiqueue_read;
+    bool supports_multiqueue_write;
+
     /* For handling image reopen for split or non-split files */
     int (*bdrv_reopen_prepare)(BDRVReopenState *reopen_state,
                                BlockReopenQueue *queue, Error **errp);
@@ -275,6 +289,15 @@ struct BlockDriver {
                                               BdrvRequestFlags read_flags,
                                               BdrvRequestFlags write_flags);
 
+    /*
+     * Return a host file descriptor from which [@offset, @offset + @bytes)
+     * of @bs can be read directly at *@host_offset, or -ENOTSUP if the data
+     * is not stored in a host file as is.  Drivers that only shift the data
+     * map the range onto their child and call bdrv_get_host_fd() on it.
+     */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, int64_t *host_offset);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -358,6 +381,7 @@ struct BlockDriver {
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs,
                                                  Error **errp);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
@@ -394,11 +418,14 @@ struct BlockDriver {
 
     /*
      * Returns 0 for completed check, -errno for internal errors.
-     * The check results are stored in result.
+     * The check results are stored in result. Drivers may report their
+     * progress through status_cb, which can be NULL.
      */
     int coroutine_fn (*bdrv_co_check)(BlockDriverState *bs,
                                       BdrvCheckResult *result,
-                                      BdrvCheckMode fix);
+                                      BdrvCheckMode fix,
+                                      BlockDriverCheckStatusCB *status_cb,
+                                      void *cb_opaque);
 
     int (*bdrv_amend_options)(BlockDriverState *bs, QemuOpts *opts,
                               BlockDriverAmendStatusCB *status_cb,
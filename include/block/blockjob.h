@@ -130,6 +130,14 @@ void block_job_remove_all_bdrv(BlockJob *job);
  */
 bool block_job_has_bdrv(BlockJob *job, BlockDriverState *bs);
 
+/**
+ * block_job_uses_bdrv:
+ * @bs: A BlockDriverState
+ *
+ * Returns true if @bs is involved in any block job.
+ */
+bool block_job_uses_bdrv(BlockDriverState *bs);
+
 /**
  * block_job_set_speed:
  * @job: The job to set the speed for.
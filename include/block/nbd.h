@@ -333,6 +333,9 @@ void nbd_export_remove(NBDExport *exp, NbdServerRemoveMode mode, Error **errp);
 void nbd_export_get(NBDExport *exp);
 void nbd_export_put(NBDExport *exp);
 
+void nbd_export_set_client_aio_contexts(NBDExport *exp, AioContext **ctxs,
+                                        int nb_ctxs);
+
 BlockBackend *nbd_export_get_blockdev(NBDExport *exp);
 
 NBDExport *nbd_export_find(const char *name);
@@ -67,6 +67,15 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /*
+     * Used by the mapped-ram migration format: bitmap of the pages that
+     * are present in the migration file, and the offsets of that bitmap
+     * and of the pages of this block in the file.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    uint64_t pages_offset;
 };
 
 /**
@@ -481,17 +490,23 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 }
 
 
-/* Called with RCU critical section */
+/*
+ * Move the migration dirty bits of [@start, @start + @length) within @rb
+ * into @dest, a bitmap indexed by page number within the block.  Returns
+ * the number of bits that were newly set in @dest.
+ *
+ * Called with RCU critical section
+ */
 static inline
-uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
-                                               ram_addr_t start,
-                                               ram_addr_t length,
-                                               uint64_t *real_dirty_pages)
+uint64_t cpu_physical_memory_sync_dirty_bitmap_to(RAMBlock *rb,
+                                                  unsigned long *dest,
+                                                  ram_addr_t start,
+                                                  ram_addr_t length,
+                                                  uint64_t *real_dirty_pages)
 {
     ram_addr_t addr;
     unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
     uint64_t num_dirty = 0;
-    unsigned long *dest = rb->bmap;
 
     /* start address and length is aligned at the start of a word? */
     if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
@@ -556,5 +571,16 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
 
     return num_dirty;
 }
+
+/* Called with RCU critical section */
+static inline
+uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
+                                               ram_addr_t start,
+                                               ram_addr_t length,
+                                               uint64_t *real_dirty_pages)
+{
+    return cpu_physical_memory_sync_dirty_bitmap_to(rb, rb->bmap, start, length,
+                                                    real_dirty_pages);
+}
 #endif
 #endif
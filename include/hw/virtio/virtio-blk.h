@@ -34,6 +34,8 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    uint32_t num_iothread_vq_mapping;
+    char **iothread_vq_mapping;
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
@@ -56,6 +58,7 @@ typedef struct VirtIOBlock {
     VMChangeStateEntry *change;
     bool dataplane_disabled;
     bool dataplane_started;
+    bool dataplane_quiesced;
     struct VirtIOBlockDataPlane *dataplane;
     uint64_t host_features;
     size_t config_size;
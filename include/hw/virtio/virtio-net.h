@@ -32,6 +32,10 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Limits of the RSS configuration that the guest can set */
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
@@ -133,9 +137,29 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /*
+     * While the peer sends a batch of packets, the used ring is only
+     * flushed at the end of the batch; rx_pending counts the filled
+     * elements.
+     */
+    bool rx_batch;
+    unsigned int rx_pending;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
+typedef struct VirtioNetRssData {
+    /* Set by VIRTIO_NET_CTRL_MQ_RSS_CONFIG or VIRTIO_NET_CTRL_MQ_HASH_CONFIG */
+    bool enabled;
+    /* Steer packets by hash (RSS), not only compute it for the hash report */
+    bool redirect;
+    uint32_t hash_types;
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint16_t indirections_len;
+    uint16_t indirections_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    /* Queue for packets that are not covered by hash_types */
+    uint16_t default_queue;
+} VirtioNetRssData;
+
 struct VirtIONet {
     VirtIODevice parent_obj;
     uint8_t mac[ETH_ALEN];
@@ -185,6 +209,8 @@ struct VirtIONet {
     AnnounceTimer announce_timer;
     bool needs_vnet_hdr_swap;
     bool mtu_bypass_backend;
+    VirtioNetRssData rss_data;
+    struct NetRxPkt *rx_pkt;
 };
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
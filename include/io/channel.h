@@ -38,12 +38,16 @@ typedef struct QIOChannelClass QIOChannelClass;
 
 #define QIO_CHANNEL_ERR_BLOCK -2
 
+#define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY 0x1
+
 typedef enum QIOChannelFeature QIOChannelFeature;
 
 enum QIOChannelFeature {
     QIO_CHANNEL_FEATURE_FD_PASS,
     QIO_CHANNEL_FEATURE_SHUTDOWN,
     QIO_CHANNEL_FEATURE_LISTEN,
+    QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY,
+    QIO_CHANNEL_FEATURE_SEEKABLE,
 };
 
 
@@ -109,6 +113,7 @@ struct QIOChannelClass {
                          size_t niov,
                          int *fds,
                          size_t nfds,
+                         int flags,
                          Error **errp);
     ssize_t (*io_readv)(QIOChannel *ioc,
                         const struct iovec *iov,
@@ -141,6 +146,18 @@ struct QIOChannelClass {
                                   IOHandler *io_read,
                                   IOHandler *io_write,
                                   void *opaque);
+    int (*io_flush)(QIOChannel *ioc,
+                    Error **errp);
+    ssize_t (*io_pwritev)(QIOChannel *ioc,
+                          const struct iovec *iov,
+                          size_t niov,
+                          off_t offset,
+                          Error **errp);
+    ssize_t (*io_preadv)(QIOChannel *ioc,
+                         const struct iovec *iov,
+                         size_t niov,
+                         off_t offset,
+                         Error **errp);
 };
 
 /* General I/O handling functions */
@@ -233,6 +250,7 @@ ssize_t qio_channel_readv_full(QIOChannel *ioc,
  * @niov: the length of the @iov array
  * @fds: an array of file handles to send
  * @nfds: number of file handles in @fds
+ * @flags: write flags (QIO_CHANNEL_WRITE_FLAG_*)
  * @errp: pointer to a NULL-initialized error object
  *
  * Write data to the IO channel, reading it from the
@@ -256,6 +274,13 @@ ssize_t qio_channel_readv_full(QIOChannel *ioc,
  * unless qio_channel_has_feature() returns a true
  * value for the QIO_CHANNEL_FEATURE_FD_PASS constant.
  *
+ * If @flags contains QIO_CHANNEL_WRITE_FLAG_ZERO_COPY, the data
+ * may be sent directly from the memory regions referenced by
+ * @iov instead of being copied by the kernel, so they must not
+ * be modified or freed until qio_channel_flush() has returned.
+ * It is an error to pass this flag unless qio_channel_has_feature()
+ * returns a true value for QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY.
+ *
  * Returns: the number of bytes sent, or -1 on error,
  * or QIO_CHANNEL_ERR_BLOCK if no data is can be sent
  * and the channel is non-blocking
@@ -265,6 +290,7 @@ ssize_t qio_channel_writev_full(QIOChannel *ioc,
                                 size_t niov,
                                 int *fds,
                                 size_t nfds,
+                                int flags,
                                 Error **errp);
 
 /**
@@ -349,6 +375,30 @@ int qio_channel_writev_all(QIOChannel *ioc,
                            size_t niov,
                            Error **erp);
 
+/**
+ * qio_channel_writev_full_all:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @fds: an array of file handles to send
+ * @nfds: number of file handles in @fds
+ * @flags: write flags (QIO_CHANNEL_WRITE_FLAG_*)
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves like qio_channel_writev_full() but will attempt
+ * to send all data passed (file handles and memory regions).
+ * The function will wait for all requested data
+ * to be written, yielding from the current coroutine
+ * if required.
+ *
+ * Returns: 0 if all bytes were written, or -1 on error
+ */
+int qio_channel_writev_full_all(QIOChannel *ioc,
+                                const struct iovec *iov,
+                                size_t niov,
+                                int *fds, size_t nfds,
+                                int flags, Error **errp);
+
 /**
  * qio_channel_readv:
  * @ioc: the channel object
@@ -601,6 +651,96 @@ off_t qio_channel_io_seek(QIOChannel *ioc,
                           int whence,
                           Error **errp);
 
+/**
+ * qio_channel_pwritev:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @offset: offset in the channel where writes should begin
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Write data to the channel at @offset, without changing
+ * the current I/O position. Not all implementations
+ * will support this facility, so may report an error.
+ * To avoid errors, the caller may check for the feature
+ * flag QIO_CHANNEL_FEATURE_SEEKABLE prior to calling
+ * this method.
+ *
+ * As with qio_channel_writev(), not all data is guaranteed
+ * to be written.
+ *
+ * Returns: the number of bytes written, or -1 on error
+ */
+ssize_t qio_channel_pwritev(QIOChannel *ioc,
+                            const struct iovec *iov,
+                            size_t niov,
+                            off_t offset,
+                            Error **errp);
+
+/**
+ * qio_channel_pwritev_all:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @offset: offset in the channel where writes should begin
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves like qio_channel_pwritev() but will write
+ * all data in @iov, issuing further writes at the
+ * following offsets if needed.
+ *
+ * Returns: 0 if all bytes were written, or -1 on error
+ */
+int qio_channel_pwritev_all(QIOChannel *ioc,
+                            const struct iovec *iov,
+                            size_t niov,
+                            off_t offset,
+                            Error **errp);
+
+/**
+ * qio_channel_preadv:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to read data into
+ * @niov: the length of the @iov array
+ * @offset: offset in the channel where reads should begin
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Read data from the channel at @offset, without changing
+ * the current I/O position. Not all implementations
+ * will support this facility, so may report an error.
+ * To avoid errors, the caller may check for the feature
+ * flag QIO_CHANNEL_FEATURE_SEEKABLE prior to calling
+ * this method.
+ *
+ * Returns: the number of bytes read, 0 at end-of-file,
+ *          or -1 on error
+ */
+ssize_t qio_channel_preadv(QIOChannel *ioc,
+                           const struct iovec *iov,
+                           size_t niov,
+                           off_t offset,
+                           Error **errp);
+
+/**
+ * qio_channel_preadv_all:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to read data into
+ * @niov: the length of the @iov array
+ * @offset: offset in the channel where reads should begin
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves like qio_channel_preadv() but will fill all
+ * of @iov. If end-of-file occurs before all requested
+ * data has been read, an error will be reported.
+ *
+ * Returns: 0 if all bytes were read, or -1 on error
+ */
+int qio_channel_preadv_all(QIOChannel *ioc,
+                           const struct iovec *iov,
+                           size_t niov,
+                           off_t offset,
+                           Error **errp);
+
 
 /**
  * qio_channel_create_watch:
@@ -780,4 +920,20 @@ void qio_channel_set_aio_fd_handler(QIOChannel *ioc,
                                     IOHandler *io_write,
                                     void *opaque);
 
+/**
+ * qio_channel_flush:
+ * @ioc: the channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Wait until all the data that was written with
+ * QIO_CHANNEL_WRITE_FLAG_ZERO_COPY has been sent, so that
+ * the memory it came from can be reused.  Channels that do
+ * not support zero copy writes have nothing to wait for.
+ *
+ * Returns: -1 on error, 1 if the kernel had to copy some of
+ *          the data after all, 0 otherwise
+ */
+int qio_channel_flush(QIOChannel *ioc,
+                      Error **errp);
+
 #endif /* QIO_CHANNEL_H */
@@ -71,36 +71,19 @@ void net_toeplitz_key_init(net_toeplitz_key *key, uint8_t *key_bytes)
     key->next_byte = key_bytes + sizeof(uint32_t);
 }
 
-static inline
+/**
+ * net_toeplitz_add: add data to a Toeplitz (RSS) hash
+ *
+ * @result: hash accumulator, updated in place
+ * @input: data to be hashed
+ * @len: length of @input
+ * @key: key state set up with net_toeplitz_key_init(); it is advanced by
+ *       @len bytes, so the hash of a tuple can be computed in several calls.
+ *       The key must be at least @len + 4 bytes long.
+ */
 void net_toeplitz_add(uint32_t *result,
                       uint8_t *input,
                       uint32_t len,
-                      net_toeplitz_key *key)
-{
-    register uint32_t accumulator = *result;
-    register uint32_t leftmost_32_bits = key->leftmost_32_bits;
-    register uint32_t byte;
-
-    for (byte = 0; byte < len; byte++) {
-        register uint8_t input_byte = input[byte];
-        register uint8_t key_byte = *(key->next_byte++);
-        register uint8_t bit;
-
-        for (bit = 0; bit < 8; bit++) {
-            if (input_byte & (1 << 7)) {
-                accumulator ^= leftmost_32_bits;
-            }
-
-            leftmost_32_bits =
-                (leftmost_32_bits << 1) | ((key_byte & (1 << 7)) >> 7);
-
-            input_byte <<= 1;
-            key_byte <<= 1;
-        }
-    }
-
-    key->leftmost_32_bits = leftmost_32_bits;
-    *result = accumulator;
-}
+                      net_toeplitz_key *key);
 
 #endif /* QEMU_NET_CHECKSUM_H */
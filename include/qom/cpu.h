@@ -340,6 +340,10 @@ struct qemu_work_item;
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: Dirty ring of the vCPU when the KVM dirty ring is used.
+ * @kvm_fetch_index: Index of the next entry to collect from @kvm_dirty_gfns.
+ * @dirty_pages: Number of pages that were collected from the dirty ring of
+ *    the vCPU so far.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
  * @trace_dstate_delayed: Delayed changes to trace_dstate (includes all changes
@@ -424,6 +428,9 @@ struct CPUState {
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
+    uint64_t dirty_pages;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -0,0 +1,541 @@
+/*
+ * Dirty page rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#include "qemu/units.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/bitmap.h"
+#include "qapi/error.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qapi/qapi-visit-migration.h"
+#include "exec/ram_addr.h"
+#include "migration/misc.h"
+#include "sysemu/kvm.h"
+#include "dirtyrate.h"
+#include "trace.h"
+
+/*
+ * State of one RAM block during a measurement.  The blocks are recorded
+ * when the measurement starts and looked up again by name at the end;
+ * blocks that went away or were resized in between are not reported.
+ */
+typedef struct DirtyRateBlock {
+    char idstr[256];
+    uint64_t used_length;
+    uint64_t pages;
+
+    /* page-sampling mode: sampled page numbers and their checksums */
+    uint64_t *sample_page;
+    uint32_t *sample_crc;
+
+    uint64_t sample_pages;
+    uint64_t dirty_pages;
+
+    /* per heatmap region: examined and dirty pages */
+    uint64_t *region_pages;
+    uint64_t *region_dirty;
+} DirtyRateBlock;
+
+/* dirty-ring mode: pages collected from the ring of a vCPU so far */
+typedef struct DirtyRateVcpuStat {
+    int cpu_index;
+    uint64_t dirty_pages;
+} DirtyRateVcpuStat;
+
+typedef struct DirtyRateConfig {
+    DirtyRateMeasureMode mode;
+    int64_t calc_time;
+    uint64_t sample_pages;
+    int64_t heatmap_regions;
+} DirtyRateConfig;
+
+/*
+ * The result is only accessed with the iothread lock held, both by the
+ * QMP handlers and by the measurement thread when it publishes it.
+ */
+static DirtyRateInfo *dirtyrate_info;
+static QemuThread dirtyrate_thread;
+static bool dirtyrate_thread_created;
+static bool dirtyrate_dirty_log;
+
+#define RAMBLOCK_FOREACH_MIGRATABLE(block)             \
+    INTERNAL_RAMBLOCK_FOREACH(block)                   \
+        if (!qemu_ram_is_migratable(block)) {} else
+
+bool dirtyrate_uses_dirty_log(void)
+{
+    return dirtyrate_dirty_log;
+}
+
+static uint32_t dirtyrate_page_crc(RAMBlock *block, uint64_t page)
+{
+    uint8_t *host = block->host + (page << TARGET_PAGE_BITS);
+
+    return crc32(0, host, TARGET_PAGE_SIZE);
+}
+
+static uint64_t dirtyrate_region(DirtyRateBlock *b, DirtyRateConfig *config,
+                                 uint64_t page)
+{
+    return page * config->heatmap_regions / b->pages;
+}
+
+/* Called with RCU critical section */
+static GArray *dirtyrate_record_blocks(DirtyRateConfig *config)
+{
+    GArray *blocks = g_array_new(false, true, sizeof(DirtyRateBlock));
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        DirtyRateBlock b = {};
+
+        pstrcpy(b.idstr, sizeof(b.idstr), block->idstr);
+        b.used_length = block->used_length;
+        b.pages = block->used_length >> TARGET_PAGE_BITS;
+        if (!b.pages) {
+            continue;
+        }
+        if (config->heatmap_regions) {
+            b.region_pages = g_new0(uint64_t, config->heatmap_regions);
+            b.region_dirty = g_new0(uint64_t, config->heatmap_regions);
+        }
+        g_array_append_val(blocks, b);
+    }
+
+    return blocks;
+}
+
+static void dirtyrate_free_blocks(GArray *blocks)
+{
+    int i;
+
+    for (i = 0; i < blocks->len; i++) {
+        DirtyRateBlock *b = &g_array_index(blocks, DirtyRateBlock, i);
+
+        g_free(b->sample_page);
+        g_free(b->sample_crc);
+        g_free(b->region_pages);
+        g_free(b->region_dirty);
+    }
+    g_array_free(blocks, true);
+}
+
+/* Called with RCU critical section */
+static RAMBlock *dirtyrate_find_block(DirtyRateBlock *b)
+{
+    RAMBlock *block = qemu_ram_block_by_name(b->idstr);
+
+    if (!block || block->used_length != b->used_length) {
+        return NULL;
+    }
+    return block;
+}
+
+/* Called with RCU critical section */
+static void dirtyrate_sample_start(GArray *blocks, DirtyRateConfig *config)
+{
+    int i;
+
+    for (i = 0; i < blocks->len; i++) {
+        DirtyRateBlock *b = &g_array_index(blocks, DirtyRateBlock, i);
+        RAMBlock *block = dirtyrate_find_block(b);
+        uint64_t n;
+
+        assert(block);
+        n = DIV_ROUND_UP(b->used_length * config->sample_pages, GiB);
+        n = MIN(n, b->pages);
+
+        b->sample_pages = n;
+        b->sample_page = g_new(uint64_t, n);
+        b->sample_crc = g_new(uint32_t, n);
+        for (n = 0; n < b->sample_pages; n++) {
+            uint64_t page = (((uint64_t)g_random_int() << 32) |
+                             g_random_int()) % b->pages;
+
+            b->sample_page[n] = page;
+            b->sample_crc[n] = dirtyrate_page_crc(block, page);
+        }
+    }
+}
+
+/* Called with RCU critical section */
+static void dirtyrate_sample_end(GArray *blocks, DirtyRateConfig *config)
+{
+    int i;
+
+    for (i = 0; i < blocks->len; i++) {
+        DirtyRateBlock *b = &g_array_index(blocks, DirtyRateBlock, i);
+        RAMBlock *block = dirtyrate_find_block(b);
+        uint64_t n;
+
+        if (!block) {
+            b->sample_pages = 0;
+            continue;
+        }
+
+        for (n = 0; n < b->sample_pages; n++) {
+            uint64_t page = b->sample_page[n];
+            bool dirty = dirtyrate_page_crc(block, page) != b->sample_crc[n];
+
+            b->dirty_pages += dirty;
+            if (config->heatmap_regions) {
+                uint64_t r = dirtyrate_region(b, config, page);
+
+                b->region_pages[r]++;
+                b->region_dirty[r] += dirty;
+            }
+        }
+    }
+}
+
+/*
+ * Move the migration dirty log of the recorded blocks into a private
+ * bitmap.  If @count is false, the pages that were dirtied so far are
+ * just dropped.
+ *
+ * Called with the iothread lock and RCU critical section
+ */
+static void dirtyrate_bitmap_sync(GArray *blocks, DirtyRateConfig *config,
+                                  bool count)
+{
+    int i;
+
+    memory_global_dirty_log_sync();
+
+    for (i = 0; i < blocks->len; i++) {
+        DirtyRateBlock *b = &g_array_index(blocks, DirtyRateBlock, i);
+        RAMBlock *block = dirtyrate_find_block(b);
+        unsigned long *bmap;
+        uint64_t real_dirty = 0;
+        uint64_t page;
+
+        if (!block) {
+            b->sample_pages = 0;
+            continue;
+        }
+
+        bmap = bitmap_new(b->pages);
+        cpu_physical_memory_sync_dirty_bitmap_to(block, bmap, 0,
+                                                 b->used_length, &real_dirty);
+        if (!count) {
+            g_free(bmap);
+            continue;
+        }
+
+        b->sample_pages = b->pages;
+        b->dirty_pages = bitmap_count_one(bmap, b->pages);
+        if (config->heatmap_regions) {
+            int64_t r;
+
+            for (r = 0; r < config->heatmap_regions; r++) {
+                uint64_t start = DIV_ROUND_UP(r * b->pages,
+                                              config->heatmap_regions);
+                uint64_t end = DIV_ROUND_UP((r + 1) * b->pages,
+                                            config->heatmap_regions);
+
+                b->region_pages[r] = end - start;
+            }
+            for (page = find_first_bit(bmap, b->pages); page < b->pages;
+                 page = find_next_bit(bmap, b->pages, page + 1)) {
+                b->region_dirty[dirtyrate_region(b, config, page)]++;
+            }
+        }
+        g_free(bmap);
+    }
+}
+
+/* Called with the iothread lock held */
+static GArray *dirtyrate_record_vcpus(void)
+{
+    GArray *vcpus = g_array_new(false, true, sizeof(DirtyRateVcpuStat));
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        DirtyRateVcpuStat stat = {
+            .cpu_index = cpu->cpu_index,
+            .dirty_pages = cpu->dirty_pages,
+        };
+
+        g_array_append_val(vcpus, stat);
+    }
+
+    return vcpus;
+}
+
+/* Dirty rate in MB/s for @bytes dirtied within @msec milliseconds */
+static int64_t dirtyrate_mbps(uint64_t bytes, int64_t msec)
+{
+    return bytes * 1000 / MiB / MAX(msec, 1);
+}
+
+static DirtyRateBlockInfoList *dirtyrate_block_info(GArray *blocks,
+                                                    DirtyRateConfig *config,
+                                                    int64_t msec,
+                                                    int64_t *total_rate)
+{
+    DirtyRateBlockInfoList *head = NULL;
+    uint64_t total_bytes = 0;
+    int i;
+
+    for (i = blocks->len - 1; i >= 0; i--) {
+        DirtyRateBlock *b = &g_array_index(blocks, DirtyRateBlock, i);
+        DirtyRateBlockInfoList *entry;
+        DirtyRateBlockInfo *info;
+        uint64_t bytes;
+
+        if (!b->sample_pages) {
+            continue;
+        }
+
+        /* Scale the sampled pages to the size of the block */
+        bytes = (b->dirty_pages * b->pages / b->sample_pages) <<
+                TARGET_PAGE_BITS;
+        total_bytes += bytes;
+
+        info = g_new0(DirtyRateBlockInfo, 1);
+        info->id = g_strdup(b->idstr);
+        info->size = b->used_length;
+        info->dirty_rate = dirtyrate_mbps(bytes, msec);
+        info->sample_pages = b->sample_pages;
+        info->dirty_pages = b->dirty_pages;
+        if (config->heatmap_regions) {
+            uint8List **tail = &info->heatmap;
+            int64_t r;
+
+            info->has_heatmap = true;
+            for (r = 0; r < config->heatmap_regions; r++) {
+                uint8List *e = g_new0(uint8List, 1);
+
+                if (b->region_pages[r]) {
+                    e->value = b->region_dirty[r] * 100 / b->region_pages[r];
+                }
+                *tail = e;
+                tail = &e->next;
+            }
+        }
+        trace_dirtyrate_block(b->idstr, b->sample_pages, b->dirty_pages,
+                              info->dirty_rate);
+
+        entry = g_new0(DirtyRateBlockInfoList, 1);
+        entry->value = info;
+        entry->next = head;
+        head = entry;
+    }
+
+    *total_rate = dirtyrate_mbps(total_bytes, msec);
+    return head;
+}
+
+/*
+ * Called with the iothread lock held, after the final sync of the dirty
+ * log so that cpu->dirty_pages is up to date.
+ */
+static DirtyRateVcpuList *dirtyrate_vcpu_info(GArray *vcpus, int64_t msec)
+{
+    DirtyRateVcpuList *head = NULL;
+    int i;
+
+    for (i = vcpus->len - 1; i >= 0; i--) {
+        DirtyRateVcpuStat *stat = &g_array_index(vcpus, DirtyRateVcpuStat, i);
+        CPUState *cpu = qemu_get_cpu(stat->cpu_index);
+        DirtyRateVcpuList *entry;
+
+        if (!cpu) {
+            /* Unplugged during the measurement */
+            continue;
+        }
+
+        entry = g_new0(DirtyRateVcpuList, 1);
+        entry->value = g_new0(DirtyRateVcpu, 1);
+        entry->value->id = stat->cpu_index;
+        entry->value->dirty_rate =
+            dirtyrate_mbps((cpu->dirty_pages - stat->dirty_pages) <<
+                           TARGET_PAGE_BITS, msec);
+        entry->next = head;
+        head = entry;
+    }
+
+    return head;
+}
+
+static void *dirtyrate_thread_fn(void *opaque)
+{
+    DirtyRateConfig *config = opaque;
+    bool dirty_log = config->mode != DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    bool dirty_ring = config->mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING;
+    DirtyRateBlockInfoList *block_info;
+    DirtyRateVcpuList *vcpu_info = NULL;
+    GArray *blocks, *vcpus = NULL;
+    int64_t start, msec, rate;
+
+    rcu_register_thread();
+    trace_dirtyrate_start(DirtyRateMeasureMode_str(config->mode),
+                          config->calc_time);
+
+    if (dirty_log) {
+        qemu_mutex_lock_iothread();
+        rcu_read_lock();
+        blocks = dirtyrate_record_blocks(config);
+        memory_global_dirty_log_start();
+        dirtyrate_bitmap_sync(blocks, config, false);
+        rcu_read_unlock();
+        if (dirty_ring) {
+            vcpus = dirtyrate_record_vcpus();
+        }
+        qemu_mutex_unlock_iothread();
+    } else {
+        rcu_read_lock();
+        blocks = dirtyrate_record_blocks(config);
+        dirtyrate_sample_start(blocks, config);
+        rcu_read_unlock();
+    }
+
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    g_usleep(config->calc_time * G_USEC_PER_SEC);
+
+    if (dirty_log) {
+        qemu_mutex_lock_iothread();
+        rcu_read_lock();
+        dirtyrate_bitmap_sync(blocks, config, true);
+        rcu_read_unlock();
+        msec = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start;
+        if (dirty_ring) {
+            vcpu_info = dirtyrate_vcpu_info(vcpus, msec);
+            g_array_free(vcpus, true);
+        }
+        memory_global_dirty_log_stop();
+        qemu_mutex_unlock_iothread();
+    } else {
+        rcu_read_lock();
+        dirtyrate_sample_end(blocks, config);
+        rcu_read_unlock();
+        msec = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start;
+    }
+
+    block_info = dirtyrate_block_info(blocks, config, msec, &rate);
+    dirtyrate_free_blocks(blocks);
+    trace_dirtyrate_done(rate, msec);
+
+    qemu_mutex_lock_iothread();
+    dirtyrate_info->has_dirty_rate = true;
+    dirtyrate_info->dirty_rate = rate;
+    dirtyrate_info->has_blocks = true;
+    dirtyrate_info->blocks = block_info;
+    dirtyrate_info->has_vcpus = dirty_ring;
+    dirtyrate_info->vcpus = vcpu_info;
+    dirtyrate_info->status = DIRTY_RATE_STATUS_MEASURED;
+    dirtyrate_dirty_log = false;
+    qemu_mutex_unlock_iothread();
+
+    g_free(config);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time,
+                         bool has_mode, DirtyRateMeasureMode mode,
+                         bool has_sample_pages, int64_t sample_pages,
+                         bool has_heatmap_regions, int64_t heatmap_regions,
+                         Error **errp)
+{
+    DirtyRateConfig *config;
+
+    if (dirtyrate_info &&
+        dirtyrate_info->status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "The dirty rate is already being measured");
+        return;
+    }
+
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, "calc-time must be between %d and %d seconds",
+                   DIRTYRATE_MIN_CALC_TIME, DIRTYRATE_MAX_CALC_TIME);
+        return;
+    }
+
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < DIRTYRATE_MIN_SAMPLE_PAGES ||
+               sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, "sample-pages must be between %d and %d",
+                   DIRTYRATE_MIN_SAMPLE_PAGES, DIRTYRATE_MAX_SAMPLE_PAGES);
+        return;
+    }
+
+    if (!has_heatmap_regions) {
+        heatmap_regions = 0;
+    } else if (heatmap_regions < 1 ||
+               heatmap_regions > DIRTYRATE_MAX_HEATMAP_REGIONS) {
+        error_setg(errp, "heatmap-regions must be between 1 and %d",
+                   DIRTYRATE_MAX_HEATMAP_REGIONS);
+        return;
+    }
+
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING &&
+        !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "The dirty-ring mode needs the KVM dirty ring, "
+                   "see the dirty-ring-size property of -accel kvm");
+        return;
+    }
+
+    if (mode != DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        /* Both would consume the migration dirty log */
+        if (!migration_is_idle() || global_dirty_log) {
+            error_setg(errp, "The %s mode cannot be used while "
+                       "migration is running",
+                       DirtyRateMeasureMode_str(mode));
+            return;
+        }
+        dirtyrate_dirty_log = true;
+    }
+
+    /* The previous measurement thread has published its result already */
+    if (dirtyrate_thread_created) {
+        qemu_thread_join(&dirtyrate_thread);
+    }
+
+    qapi_free_DirtyRateInfo(dirtyrate_info);
+    dirtyrate_info = g_new0(DirtyRateInfo, 1);
+    dirtyrate_info->status = DIRTY_RATE_STATUS_MEASURING;
+    dirtyrate_info->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
+    dirtyrate_info->calc_time = calc_time;
+    dirtyrate_info->mode = mode;
+    dirtyrate_info->sample_pages = sample_pages;
+
+    config = g_new0(DirtyRateConfig, 1);
+    config->mode = mode;
+    config->calc_time = calc_time;
+    config->sample_pages = sample_pages;
+    config->heatmap_regions = heatmap_regions;
+
+    qemu_thread_create(&dirtyrate_thread, "dirtyrate", dirtyrate_thread_fn,
+                       config, QEMU_THREAD_JOINABLE);
+    dirtyrate_thread_created = true;
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    if (!dirtyrate_info) {
+        DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+
+        info->status = DIRTY_RATE_STATUS_UNSTARTED;
+        info->mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+        info->sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+        return info;
+    }
+
+    return QAPI_CLONE(DirtyRateInfo, dirtyrate_info);
+}
@@ -0,0 +1,27 @@
+/*
+ * Dirty page rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_DIRTYRATE_H
+#define QEMU_MIGRATION_DIRTYRATE_H
+
+#define DIRTYRATE_MIN_CALC_TIME           1
+#define DIRTYRATE_MAX_CALC_TIME           60
+
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES    512
+#define DIRTYRATE_MIN_SAMPLE_PAGES        128
+#define DIRTYRATE_MAX_SAMPLE_PAGES        4096
+
+#define DIRTYRATE_MAX_HEATMAP_REGIONS     1024
+
+/*
+ * Whether a dirty-bitmap or dirty-ring measurement owns the migration
+ * dirty log, in which case migration cannot be started.  Called with the
+ * iothread lock held.
+ */
+bool dirtyrate_uses_dirty_log(void);
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * QEMU live migration to and from a seekable file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "io/channel-file.h"
+#include "trace.h"
+
+/*
+ * The multifd channels of a mapped-ram migration open the migration file
+ * again, so that each of them has its own file descriptor.
+ */
+static char *outgoing_filename;
+static char *incoming_filename;
+
+static QIOChannel *file_channel_open(const char *filename, int flags,
+                                     Error **errp)
+{
+    QIOChannelFile *fioc;
+
+#ifdef O_DIRECT
+    if (migrate_direct_io()) {
+        flags |= O_DIRECT;
+    }
+#endif
+
+    fioc = qio_channel_file_new_path(filename, flags, 0600, errp);
+    if (!fioc) {
+        return NULL;
+    }
+
+    return QIO_CHANNEL(fioc);
+}
+
+static bool file_check_parameters(Error **errp)
+{
+    if (migrate_direct_io() &&
+        (!migrate_mapped_ram() || !migrate_use_multifd())) {
+        error_setg(errp, "direct-io requires the mapped-ram and multifd "
+                   "capabilities");
+        return false;
+    }
+
+    return true;
+}
+
+QIOChannel *file_send_channel_create(Error **errp)
+{
+    QIOChannel *ioc;
+
+    ioc = file_channel_open(outgoing_filename, O_WRONLY, errp);
+    if (ioc) {
+        qio_channel_set_name(ioc, "migration-file-multifd-outgoing");
+    }
+    return ioc;
+}
+
+QIOChannel *file_recv_channel_create(Error **errp)
+{
+    QIOChannel *ioc;
+
+    ioc = file_channel_open(incoming_filename, O_RDONLY, errp);
+    if (ioc) {
+        qio_channel_set_name(ioc, "migration-file-multifd-incoming");
+    }
+    return ioc;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    if (!file_check_parameters(errp)) {
+        return;
+    }
+
+    trace_migration_file_outgoing(filename);
+
+    fioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+
+    g_free(outgoing_filename);
+    outgoing_filename = g_strdup(filename);
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-outgoing");
+    migration_channel_connect(s, QIO_CHANNEL(fioc), NULL, NULL);
+    object_unref(OBJECT(fioc));
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    if (!file_check_parameters(errp)) {
+        return;
+    }
+
+    trace_migration_file_incoming(filename);
+
+    fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+
+    g_free(incoming_filename);
+    incoming_filename = g_strdup(filename);
+
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-incoming");
+    qio_channel_add_watch_full(QIO_CHANNEL(fioc), G_IO_IN,
+                               file_accept_incoming_migration,
+                               NULL, NULL,
+                               g_main_context_get_thread_default());
+}
@@ -0,0 +1,20 @@
+/*
+ * QEMU live migration to and from a seekable file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_FILE_H
+#define QEMU_MIGRATION_FILE_H
+
+#include "io/channel.h"
+
+void file_start_incoming_migration(const char *filename, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp);
+
+QIOChannel *file_send_channel_create(Error **errp);
+QIOChannel *file_recv_channel_create(Error **errp);
+#endif
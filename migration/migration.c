@@ -16,9 +16,12 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/units.h"
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
+#include "dirtyrate.h"
 #include "socket.h"
 #include "rdma.h"
 #include "ram.h"
@@ -48,6 +51,8 @@
 #include "hw/boards.h"
 #include "monitor/monitor.h"
 #include "net/announce.h"
+#include "sysemu/balloon.h"
+#include "sysemu/cpus.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
 
@@ -82,6 +87,11 @@
 /* The delay time (in ms) between two COLO checkpoints */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY (200 * 100)
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define DEFAULT_MIGRATE_MULTIFD_COMPRESSION MULTIFD_COMPRESSION_NONE
+/* 0: means nocompress, 1: best speed, ... 9: best compress ratio */
+#define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
+/* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
+#define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -151,6 +161,7 @@ void migration_object_init(void)
     qemu_event_init(&current_incoming->main_thread_load_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
+    qemu_sem_init(&current_incoming->postcopy_qemufile_dst_done, 0);
 
     init_dirty_bitmap_incoming_migration();
 
@@ -208,6 +219,10 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -349,6 +364,12 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p;
 
+    if (migrate_mapped_ram() && strcmp(uri, "defer") &&
+        !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "mapped-ram requires a file: migration URI");
+        return;
+    }
+
     qapi_event_send_migration(MIGRATION_STATUS_SETUP);
     if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
@@ -364,6 +385,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -596,8 +619,14 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
         /*
          * Common migration only needs one channel, so we can start
          * right now.  Multifd needs more than one channel, we wait.
+         * With mapped-ram the multifd channels are opened by the
+         * destination itself.
          */
-        start_migration = !migrate_use_multifd();
+        start_migration = !migrate_use_multifd() || migrate_mapped_ram();
+    } else if (migrate_postcopy_preempt() && !mis->postcopy_qemufile_dst) {
+        /* The second connection carries the urgent postcopy pages */
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        return;
     } else {
         Error *local_err = NULL;
         /* Multiple connections */
@@ -627,6 +656,10 @@ bool migration_has_all_channels(void)
 
     all_channels = multifd_recv_all_channels_created();
 
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
+
     return all_channels && mis->from_src_file != NULL;
 }
 
@@ -769,6 +802,14 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->block_incremental = s->parameters.block_incremental;
     params->has_multifd_channels = true;
     params->multifd_channels = s->parameters.multifd_channels;
+    params->has_multifd_compression = true;
+    params->multifd_compression = s->parameters.multifd_compression;
+    params->has_multifd_zlib_level = true;
+    params->multifd_zlib_level = s->parameters.multifd_zlib_level;
+    params->has_multifd_zstd_level = true;
+    params->multifd_zstd_level = s->parameters.multifd_zstd_level;
+    params->has_direct_io = true;
+    params->direct_io = s->parameters.direct_io;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
     params->has_max_postcopy_bandwidth = true;
@@ -841,6 +882,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->page_size = qemu_target_page_size();
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
     info->ram->pages_per_second = s->pages_per_second;
+    info->ram->dirty_sync_missed_zero_copy =
+        ram_counters.dirty_sync_missed_zero_copy;
 
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
@@ -850,7 +893,10 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->pages = xbzrle_counters.pages;
         info->xbzrle_cache->cache_miss = xbzrle_counters.cache_miss;
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
+        info->xbzrle_cache->cache_hit_rate = xbzrle_counters.cache_hit_rate;
+        info->xbzrle_cache->cache_evictions = xbzrle_counters.cache_evictions;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
+        info->xbzrle_cache->overflow_rate = xbzrle_counters.overflow_rate;
     }
 
     if (migrate_use_compression()) {
@@ -1022,6 +1068,115 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+
+        /* Both use extra connections, which could not be told apart */
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Postcopy preempt is not compatible "
+                       "with multifd");
+            return false;
+        }
+    }
+
+#ifdef CONFIG_LINUX
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND] &&
+        (!cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+         cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+         migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE)) {
+        error_setg(errp, "Zero copy only available for non-compressed "
+                   "multifd migration");
+        return false;
+    }
+#endif
+
+    if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
+        static const MigrationCapability incompatible[] = {
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_DIRTY_BITMAPS,
+            MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME,
+            MIGRATION_CAPABILITY_LATE_BLOCK_ACTIVATE,
+            MIGRATION_CAPABILITY_RETURN_PATH,
+            MIGRATION_CAPABILITY_MULTIFD,
+            MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER,
+            MIGRATION_CAPABILITY_AUTO_CONVERGE,
+            MIGRATION_CAPABILITY_RELEASE_RAM,
+            MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_X_COLO,
+            MIGRATION_CAPABILITY_BLOCK,
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible); i++) {
+            if (cap_list[incompatible[i]]) {
+                error_setg(errp, "Background-snapshot is not compatible "
+                           "with %s",
+                           MigrationCapability_str(incompatible[i]));
+                return false;
+            }
+        }
+#ifdef CONFIG_LINUX
+        if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+            error_setg(errp, "Background-snapshot is not compatible "
+                       "with zero-copy-send");
+            return false;
+        }
+#endif
+
+        if (!ram_write_tracking_available()) {
+            error_setg(errp, "Background-snapshot is not supported by host "
+                       "kernel");
+            return false;
+        }
+        if (!ram_write_tracking_compatible()) {
+            error_setg(errp, "Background-snapshot is not compatible "
+                       "with guest memory configuration");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        static const MigrationCapability incompatible[] = {
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_X_COLO,
+            MIGRATION_CAPABILITY_BLOCK,
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT,
+            MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible); i++) {
+            if (cap_list[incompatible[i]]) {
+                error_setg(errp, "Mapped-ram is not compatible with %s",
+                           MigrationCapability_str(incompatible[i]));
+                return false;
+            }
+        }
+#ifdef CONFIG_LINUX
+        if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+            error_setg(errp, "Mapped-ram is not compatible with "
+                       "zero-copy-send");
+            return false;
+        }
+#endif
+
+        /* The pages are stored uncompressed at their offset in the file */
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD] &&
+            migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+            error_setg(errp, "Mapped-ram is not compatible with multifd "
+                       "compression");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -1158,6 +1313,27 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_multifd_zlib_level &&
+        (params->multifd_zlib_level > 9)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_zlib_level",
+                   "is invalid, it should be in the range of 0 to 9");
+        return false;
+    }
+
+    if (params->has_multifd_zstd_level &&
+        (params->multifd_zstd_level > 20)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_zstd_level",
+                   "is invalid, it should be in the range of 0 to 20");
+        return false;
+    }
+
+#ifndef O_DIRECT
+    if (params->has_direct_io && params->direct_io) {
+        error_setg(errp, "direct-io is not supported on this host");
+        return false;
+    }
+#endif
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1206,6 +1382,14 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
                    "is invalid, it must be in the range of 1 to 10000 ms");
        return false;
     }
+
+    if (params->has_multifd_compression &&
+        params->multifd_compression != MULTIFD_COMPRESSION_NONE &&
+        migrate_use_zero_copy_send()) {
+        error_setg(errp, "Multifd compression is not compatible with "
+                   "zero-copy-send");
+        return false;
+    }
     return true;
 }
 
@@ -1268,6 +1452,18 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_multifd_channels) {
         dest->multifd_channels = params->multifd_channels;
     }
+    if (params->has_multifd_compression) {
+        dest->multifd_compression = params->multifd_compression;
+    }
+    if (params->has_multifd_zlib_level) {
+        dest->multifd_zlib_level = params->multifd_zlib_level;
+    }
+    if (params->has_multifd_zstd_level) {
+        dest->multifd_zstd_level = params->multifd_zstd_level;
+    }
+    if (params->has_direct_io) {
+        dest->direct_io = params->direct_io;
+    }
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
@@ -1364,6 +1560,18 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_multifd_channels) {
         s->parameters.multifd_channels = params->multifd_channels;
     }
+    if (params->has_multifd_compression) {
+        s->parameters.multifd_compression = params->multifd_compression;
+    }
+    if (params->has_multifd_zlib_level) {
+        s->parameters.multifd_zlib_level = params->multifd_zlib_level;
+    }
+    if (params->has_multifd_zstd_level) {
+        s->parameters.multifd_zstd_level = params->multifd_zstd_level;
+    }
+    if (params->has_direct_io) {
+        s->parameters.direct_io = params->direct_io;
+    }
     if (params->has_xbzrle_cache_size) {
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
         xbzrle_cache_resize(params->xbzrle_cache_size, errp);
@@ -1525,6 +1733,11 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_fclose(tmp);
     }
 
+    if (s->postcopy_qemufile_src) {
+        qemu_fclose(s->postcopy_qemufile_src);
+        s->postcopy_qemufile_src = NULL;
+    }
+
     assert((s->state != MIGRATION_STATUS_ACTIVE) &&
            (s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE));
 
@@ -1609,6 +1822,9 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING && s->postcopy_qemufile_src) {
+        qemu_file_shutdown(s->postcopy_qemufile_src);
+    }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
 
@@ -1869,6 +2085,13 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
             return false;
         }
 
+        /* The preempt channel is not re-established on recovery */
+        if (migrate_postcopy_preempt()) {
+            error_setg(errp, "Postcopy recovery cannot work "
+                       "when postcopy-preempt capability is set");
+            return false;
+        }
+
         /* This is a resume, skip init status */
         return true;
     }
@@ -1889,6 +2112,12 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
         return false;
     }
 
+    if (dirtyrate_uses_dirty_log()) {
+        error_setg(errp, "Cannot migrate while the dirty rate is being "
+                   "measured with dirty logging");
+        return false;
+    }
+
     if (blk || blk_inc) {
         if (migrate_use_block() || migrate_use_block_incremental()) {
             error_setg(errp, "Command options are incompatible with "
@@ -1920,6 +2149,11 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     MigrationState *s = migrate_get_current();
     const char *p;
 
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "mapped-ram requires a file: migration URI");
+        return;
+    }
+
     if (!migrate_prepare(s, has_blk && blk, has_inc && inc,
                          has_resume && resume, errp)) {
         /* Error detected, put into errp */
@@ -1938,6 +2172,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -2137,6 +2373,33 @@ bool migrate_use_events(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_EVENTS];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
 bool migrate_use_multifd(void)
 {
     MigrationState *s;
@@ -2146,6 +2409,19 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_use_zero_copy_send(void)
+{
+#ifdef CONFIG_LINUX
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+#else
+    return false;
+#endif
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -2165,6 +2441,42 @@ int migrate_multifd_channels(void)
     return s->parameters.multifd_channels;
 }
 
+MultiFDCompression migrate_multifd_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_compression;
+}
+
+int migrate_multifd_zlib_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_zlib_level;
+}
+
+int migrate_multifd_zstd_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_zstd_level;
+}
+
+bool migrate_direct_io(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.direct_io;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -3162,6 +3474,31 @@ static void migration_iteration_finish(MigrationState *s)
     qemu_mutex_unlock_iothread();
 }
 
+/*
+ * Wait for a delay to do rate limiting OR something urgent to post the
+ * semaphore.  Returns true if we were woken up by an urgent request.
+ */
+static bool migration_rate_limit(MigrationState *s, int64_t current_time)
+{
+    bool urgent = false;
+    int ms = s->iteration_start_time + BUFFER_DELAY - current_time;
+
+    trace_migration_thread_ratelimit_pre(ms);
+    if (qemu_sem_timedwait(&s->rate_limit_sem, ms) == 0) {
+        /* We were worken by one or more urgent things but
+         * the timedwait will have consumed one of them.
+         * The service routine for the urgent wake will dec
+         * the semaphore itself for each item it consumes,
+         * so add this one we just eat back.
+         */
+        qemu_sem_post(&s->rate_limit_sem);
+        urgent = true;
+    }
+    trace_migration_thread_ratelimit_post(urgent);
+
+    return urgent;
+}
+
 void migration_make_urgent_request(void)
 {
     qemu_sem_post(&migrate_get_current()->rate_limit_sem);
@@ -3216,6 +3553,16 @@ static void *migration_thread(void *opaque)
         qemu_savevm_send_colo_enable(s->to_dst_file);
     }
 
+    if (migrate_postcopy_preempt()) {
+        Error *local_err = NULL;
+
+        if (postcopy_preempt_setup(s, &local_err)) {
+            migrate_set_error(s, local_err);
+            error_free(local_err);
+            qemu_file_set_error(s->to_dst_file, -EINVAL);
+        }
+    }
+
     qemu_savevm_state_setup(s->to_dst_file);
 
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
@@ -3261,22 +3608,7 @@ static void *migration_thread(void *opaque)
 
         urgent = false;
         if (qemu_file_rate_limit(s->to_dst_file)) {
-            /* Wait for a delay to do rate limiting OR
-             * something urgent to post the semaphore.
-             */
-            int ms = s->iteration_start_time + BUFFER_DELAY - current_time;
-            trace_migration_thread_ratelimit_pre(ms);
-            if (qemu_sem_timedwait(&s->rate_limit_sem, ms) == 0) {
-                /* We were worken by one or more urgent things but
-                 * the timedwait will have consumed one of them.
-                 * The service routine for the urgent wake will dec
-                 * the semaphore itself for each item it consumes,
-                 * so add this one we just eat back.
-                 */
-                qemu_sem_post(&s->rate_limit_sem);
-                urgent = true;
-            }
-            trace_migration_thread_ratelimit_post(urgent);
+            urgent = migration_rate_limit(s, current_time);
         }
     }
 
@@ -3287,6 +3619,239 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+/*
+ * Background snapshot
+ *
+ * The guest is stopped only while its device state is saved to a buffer
+ * and its RAM is write protected with userfaultfd.  RAM is then saved
+ * while the guest runs; pages that the guest tries to write are saved
+ * first, and the write proceeds once the page is in the stream.  The
+ * device state follows the RAM, so the stream has the same layout as
+ * the one of a normal migration and describes the guest at the moment
+ * it was stopped.
+ */
+static void bg_migration_vm_start_bh(void *opaque)
+{
+    MigrationState *s = opaque;
+
+    qemu_bh_delete(s->vm_start_bh);
+    s->vm_start_bh = NULL;
+
+    vm_start();
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - s->downtime_start;
+    trace_bg_migration_thread_vm_start(s->downtime);
+}
+
+/*
+ * Called once all RAM has been saved: write the end of the iterable
+ * sections and the device state that was stashed in @bioc.
+ */
+static void bg_migration_completion(MigrationState *s, QIOChannelBuffer *bioc)
+{
+    int current_active_state = s->state;
+    int ret;
+
+    /*
+     * Stop tracking RAM writes first: this wakes up every vCPU that still
+     * waits for a write fault to be resolved, so that the iothread lock
+     * can be taken without deadlocking with them.
+     */
+    ram_write_tracking_stop();
+
+    qemu_mutex_lock_iothread();
+    ret = qemu_savevm_state_complete_precopy_iterable(s->to_dst_file, false);
+    qemu_mutex_unlock_iothread();
+    if (ret < 0) {
+        goto fail;
+    }
+
+    qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+    qemu_fflush(s->to_dst_file);
+
+    if (qemu_file_get_error(s->to_dst_file)) {
+        trace_migration_completion_file_err();
+        goto fail;
+    }
+
+    migrate_set_state(&s->state, current_active_state,
+                      MIGRATION_STATUS_COMPLETED);
+    return;
+
+fail:
+    migrate_set_state(&s->state, current_active_state,
+                      MIGRATION_STATUS_FAILED);
+}
+
+static void bg_migration_iteration_finish(MigrationState *s)
+{
+    qemu_mutex_lock_iothread();
+    switch (s->state) {
+    case MIGRATION_STATUS_COMPLETED:
+        migration_calculate_complete(s);
+        break;
+
+    case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_FAILED:
+    case MIGRATION_STATUS_CANCELLED:
+    case MIGRATION_STATUS_CANCELLING:
+        break;
+
+    default:
+        /* Should not reach here, but if so, forgive the VM. */
+        error_report("%s: Unknown ending state %d", __func__, s->state);
+        break;
+    }
+    migrate_fd_cleanup_schedule(s);
+    qemu_mutex_unlock_iothread();
+}
+
+/*
+ * Migration thread for background snapshots.  The guest keeps running
+ * while its RAM is saved; see the comment above bg_migration_vm_start_bh.
+ */
+static void *bg_migration_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    MigThrError thr_error;
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    bool urgent = false;
+    bool early_fail = true;
+
+    rcu_register_thread();
+    object_ref(OBJECT(s));
+
+    /*
+     * Discarding guest RAM would drop the write protection of the
+     * discarded pages, so keep the balloon away while the snapshot runs.
+     */
+    qemu_balloon_inhibit(true);
+
+    /*
+     * The device state describes the guest at the moment it is stopped,
+     * but it has to follow the RAM in the stream.  Stash it here until
+     * all RAM has been saved.
+     */
+    bioc = qio_channel_buffer_new(512 * KiB);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "vmstate-buffer");
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    s->iteration_start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    qemu_savevm_state_header(s->to_dst_file);
+    qemu_savevm_state_setup(s->to_dst_file);
+
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+
+    trace_bg_migration_thread_setup_complete();
+
+    /* Map every page now, rather than with the guest stopped */
+    ram_write_tracking_prepare();
+
+    qemu_mutex_lock_iothread();
+    s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    /*
+     * If VM is currently in suspended state, then, to make a valid runstate
+     * transition in vm_stop_force_state() we need to wakeup it up.
+     */
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER, NULL);
+    s->vm_was_running = runstate_is_running();
+
+    if (global_state_store()) {
+        goto fail;
+    }
+    /* Forcibly stop VM before saving state of vCPUs and devices */
+    if (vm_stop_force_state(RUN_STATE_PAUSED)) {
+        goto fail;
+    }
+
+    cpu_synchronize_all_states();
+    if (qemu_savevm_state_complete_precopy_non_iterable(fb, false, false)) {
+        goto fail;
+    }
+    /* bioc->data is read directly, so flush the buffered data now */
+    qemu_fflush(fb);
+
+    /* Now write protect the RAM; from here on faults have to be served */
+    if (ram_write_tracking_start()) {
+        goto fail;
+    }
+    early_fail = false;
+
+    /*
+     * Start the VM from a bottom half: vm_start() runs state change
+     * notifiers that write to guest memory (e.g. virtio rings), which
+     * would block on a write fault that only this thread can resolve.
+     */
+    if (s->vm_was_running) {
+        s->vm_start_bh = qemu_bh_new(bg_migration_vm_start_bh, s);
+        qemu_bh_schedule(s->vm_start_bh);
+    } else {
+        s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                      s->downtime_start;
+    }
+
+    qemu_mutex_unlock_iothread();
+
+    while (s->state == MIGRATION_STATUS_ACTIVE) {
+        int64_t current_time;
+
+        if (urgent || !qemu_file_rate_limit(s->to_dst_file)) {
+            if (qemu_savevm_state_iterate(s->to_dst_file, false) > 0) {
+                bg_migration_completion(s, bioc);
+                break;
+            }
+        }
+
+        /*
+         * Try to detect any kind of failures, and see whether we
+         * should stop the migration now.
+         */
+        thr_error = migration_detect_error(s);
+        if (thr_error == MIG_THR_ERR_FATAL) {
+            /* Stop migration */
+            break;
+        }
+
+        current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+        migration_update_counters(s, current_time);
+
+        urgent = false;
+        if (qemu_file_rate_limit(s->to_dst_file)) {
+            urgent = migration_rate_limit(s, current_time);
+        }
+    }
+
+    trace_bg_migration_thread_after_loop();
+
+    /* Release the guest before taking the iothread lock again */
+    ram_write_tracking_stop();
+
+fail:
+    if (early_fail) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+        if (s->vm_was_running && !runstate_is_running()) {
+            vm_start();
+        }
+        qemu_mutex_unlock_iothread();
+    }
+
+    bg_migration_iteration_finish(s);
+
+    qemu_fclose(fb);
+    qemu_balloon_inhibit(false);
+    object_unref(OBJECT(s));
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s, Error *error_in)
 {
     int64_t rate_limit;
@@ -3342,8 +3907,13 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         migrate_fd_cleanup(s);
         return;
     }
-    qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
-                       QEMU_THREAD_JOINABLE);
+    if (migrate_background_snapshot()) {
+        qemu_thread_create(&s->thread, "bg_snapshot",
+                           bg_migration_thread, s, QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(&s->thread, "live_migration",
+                           migration_thread, s, QEMU_THREAD_JOINABLE);
+    }
     s->migration_thread_running = true;
 }
 
@@ -3410,6 +3980,17 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("multifd-channels", MigrationState,
                       parameters.multifd_channels,
                       DEFAULT_MIGRATE_MULTIFD_CHANNELS),
+    DEFINE_PROP_MULTIFD_COMPRESSION("multifd-compression", MigrationState,
+                      parameters.multifd_compression,
+                      DEFAULT_MIGRATE_MULTIFD_COMPRESSION),
+    DEFINE_PROP_UINT8("multifd-zlib-level", MigrationState,
+                      parameters.multifd_zlib_level,
+                      DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL),
+    DEFINE_PROP_UINT8("multifd-zstd-level", MigrationState,
+                      parameters.multifd_zstd_level,
+                      DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL),
+    DEFINE_PROP_BOOL("direct-io", MigrationState,
+                      parameters.direct_io, false),
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
@@ -3445,6 +4026,8 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+                        MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -3499,6 +4082,10 @@ static void migration_instance_init(Object *obj)
     params->has_x_checkpoint_delay = true;
     params->has_block_incremental = true;
     params->has_multifd_channels = true;
+    params->has_multifd_compression = true;
+    params->has_multifd_zlib_level = true;
+    params->has_multifd_zstd_level = true;
+    params->has_direct_io = true;
     params->has_xbzrle_cache_size = true;
     params->has_max_postcopy_bandwidth = true;
     params->has_max_cpu_throttle = true;
@@ -43,6 +43,17 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * The channels that RAM pages are received on in postcopy: the main
+ * migration stream, and the channel for urgent pages that postcopy-preempt
+ * adds.
+ */
+enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+};
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -75,8 +86,18 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* Temporary host page that each channel assembles its pages in */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
+    /* RAMBlock of the last page received on each channel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
+
+    /* Channel for urgent postcopy pages (postcopy-preempt) */
+    QEMUFile *postcopy_qemufile_dst;
+    /* Posted when postcopy_qemufile_dst is set, or on cleanup */
+    QemuSemaphore postcopy_qemufile_dst_done;
+    bool      have_preempt_thread;
+    QemuThread preempt_thread;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -136,6 +157,8 @@ struct MigrationState
     QemuThread thread;
     QEMUBH *cleanup_bh;
     QEMUFile *to_dst_file;
+    /* Channel for urgent postcopy pages (postcopy-preempt) */
+    QEMUFile *postcopy_qemufile_src;
     /*
      * Protects to_dst_file pointer.  We need to make sure we won't
      * yield or hang during the critical section, since this lock will
@@ -195,6 +218,8 @@ struct MigrationState
      * running the guest on source.
      */
     bool vm_was_running;
+    /* Restarts the guest once a background snapshot has started */
+    QEMUBH *vm_start_bh;
 
     /* Flag set once the migration has been asked to enter postcopy */
     bool start_postcopy;
@@ -288,14 +313,22 @@ bool migrate_postcopy(void);
 
 bool migrate_release_ram(void);
 bool migrate_postcopy_ram(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_background_snapshot(void);
+bool migrate_mapped_ram(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+bool migrate_use_zero_copy_send(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
+MultiFDCompression migrate_multifd_compression(void);
+int migrate_multifd_zlib_level(void);
+int migrate_multifd_zstd_level(void);
+bool migrate_direct_io(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
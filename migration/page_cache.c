@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache indexed by a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -30,26 +30,40 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
-typedef struct CacheItem CacheItem;
+/*
+ * Pages are cached in sets of PAGE_CACHE_WAYS entries; a page can be
+ * stored in any entry of the set that its address hashes to, so that
+ * a few hot pages that collide do not keep evicting each other.
+ */
+#define PAGE_CACHE_WAYS 8
 
-struct CacheItem {
-    uint64_t it_addr;
-    uint64_t it_age;
-    uint8_t *it_data;
-};
+#define PAGE_CACHE_FREE ((uint64_t)-1)
+
+/*
+ * The addresses of a set fill exactly one cache line, so a lookup only
+ * needs to touch that line; ages and data are only read on a hit or on
+ * insertion.
+ */
+typedef struct CacheSet {
+    uint64_t it_addr[PAGE_CACHE_WAYS];
+    uint64_t it_age[PAGE_CACHE_WAYS];
+    uint8_t *it_data[PAGE_CACHE_WAYS];
+} CacheSet;
 
 struct PageCache {
-    CacheItem *page_cache;
+    CacheSet *sets;
     size_t page_size;
-    size_t max_num_items;
+    size_t num_sets;
+    /* used entries per set, smaller than PAGE_CACHE_WAYS for tiny caches */
+    size_t num_ways;
     size_t num_items;
 };
 
 PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
 {
-    int64_t i;
     size_t num_pages = new_size / page_size;
     PageCache *cache;
+    size_t i, j;
 
     if (new_size < page_size) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
@@ -73,24 +87,28 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     }
     cache->page_size = page_size;
     cache->num_items = 0;
-    cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache sets to %zd of %zd pages\n",
+            cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    cache->sets = qemu_try_memalign(64, cache->num_sets *
+                                    sizeof(*cache->sets));
+    if (!cache->sets) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
                    "Failed to allocate page cache");
         g_free(cache);
         return NULL;
     }
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
+    for (i = 0; i < cache->num_sets; i++) {
+        for (j = 0; j < PAGE_CACHE_WAYS; j++) {
+            cache->sets[i].it_data[j] = NULL;
+            cache->sets[i].it_age[j] = 0;
+            cache->sets[i].it_addr[j] = PAGE_CACHE_FREE;
+        }
     }
 
     return cache;
@@ -98,54 +116,73 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
+    size_t i, j;
 
     g_assert(cache);
-    g_assert(cache->page_cache);
+    g_assert(cache->sets);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
+    for (i = 0; i < cache->num_sets; i++) {
+        for (j = 0; j < cache->num_ways; j++) {
+            g_free(cache->sets[i].it_data[j]);
+        }
     }
 
-    g_free(cache->page_cache);
-    cache->page_cache = NULL;
+    qemu_vfree(cache->sets);
+    cache->sets = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static CacheSet *cache_get_set(const PageCache *cache, uint64_t addr)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
-}
+    uint64_t page = addr / cache->page_size;
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
-{
-    size_t pos;
+    g_assert(cache->num_sets);
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    /*
+     * Mix in the high bits, so that pages that are num_sets apart (the
+     * same offset in different RAM blocks, for example) are spread
+     * over different sets.
+     */
+    page ^= page >> ctz64(cache->num_sets);
+    return &cache->sets[page & (cache->num_sets - 1)];
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/* Returns the way of @set that holds @addr, or -1 */
+static int cache_find_way(const PageCache *cache, const CacheSet *set,
+                          uint64_t addr)
+{
+    int i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set->it_addr[i] == addr) {
+            return i;
+        }
+    }
+    return -1;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheSet *set;
+    int way;
+
+    g_assert(cache);
+    g_assert(cache->sets);
+
+    set = cache_get_set(cache, addr);
+    way = cache_find_way(cache, set, addr);
+    return way < 0 ? NULL : set->it_data[way];
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
                      uint64_t current_age)
 {
-    CacheItem *it;
-
-    it = cache_get_by_addr(cache, addr);
+    CacheSet *set = cache_get_set(cache, addr);
+    int way = cache_find_way(cache, set, addr);
 
-    if (it->it_addr == addr) {
+    if (way >= 0) {
         /* update the it_age when the cache hit */
-        it->it_age = current_age;
+        set->it_age[way] = current_age;
         return true;
     }
     return false;
@@ -154,31 +191,64 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
-
-    CacheItem *it;
-
-    /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    CacheSet *set = cache_get_set(cache, addr);
+    int way = cache_find_way(cache, set, addr);
+    int ret = 0;
+    int i;
+
+    if (way < 0) {
+        /*
+         * Use a free entry if there is one, otherwise the one that was
+         * used least recently.  Pages that were used in the last
+         * CACHED_PAGE_LIFETIME cycles are never replaced.
+         */
+        for (i = 0; i < cache->num_ways; i++) {
+            if (set->it_addr[i] == PAGE_CACHE_FREE) {
+                way = i;
+                break;
+            }
+            if (way < 0 || set->it_age[i] < set->it_age[way]) {
+                way = i;
+            }
+        }
+        if (set->it_addr[way] != PAGE_CACHE_FREE) {
+            if (set->it_age[way] + CACHED_PAGE_LIFETIME > current_age) {
+                /* the cache pages are fresh, don't replace them */
+                return -1;
+            }
+            ret = 1;
+        }
     }
+
     /* allocate page */
-    if (!it->it_data) {
-        it->it_data = g_try_malloc(cache->page_size);
-        if (!it->it_data) {
+    if (!set->it_data[way]) {
+        set->it_data[way] = g_try_malloc(cache->page_size);
+        if (!set->it_data[way]) {
             DPRINTF("Error allocating page\n");
             return -1;
         }
         cache->num_items++;
     }
 
-    memcpy(it->it_data, pdata, cache->page_size);
+    memcpy(set->it_data[way], pdata, cache->page_size);
+
+    set->it_age[way] = current_age;
+    set->it_addr[way] = addr;
+
+    return ret;
+}
+
+uint8_t *cache_swap_data(PageCache *cache, uint64_t addr, uint8_t *pdata,
+                         uint64_t current_age)
+{
+    CacheSet *set = cache_get_set(cache, addr);
+    int way = cache_find_way(cache, set, addr);
+    uint8_t *old;
 
-    it->it_age = current_age;
-    it->it_addr = addr;
+    g_assert(way >= 0);
 
-    return 0;
+    old = set->it_data[way];
+    set->it_data[way] = pdata;
+    set->it_age[way] = current_age;
+    return old;
 }
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache indexed by a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -61,7 +61,8 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
- * Returns -1 when the page isn't inserted into cache
+ * Returns -1 when the page isn't inserted into cache, 1 when another
+ * page was evicted to make room for it and 0 otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -71,4 +72,19 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
+/**
+ * cache_swap_data: replace the data of a cached page without copying
+ *
+ * Returns the buffer that was cached for @addr until now; the cache
+ * takes ownership of @pdata, which must have been allocated with
+ * g_malloc() and be one page long.
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page address, must be cached
+ * @pdata: pointer to the new contents of the page
+ * @current_age: current bitmap generation
+ */
+uint8_t *cache_swap_data(PageCache *cache, uint64_t addr, uint8_t *pdata,
+                         uint64_t current_age);
+
 #endif
@@ -28,8 +28,11 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 #include "hw/boards.h"
+#include "qemu-file-channel.h"
+#include "socket.h"
 
 /* Arbitrary limit on size of each discard command,
  * keeps them around ~200 bytes
@@ -538,8 +541,28 @@ static void postcopy_balloon_inhibit(bool state)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_preempt_thread) {
+        /*
+         * After a clean end of migration, the source sends an EOS on the
+         * preempt channel, and the thread must place every page up to it.
+         * Otherwise the thread may be blocked on a channel that is never
+         * going to deliver anything, or waiting for it to be opened.
+         */
+        if (qemu_file_get_error(mis->from_src_file)) {
+            if (mis->postcopy_qemufile_dst) {
+                qemu_file_shutdown(mis->postcopy_qemufile_dst);
+            }
+            qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+        }
+        trace_postcopy_ram_incoming_cleanup_preempt_join();
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -578,9 +601,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 
     postcopy_state_set(POSTCOPY_INCOMING_END);
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -1093,6 +1118,46 @@ retry:
     return NULL;
 }
 
+/*
+ * Loads the pages that the source sends on the postcopy preempt channel,
+ * in parallel with the listen thread loading the main stream.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    QEMUFile *f;
+    int ret;
+
+    rcu_register_thread();
+    trace_postcopy_preempt_thread_entry();
+
+    qemu_sem_wait(&mis->postcopy_qemufile_dst_done);
+    f = mis->postcopy_qemufile_dst;
+    if (!f) {
+        /* Migration failed before the channel was opened */
+        goto out;
+    }
+
+    /* Like the listen thread, we can't yield and have to block */
+    qemu_file_set_blocking(f, true);
+
+    rcu_read_lock();
+    ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+    rcu_read_unlock();
+
+    if (ret) {
+        error_report("%s: loading pages failed: %s", __func__,
+                     strerror(-ret));
+        /* Let the listen thread find out too */
+        qemu_file_shutdown(mis->from_src_file);
+    }
+
+out:
+    trace_postcopy_preempt_thread_exit();
+    rcu_unregister_thread();
+    return NULL;
+}
+
 int postcopy_ram_enable_notify(MigrationIncomingState *mis)
 {
     /* Open the fd for the kernel to give us userfaults */
@@ -1127,12 +1192,34 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
     qemu_sem_destroy(&mis->fault_thread_sem);
     mis->have_fault_thread = true;
 
+    /*
+     * The zero page is allocated here rather than on first use because
+     * pages may be placed from more than one thread.  Anonymous memory
+     * reads as zeroes, so there is no need to touch it.
+     */
+    mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
+        mis->postcopy_tmp_zero_page = NULL;
+        error_report("%s: mapping large zero page: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
     /* Mark so that we get notified of accesses to unwritten areas */
     if (foreach_not_ignored_block(ram_block_enable_notify, mis)) {
         error_report("ram_block_enable_notify failed");
         return -1;
     }
 
+    if (migrate_postcopy_preempt()) {
+        qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                           postcopy_preempt_thread, mis,
+                           QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
     /*
      * Ballooning can mark pages as absent while we're postcopying
      * that would cause false userfaults.
@@ -1240,20 +1327,6 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                                                                       host));
     } else {
         /* The kernel can't use UFFDIO_ZEROPAGE for hugepages */
-        if (!mis->postcopy_tmp_zero_page) {
-            mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
-                                               PROT_READ | PROT_WRITE,
-                                               MAP_PRIVATE | MAP_ANONYMOUS,
-                                               -1, 0);
-            if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
-                int e = errno;
-                mis->postcopy_tmp_zero_page = NULL;
-                error_report("%s: %s mapping large zero page",
-                             __func__, strerror(e));
-                return -e;
-            }
-            memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
-        }
         return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page,
                                    rb);
     }
@@ -1263,26 +1336,27 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
  * Returns a target page of memory that can be mapped at a later point in time
  * using postcopy_place_page
  * The same address is used repeatedly, postcopy_place_page just takes the
- * backing page away.
+ * backing page away.  Each channel that pages are received on has its own.
  * Returns: Pointer to allocated page
  *
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
 {
-    if (!mis->postcopy_tmp_page) {
-        mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                             PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                             MAP_ANONYMOUS, -1, 0);
-        if (mis->postcopy_tmp_page == MAP_FAILED) {
-            mis->postcopy_tmp_page = NULL;
+    if (!mis->postcopy_tmp_pages[channel]) {
+        void *page = mmap(NULL, mis->largest_page_size,
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                          MAP_ANONYMOUS, -1, 0);
+        if (page == MAP_FAILED) {
             error_report("%s: %s", __func__, strerror(errno));
             return NULL;
         }
+        mis->postcopy_tmp_pages[channel] = page;
     }
 
-    return mis->postcopy_tmp_page;
+    return mis->postcopy_tmp_pages[channel];
 }
 
+
 #else
 /* No target OS support, stubs just fail */
 void fill_destination_postcopy_migration_info(MigrationInfo *info)
@@ -1340,7 +1414,7 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
 {
     assert(0);
     return NULL;
@@ -1357,6 +1431,45 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * Called on the destination when the source opens the postcopy preempt
+ * channel.
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    trace_postcopy_preempt_new_channel();
+    mis->postcopy_qemufile_dst = file;
+    qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+}
+
+/*
+ * Called on the source at the start of migration to open the postcopy
+ * preempt channel.
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    QIOChannel *ioc;
+
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "Postcopy preempt is not supported with TLS");
+        return -1;
+    }
+
+    ioc = socket_send_channel_create_sync(errp);
+    if (!ioc) {
+        error_prepend(errp, "Failed to open postcopy preempt channel: ");
+        return -1;
+    }
+
+    qio_channel_set_name(ioc, "migration-postcopy-preempt");
+    qio_channel_set_delay(ioc, false);
+    s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+    object_unref(OBJECT(ioc));
+
+    trace_postcopy_preempt_setup();
+    return 0;
+}
+
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
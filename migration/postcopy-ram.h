@@ -105,10 +105,14 @@ typedef enum {
 
 /*
  * Allocate a page of memory that can be mapped at a later point in time
- * using postcopy_place_page
+ * using postcopy_place_page, for pages received on @channel
  * Returns: Pointer to allocated page
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis);
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel);
+
+/* The channel for urgent pages with postcopy-preempt */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
 
 PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
@@ -100,6 +100,57 @@ static ssize_t channel_get_buffer(void *opaque,
 }
 
 
+static ssize_t channel_pwritev_buffer(void *opaque,
+                                      struct iovec *iov,
+                                      int iovcnt,
+                                      off_t offset)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (qio_channel_pwritev_all(ioc, iov, iovcnt, offset, NULL) < 0) {
+        /* XXX handle Error objects */
+        return -EIO;
+    }
+    return iov_size(iov, iovcnt);
+}
+
+
+static ssize_t channel_pread_buffer(void *opaque,
+                                    uint8_t *buf,
+                                    size_t size,
+                                    off_t offset)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+
+    if (qio_channel_preadv_all(ioc, &iov, 1, offset, NULL) < 0) {
+        /* XXX handle Error objects */
+        return -EIO;
+    }
+    return size;
+}
+
+
+static off_t channel_seek(void *opaque,
+                          off_t offset,
+                          int whence)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    off_t ret;
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        return -ENOTSUP;
+    }
+
+    ret = qio_channel_io_seek(ioc, offset, whence, NULL);
+    if (ret < 0) {
+        /* XXX handle Error objects */
+        return -EIO;
+    }
+    return ret;
+}
+
+
 static int channel_close(void *opaque)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
@@ -165,6 +216,8 @@ static const QEMUFileOps channel_input_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_input_return_path,
+    .pread_buffer = channel_pread_buffer,
+    .seek = channel_seek,
 };
 
 
@@ -174,6 +227,8 @@ static const QEMUFileOps channel_output_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_output_return_path,
+    .pwritev_buffer = channel_pwritev_buffer,
+    .seek = channel_seek,
 };
 
 
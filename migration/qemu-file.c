@@ -589,6 +589,122 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Write @buf at offset @pos of the backing file.  The data bypasses the
+ * stream buffer and the stream position is not changed; the bytes are
+ * accounted for like the streamed ones.
+ */
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t buflen,
+                        off_t pos)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = buflen };
+    ssize_t ret;
+
+    if (f->last_error) {
+        return;
+    }
+
+    if (!f->ops->pwritev_buffer) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return;
+    }
+
+    ret = f->ops->pwritev_buffer(f->opaque, &iov, 1, pos);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return;
+    }
+
+    f->pos += buflen;
+    f->bytes_xfer += buflen;
+}
+
+/*
+ * Read @buflen bytes at offset @pos of the backing file into @buf,
+ * bypassing the stream buffer.  Returns the number of bytes read, which
+ * is less than @buflen only on error.
+ */
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t buflen,
+                          off_t pos)
+{
+    ssize_t ret;
+
+    if (f->last_error) {
+        return 0;
+    }
+
+    if (!f->ops->pread_buffer) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return 0;
+    }
+
+    ret = f->ops->pread_buffer(f->opaque, buf, buflen, pos);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return 0;
+    }
+
+    return buflen;
+}
+
+/*
+ * Move the stream position.  Pending writes are flushed first and
+ * buffered input is dropped, so the next qemu_put_* or qemu_get_* call
+ * operates at the new position.
+ */
+void qemu_set_offset(QEMUFile *f, off_t off, int whence)
+{
+    off_t ret;
+
+    if (!f->ops->seek) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        /* Drop all cached buffers if existed; will trigger a re-fill later */
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    ret = f->ops->seek(f->opaque, off, whence);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+}
+
+/*
+ * Return the stream position, i.e. the offset of the backing file at
+ * which the next qemu_put_* call writes or the next qemu_get_* call
+ * reads.
+ */
+off_t qemu_get_offset(QEMUFile *f)
+{
+    off_t ret;
+
+    if (!f->ops->seek) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -1;
+    }
+
+    qemu_fflush(f);
+
+    ret = f->ops->seek(f->opaque, 0, SEEK_CUR);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return -1;
+    }
+
+    if (!qemu_file_is_writable(f)) {
+        /* Data that was read from the file but not consumed yet */
+        ret -= f->buf_size - f->buf_index;
+    }
+
+    return ret;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
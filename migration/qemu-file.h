@@ -99,6 +99,22 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Random access to a seekable backing file, without going through the
+ * stream buffer and without moving the stream position.  The handlers
+ * must transfer all of the data or return a negative errno value.
+ */
+typedef ssize_t (QEMUFilePwritevBufferFunc)(void *opaque, struct iovec *iov,
+                                            int iovcnt, off_t offset);
+typedef ssize_t (QEMUFilePreadBufferFunc)(void *opaque, uint8_t *buf,
+                                          size_t size, off_t offset);
+
+/*
+ * Move the stream position of the backing file, see lseek(2).
+ * Returns the new position or a negative errno value.
+ */
+typedef off_t (QEMUFileSeekFunc)(void *opaque, off_t offset, int whence);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -106,6 +122,9 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFilePwritevBufferFunc *pwritev_buffer;
+    QEMUFilePreadBufferFunc *pread_buffer;
+    QEMUFileSeekFunc *seek;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -121,6 +140,12 @@ int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 int64_t qemu_ftell_fast(QEMUFile *f);
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t buflen,
+                        off_t pos);
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t buflen,
+                          off_t pos);
+void qemu_set_offset(QEMUFile *f, off_t off, int whence);
+off_t qemu_get_offset(QEMUFile *f);
 /*
  * put_buffer without copying the buffer.
  * The buffer should be available till it is sent asynchronously.
@@ -30,6 +30,7 @@
 #include "cpu.h"
 #include <zlib.h>
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
@@ -57,6 +58,12 @@
 #include "qemu/uuid.h"
 #include "savevm.h"
 #include "qemu/iov.h"
+#include "multifd.h"
+#include "file.h"
+
+#ifdef CONFIG_LINUX
+#include "qemu/userfaultfd.h"
+#endif
 
 /***********************************************************/
 /* ram save/restore */
@@ -77,6 +84,25 @@
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
 
+/*
+ * With the mapped-ram capability, each RAMBlock entry of the
+ * RAM_SAVE_FLAG_MEM_SIZE record is followed by a MappedRamHeader. The
+ * bitmap of the pages that are present and the pages themselves live at
+ * fixed offsets of the migration file; the stream continues after the
+ * pages of the block.
+ */
+#define MAPPED_RAM_HDR_VERSION 1
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT (1 * MiB)
+/* Largest read that is handed to a single thread at load time */
+#define MAPPED_RAM_LOAD_CHUNK (1 * MiB)
+
+typedef struct {
+    uint32_t version;
+    uint64_t page_size;
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
+} QEMU_PACKED MappedRamHeader;
+
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
     return buffer_is_zero(p, size);
@@ -310,6 +336,8 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /* Same, for the postcopy preempt channel */
+    RAMBlock *last_sent_block_preempt;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -329,6 +357,11 @@ struct RAMState {
     uint64_t num_dirty_pages_period;
     /* xbzrle misses since the beginning of the period */
     uint64_t xbzrle_cache_miss_prev;
+    /* xbzrle cache hits, total and since the beginning of the period */
+    uint64_t xbzrle_cache_hit;
+    uint64_t xbzrle_cache_hit_prev;
+    /* xbzrle overflows since the beginning of the period */
+    uint64_t xbzrle_overflow_prev;
 
     /* compression statistics since the beginning of the period */
     /* amount of count that no free thread to compress data */
@@ -351,6 +384,8 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /* userfaultfd used to track guest writes in background snapshots */
+    int uffdio_fd;
 };
 typedef struct RAMState RAMState;
 
@@ -457,6 +492,25 @@ static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
 
+/* Threads that read the pages of a mapped-ram migration file in parallel */
+struct MappedRamReadParam {
+    bool done;
+    bool quit;
+    QemuMutex mutex;
+    QemuCond cond;
+    QIOChannel *c;
+    void *host;
+    size_t len;
+    off_t offset;
+};
+typedef struct MappedRamReadParam MappedRamReadParam;
+
+static QEMUFile *mapped_ram_read_file;
+static MappedRamReadParam *mapped_ram_read_param;
+static QemuThread *mapped_ram_read_threads;
+static QemuMutex mapped_ram_read_done_lock;
+static QemuCond mapped_ram_read_done_cond;
+
 static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
                                  ram_addr_t offset, uint8_t *source_buf);
 
@@ -578,127 +632,156 @@ exit:
 
 /* Multiple fd's */
 
-#define MULTIFD_MAGIC 0x11223344U
-#define MULTIFD_VERSION 1
+/* Multifd without compression */
 
-#define MULTIFD_FLAG_SYNC (1 << 0)
+/**
+ * nocomp_send_setup: setup send side
+ *
+ * For no compression this function does nothing.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int nocomp_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    return 0;
+}
 
-/* This value needs to be a multiple of qemu_target_page_size() */
-#define MULTIFD_PACKET_SIZE (512 * 1024)
+/**
+ * nocomp_send_cleanup: cleanup send side
+ *
+ * For no compression this function does nothing.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void nocomp_send_cleanup(MultiFDSendParams *p)
+{
+}
 
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    unsigned char uuid[16]; /* QemuUUID */
-    uint8_t id;
-    uint8_t unused1[7];     /* Reserved for future use */
-    uint64_t unused2[4];    /* Reserved for future use */
-} __attribute__((packed)) MultiFDInit_t;
+/**
+ * nocomp_send_prepare: prepare date to be able to send
+ *
+ * For no compression we just have to calculate the size of the
+ * packet.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    p->next_packet_size = used * qemu_target_page_size();
+    return 0;
+}
 
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t flags;
-    /* maximum number of allocated pages */
-    uint32_t pages_alloc;
-    uint32_t pages_used;
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
-    char ramblock[256];
-    uint64_t offset[];
-} __attribute__((packed)) MultiFDPacket_t;
+/**
+ * nocomp_send_write: do the actual write of the data
+ *
+ * For no compression we just have to write the pages.  With
+ * zero-copy-send, the pages are sent straight from guest memory and
+ * multifd_send_sync_main() waits for the kernel to be done with them.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int nocomp_send_write(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    return qio_channel_writev_full_all(p->c, p->pages->iov, used, NULL, 0,
+                                       p->write_flags, errp);
+}
 
-typedef struct {
-    /* number of used pages */
-    uint32_t used;
-    /* number of allocated pages */
-    uint32_t allocated;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* offset of each page */
-    ram_addr_t *offset;
-    /* pointer to each page */
-    struct iovec *iov;
-    RAMBlock *block;
-} MultiFDPages_t;
+/**
+ * nocomp_recv_setup: setup receive side
+ *
+ * For no compression this function does nothing.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    return 0;
+}
 
-typedef struct {
-    /* this fields are not changed once the thread is created */
-    /* channel number */
-    uint8_t id;
-    /* channel thread name */
-    char *name;
-    /* channel thread id */
-    QemuThread thread;
-    /* communication channel */
-    QIOChannel *c;
-    /* sem where to wait for more work */
-    QemuSemaphore sem;
-    /* this mutex protects the following parameters */
-    QemuMutex mutex;
-    /* is this channel thread running */
-    bool running;
-    /* should this thread finish */
-    bool quit;
-    /* thread has work to do */
-    int pending_job;
-    /* array of pages to sent */
-    MultiFDPages_t *pages;
-    /* packet allocated len */
-    uint32_t packet_len;
-    /* pointer to the packet */
-    MultiFDPacket_t *packet;
-    /* multifd flags for each packet */
-    uint32_t flags;
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* thread local variables */
-    /* packets sent through this channel */
-    uint64_t num_packets;
-    /* pages sent through this channel */
-    uint64_t num_pages;
-}  MultiFDSendParams;
+/**
+ * nocomp_recv_cleanup: cleanup receive side
+ *
+ * For no compression this function does nothing.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void nocomp_recv_cleanup(MultiFDRecvParams *p)
+{
+}
 
-typedef struct {
-    /* this fields are not changed once the thread is created */
-    /* channel number */
-    uint8_t id;
-    /* channel thread name */
-    char *name;
-    /* channel thread id */
-    QemuThread thread;
-    /* communication channel */
-    QIOChannel *c;
-    /* this mutex protects the following parameters */
-    QemuMutex mutex;
-    /* is this channel thread running */
-    bool running;
-    /* should this thread finish */
-    bool quit;
-    /* array of pages to receive */
-    MultiFDPages_t *pages;
-    /* packet allocated len */
-    uint32_t packet_len;
-    /* pointer to the packet */
-    MultiFDPacket_t *packet;
-    /* multifd flags for each packet */
-    uint32_t flags;
-    /* global number of generated multifd packets */
-    uint64_t packet_num;
-    /* thread local variables */
-    /* size of the next packet that contains pages */
-    uint32_t next_packet_size;
-    /* packets sent through this channel */
-    uint64_t num_packets;
-    /* pages sent through this channel */
-    uint64_t num_pages;
-    /* syncs main thread and channels */
-    QemuSemaphore sem_sync;
-} MultiFDRecvParams;
+/**
+ * nocomp_recv_pages: read the data from the channel into actual pages
+ *
+ * For no compression we just need to read things into the correct
+ * place.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int nocomp_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                             Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+
+    if (flags != MULTIFD_FLAG_NOCOMP) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_NOCOMP);
+        return -1;
+    }
+    return qio_channel_readv_all(p->c, p->pages->iov, used, errp);
+}
+
+static MultiFDMethods multifd_nocomp_ops = {
+    .send_setup = nocomp_send_setup,
+    .send_cleanup = nocomp_send_cleanup,
+    .send_prepare = nocomp_send_prepare,
+    .send_write = nocomp_send_write,
+    .recv_setup = nocomp_recv_setup,
+    .recv_cleanup = nocomp_recv_cleanup,
+    .recv_pages = nocomp_recv_pages
+};
+
+static MultiFDMethods *multifd_ops[MULTIFD_COMPRESSION__MAX] = {
+    [MULTIFD_COMPRESSION_NONE] = &multifd_nocomp_ops,
+    [MULTIFD_COMPRESSION_ZLIB] = &multifd_zlib_ops,
+#ifdef CONFIG_ZSTD
+    [MULTIFD_COMPRESSION_ZSTD] = &multifd_zstd_ops,
+#endif
+};
+
+/* Packet flag that tells the destination how the pages were compressed */
+static uint32_t multifd_compression_flag(MultiFDCompression method)
+{
+    switch (method) {
+    case MULTIFD_COMPRESSION_ZLIB:
+        return MULTIFD_FLAG_ZLIB;
+#ifdef CONFIG_ZSTD
+    case MULTIFD_COMPRESSION_ZSTD:
+        return MULTIFD_FLAG_ZSTD;
+#endif
+    default:
+        return MULTIFD_FLAG_NOCOMP;
+    }
+}
 
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
 {
@@ -786,7 +869,8 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     g_free(pages);
 }
 
-static void multifd_send_fill_packet(MultiFDSendParams *p)
+static void multifd_send_fill_packet(MultiFDSendParams *p, uint32_t used,
+                                     uint32_t flags, uint64_t packet_num)
 {
     MultiFDPacket_t *packet = p->packet;
     uint32_t page_max = MULTIFD_PACKET_SIZE / qemu_target_page_size();
@@ -794,17 +878,17 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
     packet->magic = cpu_to_be32(MULTIFD_MAGIC);
     packet->version = cpu_to_be32(MULTIFD_VERSION);
-    packet->flags = cpu_to_be32(p->flags);
+    packet->flags = cpu_to_be32(flags);
     packet->pages_alloc = cpu_to_be32(page_max);
-    packet->pages_used = cpu_to_be32(p->pages->used);
+    packet->pages_used = cpu_to_be32(used);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
-    packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->packet_num = cpu_to_be64(packet_num);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < used; i++) {
         packet->offset[i] = cpu_to_be64(p->pages->offset[i]);
     }
 }
@@ -902,6 +986,8 @@ struct {
     uint64_t packet_num;
     /* send channels ready */
     QemuSemaphore channels_ready;
+    /* multifd ops */
+    MultiFDMethods *ops;
 } *multifd_send_state;
 
 /*
@@ -953,7 +1039,10 @@ static int multifd_send_pages(void)
     p->pages->block = NULL;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE + p->packet_len;
+    transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE;
+    if (!migrate_mapped_ram()) {
+        transferred += p->packet_len;
+    }
     ram_counters.multifd_bytes += transferred;
     ram_counters.transferred += transferred;;
     qemu_mutex_unlock(&p->mutex);
@@ -1032,8 +1121,13 @@ void multifd_save_cleanup(void)
         if (p->running) {
             qemu_thread_join(&p->thread);
         }
-        socket_send_channel_destroy(p->c);
+        if (migrate_mapped_ram()) {
+            object_unref(OBJECT(p->c));
+        } else {
+            socket_send_channel_destroy(p->c);
+        }
         p->c = NULL;
+        multifd_send_state->ops->send_cleanup(p);
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
         g_free(p->name);
@@ -1092,9 +1186,64 @@ static void multifd_send_sync_main(void)
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&multifd_send_state->sem_sync);
     }
+    if (migrate_use_zero_copy_send()) {
+        /*
+         * All channels are idle now; make sure that the kernel has sent
+         * the pages that were queued with MSG_ZEROCOPY before the dirty
+         * bitmap is synced again.
+         */
+        for (i = 0; i < migrate_multifd_channels(); i++) {
+            MultiFDSendParams *p = &multifd_send_state->params[i];
+            Error *err = NULL;
+            int ret;
+
+            ret = qio_channel_flush(p->c, &err);
+            if (ret < 0) {
+                multifd_send_terminate_threads(err);
+                error_report_err(err);
+                return;
+            }
+            if (ret == 1) {
+                ram_counters.dirty_sync_missed_zero_copy++;
+            }
+        }
+    }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/*
+ * Write the first @used pages of @pages to their offset in the
+ * migration file, merging runs of consecutive pages into one request.
+ */
+static int multifd_file_write_pages(QIOChannel *ioc, MultiFDPages_t *pages,
+                                    uint32_t used, Error **errp)
+{
+    RAMBlock *block = pages->block;
+    uint32_t start = 0;
+    uint32_t i, j;
+
+    for (i = 1; i <= used; i++) {
+        if (i < used &&
+            pages->offset[i] == pages->offset[i - 1] + TARGET_PAGE_SIZE) {
+            continue;
+        }
+
+        if (qio_channel_pwritev_all(ioc, &pages->iov[start], i - start,
+                                    block->pages_offset +
+                                    pages->offset[start], errp) < 0) {
+            return -1;
+        }
+
+        for (j = start; j < i; j++) {
+            set_bit_atomic(pages->offset[j] >> TARGET_PAGE_BITS,
+                           block->file_bmap);
+        }
+        start = i;
+    }
+
+    return 0;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -1105,11 +1254,14 @@ static void *multifd_send_thread(void *opaque)
     trace_multifd_send_thread_start(p->id);
     rcu_register_thread();
 
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
-        goto out;
+    /* With mapped-ram the pages go straight to their place in the file */
+    if (!migrate_mapped_ram()) {
+        if (multifd_send_initial_packet(p, &local_err) < 0) {
+            goto out;
+        }
+        /* initial packet */
+        p->num_packets = 1;
     }
-    /* initial packet */
-    p->num_packets = 1;
 
     while (true) {
         qemu_sem_wait(&p->sem);
@@ -1120,14 +1272,41 @@ static void *multifd_send_thread(void *opaque)
             uint64_t packet_num = p->packet_num;
             flags = p->flags;
 
-            p->next_packet_size = used * qemu_target_page_size();
-            multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
             p->pages->used = 0;
             qemu_mutex_unlock(&p->mutex);
 
+            if (migrate_mapped_ram()) {
+                trace_multifd_send(p->id, packet_num, used, flags, 0);
+                if (used) {
+                    ret = multifd_file_write_pages(p->c, p->pages, used,
+                                                   &local_err);
+                    if (ret != 0) {
+                        break;
+                    }
+                }
+                goto job_done;
+            }
+
+            /*
+             * The pages belong to this channel until pending_job is
+             * decremented, so they can be compressed without holding
+             * the mutex.
+             */
+            if (used) {
+                ret = multifd_send_state->ops->send_prepare(p, used,
+                                                            &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            } else {
+                p->next_packet_size = 0;
+            }
+            flags |= multifd_compression_flag(migrate_multifd_compression());
+            multifd_send_fill_packet(p, used, flags, packet_num);
+
             trace_multifd_send(p->id, packet_num, used, flags,
                                p->next_packet_size);
 
@@ -1138,13 +1317,14 @@ static void *multifd_send_thread(void *opaque)
             }
 
             if (used) {
-                ret = qio_channel_writev_all(p->c, p->pages->iov,
-                                             used, &local_err);
+                ret = multifd_send_state->ops->send_write(p, used,
+                                                          &local_err);
                 if (ret != 0) {
                     break;
                 }
             }
 
+job_done:
             qemu_mutex_lock(&p->mutex);
             p->pending_job--;
             qemu_mutex_unlock(&p->mutex);
@@ -1188,21 +1368,36 @@ out:
     return NULL;
 }
 
+static void multifd_send_channel_start(MultiFDSendParams *p, QIOChannel *ioc)
+{
+    p->c = ioc;
+    p->write_flags = migrate_use_zero_copy_send() ?
+                     QIO_CHANNEL_WRITE_FLAG_ZERO_COPY : 0;
+    qio_channel_set_delay(p->c, false);
+    p->running = true;
+    qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
+                       QEMU_THREAD_JOINABLE);
+}
+
 static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
 {
     MultiFDSendParams *p = opaque;
     QIOChannel *sioc = QIO_CHANNEL(qio_task_get_source(task));
     Error *local_err = NULL;
 
-    if (qio_task_propagate_error(task, &local_err)) {
+    if (!qio_task_propagate_error(task, &local_err) &&
+        migrate_use_zero_copy_send() &&
+        !qio_channel_has_feature(sioc, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        error_setg(&local_err, "multifd: zero copy send is not supported "
+                   "by this host");
+        object_unref(OBJECT(sioc));
+    }
+
+    if (local_err) {
         migrate_set_error(migrate_get_current(), local_err);
         multifd_save_cleanup();
     } else {
-        p->c = QIO_CHANNEL(sioc);
-        qio_channel_set_delay(p->c, false);
-        p->running = true;
-        qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
-                           QEMU_THREAD_JOINABLE);
+        multifd_send_channel_start(p, sioc);
     }
 }
 
@@ -1221,6 +1416,7 @@ int multifd_save_setup(void)
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->sem_sync, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1235,7 +1431,35 @@ int multifd_save_setup(void)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdsend_%d", i);
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        Error *local_err = NULL;
+        int ret;
+
+        ret = multifd_send_state->ops->send_setup(p, &local_err);
+        if (ret) {
+            error_report_err(local_err);
+            return ret;
+        }
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (migrate_mapped_ram()) {
+            Error *local_err = NULL;
+            QIOChannel *ioc = file_send_channel_create(&local_err);
+
+            if (!ioc) {
+                error_report_err(local_err);
+                return -1;
+            }
+            multifd_send_channel_start(p, ioc);
+        } else {
+            socket_send_channel_create(multifd_new_send_channel_async, p);
+        }
     }
     return 0;
 }
@@ -1248,8 +1472,20 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* multifd ops */
+    MultiFDMethods *ops;
 } *multifd_recv_state;
 
+/*
+ * The destination of a mapped-ram migration reads the pages from the
+ * file itself, so the multifd channels of the source have no
+ * counterpart there.
+ */
+static bool multifd_recv_use_channels(void)
+{
+    return migrate_use_multifd() && !migrate_mapped_ram();
+}
+
 static void multifd_recv_terminate_threads(Error *err)
 {
     int i;
@@ -1283,7 +1519,7 @@ int multifd_load_cleanup(Error **errp)
     int i;
     int ret = 0;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return 0;
     }
     multifd_recv_terminate_threads(NULL);
@@ -1301,6 +1537,7 @@ int multifd_load_cleanup(Error **errp)
         }
         object_unref(OBJECT(p->c));
         p->c = NULL;
+        multifd_recv_state->ops->recv_cleanup(p);
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem_sync);
         g_free(p->name);
@@ -1324,7 +1561,7 @@ static void multifd_recv_sync_main(void)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return;
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -1389,8 +1626,7 @@ static void *multifd_recv_thread(void *opaque)
         qemu_mutex_unlock(&p->mutex);
 
         if (used) {
-            ret = qio_channel_readv_all(p->c, p->pages->iov,
-                                        used, &local_err);
+            ret = multifd_recv_state->ops->recv_pages(p, used, &local_err);
             if (ret != 0) {
                 break;
             }
@@ -1421,7 +1657,7 @@ int multifd_load_setup(void)
     uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
     uint8_t i;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return 0;
     }
     thread_count = migrate_multifd_channels();
@@ -1429,6 +1665,7 @@ int multifd_load_setup(void)
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     atomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
@@ -1443,6 +1680,18 @@ int multifd_load_setup(void)
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdrecv_%d", i);
     }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+        Error *local_err = NULL;
+        int ret;
+
+        ret = multifd_recv_state->ops->recv_setup(p, &local_err);
+        if (ret) {
+            error_report_err(local_err);
+            return ret;
+        }
+    }
     return 0;
 }
 
@@ -1450,7 +1699,7 @@ bool multifd_recv_all_channels_created(void)
 {
     int thread_count = migrate_multifd_channels();
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return true;
     }
 
@@ -1579,8 +1828,10 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
+                     ram_counters.dirty_sync_count) == 1) {
+        xbzrle_counters.cache_evictions++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -1608,20 +1859,26 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
 
     if (!cache_is_cached(XBZRLE.cache, current_addr,
                          ram_counters.dirty_sync_count)) {
+        int ret;
+
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             ram_counters.dirty_sync_count) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               ram_counters.dirty_sync_count);
+            if (ret == -1) {
                 return -1;
-            } else {
-                /* update *current_data when the page has been
-                   inserted into cache */
-                *current_data = get_cached_data(XBZRLE.cache, current_addr);
             }
+            if (ret == 1) {
+                xbzrle_counters.cache_evictions++;
+            }
+            /* update *current_data when the page has been
+               inserted into cache */
+            *current_data = get_cached_data(XBZRLE.cache, current_addr);
         }
         return -1;
     }
 
+    rs->xbzrle_cache_hit++;
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
     /* save current buffer into memory */
@@ -1634,16 +1891,22 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
 
     /*
      * Update the cache contents, so that it corresponds to the data
-     * sent, in all cases except where we skip the page.
+     * sent, in all cases except where we skip the page.  Instead of
+     * copying the page again, current_buf becomes the cached page and
+     * the old cached page is reused as current_buf.
      */
     if (!last_stage && encoded_len != 0) {
-        memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+        uint8_t *new_cached_page = XBZRLE.current_buf;
+
+        XBZRLE.current_buf = cache_swap_data(XBZRLE.cache, current_addr,
+                                             new_cached_page,
+                                             ram_counters.dirty_sync_count);
         /*
          * In the case where we couldn't compress, ensure that the caller
          * sends the data from the cache, since the guest might have
          * changed the RAM since we copied it.
          */
-        *current_data = prev_cached_page;
+        *current_data = new_cached_page;
     }
 
     if (encoded_len == 0) {
@@ -1797,9 +2060,22 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
     }
 
     if (migrate_use_xbzrle()) {
-        xbzrle_counters.cache_miss_rate = (double)(xbzrle_counters.cache_miss -
-            rs->xbzrle_cache_miss_prev) / page_count;
+        uint64_t misses = xbzrle_counters.cache_miss -
+                          rs->xbzrle_cache_miss_prev;
+        uint64_t hits = rs->xbzrle_cache_hit - rs->xbzrle_cache_hit_prev;
+        uint64_t overflows = xbzrle_counters.overflow -
+                             rs->xbzrle_overflow_prev;
+
+        xbzrle_counters.cache_miss_rate = (double)misses / page_count;
+        if (hits + misses) {
+            xbzrle_counters.cache_hit_rate = (double)hits / (hits + misses);
+        }
+        if (hits) {
+            xbzrle_counters.overflow_rate = (double)overflows / hits;
+        }
         rs->xbzrle_cache_miss_prev = xbzrle_counters.cache_miss;
+        rs->xbzrle_cache_hit_prev = rs->xbzrle_cache_hit;
+        rs->xbzrle_overflow_prev = xbzrle_counters.overflow;
     }
 
     if (migrate_use_compression()) {
@@ -1943,7 +2219,22 @@ static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
  */
 static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
 {
-    int len = save_zero_page_to_file(rs, rs->f, block, offset);
+    int len;
+
+    if (migrate_mapped_ram()) {
+        /*
+         * Nothing is written; the page is just left out of the bitmap,
+         * in case an earlier version of it is in the file.
+         */
+        if (!is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+            return -1;
+        }
+        clear_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    len = save_zero_page_to_file(rs, rs->f, block, offset);
 
     if (len) {
         ram_counters.duplicate++;
@@ -2014,6 +2305,15 @@ static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
 static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
                             uint8_t *buf, bool async)
 {
+    if (migrate_mapped_ram()) {
+        qemu_put_buffer_at(rs->f, buf, TARGET_PAGE_SIZE,
+                           block->pages_offset + offset);
+        set_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        ram_counters.transferred += TARGET_PAGE_SIZE;
+        ram_counters.normal++;
+        return 1;
+    }
+
     ram_counters.transferred += save_page_header(rs, rs->f, block,
                                                  offset | RAM_SAVE_FLAG_PAGE);
     if (async) {
@@ -2066,6 +2366,14 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
         }
     }
 
+    if (migrate_background_snapshot()) {
+        /*
+         * The page is write-unprotected as soon as it has been saved, so
+         * its contents must be copied before the guest can change them.
+         */
+        send_async = false;
+    }
+
     /* XBZRLE overflow or normal page */
     if (pages == -1) {
         pages = save_normal_page(rs, block, offset, p, send_async);
@@ -2209,63 +2517,387 @@ retry:
     }
     qemu_mutex_unlock(&comp_done_lock);
 
-    return pages;
+    return pages;
+}
+
+/**
+ * find_dirty_block: find the next dirty page and update any state
+ * associated with the search process.
+ *
+ * Returns true if a page is found
+ *
+ * @rs: current RAM state
+ * @pss: data about the state of the current dirty page scan
+ * @again: set to false if the search has scanned the whole of RAM
+ */
+static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
+{
+    pss->page = migration_bitmap_find_dirty(rs, pss->block, pss->page);
+    if (pss->complete_round && pss->block == rs->last_seen_block &&
+        pss->page >= rs->last_page) {
+        /*
+         * We've been once around the RAM and haven't found anything.
+         * Give up.
+         */
+        *again = false;
+        return false;
+    }
+    if ((pss->page << TARGET_PAGE_BITS) >= pss->block->used_length) {
+        /* Didn't find anything in this RAM Block */
+        pss->page = 0;
+        pss->block = QLIST_NEXT_RCU(pss->block, next);
+        if (!pss->block) {
+            /*
+             * If memory migration starts over, we will meet a dirtied page
+             * which may still exists in compression threads's ring, so we
+             * should flush the compressed data to make sure the new page
+             * is not overwritten by the old one in the destination.
+             *
+             * Also If xbzrle is on, stop using the data compression at this
+             * point. In theory, xbzrle can do better than compression.
+             */
+            flush_compressed_data(rs);
+
+            /* Hit the end of the list */
+            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
+            /* Flag that we've looped */
+            pss->complete_round = true;
+            rs->ram_bulk_stage = false;
+        }
+        /* Didn't find anything this time, but try again on the new block */
+        *again = true;
+        return false;
+    } else {
+        /* Can go around again, but... */
+        *again = true;
+        /* We've found something so probably don't need to */
+        return true;
+    }
+}
+
+#ifdef CONFIG_LINUX
+/**
+ * poll_fault_page: try to get next UFFD write fault page and, if pending
+ *   fault is found, return RAM block pointer and page offset
+ *
+ * Returns pointer to the RAMBlock containing faulting page,
+ *   NULL if no write faults are pending
+ *
+ * @rs: current RAM state
+ * @offset: page offset from the beginning of the block
+ */
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    struct uffd_msg uffd_msg;
+    void *page_address;
+    RAMBlock *block;
+    int res;
+
+    if (rs->uffdio_fd < 0) {
+        return NULL;
+    }
+
+    res = uffd_read_events(rs->uffdio_fd, &uffd_msg, 1);
+    if (res <= 0) {
+        return NULL;
+    }
+
+    page_address = (void *)(uintptr_t) uffd_msg.arg.pagefault.address;
+    block = qemu_ram_block_from_host(page_address, false, offset);
+    assert(block && (block->flags & RAM_UF_WRITEPROTECT) != 0);
+    /* Save the whole host page, see ram_save_host_page() */
+    *offset = QEMU_ALIGN_DOWN(*offset, qemu_ram_pagesize(block));
+    trace_ram_write_tracking_fault(block->idstr, (uint64_t)*offset);
+    return block;
+}
+
+/**
+ * ram_save_release_protection: release UFFD write protection after
+ *   a range of pages has been saved
+ *
+ * Returns 0 on success, negative value in case of an error
+ *
+ * @rs: current RAM state
+ * @pss: page-search-status structure
+ * @start_page: index of the first page in the range relative to pss->block
+ */
+static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
+                                       unsigned long start_page)
+{
+    void *page_address;
+    uint64_t run_length;
+
+    if (rs->uffdio_fd < 0 || !(pss->block->flags & RAM_UF_WRITEPROTECT)) {
+        return 0;
+    }
+
+    /* Un-protect the pages and wake up the vCPUs that wait for them */
+    page_address = pss->block->host + (start_page << TARGET_PAGE_BITS);
+    run_length = (pss->page - start_page + 1) << TARGET_PAGE_BITS;
+
+    return uffd_change_protection(rs->uffdio_fd, page_address, run_length,
+                                  false, false);
+}
+
+/**
+ * ram_write_tracking_available: check if kernel supports required UFFD
+ *   features
+ *
+ * Returns true if supports, false otherwise
+ */
+bool ram_write_tracking_available(void)
+{
+    uint64_t uffd_features;
+    int res;
+
+    res = uffd_query_features(&uffd_features);
+    return (res == 0 &&
+            (uffd_features & UFFD_FEATURE_PAGEFAULT_FLAG_WP) != 0);
+}
+
+/**
+ * ram_write_tracking_compatible: check if guest configuration is
+ *   compatible with 'write-tracking'
+ *
+ * Returns true if compatible, false otherwise
+ */
+bool ram_write_tracking_compatible(void)
+{
+    const uint64_t uffd_ioctls_mask = BIT(_UFFDIO_WRITEPROTECT);
+    int uffd_fd;
+    RAMBlock *block;
+    bool ret = false;
+
+    /* Open UFFD file descriptor */
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, false);
+    if (uffd_fd < 0) {
+        return false;
+    }
+
+    rcu_read_lock();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        uint64_t uffd_ioctls;
+
+        /* Nothing to do with read-only and MMIO-writable regions */
+        if (block->mr->readonly || block->mr->rom_device) {
+            continue;
+        }
+        /* Try to register block memory via UFFD-IO to track writes */
+        if (uffd_register_memory(uffd_fd, block->host, block->max_length,
+                                 UFFDIO_REGISTER_MODE_WP, &uffd_ioctls)) {
+            goto out;
+        }
+        if ((uffd_ioctls & uffd_ioctls_mask) != uffd_ioctls_mask) {
+            goto out;
+        }
+    }
+    ret = true;
+
+out:
+    rcu_read_unlock();
+    uffd_close_fd(uffd_fd);
+    return ret;
+}
+
+/**
+ * ram_write_tracking_prepare: populate the guest RAM before it is write
+ *   protected
+ *
+ * Write protection only applies to pages that are mapped, so every page
+ * is read once; pages that are not populated yet get the shared zero
+ * page, which does not use any memory.
+ */
+void ram_write_tracking_prepare(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t offset;
+
+        /* Nothing to do with read-only and MMIO-writable regions */
+        if (block->mr->readonly || block->mr->rom_device) {
+            continue;
+        }
+
+        for (offset = 0; offset < block->used_length;
+             offset += qemu_real_host_page_size) {
+            char tmp = *((volatile char *)block->host + offset);
+
+            (void)tmp;
+        }
+    }
+
+    rcu_read_unlock();
+}
+
+/**
+ * ram_write_tracking_start: start UFFD-WP memory tracking
+ *
+ * Returns 0 for success or negative value in case of error
+ */
+int ram_write_tracking_start(void)
+{
+    int uffd_fd;
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    /* Open UFFD file descriptor */
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, true);
+    if (uffd_fd < 0) {
+        return uffd_fd;
+    }
+    rs->uffdio_fd = uffd_fd;
+
+    rcu_read_lock();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        /* Nothing to do with read-only and MMIO-writable regions */
+        if (block->mr->readonly || block->mr->rom_device) {
+            continue;
+        }
+
+        /* Register block memory with UFFD to track writes */
+        if (uffd_register_memory(rs->uffdio_fd, block->host,
+                                 block->max_length, UFFDIO_REGISTER_MODE_WP,
+                                 NULL)) {
+            goto fail;
+        }
+        /* Apply UFFD write protection to the block memory range */
+        if (uffd_change_protection(rs->uffdio_fd, block->host,
+                                   block->max_length, true, false)) {
+            goto fail;
+        }
+        block->flags |= RAM_UF_WRITEPROTECT;
+        memory_region_ref(block->mr);
+
+        trace_ram_write_tracking_ramblock_start(block->idstr,
+                                                block->page_size,
+                                                block->host,
+                                                block->max_length);
+    }
+
+    rcu_read_unlock();
+    return 0;
+
+fail:
+    error_report("ram_write_tracking_start() failed: restoring initial "
+                 "memory state");
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if ((block->flags & RAM_UF_WRITEPROTECT) == 0) {
+            continue;
+        }
+        /*
+         * In case some memory block failed to be write-protected
+         * remove protection and unregister all succeeded RAM blocks
+         */
+        uffd_change_protection(rs->uffdio_fd, block->host,
+                               block->max_length, false, false);
+        uffd_unregister_memory(rs->uffdio_fd, block->host,
+                               block->max_length);
+        /* Cleanup flags and remove reference */
+        block->flags &= ~RAM_UF_WRITEPROTECT;
+        memory_region_unref(block->mr);
+    }
+
+    rcu_read_unlock();
+    uffd_close_fd(uffd_fd);
+    rs->uffdio_fd = -1;
+    return -1;
+}
+
+/**
+ * ram_write_tracking_stop: stop UFFD-WP memory tracking and remove
+ *   protection
+ *
+ * Threads that wait for a write fault to be resolved are woken up.
+ */
+void ram_write_tracking_stop(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs || rs->uffdio_fd < 0) {
+        return;
+    }
+
+    rcu_read_lock();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if ((block->flags & RAM_UF_WRITEPROTECT) == 0) {
+            continue;
+        }
+        /* Remove protection and unregister all affected RAM blocks */
+        uffd_change_protection(rs->uffdio_fd, block->host, block->max_length,
+                               false, false);
+        uffd_unregister_memory(rs->uffdio_fd, block->host, block->max_length);
+
+        trace_ram_write_tracking_ramblock_stop(block->idstr, block->page_size,
+                                               block->host,
+                                               block->max_length);
+
+        /* Cleanup flags and remove reference */
+        block->flags &= ~RAM_UF_WRITEPROTECT;
+        memory_region_unref(block->mr);
+    }
+
+    rcu_read_unlock();
+
+    /* Finally close UFFD file descriptor */
+    uffd_close_fd(rs->uffdio_fd);
+    rs->uffdio_fd = -1;
+}
+
+#else
+/* No target OS support, stubs just fail or ignore */
+
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    (void) rs;
+    (void) offset;
+
+    return NULL;
+}
+
+static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
+                                       unsigned long start_page)
+{
+    (void) rs;
+    (void) pss;
+    (void) start_page;
+
+    return 0;
+}
+
+bool ram_write_tracking_available(void)
+{
+    return false;
+}
+
+bool ram_write_tracking_compatible(void)
+{
+    assert(0);
+    return false;
+}
+
+void ram_write_tracking_prepare(void)
+{
+    assert(0);
 }
 
-/**
- * find_dirty_block: find the next dirty page and update any state
- * associated with the search process.
- *
- * Returns true if a page is found
- *
- * @rs: current RAM state
- * @pss: data about the state of the current dirty page scan
- * @again: set to false if the search has scanned the whole of RAM
- */
-static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
+int ram_write_tracking_start(void)
 {
-    pss->page = migration_bitmap_find_dirty(rs, pss->block, pss->page);
-    if (pss->complete_round && pss->block == rs->last_seen_block &&
-        pss->page >= rs->last_page) {
-        /*
-         * We've been once around the RAM and haven't found anything.
-         * Give up.
-         */
-        *again = false;
-        return false;
-    }
-    if ((pss->page << TARGET_PAGE_BITS) >= pss->block->used_length) {
-        /* Didn't find anything in this RAM Block */
-        pss->page = 0;
-        pss->block = QLIST_NEXT_RCU(pss->block, next);
-        if (!pss->block) {
-            /*
-             * If memory migration starts over, we will meet a dirtied page
-             * which may still exists in compression threads's ring, so we
-             * should flush the compressed data to make sure the new page
-             * is not overwritten by the old one in the destination.
-             *
-             * Also If xbzrle is on, stop using the data compression at this
-             * point. In theory, xbzrle can do better than compression.
-             */
-            flush_compressed_data(rs);
+    assert(0);
+    return -1;
+}
 
-            /* Hit the end of the list */
-            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
-            /* Flag that we've looped */
-            pss->complete_round = true;
-            rs->ram_bulk_stage = false;
-        }
-        /* Didn't find anything this time, but try again on the new block */
-        *again = true;
-        return false;
-    } else {
-        /* Can go around again, but... */
-        *again = true;
-        /* We've found something so probably don't need to */
-        return true;
-    }
+void ram_write_tracking_stop(void)
+{
 }
+#endif /* CONFIG_LINUX */
 
 /**
  * unqueue_page: gets a page of the queue
@@ -2346,6 +2978,11 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     } while (block && !dirty);
 
+    if (!block) {
+        /* Pages that the guest tried to write come next in a snapshot */
+        block = poll_fault_page(rs, &offset);
+    }
+
     if (block) {
         /*
          * As soon as we start servicing pages out of order, then we have
@@ -2590,6 +3227,8 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     int tmppages, pages = 0;
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long start_page = pss->page;
+    int res;
 
     if (ramblock_is_ignored(pss->block)) {
         error_report("block %s should not be migrated !", pss->block->idstr);
@@ -2619,6 +3258,58 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
 
     /* The offset we leave with is the last one we looked at */
     pss->page--;
+
+    res = ram_save_release_protection(rs, pss, start_page);
+    return (res < 0 ? res : pages);
+}
+
+/**
+ * ram_save_urgent_host_page: save a host page that the destination asked for
+ *
+ * With postcopy-preempt, the page is sent on the dedicated channel, so
+ * that it does not wait behind the background pages that are already
+ * queued on the main migration stream.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_urgent_host_page(RAMState *rs, PageSearchStatus *pss,
+                                     bool last_stage)
+{
+    QEMUFile *preempt_file = migrate_get_current()->postcopy_qemufile_src;
+    QEMUFile *main_file = rs->f;
+    RAMBlock *main_last_sent_block = rs->last_sent_block;
+    ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
+    int pages, ret;
+
+    if (!migrate_postcopy_preempt() || !migration_in_postcopy()) {
+        return ram_save_host_page(rs, pss, last_stage);
+    }
+
+    /*
+     * Nothing that is used in postcopy (compression, xbzrle, multifd,
+     * RDMA) keeps per-stream state other than the last sent block.
+     */
+    rs->f = preempt_file;
+    rs->last_sent_block = rs->last_sent_block_preempt;
+
+    pages = ram_save_host_page(rs, pss, last_stage);
+    qemu_fflush(preempt_file);
+
+    rs->last_sent_block_preempt = rs->last_sent_block;
+    rs->last_sent_block = main_last_sent_block;
+    rs->f = main_file;
+
+    trace_ram_save_urgent_host_page(pss->block->idstr, (uint64_t)offset,
+                                    pages);
+
+    ret = qemu_file_get_error(preempt_file);
+    if (pages >= 0 && ret) {
+        return ret;
+    }
     return pages;
 }
 
@@ -2641,7 +3332,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 {
     PageSearchStatus pss;
     int pages = 0;
-    bool again, found;
+    bool again, found, urgent;
 
     /* No dirty page as there is zero RAM */
     if (!ram_bytes_total()) {
@@ -2658,14 +3349,16 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 
     do {
         again = true;
-        found = get_queued_page(rs, &pss);
+        found = urgent = get_queued_page(rs, &pss);
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
             found = find_dirty_block(rs, &pss, &again);
         }
 
-        if (found) {
+        if (urgent) {
+            pages = ram_save_urgent_host_page(rs, &pss, last_stage);
+        } else if (found) {
             pages = ram_save_host_page(rs, &pss, last_stage);
         }
     } while (!pages && again);
@@ -2756,10 +3449,15 @@ static void ram_save_cleanup(void *opaque)
     RAMState **rsp = opaque;
     RAMBlock *block;
 
-    /* caller have hold iothread lock or is in a bh, so there is
-     * no writing race against the migration bitmap
-     */
-    memory_global_dirty_log_stop();
+    if (migrate_background_snapshot()) {
+        /* Normally stopped by the migration thread already */
+        ram_write_tracking_stop();
+    } else {
+        /* caller have hold iothread lock or is in a bh, so there is
+         * no writing race against the migration bitmap
+         */
+        memory_global_dirty_log_stop();
+    }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->clear_bmap);
@@ -2768,6 +3466,8 @@ static void ram_save_cleanup(void *opaque)
         block->bmap = NULL;
         g_free(block->unsentmap);
         block->unsentmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
@@ -3259,6 +3959,7 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    (*rsp)->uffdio_fd = -1;
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -3322,8 +4023,14 @@ static void ram_init_bitmaps(RAMState *rs)
     rcu_read_lock();
 
     ram_list_init_bitmaps();
-    memory_global_dirty_log_start();
-    migration_bitmap_sync_precopy(rs);
+    /*
+     * A background snapshot saves every page once and tracks guest
+     * writes with userfaultfd, so it does not need dirty logging.
+     */
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync_precopy(rs);
+    }
 
     rcu_read_unlock();
     qemu_mutex_unlock_ramlist();
@@ -3443,6 +4150,47 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
  * @f: QEMUFile where to send the data
  * @opaque: RAMState pointer
  */
+/*
+ * Write the mapped-ram header of @block and reserve room for its bitmap
+ * and pages in the migration file.  The stream continues after them.
+ */
+static void mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
+{
+    MappedRamHeader header = {};
+    size_t num_pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+
+    g_free(block->file_bmap);
+    block->file_bmap = bitmap_new(num_pages);
+
+    block->bitmap_offset = qemu_get_offset(file) + sizeof(header);
+    block->pages_offset = ROUND_UP(block->bitmap_offset + bitmap_size,
+                                   MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+
+    header.version = cpu_to_be32(MAPPED_RAM_HDR_VERSION);
+    header.page_size = cpu_to_be64(TARGET_PAGE_SIZE);
+    header.bitmap_offset = cpu_to_be64(block->bitmap_offset);
+    header.pages_offset = cpu_to_be64(block->pages_offset);
+    qemu_put_buffer(file, (uint8_t *)&header, sizeof(header));
+
+    trace_ram_mapped_ram_setup(block->idstr, block->bitmap_offset,
+                               block->pages_offset);
+
+    qemu_set_offset(file, block->pages_offset + block->used_length, SEEK_SET);
+}
+
+static void mapped_ram_write_bitmap(QEMUFile *file, RAMBlock *block)
+{
+    size_t num_pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+    unsigned long *le_bitmap = bitmap_new(num_pages);
+
+    bitmap_to_le(le_bitmap, block->file_bmap, num_pages);
+    qemu_put_buffer_at(file, (uint8_t *)le_bitmap, bitmap_size,
+                       block->bitmap_offset);
+    g_free(le_bitmap);
+}
+
 static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMState **rsp = opaque;
@@ -3475,6 +4223,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         if (migrate_ignore_shared()) {
             qemu_put_be64(f, block->mr->addr);
         }
+        if (migrate_mapped_ram()) {
+            mapped_ram_setup_ramblock(f, block);
+        }
     }
 
     rcu_read_unlock();
@@ -3601,7 +4352,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     rcu_read_lock();
 
-    if (!migration_in_postcopy()) {
+    if (!migration_in_postcopy() && !migrate_background_snapshot()) {
         migration_bitmap_sync_precopy(rs);
     }
 
@@ -3630,9 +4381,32 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     rcu_read_unlock();
 
     multifd_send_sync_main();
+
+    if (migrate_mapped_ram()) {
+        RAMBlock *block;
+
+        /* All pages are in the file now, say which ones are valid */
+        rcu_read_lock();
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            mapped_ram_write_bitmap(f, block);
+        }
+        rcu_read_unlock();
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
+    if (migrate_postcopy_preempt() && migration_in_postcopy()) {
+        /* Let the destination's preempt thread finish */
+        QEMUFile *preempt_file = migrate_get_current()->postcopy_qemufile_src;
+
+        qemu_put_be64(preempt_file, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(preempt_file);
+        if (!ret) {
+            ret = qemu_file_get_error(preempt_file);
+        }
+    }
+
     return ret;
 }
 
@@ -3708,10 +4482,13 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: RAM_CHANNEL_* that @f is; each channel has its own previous block
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block = NULL;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -3728,6 +4505,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
     id[len] = 0;
 
     block = qemu_ram_block_by_name(id);
+    mis->last_recv_block[channel] = block;
     if (!block) {
         error_report("Can't find block %s", id);
         return NULL;
@@ -3978,6 +4756,277 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
     qemu_mutex_unlock(&decomp_done_lock);
 }
 
+static bool mapped_ram_use_read_threads(void)
+{
+    return migrate_mapped_ram() && migrate_use_multifd();
+}
+
+static void *do_mapped_ram_read(void *opaque)
+{
+    MappedRamReadParam *param = opaque;
+    Error *local_err = NULL;
+    struct iovec iov;
+    off_t offset;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->host) {
+            iov.iov_base = param->host;
+            iov.iov_len = param->len;
+            offset = param->offset;
+            param->host = NULL;
+            qemu_mutex_unlock(&param->mutex);
+
+            if (qio_channel_preadv_all(param->c, &iov, 1, offset,
+                                       &local_err) < 0) {
+                error_report_err(local_err);
+                local_err = NULL;
+                qemu_file_set_error(mapped_ram_read_file, -EIO);
+            }
+
+            qemu_mutex_lock(&mapped_ram_read_done_lock);
+            param->done = true;
+            qemu_cond_signal(&mapped_ram_read_done_cond);
+            qemu_mutex_unlock(&mapped_ram_read_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static int wait_for_mapped_ram_read_done(void)
+{
+    int idx, thread_count;
+
+    if (!mapped_ram_use_read_threads()) {
+        return 0;
+    }
+
+    thread_count = migrate_multifd_channels();
+    qemu_mutex_lock(&mapped_ram_read_done_lock);
+    for (idx = 0; idx < thread_count; idx++) {
+        while (!mapped_ram_read_param[idx].done) {
+            qemu_cond_wait(&mapped_ram_read_done_cond,
+                           &mapped_ram_read_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&mapped_ram_read_done_lock);
+    return qemu_file_get_error(mapped_ram_read_file);
+}
+
+static void mapped_ram_load_cleanup(void)
+{
+    int i, thread_count;
+
+    if (!mapped_ram_use_read_threads() || !mapped_ram_read_param) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    for (i = 0; i < thread_count; i++) {
+        /* the channel tells whether the thread was started */
+        if (!mapped_ram_read_param[i].c) {
+            break;
+        }
+
+        qemu_mutex_lock(&mapped_ram_read_param[i].mutex);
+        mapped_ram_read_param[i].quit = true;
+        qemu_cond_signal(&mapped_ram_read_param[i].cond);
+        qemu_mutex_unlock(&mapped_ram_read_param[i].mutex);
+    }
+    for (i = 0; i < thread_count; i++) {
+        if (!mapped_ram_read_param[i].c) {
+            break;
+        }
+
+        qemu_thread_join(mapped_ram_read_threads + i);
+        qemu_mutex_destroy(&mapped_ram_read_param[i].mutex);
+        qemu_cond_destroy(&mapped_ram_read_param[i].cond);
+        object_unref(OBJECT(mapped_ram_read_param[i].c));
+        mapped_ram_read_param[i].c = NULL;
+    }
+    qemu_mutex_destroy(&mapped_ram_read_done_lock);
+    qemu_cond_destroy(&mapped_ram_read_done_cond);
+    g_free(mapped_ram_read_threads);
+    g_free(mapped_ram_read_param);
+    mapped_ram_read_threads = NULL;
+    mapped_ram_read_param = NULL;
+    mapped_ram_read_file = NULL;
+}
+
+static int mapped_ram_load_setup(QEMUFile *f)
+{
+    int i, thread_count;
+
+    if (!mapped_ram_use_read_threads()) {
+        return 0;
+    }
+
+    thread_count = migrate_multifd_channels();
+    mapped_ram_read_threads = g_new0(QemuThread, thread_count);
+    mapped_ram_read_param = g_new0(MappedRamReadParam, thread_count);
+    qemu_mutex_init(&mapped_ram_read_done_lock);
+    qemu_cond_init(&mapped_ram_read_done_cond);
+    mapped_ram_read_file = f;
+    for (i = 0; i < thread_count; i++) {
+        Error *local_err = NULL;
+
+        mapped_ram_read_param[i].c = file_recv_channel_create(&local_err);
+        if (!mapped_ram_read_param[i].c) {
+            error_report_err(local_err);
+            goto exit;
+        }
+
+        qemu_mutex_init(&mapped_ram_read_param[i].mutex);
+        qemu_cond_init(&mapped_ram_read_param[i].cond);
+        mapped_ram_read_param[i].done = true;
+        mapped_ram_read_param[i].quit = false;
+        qemu_thread_create(mapped_ram_read_threads + i, "mapped-ram-read",
+                           do_mapped_ram_read, mapped_ram_read_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+    return 0;
+exit:
+    mapped_ram_load_cleanup();
+    return -1;
+}
+
+static void mapped_ram_read_with_threads(void *host, size_t len,
+                                         off_t offset)
+{
+    int idx, thread_count;
+
+    thread_count = migrate_multifd_channels();
+    qemu_mutex_lock(&mapped_ram_read_done_lock);
+    while (true) {
+        for (idx = 0; idx < thread_count; idx++) {
+            if (mapped_ram_read_param[idx].done) {
+                mapped_ram_read_param[idx].done = false;
+                qemu_mutex_lock(&mapped_ram_read_param[idx].mutex);
+                mapped_ram_read_param[idx].host = host;
+                mapped_ram_read_param[idx].len = len;
+                mapped_ram_read_param[idx].offset = offset;
+                qemu_cond_signal(&mapped_ram_read_param[idx].cond);
+                qemu_mutex_unlock(&mapped_ram_read_param[idx].mutex);
+                break;
+            }
+        }
+        if (idx < thread_count) {
+            break;
+        } else {
+            qemu_cond_wait(&mapped_ram_read_done_cond,
+                           &mapped_ram_read_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&mapped_ram_read_done_lock);
+}
+
+/*
+ * Read the pages of @block that are present in a mapped-ram migration
+ * file and move the stream after them.
+ *
+ * Returns 0 for success or a negative error code.
+ */
+static int parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
+                                     ram_addr_t length)
+{
+    MappedRamHeader header;
+    size_t num_pages = length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+    unsigned long *bitmap, *le_bitmap;
+    unsigned long set_bit_idx, clear_bit_idx;
+    int ret = 0, wait_ret;
+
+    qemu_get_buffer(f, (uint8_t *)&header, sizeof(header));
+    header.version = be32_to_cpu(header.version);
+    header.page_size = be64_to_cpu(header.page_size);
+    header.bitmap_offset = be64_to_cpu(header.bitmap_offset);
+    header.pages_offset = be64_to_cpu(header.pages_offset);
+
+    if (header.version > MAPPED_RAM_HDR_VERSION) {
+        error_report("Mapped-ram header of block %s has version %" PRIu32
+                     ", expected at most %d", block->idstr, header.version,
+                     MAPPED_RAM_HDR_VERSION);
+        return -EINVAL;
+    }
+    if (header.page_size != TARGET_PAGE_SIZE) {
+        error_report("Mapped-ram page size of block %s is %" PRIu64
+                     ", expected %d", block->idstr, header.page_size,
+                     TARGET_PAGE_SIZE);
+        return -EINVAL;
+    }
+
+    trace_ram_mapped_ram_load(block->idstr, header.bitmap_offset,
+                              header.pages_offset);
+
+    le_bitmap = bitmap_new(num_pages);
+    bitmap = bitmap_new(num_pages);
+    if (qemu_get_buffer_at(f, (uint8_t *)le_bitmap, bitmap_size,
+                           header.bitmap_offset) != bitmap_size) {
+        error_report("Cannot read the mapped-ram bitmap of block %s",
+                     block->idstr);
+        ret = -EIO;
+        goto out;
+    }
+    bitmap_from_le(bitmap, le_bitmap, num_pages);
+
+    for (set_bit_idx = find_first_bit(bitmap, num_pages);
+         set_bit_idx < num_pages;
+         set_bit_idx = find_next_bit(bitmap, num_pages, clear_bit_idx + 1)) {
+        ram_addr_t offset, size;
+
+        clear_bit_idx = find_next_zero_bit(bitmap, num_pages, set_bit_idx + 1);
+        offset = (ram_addr_t)set_bit_idx << TARGET_PAGE_BITS;
+        size = (ram_addr_t)(clear_bit_idx - set_bit_idx) << TARGET_PAGE_BITS;
+
+        if (!migration_incoming_in_colo_state()) {
+            ramblock_recv_bitmap_set_range(block, block->host + offset,
+                                           clear_bit_idx - set_bit_idx);
+        }
+
+        while (size) {
+            ram_addr_t len = MIN(size, MAPPED_RAM_LOAD_CHUNK);
+            void *host = host_from_ram_block_offset(block, offset);
+
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, offset);
+                ret = -EINVAL;
+                goto out;
+            }
+
+            if (mapped_ram_use_read_threads()) {
+                mapped_ram_read_with_threads(host, len,
+                                             header.pages_offset + offset);
+            } else if (qemu_get_buffer_at(f, host, len,
+                                          header.pages_offset + offset)
+                       != len) {
+                ret = -EIO;
+                goto out;
+            }
+            offset += len;
+            size -= len;
+        }
+    }
+
+out:
+    /* Always wait for the read threads, but report the first error */
+    wait_ret = wait_for_mapped_ram_read_done();
+    if (!ret) {
+        ret = wait_ret;
+    }
+    if (!ret) {
+        qemu_set_offset(f, header.pages_offset + length, SEEK_SET);
+        ret = qemu_file_get_error(f);
+    }
+    g_free(bitmap);
+    g_free(le_bitmap);
+    return ret;
+}
+
 /*
  * colo cache: this is for secondary VM, we cache the whole
  * memory of the secondary VM, it is need to hold the global lock
@@ -4076,6 +5125,11 @@ static int ram_load_setup(QEMUFile *f, void *opaque)
         return -1;
     }
 
+    if (mapped_ram_load_setup(f)) {
+        compress_threads_load_cleanup();
+        return -1;
+    }
+
     xbzrle_load_setup();
     ramblock_recv_map_init();
 
@@ -4094,6 +5148,7 @@ static int ram_load_cleanup(void *opaque)
 
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
+    mapped_ram_load_cleanup();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
@@ -4124,19 +5179,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt
+ * thread for the pages that are received on its channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: RAM_CHANNEL_* that @f is
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = postcopy_get_tmp_page(mis);
+    void *postcopy_host_page = postcopy_get_tmp_page(mis, channel);
     void *last_host = NULL;
     bool all_zero = false;
 
@@ -4165,7 +5222,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -4352,7 +5409,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     rcu_read_lock();
 
     if (postcopy_running) {
-        ret = ram_load_postcopy(f);
+        ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
     }
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
@@ -4375,7 +5432,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             /*
              * After going into COLO, we should load the Page into colo_cache.
@@ -4449,6 +5507,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = parse_ramblock_mapped_ram(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,8 +25,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,6 +127,285 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+/*
+ * The vectorized encoders share the run loop below and only differ in
+ * how they look for the end of a run.  Each of them must produce
+ * exactly the same output as xbzrle_encode_buffer_int, including the
+ * points where an overflow of @dst is detected.
+ *
+ * @zrun_end returns the index of the first byte at or after @i that
+ * differs between the two buffers, @nzrun_end the index of the first
+ * byte that is the same; both return @slen if there is none.
+ */
+typedef int (*XBZRLERunEndFunc)(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int i, int slen);
+
+static inline __attribute__((__always_inline__)) int
+xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                   uint8_t *dst, int dlen,
+                   XBZRLERunEndFunc zrun_end, XBZRLERunEndFunc nzrun_end)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, end;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        end = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        end = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i = end;
+    }
+
+    return d;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* Bitmask of the bytes that are equal in the 32 bytes at @i */
+static inline uint32_t xbzrle_eq_mask_avx2(const uint8_t *old_buf,
+                                           const uint8_t *new_buf, int i)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+}
+
+static int xbzrle_zrun_end_avx2(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        uint32_t eq = xbzrle_eq_mask_avx2(old_buf, new_buf, i);
+
+        if (eq != UINT32_MAX) {
+            return i + ctz32(~eq);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_nzrun_end_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        uint32_t eq = xbzrle_eq_mask_avx2(old_buf, new_buf, i);
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_end_avx2, xbzrle_nzrun_end_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+/* Bitmask of the bytes that are equal in the 64 bytes at @i */
+static inline uint64_t xbzrle_eq_mask_avx512(const uint8_t *old_buf,
+                                             const uint8_t *new_buf, int i)
+{
+    __m512i a = _mm512_loadu_si512(old_buf + i);
+    __m512i b = _mm512_loadu_si512(new_buf + i);
+
+    return _mm512_cmpeq_epi8_mask(a, b);
+}
+
+/*
+ * Same for the last @slen - @i < 64 bytes.  The bytes past the end are
+ * not loaded and reported as different from each other.
+ */
+static inline uint64_t xbzrle_eq_mask_tail_avx512(const uint8_t *old_buf,
+                                                  const uint8_t *new_buf,
+                                                  int i, int slen)
+{
+    __mmask64 valid = (1ULL << (slen - i)) - 1;
+    __m512i a = _mm512_maskz_loadu_epi8(valid, old_buf + i);
+    __m512i b = _mm512_maskz_loadu_epi8(valid, new_buf + i);
+
+    return _mm512_mask_cmpeq_epi8_mask(valid, a, b);
+}
+
+static int xbzrle_zrun_end_avx512(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int i, int slen)
+{
+    uint64_t eq;
+
+    for (; i + 64 <= slen; i += 64) {
+        eq = xbzrle_eq_mask_avx512(old_buf, new_buf, i);
+        if (eq != UINT64_MAX) {
+            return i + ctz64(~eq);
+        }
+    }
+    if (i == slen) {
+        return slen;
+    }
+    eq = xbzrle_eq_mask_tail_avx512(old_buf, new_buf, i, slen);
+    return MIN(i + ctz64(~eq), slen);
+}
+
+static int xbzrle_nzrun_end_avx512(const uint8_t *old_buf,
+                                   const uint8_t *new_buf, int i, int slen)
+{
+    uint64_t eq;
+
+    for (; i + 64 <= slen; i += 64) {
+        eq = xbzrle_eq_mask_avx512(old_buf, new_buf, i);
+        if (eq) {
+            return i + ctz64(eq);
+        }
+    }
+    if (i == slen) {
+        return slen;
+    }
+    eq = xbzrle_eq_mask_tail_avx512(old_buf, new_buf, i, slen);
+    return MIN(i + ctz64(eq), slen);
+}
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_end_avx512,
+                              xbzrle_nzrun_end_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+/*
+ * Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+
+typedef int (*XBZRLEEncodeFunc)(uint8_t *old_buf, uint8_t *new_buf,
+                                int slen, uint8_t *dst, int dlen);
+
+static unsigned cpuid_cache;
+static XBZRLEEncodeFunc xbzrle_encode_accel = xbzrle_encode_buffer_int;
+
+static void init_accel(unsigned cache)
+{
+    XBZRLEEncodeFunc fn = xbzrle_encode_buffer_int;
+
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_buffer_avx512;
+    }
+#endif
+    xbzrle_encode_accel = fn;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* AVX-512 also needs the opmask and ZMM state to be enabled.  */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F) &&
+                (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_buffer_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
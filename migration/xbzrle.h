@@ -18,4 +18,19 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/*
+ * Portable encoder that xbzrle_encode_buffer falls back to when the host
+ * has no vector extension it can use.  The accelerated encoders must
+ * produce the same output.
+ */
+int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen);
+
+/*
+ * Switch xbzrle_encode_buffer to the next less preferred implementation;
+ * returns false once the portable one has been selected.  Only meant for
+ * the tests.
+ */
+bool test_xbzrle_encode_next_accel(void);
 #endif
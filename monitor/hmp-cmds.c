@@ -40,6 +40,7 @@
 #include "qapi/qapi-commands-run-state.h"
 #include "qapi/qapi-commands-tpm.h"
 #include "qapi/qapi-commands-ui.h"
+#include "qapi/qapi-visit-migration.h"
 #include "qapi/qapi-visit-net.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qerror.h"
@@ -289,6 +290,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->multifd_bytes >> 10);
         monitor_printf(mon, "pages-per-second: %" PRIu64 "\n",
                        info->ram->pages_per_second);
+        if (info->ram->dirty_sync_missed_zero_copy) {
+            monitor_printf(mon,
+                           "Zero-copy-send fallbacks happened: %" PRIu64
+                           " times\n",
+                           info->ram->dirty_sync_missed_zero_copy);
+        }
 
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
@@ -320,8 +327,14 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
+        monitor_printf(mon, "xbzrle cache hit rate: %0.2f\n",
+                       info->xbzrle_cache->cache_hit_rate);
+        monitor_printf(mon, "xbzrle cache evictions: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_evictions);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle overflow rate: %0.2f\n",
+                       info->xbzrle_cache->overflow_rate);
     }
 
     if (info->has_compression) {
@@ -464,6 +477,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_CHANNELS),
             params->multifd_channels);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_COMPRESSION),
+            MultiFDCompression_str(params->multifd_compression));
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_ZLIB_LEVEL),
+            params->multifd_zlib_level);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_ZSTD_LEVEL),
+            params->multifd_zstd_level);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DIRECT_IO),
+            params->direct_io ? "on" : "off");
         monitor_printf(mon, "%s: %" PRIu64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
@@ -484,6 +509,49 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateBlockInfoList *block;
+    DirtyRateVcpuList *vcpu;
+    uint8List *region;
+
+    monitor_printf(mon, "Status: %s\n", DirtyRateStatus_str(info->status));
+    monitor_printf(mon, "Mode: %s\n", DirtyRateMeasureMode_str(info->mode));
+    monitor_printf(mon, "Start time: %" PRId64 " s\n", info->start_time);
+    monitor_printf(mon, "Calc time: %" PRId64 " s\n", info->calc_time);
+    if (info->mode == DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        monitor_printf(mon, "Sample pages: %" PRIu64 " per GiB\n",
+                       info->sample_pages);
+    }
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRId64 " MB/s\n",
+                       info->dirty_rate);
+    }
+
+    for (block = info->blocks; block; block = block->next) {
+        DirtyRateBlockInfo *b = block->value;
+
+        monitor_printf(mon, "  %s: %" PRId64 " MB/s, %" PRIu64 "/%" PRIu64
+                       " pages dirty", b->id, b->dirty_rate, b->dirty_pages,
+                       b->sample_pages);
+        if (b->has_heatmap) {
+            monitor_printf(mon, ", heatmap (%%):");
+            for (region = b->heatmap; region; region = region->next) {
+                monitor_printf(mon, " %u", region->value);
+            }
+        }
+        monitor_printf(mon, "\n");
+    }
+
+    for (vcpu = info->vcpus; vcpu; vcpu = vcpu->next) {
+        monitor_printf(mon, "  vcpu %" PRId64 ": %" PRId64 " MB/s\n",
+                       vcpu->value->id, vcpu->value->dirty_rate);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 static void print_block_info(Monitor *mon, BlockInfo *info,
                              BlockDeviceInfo *inserted, bool verbose)
 {
@@ -1707,6 +1775,32 @@ void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
     qmp_migrate_set_downtime(value, NULL);
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    bool dirty_bitmap = qdict_get_try_bool(qdict, "dirty_bitmap", false);
+    bool dirty_ring = qdict_get_try_bool(qdict, "dirty_ring", false);
+    int64_t sec = qdict_get_int(qdict, "second");
+    bool has_regions = qdict_haskey(qdict, "regions");
+    int64_t regions = qdict_get_try_int(qdict, "regions", 0);
+    DirtyRateMeasureMode mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    Error *err = NULL;
+
+    if (dirty_ring) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_RING;
+    } else if (dirty_bitmap) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP;
+    }
+
+    qmp_calc_dirty_rate(sec, true, mode, false, 0, has_regions, regions,
+                        &err);
+    if (!err) {
+        monitor_printf(mon, "Started measuring the dirty rate for %" PRId64
+                       " seconds, use 'info dirty_rate' for the result\n",
+                       sec);
+    }
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -1840,6 +1934,23 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_channels = true;
         visit_type_int(v, param, &p->multifd_channels, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_COMPRESSION:
+        p->has_multifd_compression = true;
+        visit_type_MultiFDCompression(v, param, &p->multifd_compression,
+                                      &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_ZLIB_LEVEL:
+        p->has_multifd_zlib_level = true;
+        visit_type_int(v, param, &p->multifd_zlib_level, &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_ZSTD_LEVEL:
+        p->has_multifd_zstd_level = true;
+        visit_type_int(v, param, &p->multifd_zstd_level, &err);
+        break;
+    case MIGRATION_PARAMETER_DIRECT_IO:
+        p->has_direct_io = true;
+        visit_type_bool(v, param, &p->direct_io, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         visit_type_size(v, param, &cache_size, &err);
@@ -22,6 +22,11 @@
 #include "trace.h"
 #include "nbd-internal.h"
 #include "qemu/units.h"
+#include "block/thread-pool.h"
+
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_DIRTY_BITMAP 1
@@ -88,6 +93,15 @@ struct NBDExport {
 
     AioContext *ctx;
 
+    /*
+     * If non-empty, clients are spread round-robin across these
+     * AioContexts once they have negotiated the export, see
+     * nbd_export_set_client_aio_contexts().
+     */
+    AioContext **client_ctxs;
+    int nb_client_ctxs;
+    int next_client_ctx;
+
     BlockBackend *eject_notifier_blk;
     Notifier eject_notifier;
 
@@ -108,6 +122,15 @@ typedef struct NBDExportMetaContexts {
     bool bitmap; /* export qemu:dirty-bitmap:<export bitmap name> */
 } NBDExportMetaContexts;
 
+/* Read and write requests that were served to a client */
+typedef struct NBDClientStats {
+    int64_t start_ns;   /* QEMU_CLOCK_REALTIME when negotiation finished */
+    uint64_t rd_ops;
+    uint64_t rd_bytes;
+    uint64_t wr_ops;
+    uint64_t wr_bytes;
+} NBDClientStats;
+
 struct NBDClient {
     int refcount;
     void (*close_fn)(NBDClient *client, bool negotiated);
@@ -118,6 +141,14 @@ struct NBDClient {
     QIOChannelSocket *sioc; /* The underlying data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
 
+    /*
+     * AioContext that runs the client's coroutines if it is served from
+     * one of exp->client_ctxs, NULL if it follows exp->ctx.  Such clients
+     * access refcount and closing from several threads.
+     */
+    AioContext *ctx;
+    NBDClientStats stats;
+
     Coroutine *recv_coroutine;
 
     CoMutex send_lock;
@@ -1344,40 +1375,81 @@ static int nbd_receive_request(QIOChannel *ioc, NBDRequest *request,
 
 void nbd_client_get(NBDClient *client)
 {
-    client->refcount++;
+    atomic_inc(&client->refcount);
+}
+
+/*
+ * Whether a client that runs in its own AioContext must defer work that
+ * touches the export, or the owner of the client, to the export's AioContext
+ */
+static bool nbd_client_outside_export_context(NBDClient *client)
+{
+    return client->ctx &&
+           qemu_get_current_aio_context() != client->exp->ctx;
+}
+
+static void nbd_client_free(NBDClient *client)
+{
+    int64_t elapsed_ns = 0;
+
+    if (client->stats.start_ns) {
+        elapsed_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                     client->stats.start_ns;
+    }
+    trace_nbd_client_free(client, elapsed_ns, client->stats.rd_ops,
+                          client->stats.rd_bytes, client->stats.wr_ops,
+                          client->stats.wr_bytes);
+
+    qio_channel_detach_aio_context(client->ioc);
+    object_unref(OBJECT(client->sioc));
+    object_unref(OBJECT(client->ioc));
+    if (client->tlscreds) {
+        object_unref(OBJECT(client->tlscreds));
+    }
+    g_free(client->tlsauthz);
+    if (client->exp) {
+        QTAILQ_REMOVE(&client->exp->clients, client, next);
+        nbd_export_put(client->exp);
+    }
+    g_free(client);
+}
+
+static void nbd_client_free_bh(void *opaque)
+{
+    nbd_client_free(opaque);
 }
 
 void nbd_client_put(NBDClient *client)
 {
-    if (--client->refcount == 0) {
+    if (atomic_fetch_dec(&client->refcount) == 1) {
         /* The last reference should be dropped by client->close,
          * which is called by client_close.
          */
         assert(client->closing);
 
-        qio_channel_detach_aio_context(client->ioc);
-        object_unref(OBJECT(client->sioc));
-        object_unref(OBJECT(client->ioc));
-        if (client->tlscreds) {
-            object_unref(OBJECT(client->tlscreds));
-        }
-        g_free(client->tlsauthz);
-        if (client->exp) {
-            QTAILQ_REMOVE(&client->exp->clients, client, next);
-            nbd_export_put(client->exp);
+        if (nbd_client_outside_export_context(client)) {
+            aio_bh_schedule_oneshot(client->exp->ctx, nbd_client_free_bh,
+                                    client);
+        } else {
+            nbd_client_free(client);
         }
-        g_free(client);
     }
 }
 
+static void nbd_client_close_bh(void *opaque)
+{
+    NBDClient *client = opaque;
+
+    /* Only clients that completed negotiation get their own AioContext */
+    client->close_fn(client, true);
+}
+
 static void client_close(NBDClient *client, bool negotiated)
 {
-    if (client->closing) {
+    if (atomic_xchg(&client->closing, true)) {
         return;
     }
 
-    client->closing = true;
-
     /* Force requests to finish.  They will drop their own references,
      * then we'll close the socket and free the NBDClient.
      */
@@ -1386,7 +1458,12 @@ static void client_close(NBDClient *client, bool negotiated)
 
     /* Also tell the client, so that they release their reference.  */
     if (client->close_fn) {
-        client->close_fn(client, negotiated);
+        if (nbd_client_outside_export_context(client)) {
+            aio_bh_schedule_oneshot(client->exp->ctx, nbd_client_close_bh,
+                                    client);
+        } else {
+            client->close_fn(client, negotiated);
+        }
     }
 }
 
@@ -1428,6 +1505,10 @@ static void blk_aio_attached(AioContext *ctx, void *opaque)
     exp->ctx = ctx;
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
+        if (client->ctx) {
+            /* Only requests are forwarded to exp->ctx, see nbd_blk_request() */
+            continue;
+        }
         qio_channel_attach_aio_context(client->ioc, ctx);
         if (client->recv_coroutine) {
             aio_co_schedule(ctx, client->recv_coroutine);
@@ -1446,7 +1527,9 @@ static void blk_aio_detach(void *opaque)
     trace_nbd_blk_aio_detach(exp->name, exp->ctx);
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
-        qio_channel_detach_aio_context(client->ioc);
+        if (!client->ctx) {
+            qio_channel_detach_aio_context(client->ioc);
+        }
     }
 
     exp->ctx = NULL;
@@ -1659,10 +1742,33 @@ void nbd_export_put(NBDExport *exp)
             g_free(exp->export_bitmap_context);
         }
 
+        g_free(exp->client_ctxs);
         g_free(exp);
     }
 }
 
+/*
+ * Serve the clients of @exp from the AioContexts in @ctxs instead of the
+ * export's AioContext.  Each client is assigned one of them after it has
+ * negotiated the export, and its socket I/O and request coroutines run
+ * there.  Block requests are submitted with the export's AioContext held
+ * and run in the client's AioContext when the block graph supports it
+ * (see blk_set_multiqueue()), in the export's AioContext otherwise.
+ *
+ * Must be called before the export is made available to clients.
+ */
+void nbd_export_set_client_aio_contexts(NBDExport *exp, AioContext **ctxs,
+                                        int nb_ctxs)
+{
+    assert(QTAILQ_EMPTY(&exp->clients));
+
+    g_free(exp->client_ctxs);
+    exp->client_ctxs = g_memdup(ctxs, nb_ctxs * sizeof(ctxs[0]));
+    exp->nb_client_ctxs = nb_ctxs;
+    exp->next_client_ctx = 0;
+    blk_set_multiqueue(exp->blk, nb_ctxs > 0);
+}
+
 BlockBackend *nbd_export_get_blockdev(NBDExport *exp)
 {
     return exp->blk;
@@ -1677,6 +1783,110 @@ void nbd_export_close_all(void)
     }
 }
 
+typedef struct NBDBlkRequest {
+    Coroutine *co;
+    int ret;
+} NBDBlkRequest;
+
+static void nbd_blk_request_cb(void *opaque, int ret)
+{
+    NBDBlkRequest *req = opaque;
+
+    req->ret = ret;
+    aio_co_wake(req->co);
+}
+
+/*
+ * Perform the block layer part of a request of type @type (NBD_CMD_READ,
+ * NBD_CMD_WRITE, NBD_CMD_WRITE_ZEROES, NBD_CMD_FLUSH or NBD_CMD_TRIM) at
+ * @offset in the export's BlockBackend.
+ *
+ * Clients that have an AioContext of their own submit aio requests while
+ * holding the export's AioContext.  blk_set_multiqueue() lets these run in
+ * the client's AioContext if the block graph supports it.
+ *
+ * Returns a negative errno on failure and a non-negative value on success.
+ */
+static int coroutine_fn nbd_blk_request(NBDClient *client, uint16_t type,
+                                        uint64_t offset, void *buf,
+                                        uint64_t bytes,
+                                        BdrvRequestFlags flags)
+{
+    BlockBackend *blk = client->exp->blk;
+    NBDBlkRequest req = {
+        .co = qemu_coroutine_self(),
+    };
+    QEMUIOVector qiov;
+
+    if (!client->ctx) {
+        switch (type) {
+        case NBD_CMD_READ:
+            return blk_pread(blk, offset, buf, bytes);
+        case NBD_CMD_WRITE:
+            return blk_pwrite(blk, offset, buf, bytes, flags);
+        case NBD_CMD_WRITE_ZEROES:
+            return blk_pwrite_zeroes(blk, offset, bytes, flags);
+        case NBD_CMD_FLUSH:
+            return blk_co_flush(blk);
+        case NBD_CMD_TRIM:
+            return blk_co_pdiscard(blk, offset, bytes);
+        default:
+            abort();
+        }
+    }
+
+    aio_context_acquire(client->exp->ctx);
+    switch (type) {
+    case NBD_CMD_READ:
+        qemu_iovec_init_buf(&qiov, buf, bytes);
+        blk_aio_preadv(blk, offset, &qiov, flags, nbd_blk_request_cb, &req);
+        break;
+    case NBD_CMD_WRITE:
+        qemu_iovec_init_buf(&qiov, buf, bytes);
+        blk_aio_pwritev(blk, offset, &qiov, flags, nbd_blk_request_cb, &req);
+        break;
+    case NBD_CMD_WRITE_ZEROES:
+        blk_aio_pwrite_zeroes(blk, offset, bytes, flags, nbd_blk_request_cb,
+                              &req);
+        break;
+    case NBD_CMD_FLUSH:
+        blk_aio_flush(blk, nbd_blk_request_cb, &req);
+        break;
+    case NBD_CMD_TRIM:
+        blk_aio_pdiscard(blk, offset, bytes, nbd_blk_request_cb, &req);
+        break;
+    default:
+        abort();
+    }
+    aio_context_release(client->exp->ctx);
+
+    /* nbd_blk_request_cb() reschedules us to client->ctx if needed */
+    qemu_coroutine_yield();
+    return req.ret;
+}
+
+/*
+ * Move a client that has an AioContext of its own to the export's
+ * AioContext before querying block status, unless the block graph supports
+ * requests from any AioContext.  Returns whether the caller must call
+ * nbd_client_leave_export_context() afterwards.
+ */
+static bool coroutine_fn nbd_client_enter_export_context(NBDClient *client)
+{
+    if (!client->ctx ||
+        bdrv_supports_multiqueue(blk_bs(client->exp->blk), false)) {
+        return false;
+    }
+
+    aio_co_reschedule_self(client->exp->ctx);
+    return true;
+}
+
+static void coroutine_fn nbd_client_leave_export_context(NBDClient *client)
+{
+    aio_co_reschedule_self(client->ctx);
+}
+
 static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
                                         unsigned niov, Error **errp)
 {
@@ -1694,6 +1904,125 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+#ifdef CONFIG_SENDFILE
+typedef struct NBDSendfileData {
+    int out_fd;
+    int in_fd;
+    off_t offset;
+    size_t size;
+} NBDSendfileData;
+
+static int nbd_sendfile_func(void *opaque)
+{
+    NBDSendfileData *data = opaque;
+    ssize_t len;
+
+    do {
+        len = sendfile(data->out_fd, data->in_fd, &data->offset, data->size);
+    } while (len < 0 && errno == EINTR);
+
+    return len < 0 ? -errno : len;
+}
+
+/*
+ * Send @iov, followed by @size bytes that the kernel copies from @fd at
+ * @fd_offset to the socket.  sendfile() runs in the thread pool because it
+ * blocks while the data is read from disk; the socket is non-blocking, so
+ * waiting for it to become writable still happens in the coroutine.
+ * Errors leave the connection unusable.
+ */
+static int coroutine_fn nbd_co_send_iov_fd(NBDClient *client,
+                                           struct iovec *iov, unsigned niov,
+                                           int fd, off_t fd_offset,
+                                           size_t size, Error **errp)
+{
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_current_aio_context());
+    NBDSendfileData data = {
+        .out_fd = client->sioc->fd,
+        .in_fd = fd,
+        .offset = fd_offset,
+    };
+    int ret = 0;
+
+    assert(size <= NBD_MAX_BUFFER_SIZE);
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    if (qio_channel_writev_all(client->ioc, iov, niov, errp) < 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    while (size > 0) {
+        int len;
+
+        data.size = size;
+        len = thread_pool_submit_co(pool, nbd_sendfile_func, &data);
+        if (len == -EAGAIN) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            continue;
+        }
+        if (len <= 0) {
+            error_setg_errno(errp, len < 0 ? -len : EIO,
+                             "sending data from file failed");
+            ret = -EIO;
+            goto out;
+        }
+        size -= len;
+    }
+
+out:
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+#endif
+
+/* Send @iov, followed by [@offset, @offset + @size) of the export read
+ * straight from the host file, without copying the data through a buffer.
+ * Returns -ENOTSUP without sending anything if the export or connection
+ * does not allow this (e.g. image formats, TLS), in which case the caller
+ * has to read the data itself. */
+static int coroutine_fn nbd_co_send_iov_zero_copy(NBDClient *client,
+                                                  struct iovec *iov,
+                                                  unsigned niov,
+                                                  uint64_t offset,
+                                                  size_t size,
+                                                  Error **errp)
+{
+#ifdef CONFIG_SENDFILE
+    NBDExport *exp = client->exp;
+    int64_t host_offset;
+    int fd;
+    int ret;
+
+    if (client->ioc != QIO_CHANNEL(client->sioc)) {
+        return -ENOTSUP;
+    }
+
+    /* Keep drain from completing while the file is read behind its back */
+    aio_context_acquire(exp->ctx);
+    blk_inc_in_flight(exp->blk);
+    fd = blk_get_host_fd(exp->blk, offset + exp->dev_offset, size,
+                         &host_offset);
+    aio_context_release(exp->ctx);
+    if (fd < 0) {
+        ret = -ENOTSUP;
+    } else {
+        trace_nbd_co_send_iov_zero_copy(offset, host_offset, size);
+        ret = nbd_co_send_iov_fd(client, iov, niov, fd, host_offset, size,
+                                 errp);
+    }
+    blk_dec_in_flight(exp->blk);
+
+    return ret;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1723,6 +2052,24 @@ static int nbd_co_send_simple_reply(NBDClient *client,
     return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
 }
 
+/* Like nbd_co_send_simple_reply() for a successful read of
+ * [@offset, @offset + @len), but see nbd_co_send_iov_zero_copy(). */
+static int coroutine_fn nbd_co_send_simple_read_zero_copy(NBDClient *client,
+                                                          uint64_t handle,
+                                                          uint64_t offset,
+                                                          size_t len,
+                                                          Error **errp)
+{
+    NBDSimpleReply reply;
+    struct iovec iov[] = {
+        {.iov_base = &reply, .iov_len = sizeof(reply)},
+    };
+
+    set_be_simple_reply(&reply, 0, handle);
+
+    return nbd_co_send_iov_zero_copy(client, iov, 1, offset, len, errp);
+}
+
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
                                 uint16_t type, uint64_t handle, uint32_t length)
 {
@@ -1772,6 +2119,26 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
+/* Like nbd_co_send_structured_read(), but see nbd_co_send_iov_zero_copy() */
+static int coroutine_fn
+nbd_co_send_structured_read_zero_copy(NBDClient *client, uint64_t handle,
+                                      uint64_t offset, size_t size,
+                                      bool final, Error **errp)
+{
+    NBDStructuredReadData chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+    };
+
+    assert(size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                 sizeof(chunk) - sizeof(chunk.h) + size);
+    stq_be_p(&chunk.offset, offset);
+
+    return nbd_co_send_iov_zero_copy(client, iov, 1, offset, size, errp);
+}
+
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
                                                      uint64_t handle,
                                                      uint32_t error,
@@ -1796,6 +2163,16 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1 + !!iov[1].iov_len, errp);
 }
 
+/* Allocate the buffer of a read that cannot be sent zero copy */
+static bool nbd_request_alloc_data(NBDClient *client, NBDRequestData *req,
+                                   size_t size)
+{
+    if (!req->data) {
+        req->data = blk_try_blockalign(client->exp->blk, size);
+    }
+    return req->data != NULL;
+}
+
 /* Do a sparse read and send the structured reply to the client.
  * Returns -errno if sending fails. bdrv_block_status_above() failure is
  * reported to the client, at which point this function succeeds.
@@ -1803,7 +2180,7 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
 static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                                                 uint64_t handle,
                                                 uint64_t offset,
-                                                uint8_t *data,
+                                                NBDRequestData *req,
                                                 size_t size,
                                                 Error **errp)
 {
@@ -1813,12 +2190,17 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
 
     while (progress < size) {
         int64_t pnum;
+        bool moved = nbd_client_enter_export_context(client);
         int status = bdrv_block_status_above(blk_bs(exp->blk), NULL,
                                              offset + progress,
                                              size - progress, &pnum, NULL,
                                              NULL);
         bool final;
 
+        if (moved) {
+            nbd_client_leave_export_context(client);
+        }
+
         if (status < 0) {
             char *msg = g_strdup_printf("unable to check for holes: %s",
                                         strerror(-status));
@@ -1845,15 +2227,27 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
         } else {
-            ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
-                            data + progress, pnum);
-            if (ret < 0) {
-                error_setg_errno(errp, -ret, "reading from file failed");
-                break;
+            ret = nbd_co_send_structured_read_zero_copy(client, handle,
+                                                        offset + progress,
+                                                        pnum, final, errp);
+            if (ret == -ENOTSUP) {
+                if (!nbd_request_alloc_data(client, req, size)) {
+                    return nbd_co_send_structured_error(client, handle,
+                                                        ENOMEM, "No memory",
+                                                        errp);
+                }
+                ret = nbd_blk_request(client, NBD_CMD_READ,
+                                      offset + progress + exp->dev_offset,
+                                      req->data + progress, pnum, 0);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "reading from file failed");
+                    break;
+                }
+                ret = nbd_co_send_structured_read(client, handle,
+                                                  offset + progress,
+                                                  req->data + progress, pnum,
+                                                  final, errp);
             }
-            ret = nbd_co_send_structured_read(client, handle, offset + progress,
-                                              data + progress, pnum, final,
-                                              errp);
         }
 
         if (ret < 0) {
@@ -1966,9 +2360,13 @@ static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
     unsigned int nb_extents = dont_fragment ? 1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
     NBDExtent *extents = g_new(NBDExtent, nb_extents);
     uint64_t final_length = length;
+    bool moved = nbd_client_enter_export_context(client);
 
     ret = blockstatus_to_extents(bs, offset, &final_length, extents,
                                  &nb_extents);
+    if (moved) {
+        nbd_client_leave_export_context(client);
+    }
     if (ret < 0) {
         g_free(extents);
         return nbd_co_send_structured_error(
@@ -2103,7 +2501,9 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
                        request->len, NBD_MAX_BUFFER_SIZE);
             return -EINVAL;
         }
-
+    }
+    if (request->type == NBD_CMD_WRITE || request->type == NBD_CMD_CACHE) {
+        /* Reads allocate their buffer only if they cannot use zero copy */
         req->data = blk_try_blockalign(client->exp->blk, request->len);
         if (req->data == NULL) {
             error_setg(errp, "No memory");
@@ -2189,16 +2589,17 @@ static coroutine_fn int nbd_send_generic_reply(NBDClient *client,
  * Return -errno if sending fails. Other errors are reported directly to the
  * client as an error reply. */
 static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
-                                        uint8_t *data, Error **errp)
+                                        NBDRequestData *req, Error **errp)
 {
     int ret;
     NBDExport *exp = client->exp;
+    uint8_t *data;
 
     assert(request->type == NBD_CMD_READ || request->type == NBD_CMD_CACHE);
 
     /* XXX: NBD Protocol only documents use of FUA with WRITE */
     if (request->flags & NBD_CMD_FLAG_FUA) {
-        ret = blk_co_flush(exp->blk);
+        ret = nbd_blk_request(client, NBD_CMD_FLUSH, 0, NULL, 0, 0);
         if (ret < 0) {
             return nbd_send_generic_reply(client, request->handle, ret,
                                           "flush failed", errp);
@@ -2209,11 +2610,34 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
         request->len && request->type != NBD_CMD_CACHE)
     {
         return nbd_co_send_sparse_read(client, request->handle, request->from,
-                                       data, request->len, errp);
+                                       req, request->len, errp);
+    }
+
+    if (request->type == NBD_CMD_READ && request->len) {
+        if (client->structured_reply) {
+            ret = nbd_co_send_structured_read_zero_copy(client,
+                                                        request->handle,
+                                                        request->from,
+                                                        request->len, true,
+                                                        errp);
+        } else {
+            ret = nbd_co_send_simple_read_zero_copy(client, request->handle,
+                                                    request->from,
+                                                    request->len, errp);
+        }
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+
+    if (!nbd_request_alloc_data(client, req, request->len)) {
+        return nbd_send_generic_reply(client, request->handle, -ENOMEM,
+                                      "No memory", errp);
     }
+    data = req->data;
 
-    ret = blk_pread(exp->blk, request->from + exp->dev_offset, data,
-                    request->len);
+    ret = nbd_blk_request(client, NBD_CMD_READ, request->from + exp->dev_offset,
+                          data, request->len, 0);
     if (ret < 0 || request->type == NBD_CMD_CACHE) {
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "reading from file failed", errp);
@@ -2238,7 +2662,8 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
  * client as an error reply. */
 static coroutine_fn int nbd_handle_request(NBDClient *client,
                                            NBDRequest *request,
-                                           uint8_t *data, Error **errp)
+                                           NBDRequestData *req,
+                                           Error **errp)
 {
     int ret;
     int flags;
@@ -2248,15 +2673,25 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
     switch (request->type) {
     case NBD_CMD_READ:
     case NBD_CMD_CACHE:
-        return nbd_do_cmd_read(client, request, data, errp);
+        ret = nbd_do_cmd_read(client, request, req, errp);
+        if (ret >= 0 && request->type == NBD_CMD_READ) {
+            client->stats.rd_ops++;
+            client->stats.rd_bytes += request->len;
+        }
+        return ret;
 
     case NBD_CMD_WRITE:
         flags = 0;
         if (request->flags & NBD_CMD_FLAG_FUA) {
             flags |= BDRV_REQ_FUA;
         }
-        ret = blk_pwrite(exp->blk, request->from + exp->dev_offset,
-                         data, request->len, flags);
+        ret = nbd_blk_request(client, NBD_CMD_WRITE,
+                              request->from + exp->dev_offset, req->data,
+                              request->len, flags);
+        if (ret >= 0) {
+            client->stats.wr_ops++;
+            client->stats.wr_bytes += request->len;
+        }
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "writing to file failed", errp);
 
@@ -2268,8 +2703,9 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         if (!(request->flags & NBD_CMD_FLAG_NO_HOLE)) {
             flags |= BDRV_REQ_MAY_UNMAP;
         }
-        ret = blk_pwrite_zeroes(exp->blk, request->from + exp->dev_offset,
-                                request->len, flags);
+        ret = nbd_blk_request(client, NBD_CMD_WRITE_ZEROES,
+                              request->from + exp->dev_offset, NULL,
+                              request->len, flags);
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "writing to file failed", errp);
 
@@ -2278,15 +2714,16 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         abort();
 
     case NBD_CMD_FLUSH:
-        ret = blk_co_flush(exp->blk);
+        ret = nbd_blk_request(client, NBD_CMD_FLUSH, 0, NULL, 0, 0);
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "flush failed", errp);
 
     case NBD_CMD_TRIM:
-        ret = blk_co_pdiscard(exp->blk, request->from + exp->dev_offset,
-                              request->len);
+        ret = nbd_blk_request(client, NBD_CMD_TRIM,
+                              request->from + exp->dev_offset, NULL,
+                              request->len, 0);
         if (ret == 0 && request->flags & NBD_CMD_FLAG_FUA) {
-            ret = blk_co_flush(exp->blk);
+            ret = nbd_blk_request(client, NBD_CMD_FLUSH, 0, NULL, 0, 0);
         }
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "discard failed", errp);
@@ -2384,7 +2821,7 @@ static coroutine_fn void nbd_trip(void *opaque)
                                      error_get_pretty(export_err), &local_err);
         error_free(export_err);
     } else {
-        ret = nbd_handle_request(client, &request, req->data, &local_err);
+        ret = nbd_handle_request(client, &request, req, &local_err);
     }
     if (ret < 0) {
         error_prepend(&local_err, "Failed to send reply: ");
@@ -2418,10 +2855,30 @@ static void nbd_client_receive_next_request(NBDClient *client)
     if (!client->recv_coroutine && client->nb_requests < MAX_NBD_REQUESTS) {
         nbd_client_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, client);
-        aio_co_schedule(client->exp->ctx, client->recv_coroutine);
+        aio_co_schedule(client->ctx ?: client->exp->ctx,
+                        client->recv_coroutine);
     }
 }
 
+/* Pick the AioContext that serves @client from now on, if any */
+static void nbd_client_choose_aio_context(NBDClient *client)
+{
+    NBDExport *exp = client->exp;
+
+    client->stats.start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (!exp->nb_client_ctxs) {
+        return;
+    }
+
+    client->ctx = exp->client_ctxs[exp->next_client_ctx];
+    exp->next_client_ctx = (exp->next_client_ctx + 1) % exp->nb_client_ctxs;
+    trace_nbd_client_choose_aio_context(client, exp->name, client->ctx);
+
+    /* Drop the fd handlers that negotiation left in the old context */
+    qio_channel_detach_aio_context(client->ioc);
+    qio_channel_attach_aio_context(client->ioc, client->ctx);
+}
+
 static coroutine_fn void nbd_co_client_start(void *opaque)
 {
     NBDClient *client = opaque;
@@ -2437,6 +2894,7 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
         return;
     }
 
+    nbd_client_choose_aio_context(client);
     nbd_client_receive_next_request(client);
 }
 
@@ -190,3 +190,37 @@ net_checksum_add_iov(const struct iovec *iov, const unsigned int iov_cnt,
     }
     return res;
 }
+
+void net_toeplitz_add(uint32_t *result,
+                      uint8_t *input,
+                      uint32_t len,
+                      net_toeplitz_key *key)
+{
+    uint32_t accumulator = *result;
+    uint32_t leftmost_32_bits = key->leftmost_32_bits;
+    uint32_t byte;
+
+    for (byte = 0; byte < len; byte++) {
+        /*
+         * Bit b (counting from the MSB) of the input byte selects the 32
+         * key bits that start b bits after the current key position. All
+         * of them are in this 40-bit window, so the key does not have to
+         * be shifted bit by bit.
+         */
+        uint64_t window = ((uint64_t)leftmost_32_bits << 8) |
+                          *(key->next_byte++);
+        uint32_t input_byte = input[byte];
+        int bit;
+
+        for (bit = 0; bit < 8; bit++) {
+            uint32_t mask = -((input_byte >> (7 - bit)) & 1);
+
+            accumulator ^= (uint32_t)(window >> (8 - bit)) & mask;
+        }
+
+        leftmost_32_bits = window;
+    }
+
+    key->leftmost_32_bits = leftmost_32_bits;
+    *result = accumulator;
+}
@@ -617,6 +617,30 @@ void qemu_flush_queued_packets(NetClientState *nc)
     qemu_flush_or_purge_queued_packets(nc, false);
 }
 
+/*
+ * Tell the peer of @nc that @nc is going to send several packets in a row,
+ * so that it can defer per-packet work (e.g. notifying the guest) until
+ * qemu_send_batch_end() is called. Packets that are queued or held back by
+ * filters are delivered later, outside of the batch.
+ */
+void qemu_send_batch_begin(NetClientState *nc)
+{
+    if (!nc->peer || !nc->peer->info->receive_batch) {
+        return;
+    }
+
+    nc->peer->info->receive_batch(nc->peer, true);
+}
+
+void qemu_send_batch_end(NetClientState *nc)
+{
+    if (!nc->peer || !nc->peer->info->receive_batch) {
+        return;
+    }
+
+    nc->peer->info->receive_batch(nc->peer, false);
+}
+
 static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
                                                  unsigned flags,
                                                  const uint8_t *buf, int size,
@@ -186,6 +186,13 @@ static void tap_send(void *opaque)
     int size;
     int packets = 0;
 
+    /*
+     * A tap fd returns one frame per read(), but the peer can still
+     * complete the frames of one wakeup together, e.g. virtio-net updates
+     * the used ring and notifies the guest once per batch.
+     */
+    qemu_send_batch_begin(&s->nc);
+
     while (true) {
         uint8_t *buf = s->buf;
 
@@ -218,6 +225,8 @@ static void tap_send(void *opaque)
             break;
         }
     }
+
+    qemu_send_batch_end(&s->nc);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -616,6 +616,16 @@ static void dump_human_image_check(ImageCheck *check, bool quiet)
     }
 }
 
+static void check_status_cb(BlockDriverState *bs,
+                            int64_t offset, int64_t total_work_size,
+                            void *opaque)
+{
+    /* Nothing to check, e.g. an image with an empty L1 table */
+    if (total_work_size > 0) {
+        qemu_progress_print(100.f * offset / total_work_size, 0);
+    }
+}
+
 static int collect_image_check(BlockDriverState *bs,
                    ImageCheck *check,
                    const char *filename,
@@ -625,7 +635,10 @@ static int collect_image_check(BlockDriverState *bs,
     int ret;
     BdrvCheckResult result;
 
-    ret = bdrv_check(bs, &result, fix);
+    /* In case the driver does not call check_status_cb() */
+    qemu_progress_print(0.f, 0);
+    ret = bdrv_check(bs, &result, fix, check_status_cb, NULL);
+    qemu_progress_print(100.f, 0);
     if (ret < 0) {
         return ret;
     }
@@ -678,6 +691,7 @@ static int img_check(int argc, char **argv)
     bool quiet = false;
     bool image_opts = false;
     bool force_share = false;
+    bool progress = false;
 
     fmt = NULL;
     output = NULL;
@@ -695,7 +709,7 @@ static int img_check(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:r:T:qU",
+        c = getopt_long(argc, argv, ":hf:r:T:pqU",
                         long_options, &option_index);
         if (c == -1) {
             break;
@@ -731,6 +745,9 @@ static int img_check(int argc, char **argv)
         case 'T':
             cache = optarg;
             break;
+        case 'p':
+            progress = true;
+            break;
         case 'q':
             quiet = true;
             break;
@@ -764,6 +781,11 @@ static int img_check(int argc, char **argv)
         return 1;
     }
 
+    /* The progress bar would end up in the JSON output */
+    if (quiet || output_format == OFORMAT_JSON) {
+        progress = false;
+    }
+
     if (qemu_opts_foreach(&qemu_object_opts,
                           user_creatable_add_opts_foreach,
                           NULL, &error_fatal)) {
@@ -784,7 +806,9 @@ static int img_check(int argc, char **argv)
     bs = blk_bs(blk);
 
     check = g_new0(ImageCheck, 1);
+    qemu_progress_init(progress, 1.f);
     ret = collect_image_check(bs, check, filename, fmt, fix);
+    qemu_progress_end();
 
     if (ret == -ENOTSUP) {
         error_report("This image format does not support checks");
@@ -808,7 +832,9 @@ static int img_check(int argc, char **argv)
                     check->corruptions_fixed);
         }
 
+        qemu_progress_init(progress, 1.f);
         ret = collect_image_check(bs, check, filename, fmt, 0);
+        qemu_progress_end();
 
         check->leaks_fixed          = leaks_fixed;
         check->corruptions_fixed    = corruptions_fixed;
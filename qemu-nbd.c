@@ -34,6 +34,7 @@
 #include "qemu/config-file.h"
 #include "qemu/bswap.h"
 #include "qemu/log.h"
+#include "qemu/rcu.h"
 #include "qemu/systemd.h"
 #include "block/snapshot.h"
 #include "qapi/qmp/qdict.h"
@@ -62,8 +63,10 @@
 #define QEMU_NBD_OPT_FORK          263
 #define QEMU_NBD_OPT_TLSAUTHZ      264
 #define QEMU_NBD_OPT_PID_FILE      265
+#define QEMU_NBD_OPT_THREADS       266
 
 #define MBR_SIZE 512
+#define MAX_NBD_THREADS 64
 
 static NBDExport *export;
 static int verbose;
@@ -94,6 +97,8 @@ static void usage(const char *name)
 "                            (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM          device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent          don't exit on the last connection\n"
+"      --threads=NUM         serve clients from a pool of NUM threads\n"
+"                            (default: serve them from the main loop)\n"
 "  -v, --verbose             display extra debugging information\n"
 "  -x, --export-name=NAME    expose export by name (default is empty string)\n"
 "  -D, --description=TEXT    export a human-readable description\n"
@@ -135,7 +140,7 @@ static void usage(const char *name)
 "                            '[ID_OR_NAME]'\n"
 "  -n, --nocache             disable host cache\n"
 "      --cache=MODE          set cache mode (none, writeback, ...)\n"
-"      --aio=MODE            set AIO mode (native or threads)\n"
+"      --aio=MODE            set AIO mode (native, io_uring or threads)\n"
 "      --discard=MODE        set discard mode (ignore, unmap)\n"
 "      --detect-zeroes=MODE  set detect-zeroes mode (off, on, unmap)\n"
 "      --image-opts          treat FILE as a full set of image options\n"
@@ -429,6 +434,64 @@ static void nbd_export_closed(NBDExport *export)
 
 static void nbd_update_server_watch(void);
 
+typedef struct NBDWorker {
+    QemuThread thread;
+    AioContext *ctx;
+    bool stopping;
+} NBDWorker;
+
+static NBDWorker workers[MAX_NBD_THREADS];
+static int nb_workers;
+
+static void *nbd_worker_thread(void *opaque)
+{
+    NBDWorker *worker = opaque;
+
+    rcu_register_thread();
+    qemu_set_current_aio_context(worker->ctx);
+
+    while (!atomic_read(&worker->stopping)) {
+        aio_poll(worker->ctx, true);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Start a thread that runs a new AioContext for serving clients */
+static AioContext *nbd_start_worker_thread(Error **errp)
+{
+    NBDWorker *worker = &workers[nb_workers];
+
+    assert(nb_workers < MAX_NBD_THREADS);
+    worker->ctx = aio_context_new(errp);
+    if (!worker->ctx) {
+        return NULL;
+    }
+
+    worker->stopping = false;
+    qemu_thread_create(&worker->thread, "nbd-worker", nbd_worker_thread,
+                       worker, QEMU_THREAD_JOINABLE);
+    nb_workers++;
+    return worker->ctx;
+}
+
+/* Stop all worker threads; their clients must be gone already */
+static void nbd_stop_worker_threads(void)
+{
+    int i;
+
+    for (i = 0; i < nb_workers; i++) {
+        atomic_set(&workers[i].stopping, true);
+        aio_notify(workers[i].ctx);
+    }
+    for (i = 0; i < nb_workers; i++) {
+        qemu_thread_join(&workers[i].thread);
+        aio_context_unref(workers[i].ctx);
+    }
+    nb_workers = 0;
+}
+
 static void nbd_client_closed(NBDClient *client, bool negotiated)
 {
     nb_fds--;
@@ -644,6 +707,7 @@ int main(int argc, char **argv)
         { "trace", required_argument, NULL, 'T' },
         { "fork", no_argument, NULL, QEMU_NBD_OPT_FORK },
         { "pid-file", required_argument, NULL, QEMU_NBD_OPT_PID_FILE },
+        { "threads", required_argument, NULL, QEMU_NBD_OPT_THREADS },
         { NULL, 0, NULL, 0 }
     };
     int ch;
@@ -671,6 +735,7 @@ int main(int argc, char **argv)
     int old_stderr = -1;
     unsigned socket_activation;
     const char *pid_file_name = NULL;
+    int nb_threads = 0;
 
     /* The client thread uses SIGTERM to interrupt the server.  A signal
      * handler ensures that "qemu-nbd -v -c" exits with a nice status code.
@@ -718,13 +783,9 @@ int main(int argc, char **argv)
                 exit(EXIT_FAILURE);
             }
             seen_aio = true;
-            if (!strcmp(optarg, "native")) {
-                flags |= BDRV_O_NATIVE_AIO;
-            } else if (!strcmp(optarg, "threads")) {
-                /* this is the default */
-            } else {
-               error_report("invalid aio mode `%s'", optarg);
-               exit(EXIT_FAILURE);
+            if (bdrv_parse_aio(optarg, &flags) < 0) {
+                error_report("invalid aio mode `%s'", optarg);
+                exit(EXIT_FAILURE);
             }
             break;
         case QEMU_NBD_OPT_DISCARD:
@@ -873,6 +934,13 @@ int main(int argc, char **argv)
         case QEMU_NBD_OPT_PID_FILE:
             pid_file_name = optarg;
             break;
+        case QEMU_NBD_OPT_THREADS:
+            if (qemu_strtoi(optarg, NULL, 0, &nb_threads) < 0 ||
+                nb_threads < 1 || nb_threads > MAX_NBD_THREADS) {
+                error_report("Invalid number of threads '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         }
     }
 
@@ -1172,11 +1240,30 @@ int main(int argc, char **argv)
         fd_size = limit;
     }
 
+    /*
+     * All clients share the export's BlockBackend, so they see each other's
+     * writes as NBD_FLAG_CAN_MULTI_CONN requires.  Only advertise it if more
+     * than one client can connect at the same time.
+     */
+    if (shared > 1) {
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
+
     export = nbd_export_new(bs, dev_offset, fd_size, export_name,
                             export_description, bitmap, nbdflags,
                             nbd_export_closed, writethrough, NULL,
                             &error_fatal);
 
+    if (nb_threads) {
+        AioContext *ctxs[MAX_NBD_THREADS];
+        int i;
+
+        for (i = 0; i < nb_threads; i++) {
+            ctxs[i] = nbd_start_worker_thread(&error_fatal);
+        }
+        nbd_export_set_client_aio_contexts(export, ctxs, nb_threads);
+    }
+
     if (device) {
 #if HAVE_NBD_DEVICE
         int ret;
@@ -1222,6 +1309,7 @@ int main(int argc, char **argv)
         }
     } while (state != TERMINATED);
 
+    nbd_stop_worker_threads();
     blk_unref(blk);
     if (sockpath) {
         unlink(sockpath);
@@ -118,9 +118,10 @@ Select CPU model (@code{-cpu help} for list and additional feature selection)
 ETEXI
 
 DEF("accel", HAS_ARG, QEMU_OPTION_accel,
-    "-accel [accel=]accelerator[,thread=single|multi]\n"
+    "-accel [accel=]accelerator[,thread=single|multi][,dirty-ring-size=n]\n"
     "                select accelerator (kvm, xen, hax, hvf, whpx or tcg; use 'help' for a list)\n"
-    "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
+    "                thread=single|multi (enable multi-threaded TCG)\n"
+    "                dirty-ring-size=n (KVM dirty ring size per vCPU, 0 to use dirty log bitmaps)\n", QEMU_ARCH_ALL)
 STEXI
 @item -accel @var{name}[,prop=@var{value}[,...]]
 @findex -accel
@@ -134,6 +135,14 @@ Controls number of TCG threads. When the TCG is multi-threaded there will be one
 thread per vCPU therefor taking advantage of additional host cores. The default
 is to enable multi-threading where both the back-end and front-ends support it and
 no incompatible TCG features have been enabled (e.g. icount/replay).
+@item dirty-ring-size=@var{n}
+When the KVM accelerator is used, it can be told to report dirty pages
+through a per-vCPU ring of @var{n} entries instead of a dirty bitmap for
+each memory slot.  @var{n} must be a power of two; the maximum depends on
+the host kernel.  With the ring, the time needed to collect the dirty
+pages during migration depends on the number of dirty pages rather than on
+the size of guest memory, which helps large guests with a small working
+set.  The default is 0, i.e. the dirty ring is not used.
 @end table
 ETEXI
 
@@ -911,7 +920,7 @@ This is the protocol-level block driver for accessing regular files.
 @item filename
 The path to the image file in the local filesystem
 @item aio
-Specifies the AIO backend (threads/native, default: threads)
+Specifies the AIO backend (threads/native/io_uring, default: threads)
 @item locking
 Specifies whether the image file is protected with Linux OFD / POSIX locks. The
 default is to use the Linux Open File Descriptor API if available, otherwise no
@@ -1021,7 +1030,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,snapshot=on|off][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -1089,7 +1098,8 @@ unsafe       │ on                off            on
 The default mode is @option{cache=writeback}.
 
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native", or "io_uring" and selects between pthread
+based disk I/O, native Linux AIO, or Linux io_uring API.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specify format=raw to avoid interpreting
@@ -2,7 +2,15 @@
 #include "block/aio.h"
 #include "qemu/main-loop.h"
 
+static __thread AioContext *my_aio_context;
+
 AioContext *qemu_get_current_aio_context(void)
 {
-    return qemu_get_aio_context();
+    return my_aio_context ? my_aio_context : qemu_get_aio_context();
+}
+
+void qemu_set_current_aio_context(AioContext *ctx)
+{
+    assert(!my_aio_context);
+    my_aio_context = ctx;
 }
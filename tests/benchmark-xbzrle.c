@@ -0,0 +1,90 @@
+/*
+ * XBZRLE encoder speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define NR_PAGES 256
+#define BUF_SIZE (NR_PAGES * PAGE_SIZE)
+
+/* Percentage of the bytes in each page that are changed */
+static const int dirty_percent[] = { 0, 1, 10, 50 };
+
+static void fill_buffers(uint8_t *old_buf, uint8_t *new_buf, int percent)
+{
+    int i, j;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, BUF_SIZE);
+
+    /* Dirty short runs at random places, as a guest usually does */
+    for (i = 0; i < BUF_SIZE / 100 * percent / 8; i++) {
+        int start = g_test_rand_int_range(0, BUF_SIZE - 8);
+
+        for (j = start; j < start + 8; j++) {
+            new_buf[j] = ~old_buf[j];
+        }
+    }
+}
+
+static void test_encode_speed(void)
+{
+    uint8_t *old_buf[ARRAY_SIZE(dirty_percent)];
+    uint8_t *new_buf[ARRAY_SIZE(dirty_percent)];
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    int accel = 0;
+    size_t n;
+    int i;
+
+    for (n = 0; n < ARRAY_SIZE(dirty_percent); n++) {
+        old_buf[n] = g_malloc(BUF_SIZE);
+        new_buf[n] = g_malloc(BUF_SIZE);
+        fill_buffers(old_buf[n], new_buf[n], dirty_percent[n]);
+    }
+
+    /* The most preferred implementation comes first, the portable last */
+    do {
+        for (n = 0; n < ARRAY_SIZE(dirty_percent); n++) {
+            double total = 0.0;
+
+            g_test_timer_start();
+            do {
+                for (i = 0; i < NR_PAGES; i++) {
+                    xbzrle_encode_buffer(old_buf[n] + i * PAGE_SIZE,
+                                         new_buf[n] + i * PAGE_SIZE,
+                                         PAGE_SIZE, dst, PAGE_SIZE);
+                }
+                total += BUF_SIZE;
+            } while (g_test_timer_elapsed() < 2.0);
+
+            total /= MiB;
+            g_print("xbzrle encoder %d, %d%% dirty: ", accel,
+                    dirty_percent[n]);
+            g_print("done: %.2f MB in %.2f secs: ", total,
+                    g_test_timer_last());
+            g_print("%.2f MB/sec\n", total / g_test_timer_last());
+        }
+        accel++;
+    } while (test_xbzrle_encode_next_accel());
+
+    for (n = 0; n < ARRAY_SIZE(dirty_percent); n++) {
+        g_free(old_buf[n]);
+        g_free(new_buf[n]);
+    }
+    g_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/encode/speed", test_encode_speed);
+    return g_test_run();
+}
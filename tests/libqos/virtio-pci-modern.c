@@ -0,0 +1,325 @@
+/*
+ * libqos virtio PCI modern (virtio 1.0) driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci.h"
+#include "libqos/malloc.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include "standard-headers/linux/virtio_pci.h"
+
+#include "hw/pci/pci_regs.h"
+
+/* Modern-only virtio PCI devices use 0x1040 + virtio device id */
+#define VIRTIO_PCI_MODERN_DEVICE_ID_BASE 0x1040
+
+/*
+ * Unlike the legacy layout, the registers of a modern device are all
+ * little-endian, which qpci_io_*() already takes care of.
+ */
+
+static uint8_t qvirtio_pci_modern_config_readb(QVirtioDevice *d, uint64_t off)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readb(dev->pdev, dev->bar, dev->device_cfg_offset + off);
+}
+
+static uint16_t qvirtio_pci_modern_config_readw(QVirtioDevice *d, uint64_t off)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readw(dev->pdev, dev->bar, dev->device_cfg_offset + off);
+}
+
+static uint32_t qvirtio_pci_modern_config_readl(QVirtioDevice *d, uint64_t off)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readl(dev->pdev, dev->bar, dev->device_cfg_offset + off);
+}
+
+static uint64_t qvirtio_pci_modern_config_readq(QVirtioDevice *d, uint64_t off)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readq(dev->pdev, dev->bar, dev->device_cfg_offset + off);
+}
+
+static uint64_t qvirtio_pci_modern_get_features(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    uint64_t lo, hi;
+
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_DFSELECT, 0);
+    lo = qpci_io_readl(dev->pdev, dev->bar,
+                       dev->common_cfg_offset + VIRTIO_PCI_COMMON_DF);
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_DFSELECT, 1);
+    hi = qpci_io_readl(dev->pdev, dev->bar,
+                       dev->common_cfg_offset + VIRTIO_PCI_COMMON_DF);
+
+    return hi << 32 | lo;
+}
+
+static void qvirtio_pci_modern_set_features(QVirtioDevice *d,
+                                            uint64_t features)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GFSELECT, 0);
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GF,
+                   features & 0xffffffff);
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GFSELECT, 1);
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GF,
+                   features >> 32);
+}
+
+static uint64_t qvirtio_pci_modern_get_guest_features(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    uint64_t lo, hi;
+
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GFSELECT, 0);
+    lo = qpci_io_readl(dev->pdev, dev->bar,
+                       dev->common_cfg_offset + VIRTIO_PCI_COMMON_GF);
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GFSELECT, 1);
+    hi = qpci_io_readl(dev->pdev, dev->bar,
+                       dev->common_cfg_offset + VIRTIO_PCI_COMMON_GF);
+
+    return hi << 32 | lo;
+}
+
+static uint8_t qvirtio_pci_modern_get_status(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readb(dev->pdev, dev->bar,
+                         dev->common_cfg_offset + VIRTIO_PCI_COMMON_STATUS);
+}
+
+static void qvirtio_pci_modern_set_status(QVirtioDevice *d, uint8_t status)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    qpci_io_writeb(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_STATUS, status);
+}
+
+/* MSI-X is only supported through the legacy layout for now */
+static bool qvirtio_pci_modern_get_queue_isr_status(QVirtioDevice *d,
+                                                    QVirtQueue *vq)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+
+    g_assert(!dev->pdev->msix_enabled);
+    return qpci_io_readb(dev->pdev, dev->bar, dev->isr_cfg_offset) & 1;
+}
+
+static bool qvirtio_pci_modern_get_config_isr_status(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+
+    g_assert(!dev->pdev->msix_enabled);
+    return qpci_io_readb(dev->pdev, dev->bar, dev->isr_cfg_offset) & 2;
+}
+
+static void qvirtio_pci_modern_queue_select(QVirtioDevice *d, uint16_t index)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    qpci_io_writew(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_Q_SELECT, index);
+}
+
+static uint16_t qvirtio_pci_modern_get_queue_size(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    return qpci_io_readw(dev->pdev, dev->bar,
+                         dev->common_cfg_offset + VIRTIO_PCI_COMMON_Q_SIZE);
+}
+
+static void qvirtio_pci_modern_set_queue_address(QVirtioDevice *d, uint32_t pfn)
+{
+    /* Modern devices take the address of each part of the ring instead */
+    g_assert_not_reached();
+}
+
+static void qvirtio_pci_modern_writeq(QVirtioPCIDevice *dev, uint64_t off,
+                                      uint64_t val)
+{
+    qpci_io_writel(dev->pdev, dev->bar, dev->common_cfg_offset + off,
+                   val & 0xffffffff);
+    qpci_io_writel(dev->pdev, dev->bar, dev->common_cfg_offset + off + 4,
+                   val >> 32);
+}
+
+static QVirtQueue *qvirtio_pci_modern_virtqueue_setup(QVirtioDevice *d,
+                                                      QGuestAllocator *alloc,
+                                                      uint16_t index)
+{
+    uint64_t feat;
+    uint64_t addr;
+    uint16_t notify_off;
+    QVirtQueuePCI *vqpci;
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+
+    vqpci = g_malloc0(sizeof(*vqpci));
+    feat = qvirtio_pci_modern_get_guest_features(d);
+
+    qvirtio_pci_modern_queue_select(d, index);
+    vqpci->vq.index = index;
+    vqpci->vq.size = qvirtio_pci_modern_get_queue_size(d);
+    vqpci->vq.free_head = 0;
+    vqpci->vq.num_free = vqpci->vq.size;
+    vqpci->vq.align = VIRTIO_PCI_VRING_ALIGN;
+    vqpci->vq.indirect = (feat & (1u << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+    vqpci->vq.event = (feat & (1u << VIRTIO_RING_F_EVENT_IDX)) != 0;
+    vqpci->vq.packed = (feat & (1ull << VIRTIO_F_RING_PACKED)) != 0;
+
+    vqpci->msix_entry = -1;
+
+    /* Check different than 0 */
+    g_assert_cmpint(vqpci->vq.size, !=, 0);
+
+    /* Check power of 2 */
+    g_assert_cmpint(vqpci->vq.size & (vqpci->vq.size - 1), ==, 0);
+
+    if (vqpci->vq.packed) {
+        addr = guest_alloc(alloc, qvring_packed_size(vqpci->vq.size));
+    } else {
+        addr = guest_alloc(alloc, qvring_size(vqpci->vq.size,
+                                              VIRTIO_PCI_VRING_ALIGN));
+    }
+    qvring_init(dev->pdev->bus->qts, alloc, &vqpci->vq, addr);
+
+    qvirtio_pci_modern_writeq(dev, VIRTIO_PCI_COMMON_Q_DESCLO, vqpci->vq.desc);
+    qvirtio_pci_modern_writeq(dev, VIRTIO_PCI_COMMON_Q_AVAILLO,
+                              vqpci->vq.avail);
+    qvirtio_pci_modern_writeq(dev, VIRTIO_PCI_COMMON_Q_USEDLO, vqpci->vq.used);
+    qpci_io_writew(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_Q_ENABLE, 1);
+
+    notify_off = qpci_io_readw(dev->pdev, dev->bar,
+                               dev->common_cfg_offset +
+                               VIRTIO_PCI_COMMON_Q_NOFF);
+    vqpci->notify_offset = dev->notify_cfg_offset +
+                           notify_off * dev->notify_off_multiplier;
+
+    return &vqpci->vq;
+}
+
+static void qvirtio_pci_modern_virtqueue_cleanup(QVirtQueue *vq,
+                                                 QGuestAllocator *alloc)
+{
+    QVirtQueuePCI *vqpci = container_of(vq, QVirtQueuePCI, vq);
+
+    guest_free(alloc, vq->desc);
+    g_free(vq->packed_bufs);
+    g_free(vqpci);
+}
+
+static void qvirtio_pci_modern_virtqueue_kick(QVirtioDevice *d,
+                                              QVirtQueue *vq)
+{
+    QVirtioPCIDevice *dev = container_of(d, QVirtioPCIDevice, vdev);
+    QVirtQueuePCI *vqpci = container_of(vq, QVirtQueuePCI, vq);
+
+    qpci_io_writew(dev->pdev, dev->bar, vqpci->notify_offset, vq->index);
+}
+
+const QVirtioBus qvirtio_pci_modern = {
+    .config_readb = qvirtio_pci_modern_config_readb,
+    .config_readw = qvirtio_pci_modern_config_readw,
+    .config_readl = qvirtio_pci_modern_config_readl,
+    .config_readq = qvirtio_pci_modern_config_readq,
+    .get_features = qvirtio_pci_modern_get_features,
+    .set_features = qvirtio_pci_modern_set_features,
+    .get_guest_features = qvirtio_pci_modern_get_guest_features,
+    .get_status = qvirtio_pci_modern_get_status,
+    .set_status = qvirtio_pci_modern_set_status,
+    .get_queue_isr_status = qvirtio_pci_modern_get_queue_isr_status,
+    .get_config_isr_status = qvirtio_pci_modern_get_config_isr_status,
+    .queue_select = qvirtio_pci_modern_queue_select,
+    .get_queue_size = qvirtio_pci_modern_get_queue_size,
+    .set_queue_address = qvirtio_pci_modern_set_queue_address,
+    .virtqueue_setup = qvirtio_pci_modern_virtqueue_setup,
+    .virtqueue_cleanup = qvirtio_pci_modern_virtqueue_cleanup,
+    .virtqueue_kick = qvirtio_pci_modern_virtqueue_kick,
+};
+
+/*
+ * Set up @dev to be driven through its virtio 1.0 registers if it is a
+ * modern-only device.  Transitional devices keep using the legacy layout.
+ *
+ * Returns: true if @dev is a modern-only device
+ */
+bool qvirtio_pci_init_modern(QVirtioPCIDevice *dev)
+{
+    QPCIDevice *pdev = dev->pdev;
+    uint16_t device_id = qpci_config_readw(pdev, PCI_DEVICE_ID);
+    unsigned found = 0;
+    uint8_t addr;
+
+    if (device_id < VIRTIO_PCI_MODERN_DEVICE_ID_BASE) {
+        return false;
+    }
+
+    addr = qpci_config_readb(pdev, PCI_CAPABILITY_LIST);
+    for (; addr; addr = qpci_config_readb(pdev, addr + PCI_CAP_LIST_NEXT)) {
+        uint8_t cfg_type, bar;
+        uint32_t offset;
+
+        if (qpci_config_readb(pdev, addr) != PCI_CAP_ID_VNDR) {
+            continue;
+        }
+
+        cfg_type = qpci_config_readb(pdev, addr + VIRTIO_PCI_CAP_CFG_TYPE);
+        bar = qpci_config_readb(pdev, addr + VIRTIO_PCI_CAP_BAR);
+        offset = qpci_config_readl(pdev, addr + VIRTIO_PCI_CAP_OFFSET);
+
+        switch (cfg_type) {
+        case VIRTIO_PCI_CAP_COMMON_CFG:
+            dev->common_cfg_offset = offset;
+            break;
+        case VIRTIO_PCI_CAP_NOTIFY_CFG:
+            dev->notify_cfg_offset = offset;
+            dev->notify_off_multiplier = qpci_config_readl(pdev,
+                addr + offsetof(struct virtio_pci_notify_cap,
+                                notify_off_multiplier));
+            break;
+        case VIRTIO_PCI_CAP_ISR_CFG:
+            dev->isr_cfg_offset = offset;
+            break;
+        case VIRTIO_PCI_CAP_DEVICE_CFG:
+            dev->device_cfg_offset = offset;
+            break;
+        default:
+            continue;
+        }
+
+        /* Only one BAR is mapped, so all structures must be in it */
+        if (found) {
+            g_assert_cmpint(bar, ==, dev->bar_idx);
+        }
+        dev->bar_idx = bar;
+        found |= 1u << cfg_type;
+    }
+
+    g_assert_cmphex(found, ==, (1u << VIRTIO_PCI_CAP_COMMON_CFG) |
+                               (1u << VIRTIO_PCI_CAP_NOTIFY_CFG) |
+                               (1u << VIRTIO_PCI_CAP_ISR_CFG) |
+                               (1u << VIRTIO_PCI_CAP_DEVICE_CFG));
+
+    dev->vdev.device_type = device_id - VIRTIO_PCI_MODERN_DEVICE_ID_BASE;
+    dev->vdev.bus = &qvirtio_pci_modern;
+    dev->vdev.big_endian = false;
+    return true;
+}
@@ -19,9 +19,17 @@ typedef struct QVirtioPCIDevice {
     QVirtioDevice vdev;
     QPCIDevice *pdev;
     QPCIBar bar;
+    int bar_idx;
     uint16_t config_msix_entry;
     uint64_t config_msix_addr;
     uint32_t config_msix_data;
+
+    /* Offsets in @bar of the virtio 1.0 structures, modern devices only */
+    uint32_t common_cfg_offset;
+    uint32_t notify_cfg_offset;
+    uint32_t notify_off_multiplier;
+    uint32_t isr_cfg_offset;
+    uint32_t device_cfg_offset;
 } QVirtioPCIDevice;
 
 typedef struct QVirtQueuePCI {
@@ -29,9 +37,15 @@ typedef struct QVirtQueuePCI {
     uint16_t msix_entry;
     uint64_t msix_addr;
     uint32_t msix_data;
+
+    /* Offset in the device's bar of the queue notifier, modern devices only */
+    uint64_t notify_offset;
 } QVirtQueuePCI;
 
 extern const QVirtioBus qvirtio_pci;
+extern const QVirtioBus qvirtio_pci_modern;
+
+bool qvirtio_pci_init_modern(QVirtioPCIDevice *dev);
 
 void virtio_pci_init(QVirtioPCIDevice *dev, QPCIBus *bus, QPCIAddress * addr);
 QVirtioPCIDevice *virtio_pci_new(QPCIBus *bus, QPCIAddress * addr);
@@ -8,6 +8,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "libqtest.h"
 #include "libqos/virtio.h"
 #include "standard-headers/linux/virtio_config.h"
@@ -33,15 +34,24 @@ uint64_t qvirtio_config_readq(QVirtioDevice *d, uint64_t addr)
     return d->bus->config_readq(d, addr);
 }
 
-uint32_t qvirtio_get_features(QVirtioDevice *d)
+uint64_t qvirtio_get_features(QVirtioDevice *d)
 {
     return d->bus->get_features(d);
 }
 
-void qvirtio_set_features(QVirtioDevice *d, uint32_t features)
+void qvirtio_set_features(QVirtioDevice *d, uint64_t features)
 {
     d->features = features;
     d->bus->set_features(d, features);
+
+    /* virtio 1.0 devices must accept the features before going live */
+    if (features & (1ull << VIRTIO_F_VERSION_1)) {
+        d->bus->set_status(d, d->bus->get_status(d) |
+                           VIRTIO_CONFIG_S_FEATURES_OK);
+        g_assert_cmphex(d->bus->get_status(d), ==,
+                        VIRTIO_CONFIG_S_FEATURES_OK |
+                        VIRTIO_CONFIG_S_DRIVER | VIRTIO_CONFIG_S_ACKNOWLEDGE);
+    }
 }
 
 QVirtQueue *qvirtqueue_setup(QVirtioDevice *d,
@@ -77,9 +87,15 @@ void qvirtio_set_driver(QVirtioDevice *d)
 
 void qvirtio_set_driver_ok(QVirtioDevice *d)
 {
+    uint8_t status = VIRTIO_CONFIG_S_DRIVER_OK |
+                     VIRTIO_CONFIG_S_DRIVER | VIRTIO_CONFIG_S_ACKNOWLEDGE;
+
+    if (d->features & (1ull << VIRTIO_F_VERSION_1)) {
+        status |= VIRTIO_CONFIG_S_FEATURES_OK;
+    }
+
     d->bus->set_status(d, d->bus->get_status(d) | VIRTIO_CONFIG_S_DRIVER_OK);
-    g_assert_cmphex(d->bus->get_status(d), ==, VIRTIO_CONFIG_S_DRIVER_OK |
-                    VIRTIO_CONFIG_S_DRIVER | VIRTIO_CONFIG_S_ACKNOWLEDGE);
+    g_assert_cmphex(d->bus->get_status(d), ==, status);
 }
 
 void qvirtio_wait_queue_isr(QVirtioDevice *d,
@@ -162,11 +178,67 @@ void qvirtio_wait_config_isr(QVirtioDevice *d, gint64 timeout_us)
     }
 }
 
+/*
+ * Packed rings are only available to virtio 1.0 devices, whose rings are
+ * little-endian whatever the guest is.
+ */
+static uint16_t qvring_le_readw(uint64_t addr)
+{
+    uint16_t val = readw(addr);
+
+    return qtest_big_endian(global_qtest) ? bswap16(val) : val;
+}
+
+static uint32_t qvring_le_readl(uint64_t addr)
+{
+    uint32_t val = readl(addr);
+
+    return qtest_big_endian(global_qtest) ? bswap32(val) : val;
+}
+
+static void qvring_le_writew(uint64_t addr, uint16_t val)
+{
+    writew(addr, qtest_big_endian(global_qtest) ? bswap16(val) : val);
+}
+
+static void qvring_le_writel(uint64_t addr, uint32_t val)
+{
+    writel(addr, qtest_big_endian(global_qtest) ? bswap32(val) : val);
+}
+
+static void qvring_le_writeq(uint64_t addr, uint64_t val)
+{
+    writeq(addr, qtest_big_endian(global_qtest) ? bswap64(val) : val);
+}
+
+static void qvring_packed_init(QTestState *qts, QVirtQueue *vq, uint64_t addr)
+{
+    vq->desc = addr;
+    vq->avail = vq->desc + vq->size * sizeof(struct vring_packed_desc);
+    vq->used = vq->avail + sizeof(struct vring_packed_desc_event);
+
+    /*
+     * Descriptors with neither flag set are not available in the first
+     * lap, and zeroed event structures enable notifications.
+     */
+    qtest_memset(qts, addr, 0, qvring_packed_size(vq->size));
+
+    vq->avail_wrap_counter = true;
+    vq->used_wrap_counter = true;
+    vq->packed_chaining = false;
+    vq->packed_bufs = g_new0(QVRingPackedBuf, vq->size);
+}
+
 void qvring_init(QTestState *qts, const QGuestAllocator *alloc, QVirtQueue *vq,
                  uint64_t addr)
 {
     int i;
 
+    if (vq->packed) {
+        qvring_packed_init(qts, vq, addr);
+        return;
+    }
+
     vq->desc = addr;
     vq->avail = vq->desc + vq->size * sizeof(struct vring_desc);
     vq->used = (uint64_t)((vq->avail + sizeof(uint16_t) * (3 + vq->size)
@@ -238,10 +310,68 @@ void qvring_indirect_desc_add(QVRingIndirectDesc *indirect, uint64_t data,
     indirect->index++;
 }
 
+static uint32_t qvirtqueue_add_packed(QVirtQueue *vq, uint64_t data,
+                                      uint32_t len, bool write, bool next)
+{
+    uint32_t idx = vq->free_head;
+    uint64_t desc = vq->desc + sizeof(struct vring_packed_desc) * idx;
+    QVRingPackedBuf *buf;
+    uint16_t flags = 0;
+
+    g_assert_cmpint(vq->num_free, >, 0);
+    vq->num_free--;
+
+    if (!vq->packed_chaining) {
+        vq->packed_head = idx;
+        vq->packed_bufs[idx].ndescs = 0;
+    }
+    buf = &vq->packed_bufs[vq->packed_head];
+    buf->ndescs++;
+
+    if (write) {
+        flags |= VRING_DESC_F_WRITE;
+    }
+
+    if (next) {
+        flags |= VRING_DESC_F_NEXT;
+    }
+
+    if (vq->avail_wrap_counter) {
+        flags |= 1 << VRING_PACKED_DESC_F_AVAIL;
+    } else {
+        flags |= 1 << VRING_PACKED_DESC_F_USED;
+    }
+
+    /* vq->desc[idx].addr */
+    qvring_le_writeq(desc, data);
+    /* vq->desc[idx].len */
+    qvring_le_writel(desc + 8, len);
+    /* vq->desc[idx].id */
+    qvring_le_writew(desc + 12, vq->packed_head);
+    if (idx == vq->packed_head) {
+        buf->flags = flags;
+    } else {
+        /* vq->desc[idx].flags */
+        qvring_le_writew(desc + 14, flags);
+    }
+
+    vq->packed_chaining = next;
+    if (++vq->free_head == vq->size) {
+        vq->free_head = 0;
+        vq->avail_wrap_counter = !vq->avail_wrap_counter;
+    }
+    return idx;
+}
+
 uint32_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len, bool write,
                                                                     bool next)
 {
     uint16_t flags = 0;
+
+    if (vq->packed) {
+        return qvirtqueue_add_packed(vq, data, len, write, next);
+    }
+
     vq->num_free--;
 
     if (write) {
@@ -264,6 +394,7 @@ uint32_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len, bool write,
 
 uint32_t qvirtqueue_add_indirect(QVirtQueue *vq, QVRingIndirectDesc *indirect)
 {
+    g_assert(!vq->packed);
     g_assert(vq->indirect);
     g_assert_cmpint(vq->size, >=, indirect->elem);
     g_assert_cmpint(indirect->index, ==, indirect->elem);
@@ -281,15 +412,66 @@ uint32_t qvirtqueue_add_indirect(QVirtQueue *vq, QVRingIndirectDesc *indirect)
     return vq->free_head++; /* Return and increase, in this order */
 }
 
+static void qvirtqueue_kick_packed(QVirtioDevice *d, QVirtQueue *vq,
+                                   uint32_t head)
+{
+    QVRingPackedBuf *buf = &vq->packed_bufs[head];
+    bool wrap = buf->flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    uint16_t new = head + buf->ndescs;
+    uint16_t old = head;
+    uint16_t off_wrap;
+    uint16_t flags;
+    uint16_t event;
+
+    /* vq->desc[head].flags, this makes the whole chain available */
+    qvring_le_writew(vq->desc + sizeof(struct vring_packed_desc) * head + 14,
+                     buf->flags);
+
+    /* Must read after the flags are updated */
+    /* vq->used->off_wrap */
+    off_wrap = qvring_le_readw(vq->used);
+    /* vq->used->flags */
+    flags = qvring_le_readw(vq->used + 2);
+
+    if (new >= vq->size) {
+        new -= vq->size;
+        old -= vq->size;
+        wrap = !wrap;
+    }
+
+    if (flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return;
+    }
+
+    if (flags == VRING_PACKED_EVENT_FLAG_DESC) {
+        event = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+        if (wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+            event -= vq->size;
+        }
+        if (!vring_need_event(event, new, old)) {
+            return;
+        }
+    }
+
+    d->bus->virtqueue_kick(d, vq);
+}
+
 void qvirtqueue_kick(QVirtioDevice *d, QVirtQueue *vq, uint32_t free_head)
 {
     /* vq->avail->idx */
-    uint16_t idx = readw(vq->avail + 2);
+    uint16_t idx;
     /* vq->used->flags */
     uint16_t flags;
     /* vq->used->avail_event */
     uint16_t avail_event;
 
+    if (vq->packed) {
+        qvirtqueue_kick_packed(d, vq, free_head);
+        return;
+    }
+
+    idx = readw(vq->avail + 2);
+
     /* vq->avail->ring[idx % vq->size] */
     writew(vq->avail + 4 + (2 * (idx % vq->size)), free_head);
     /* vq->avail->idx */
@@ -317,11 +499,52 @@ void qvirtqueue_kick(QVirtioDevice *d, QVirtQueue *vq, uint32_t free_head)
  *
  * Returns: true if an element was ready, false otherwise
  */
+static bool qvirtqueue_get_buf_packed(QVirtQueue *vq, uint32_t *desc_idx,
+                                      uint32_t *len)
+{
+    uint64_t desc = vq->desc +
+        sizeof(struct vring_packed_desc) * vq->last_used_idx;
+    /* vq->desc[vq->last_used_idx].flags */
+    uint16_t flags = qvring_le_readw(desc + 14);
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+    uint16_t id;
+
+    if (avail != used || used != vq->used_wrap_counter) {
+        return false;
+    }
+
+    /* vq->desc[vq->last_used_idx].id */
+    id = qvring_le_readw(desc + 12);
+    g_assert_cmpint(id, <, vq->size);
+
+    if (desc_idx) {
+        *desc_idx = id;
+    }
+
+    if (len) {
+        /* vq->desc[vq->last_used_idx].len */
+        *len = qvring_le_readl(desc + 8);
+    }
+
+    vq->num_free += vq->packed_bufs[id].ndescs;
+    vq->last_used_idx += vq->packed_bufs[id].ndescs;
+    if (vq->last_used_idx >= vq->size) {
+        vq->last_used_idx -= vq->size;
+        vq->used_wrap_counter = !vq->used_wrap_counter;
+    }
+    return true;
+}
+
 bool qvirtqueue_get_buf(QVirtQueue *vq, uint32_t *desc_idx, uint32_t *len)
 {
     uint16_t idx;
     uint64_t elem_addr;
 
+    if (vq->packed) {
+        return qvirtqueue_get_buf_packed(vq, desc_idx, len);
+    }
+
     idx = readw(vq->used + offsetof(struct vring_used, idx));
     if (idx == vq->last_used_idx) {
         return false;
@@ -344,14 +567,58 @@ bool qvirtqueue_get_buf(QVirtQueue *vq, uint32_t *desc_idx, uint32_t *len)
     return true;
 }
 
+/*
+ * qvirtqueue_set_used_event:
+ * @idx: For split rings, the used index after which the device should
+ *       notify.  For packed rings, the descriptor whose use should be
+ *       notified; it is taken to be in the next lap if it is behind the
+ *       next used descriptor.
+ */
 void qvirtqueue_set_used_event(QVirtQueue *vq, uint16_t idx)
 {
+    bool wrap;
+
     g_assert(vq->event);
 
+    if (vq->packed) {
+        g_assert_cmpint(idx, <, vq->size);
+        wrap = vq->used_wrap_counter;
+        if (idx < vq->last_used_idx) {
+            wrap = !wrap;
+        }
+        /* vq->avail->off_wrap */
+        qvring_le_writew(vq->avail,
+                         idx | wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+        /* vq->avail->flags */
+        qvring_le_writew(vq->avail + 2, VRING_PACKED_EVENT_FLAG_DESC);
+        return;
+    }
+
     /* vq->avail->used_event */
     writew(vq->avail + 4 + (2 * vq->size), idx);
 }
 
+/*
+ * qvirtqueue_set_used_notify:
+ * @enable: Whether the device should notify used buffers
+ *
+ * For split rings, this has no effect if VIRTIO_RING_F_EVENT_IDX was
+ * negotiated; use qvirtqueue_set_used_event() instead.
+ */
+void qvirtqueue_set_used_notify(QVirtQueue *vq, bool enable)
+{
+    if (vq->packed) {
+        /* vq->avail->flags */
+        qvring_le_writew(vq->avail + 2,
+                         enable ? VRING_PACKED_EVENT_FLAG_ENABLE :
+                                  VRING_PACKED_EVENT_FLAG_DISABLE);
+        return;
+    }
+
+    /* vq->avail->flags */
+    writew(vq->avail, enable ? 0 : VRING_AVAIL_F_NO_INTERRUPT);
+}
+
 void qvirtio_start_device(QVirtioDevice *vdev)
 {
     qvirtio_reset(vdev);
@@ -25,6 +25,16 @@ typedef struct QVirtioDevice {
     bool big_endian;
 } QVirtioDevice;
 
+/*
+ * A packed ring buffer is identified by the index of its first descriptor.
+ * The flags of that descriptor are only written by qvirtqueue_kick(), so
+ * that the device never sees a partially built descriptor chain.
+ */
+typedef struct QVRingPackedBuf {
+    uint16_t ndescs;
+    uint16_t flags;
+} QVRingPackedBuf;
+
 typedef struct QVirtQueue {
     uint64_t desc; /* This points to an array of struct vring_desc */
     uint64_t avail; /* This points to a struct vring_avail */
@@ -37,6 +47,17 @@ typedef struct QVirtQueue {
     uint16_t last_used_idx;
     bool indirect;
     bool event;
+    /*
+     * Packed ring state, only valid if VIRTIO_F_RING_PACKED was negotiated.
+     * In that case avail and used point to the driver and device event
+     * suppression structures.
+     */
+    bool packed;
+    bool avail_wrap_counter;
+    bool used_wrap_counter;
+    bool packed_chaining; /* the last descriptor added had the next flag */
+    uint16_t packed_head; /* first descriptor of the buffer being added */
+    QVRingPackedBuf *packed_bufs; /* indexed by buffer id */
 } QVirtQueue;
 
 typedef struct QVRingIndirectDesc {
@@ -52,13 +73,13 @@ struct QVirtioBus {
     uint64_t (*config_readq)(QVirtioDevice *d, uint64_t addr);
 
     /* Get features of the device */
-    uint32_t (*get_features)(QVirtioDevice *d);
+    uint64_t (*get_features)(QVirtioDevice *d);
 
     /* Set features of the device */
-    void (*set_features)(QVirtioDevice *d, uint32_t features);
+    void (*set_features)(QVirtioDevice *d, uint64_t features);
 
     /* Get features of the guest */
-    uint32_t (*get_guest_features)(QVirtioDevice *d);
+    uint64_t (*get_guest_features)(QVirtioDevice *d);
 
     /* Get status of the device */
     uint8_t (*get_status)(QVirtioDevice *d);
@@ -99,12 +120,18 @@ static inline uint32_t qvring_size(uint32_t num, uint32_t align)
         + sizeof(uint16_t) * 3 + sizeof(struct vring_used_elem) * num;
 }
 
+static inline uint32_t qvring_packed_size(uint32_t num)
+{
+    return sizeof(struct vring_packed_desc) * num +
+        sizeof(struct vring_packed_desc_event) * 2;
+}
+
 uint8_t qvirtio_config_readb(QVirtioDevice *d, uint64_t addr);
 uint16_t qvirtio_config_readw(QVirtioDevice *d, uint64_t addr);
 uint32_t qvirtio_config_readl(QVirtioDevice *d, uint64_t addr);
 uint64_t qvirtio_config_readq(QVirtioDevice *d, uint64_t addr);
-uint32_t qvirtio_get_features(QVirtioDevice *d);
-void qvirtio_set_features(QVirtioDevice *d, uint32_t features);
+uint64_t qvirtio_get_features(QVirtioDevice *d);
+void qvirtio_set_features(QVirtioDevice *d, uint64_t features);
 bool qvirtio_is_big_endian(QVirtioDevice *d);
 
 void qvirtio_reset(QVirtioDevice *d);
@@ -142,6 +169,7 @@ void qvirtqueue_kick(QVirtioDevice *d, QVirtQueue *vq, uint32_t free_head);
 bool qvirtqueue_get_buf(QVirtQueue *vq, uint32_t *desc_idx, uint32_t *len);
 
 void qvirtqueue_set_used_event(QVirtQueue *vq, uint16_t idx);
+void qvirtqueue_set_used_notify(QVirtQueue *vq, bool enable);
 
 void qvirtio_start_device(QVirtioDevice *vdev);
 
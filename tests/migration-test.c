@@ -15,6 +15,7 @@
 #include "libqtest.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -34,6 +35,7 @@ unsigned start_address;
 unsigned end_address;
 bool got_stop;
 static bool uffd_feature_thread_id;
+static bool uffd_feature_wp;
 
 #if defined(__linux__)
 #include <sys/syscall.h>
@@ -64,6 +66,7 @@ static bool ufd_version_check(void)
         return false;
     }
     uffd_feature_thread_id = api_struct.features & UFFD_FEATURE_THREAD_ID;
+    uffd_feature_wp = api_struct.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP;
 
     ioctl_mask = (__u64)1 << _UFFDIO_REGISTER |
                  (__u64)1 << _UFFDIO_UNREGISTER;
@@ -438,6 +441,19 @@ static void migrate_set_parameter_int(QTestState *who, const char *parameter,
     migrate_check_parameter_int(who, parameter, value);
 }
 
+static void migrate_set_parameter_str(QTestState *who, const char *parameter,
+                                      const char *value)
+{
+    QDict *rsp;
+
+    rsp = qtest_qmp(who,
+                    "{ 'execute': 'migrate-set-parameters',"
+                    "'arguments': { %s: %s } }",
+                    parameter, value);
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+}
+
 static void migrate_pause(QTestState *who)
 {
     QDict *rsp;
@@ -727,7 +743,8 @@ static void test_deprecated(void)
 
 static int migrate_postcopy_prepare(QTestState **from_ptr,
                                      QTestState **to_ptr,
-                                     bool hide_error)
+                                     bool hide_error,
+                                     bool preempt)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     QTestState *from, *to;
@@ -739,6 +756,10 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(from, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
+    if (preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
 
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
@@ -779,7 +800,18 @@ static void test_postcopy(void)
 {
     QTestState *from, *to;
 
-    if (migrate_postcopy_prepare(&from, &to, false)) {
+    if (migrate_postcopy_prepare(&from, &to, false, false)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_preempt(void)
+{
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, false, true)) {
         return;
     }
     migrate_postcopy_start(from, to);
@@ -791,7 +823,7 @@ static void test_postcopy_recovery(void)
     QTestState *from, *to;
     char *uri;
 
-    if (migrate_postcopy_prepare(&from, &to, true)) {
+    if (migrate_postcopy_prepare(&from, &to, true, false)) {
         return;
     }
 
@@ -948,6 +980,123 @@ static void test_ignore_shared(void)
 }
 #endif
 
+static void test_background_snapshot(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+
+    if (!uffd_feature_wp) {
+        g_test_message("Skipping test: userfaultfd write protection "
+                       "not available");
+        g_free(uri);
+        return;
+    }
+
+    if (test_migrate_start(&from, &to, uri, false, false)) {
+        g_free(uri);
+        return;
+    }
+
+    migrate_set_capability(from, "background-snapshot", true);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    /*
+     * The snapshot is taken at the start of the migration, while the
+     * guest keeps changing its memory; the destination must still see
+     * consistent RAM.
+     */
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+/*
+ * Measure the dirty rate of the running guest and check that the pages
+ * dirtied by the test loop show up, both in the total and in the heatmap.
+ */
+static void test_dirty_rate_mode(QTestState *who, const char *mode)
+{
+    QDict *rsp_return;
+    QList *blocks;
+    const QListEntry *entry;
+    const char *status;
+    uint64_t dirty_pages = 0;
+
+    rsp_return = wait_command(who, "{ 'execute': 'calc-dirty-rate',"
+                              "  'arguments': { 'calc-time': 1,"
+                              "                 'mode': %s,"
+                              "                 'heatmap-regions': 4 } }",
+                              mode);
+    qobject_unref(rsp_return);
+
+    for (;;) {
+        usleep(100 * 1000);
+        rsp_return = wait_command(who, "{ 'execute': 'query-dirty-rate' }");
+        status = qdict_get_str(rsp_return, "status");
+        if (!strcmp(status, "measured")) {
+            break;
+        }
+        g_assert_cmpstr(status, ==, "measuring");
+        qobject_unref(rsp_return);
+    }
+
+    g_assert_cmpstr(qdict_get_str(rsp_return, "mode"), ==, mode);
+    g_assert_cmpint(qdict_get_int(rsp_return, "dirty-rate"), >, 0);
+
+    blocks = qdict_get_qlist(rsp_return, "blocks");
+    g_assert(blocks);
+    QLIST_FOREACH_ENTRY(blocks, entry) {
+        QDict *block = qobject_to(QDict, qlist_entry_obj(entry));
+        QList *heatmap = qdict_get_qlist(block, "heatmap");
+
+        g_assert_cmpint(qdict_get_int(block, "dirty-pages"), <=,
+                        qdict_get_int(block, "sample-pages"));
+        g_assert_cmpint(qlist_size(heatmap), ==, 4);
+        dirty_pages += qdict_get_int(block, "dirty-pages");
+    }
+    g_assert_cmpint(dirty_pages, >, 0);
+
+    qobject_unref(rsp_return);
+}
+
+static void test_dirty_rate(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, uri, false, false)) {
+        g_free(uri);
+        return;
+    }
+
+    /* Wait for the guest to start dirtying its memory */
+    wait_for_serial("src_serial");
+
+    test_dirty_rate_mode(from, "page-sampling");
+    test_dirty_rate_mode(from, "dirty-bitmap");
+
+    /* The test does not enable the KVM dirty ring */
+    rsp = qtest_qmp(from, "{ 'execute': 'calc-dirty-rate',"
+                    "  'arguments': { 'calc-time': 1,"
+                    "                 'mode': 'dirty-ring' } }");
+    g_assert_true(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, false);
+    g_free(uri);
+}
+
 static void test_xbzrle(const char *uri)
 {
     QTestState *from, *to;
@@ -1126,6 +1275,140 @@ static void test_migrate_fd_proto(void)
     test_migrate_end(from, to, true);
 }
 
+static void test_mapped_ram(bool multifd)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    char *filename = g_strdup_printf("%s/migfile", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", false, false)) {
+        goto out;
+    }
+
+    /* 1 ms should make it not converge, so pages are written again */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+    if (multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300ms should converge */
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    /* The whole file is there now, load it */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+
+out:
+    unlink(filename);
+    g_free(filename);
+    g_free(uri);
+}
+
+static void test_mapped_ram_file(void)
+{
+    test_mapped_ram(false);
+}
+
+static void test_mapped_ram_multifd_file(void)
+{
+    test_mapped_ram(true);
+}
+
+static void test_multifd_tcp(const char *method)
+{
+    char *uri;
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, "tcp:127.0.0.1:0", false, false)) {
+        return;
+    }
+
+    /*
+     * We want to pick a speed slow enough that the test completes
+     * quickly, but that it doesn't complete precopy even on a slow
+     * machine, so also set the downtime.
+     */
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter_int(from, "multifd-channels", 2);
+    migrate_set_parameter_int(to, "multifd-channels", 2);
+
+    migrate_set_parameter_str(from, "multifd-compression", method);
+    migrate_set_parameter_str(to, "multifd-compression", method);
+
+    migrate_set_capability(from, "multifd", "true");
+    migrate_set_capability(to, "multifd", "true");
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    uri = migrate_get_socket_address(to, "socket-address");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300ms it should converge */
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_multifd_tcp_none(void)
+{
+    test_multifd_tcp("none");
+}
+
+static void test_multifd_tcp_zlib(void)
+{
+    test_multifd_tcp("zlib");
+}
+
+#ifdef CONFIG_ZSTD
+static void test_multifd_tcp_zstd(void)
+{
+    test_multifd_tcp("zstd");
+}
+#endif
+
 int main(int argc, char **argv)
 {
     char template[] = "/tmp/migration-test-XXXXXX";
@@ -1174,13 +1457,24 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
+    qtest_add_func("/migration/background-snapshot", test_background_snapshot);
+    qtest_add_func("/migration/dirty-rate", test_dirty_rate);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/mapped-ram/file", test_mapped_ram_file);
+    qtest_add_func("/migration/mapped-ram/multifd/file",
+                   test_mapped_ram_multifd_file);
+    qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
+#ifdef CONFIG_ZSTD
+    qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
+#endif
 
     ret = g_test_run();
 
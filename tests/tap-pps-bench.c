@@ -0,0 +1,277 @@
+/*
+ * Packet rate benchmark for the tap backend (Linux only)
+ *
+ * Run it on the host against the tap interface of a running guest:
+ *
+ *  - "rx" mode floods the interface with small UDP frames from an
+ *    AF_PACKET socket. Each frame that QEMU reads from the tap fd is
+ *    counted by the kernel in the tx_packets statistics of the interface;
+ *    frames that QEMU did not read in time are counted in tx_dropped.
+ *  - "tx" mode only samples the rx_packets statistics, i.e. the frames
+ *    that QEMU wrote to the tap fd, while the guest generates traffic.
+ *
+ * The interface must be up. Flooding needs CAP_NET_RAW.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+
+#define MAX_BATCH 256
+#define MAX_FRAME_SIZE 1514
+
+static const char *ifname;
+static bool tx_mode;
+static unsigned int duration = 10;
+static unsigned int frame_size = 64;
+static unsigned int batch = 32;
+static unsigned int flows = 1;
+static uint8_t dest_mac[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static const char commands_string[] =
+    " -i = tap interface (required)\n"
+    " -m = mode: 'rx' (guest receives, default) or 'tx' (guest sends)\n"
+    " -d = duration in seconds\n"
+    " -s = frame size in bytes, 60-1514 (rx mode)\n"
+    " -b = frames per sendmmsg() call, 1-256 (rx mode)\n"
+    " -f = number of UDP flows, i.e. source ports (rx mode)\n"
+    " -M = destination MAC address, default broadcast (rx mode)";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static uint64_t read_stat(const char *name)
+{
+    char *path = g_strdup_printf("/sys/class/net/%s/statistics/%s",
+                                 ifname, name);
+    char *contents = NULL;
+    uint64_t val = 0;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        fprintf(stderr, "cannot read %s\n", path);
+        exit(1);
+    }
+    val = g_ascii_strtoull(contents, NULL, 10);
+    g_free(contents);
+    g_free(path);
+    return val;
+}
+
+static void build_frame(uint8_t *frame, uint16_t src_port)
+{
+    struct eth_header *eth = (struct eth_header *)frame;
+    struct ip_header *ip = (struct ip_header *)(eth + 1);
+    struct udp_header *udp = (struct udp_header *)(ip + 1);
+    static const uint8_t src_mac[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 1 };
+    size_t ip_len = frame_size - sizeof(*eth);
+
+    memset(frame, 0, frame_size);
+    memcpy(eth->h_dest, dest_mac, ETH_ALEN);
+    memcpy(eth->h_source, src_mac, ETH_ALEN);
+    eth->h_proto = cpu_to_be16(ETH_P_IP);
+
+    ip->ip_ver_len = (IP_HEADER_VERSION_4 << 4) | (sizeof(*ip) >> 2);
+    ip->ip_len = cpu_to_be16(ip_len);
+    ip->ip_ttl = 64;
+    ip->ip_p = IP_PROTO_UDP;
+    ip->ip_src = cpu_to_be32(0xc6120001); /* 198.18.0.1 */
+    ip->ip_dst = cpu_to_be32(0xc6120002); /* 198.18.0.2 */
+    ip->ip_sum = cpu_to_be16(net_raw_checksum((uint8_t *)ip, sizeof(*ip)));
+
+    udp->uh_sport = cpu_to_be16(src_port);
+    udp->uh_dport = cpu_to_be16(9); /* discard */
+    udp->uh_ulen = cpu_to_be16(ip_len - sizeof(*ip));
+}
+
+static int open_packet_socket(void)
+{
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = cpu_to_be16(ETH_P_IP),
+        .sll_ifindex = if_nametoindex(ifname),
+    };
+    int fd;
+
+    if (!sll.sll_ifindex) {
+        fprintf(stderr, "no such interface: %s\n", ifname);
+        exit(1);
+    }
+
+    fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd < 0) {
+        perror("socket(AF_PACKET)");
+        exit(1);
+    }
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+#ifdef PACKET_QDISC_BYPASS
+    {
+        /* Not fatal: the qdisc only adds overhead on the sender side */
+        int one = 1;
+
+        setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+    }
+#endif
+    return fd;
+}
+
+static void run(void)
+{
+    static uint8_t frames[MAX_BATCH][MAX_FRAME_SIZE];
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH];
+    uint64_t next_ns, now_ns;
+    uint64_t sent = 0, last_sent = 0;
+    uint64_t first_done, first_drop, last_done, last_drop;
+    const char *done_stat = tx_mode ? "rx_packets" : "tx_packets";
+    unsigned int i, seconds = 0;
+    int fd = -1;
+
+    if (!tx_mode) {
+        fd = open_packet_socket();
+        for (i = 0; i < batch; i++) {
+            build_frame(frames[i], 1024 + i % flows);
+            iovs[i].iov_base = frames[i];
+            iovs[i].iov_len = frame_size;
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    first_done = last_done = read_stat(done_stat);
+    first_drop = last_drop = read_stat("tx_dropped");
+    next_ns = get_clock() + NANOSECONDS_PER_SECOND;
+
+    while (seconds < duration) {
+        if (tx_mode) {
+            now_ns = get_clock();
+            if (now_ns < next_ns) {
+                g_usleep((next_ns - now_ns) / SCALE_US);
+            }
+        } else {
+            int ret = sendmmsg(fd, msgs, batch, 0);
+
+            if (ret < 0 && errno != EAGAIN && errno != ENOBUFS &&
+                errno != EINTR) {
+                perror("sendmmsg");
+                exit(1);
+            }
+            if (ret > 0) {
+                sent += ret;
+            }
+        }
+
+        now_ns = get_clock();
+        if (now_ns >= next_ns) {
+            uint64_t done = read_stat(done_stat);
+            uint64_t drop = read_stat("tx_dropped");
+
+            if (tx_mode) {
+                printf("%3u: %" PRIu64 " pps sent by the guest\n",
+                       seconds + 1, done - last_done);
+            } else {
+                printf("%3u: %" PRIu64 " pps injected, %" PRIu64
+                       " pps read by QEMU, %" PRIu64 " pps dropped\n",
+                       seconds + 1, sent - last_sent, done - last_done,
+                       drop - last_drop);
+            }
+            last_sent = sent;
+            last_done = done;
+            last_drop = drop;
+            next_ns += NANOSECONDS_PER_SECOND;
+            seconds++;
+        }
+    }
+
+    if (tx_mode) {
+        printf("average: %" PRIu64 " pps sent by the guest\n",
+               (last_done - first_done) / duration);
+    } else {
+        printf("average: %" PRIu64 " pps read by QEMU, %" PRIu64
+               " pps dropped\n",
+               (last_done - first_done) / duration,
+               (last_drop - first_drop) / duration);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hi:m:d:s:b:f:M:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'i':
+            ifname = optarg;
+            break;
+        case 'm':
+            if (!strcmp(optarg, "tx")) {
+                tx_mode = true;
+            } else if (strcmp(optarg, "rx")) {
+                usage_complete(argv);
+                exit(1);
+            }
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 's':
+            frame_size = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'f':
+            flows = atoi(optarg);
+            break;
+        case 'M':
+            if (sscanf(optarg, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+                       &dest_mac[0], &dest_mac[1], &dest_mac[2],
+                       &dest_mac[3], &dest_mac[4], &dest_mac[5]) != 6) {
+                fprintf(stderr, "invalid MAC address: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            usage_complete(argv);
+            exit(1);
+        }
+    }
+
+    if (!ifname || frame_size < 60 || frame_size > MAX_FRAME_SIZE ||
+        batch < 1 || batch > MAX_BATCH || flows < 1 || !duration) {
+        usage_complete(argv);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    run();
+    return 0;
+}
@@ -270,7 +270,7 @@ static void test_sync_op_check(BdrvChild *c)
     int ret;
 
     /* Error: Driver does not implement check */
-    ret = bdrv_check(c->bs, &result, 0);
+    ret = bdrv_check(c->bs, &result, 0, NULL, NULL);
     g_assert_cmpint(ret, ==, -ENOTSUP);
 }
 
@@ -92,6 +92,48 @@ static void test_io_channel_fd(void)
 }
 
 
+#ifdef CONFIG_PREADV
+static void test_io_channel_file_pos(void)
+{
+    QIOChannel *ioc;
+    char head[] = "head", tail[] = "tail";
+    char buf[8];
+    struct iovec wiov[2] = {
+        { .iov_base = head, .iov_len = 4 },
+        { .iov_base = tail, .iov_len = 4 },
+    };
+    struct iovec riov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    struct stat st;
+
+    unlink(TEST_FILE);
+    ioc = QIO_CHANNEL(qio_channel_file_new_path(
+                          TEST_FILE,
+                          O_RDWR | O_CREAT | O_TRUNC | O_BINARY, TEST_MASK,
+                          &error_abort));
+    g_assert(qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE));
+
+    /* Positional writes leave a hole and do not move the file offset */
+    g_assert_cmpint(qio_channel_pwritev_all(ioc, wiov, 2, 4096,
+                                            &error_abort), ==, 0);
+    g_assert_cmpint(qio_channel_io_seek(ioc, 0, SEEK_CUR, &error_abort),
+                    ==, 0);
+    g_assert_cmpint(stat(TEST_FILE, &st), ==, 0);
+    g_assert_cmpint(st.st_size, ==, 4096 + sizeof(buf));
+
+    g_assert_cmpint(qio_channel_preadv_all(ioc, &riov, 1, 4096,
+                                           &error_abort), ==, 0);
+    g_assert(memcmp(buf, "headtail", sizeof(buf)) == 0);
+
+    /* Reading past the end of the file is an error */
+    g_assert_cmpint(qio_channel_preadv_all(ioc, &riov, 1, 4100, NULL),
+                    ==, -1);
+
+    unlink(TEST_FILE);
+    object_unref(OBJECT(ioc));
+}
+#endif
+
+
 #ifndef _WIN32
 static void test_io_channel_pipe(bool async)
 {
@@ -137,6 +179,9 @@ int main(int argc, char **argv)
     g_test_add_func("/io/channel/file", test_io_channel_file);
     g_test_add_func("/io/channel/file/rdwr", test_io_channel_file_rdwr);
     g_test_add_func("/io/channel/file/fd", test_io_channel_fd);
+#ifdef CONFIG_PREADV
+    g_test_add_func("/io/channel/file/pos", test_io_channel_file_pos);
+#endif
 #ifndef _WIN32
     g_test_add_func("/io/channel/pipe/sync", test_io_channel_pipe_sync);
     g_test_add_func("/io/channel/pipe/async", test_io_channel_pipe_async);
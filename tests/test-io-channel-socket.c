@@ -443,7 +443,7 @@ static void test_io_channel_unix_fd_pass(void)
                             G_N_ELEMENTS(iosend),
                             fdsend,
                             G_N_ELEMENTS(fdsend),
-                            &error_abort);
+                            0, &error_abort);
 
     qio_channel_readv_full(dst,
                            iorecv,
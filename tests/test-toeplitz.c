@@ -0,0 +1,119 @@
+/*
+ * Toeplitz (RSS) hash unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+/* The verification suite of the Microsoft RSS specification */
+static uint8_t rss_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+typedef struct {
+    const char *src;
+    const char *dst;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint32_t ip_hash;
+    uint32_t tcp_hash;
+} ToeplitzTestData;
+
+static const ToeplitzTestData ipv4_data[] = {
+    { "66.9.149.187", "161.142.100.80", 2794, 1766,
+      0x323e8fc2, 0x51ccc178 },
+    { "199.92.111.2", "65.69.140.83", 14230, 4739,
+      0xd718262a, 0xc626b0ea },
+    { "24.19.198.95", "12.22.207.184", 12898, 38024,
+      0xd2d0a5de, 0x5c2b394a },
+    { "38.27.205.30", "209.142.163.6", 48228, 2217,
+      0x82989176, 0xafc7327f },
+    { "153.39.163.191", "202.188.127.2", 44251, 1303,
+      0x5d1809c5, 0x10e828a2 },
+};
+
+static const ToeplitzTestData ipv6_data[] = {
+    { "3ffe:2501:200:1fff::7", "3ffe:2501:200:3::1", 2794, 1766,
+      0x2cc18cd5, 0x40207d3d },
+    { "3ffe:501:8::260:97ff:fe40:efab", "ff02::1", 14230, 4739,
+      0x0f0c461c, 0xdde51bbf },
+    { "3ffe:1900:4545:3:200:f8ff:fe21:67cf", "fe80::200:f8ff:fe21:67cf",
+      44251, 38024,
+      0x4b61e985, 0x02d1feef },
+};
+
+static uint32_t toeplitz_hash(uint8_t *input, size_t len)
+{
+    net_toeplitz_key key;
+    uint32_t hash = 0;
+
+    net_toeplitz_key_init(&key, rss_key);
+    net_toeplitz_add(&hash, input, len, &key);
+    return hash;
+}
+
+static void check_data(const ToeplitzTestData *data, int af, size_t addr_len)
+{
+    uint8_t input[36];
+    uint16_t port;
+
+    g_assert(inet_pton(af, data->src, input) == 1);
+    g_assert(inet_pton(af, data->dst, input + addr_len) == 1);
+    port = cpu_to_be16(data->src_port);
+    memcpy(input + 2 * addr_len, &port, sizeof(port));
+    port = cpu_to_be16(data->dst_port);
+    memcpy(input + 2 * addr_len + 2, &port, sizeof(port));
+
+    g_assert_cmphex(toeplitz_hash(input, 2 * addr_len), ==, data->ip_hash);
+    g_assert_cmphex(toeplitz_hash(input, 2 * addr_len + 4), ==,
+                    data->tcp_hash);
+}
+
+static void test_toeplitz_ipv4(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ipv4_data); i++) {
+        check_data(&ipv4_data[i], AF_INET, 4);
+    }
+}
+
+static void test_toeplitz_ipv6(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ipv6_data); i++) {
+        check_data(&ipv6_data[i], AF_INET6, 16);
+    }
+}
+
+static void test_toeplitz_split(void)
+{
+    uint8_t input[12] = { 66, 9, 149, 187, 161, 142, 100, 80,
+                          0x0a, 0xea, 0x06, 0xe6 };
+    net_toeplitz_key key;
+    uint32_t hash = 0;
+
+    /* Adding the tuple in pieces gives the same result */
+    net_toeplitz_key_init(&key, rss_key);
+    net_toeplitz_add(&hash, input, 4, &key);
+    net_toeplitz_add(&hash, input + 4, 5, &key);
+    net_toeplitz_add(&hash, input + 9, 3, &key);
+    g_assert_cmphex(hash, ==, 0x51ccc178);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/toeplitz/ipv4", test_toeplitz_ipv4);
+    g_test_add_func("/toeplitz/ipv6", test_toeplitz_ipv6);
+    g_test_add_func("/toeplitz/split", test_toeplitz_split);
+    return g_test_run();
+}
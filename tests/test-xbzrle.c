@@ -13,7 +13,9 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qapi/error.h"
 #include "../migration/xbzrle.h"
+#include "../migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -174,6 +176,118 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * Modify random runs of @buf; the mix of short and long runs, and of
+ * changed bytes that sometimes keep their old value, exercises the run
+ * ends at every position relative to the vector width.
+ */
+static void fuzz_modify(uint8_t *buf, int len)
+{
+    int changes = g_test_rand_int_range(0, 64);
+    int i, j;
+
+    for (i = 0; i < changes; i++) {
+        int start = g_test_rand_int_range(0, len);
+        int run = g_test_rand_int_range(1, g_test_rand_bit() ? 8 : 512);
+
+        for (j = start; j < start + run && j < len; j++) {
+            buf[j] += g_test_rand_int_range(0, 3);
+        }
+    }
+}
+
+static void test_encode_fuzz(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    int i, j;
+
+    /* Compare every accelerated encoder with the portable one */
+    do {
+        for (i = 0; i < 10000; i++) {
+            int len = g_test_rand_bit() ? PAGE_SIZE :
+                      g_test_rand_int_range(0, PAGE_SIZE / 8 + 1) * 8;
+            int dlen = g_test_rand_bit() ? len :
+                       g_test_rand_int_range(0, len + 1);
+            int rc, expected_rc;
+
+            for (j = 0; j < len; j++) {
+                old_buf[j] = g_test_rand_int();
+            }
+            memcpy(new_buf, old_buf, len);
+            fuzz_modify(new_buf, len);
+
+            expected_rc = xbzrle_encode_buffer_int(old_buf, new_buf, len,
+                                                   expected, dlen);
+            rc = xbzrle_encode_buffer(old_buf, new_buf, len, compressed,
+                                      dlen);
+            g_assert_cmpint(rc, ==, expected_rc);
+            if (rc <= 0) {
+                continue;
+            }
+            g_assert(memcmp(compressed, expected, rc) == 0);
+
+            memcpy(decoded, old_buf, len);
+            g_assert_cmpint(xbzrle_decode_buffer(compressed, rc, decoded,
+                                                 len), <=, len);
+            g_assert(memcmp(decoded, new_buf, len) == 0);
+        }
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(expected);
+    g_free(compressed);
+    g_free(decoded);
+}
+
+static void test_page_cache_replace(void)
+{
+    /* A cache of eight pages is a single set */
+    PageCache *cache = cache_init(8 * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint8_t *buf;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        page[0] = i;
+        g_assert_cmpint(cache_insert(cache, i * PAGE_SIZE, page, 0), ==, 0);
+    }
+    for (i = 0; i < 8; i++) {
+        g_assert(cache_is_cached(cache, i * PAGE_SIZE, 0));
+        g_assert_cmpint(get_cached_data(cache, i * PAGE_SIZE)[0], ==, i);
+    }
+
+    /* All pages are fresh, nothing can be replaced */
+    g_assert_cmpint(cache_insert(cache, 8 * PAGE_SIZE, page, 1), ==, -1);
+    g_assert(!cache_is_cached(cache, 8 * PAGE_SIZE, 1));
+
+    /* The page that was not used recently is evicted */
+    for (i = 0; i < 8; i++) {
+        if (i != 3) {
+            g_assert(cache_is_cached(cache, i * PAGE_SIZE, 4));
+        }
+    }
+    page[0] = 8;
+    g_assert_cmpint(cache_insert(cache, 8 * PAGE_SIZE, page, 4), ==, 1);
+    g_assert(!cache_is_cached(cache, 3 * PAGE_SIZE, 4));
+    g_assert_cmpint(get_cached_data(cache, 8 * PAGE_SIZE)[0], ==, 8);
+
+    /* Swapping the data gives back the old buffer */
+    buf = g_malloc0(PAGE_SIZE);
+    buf[0] = 42;
+    buf = cache_swap_data(cache, 8 * PAGE_SIZE, buf, 4);
+    g_assert_cmpint(buf[0], ==, 8);
+    g_assert_cmpint(get_cached_data(cache, 8 * PAGE_SIZE)[0], ==, 42);
+
+    g_free(buf);
+    g_free(page);
+    cache_fini(cache);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +300,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_fuzz", test_encode_fuzz);
+    g_test_add_func("/xbzrle/page_cache_replace", test_page_cache_replace);
 
     return g_test_run();
 }
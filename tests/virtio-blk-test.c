@@ -723,6 +723,409 @@ static void test_nonexistent_virtqueue(void *obj, void *data,
     g_free(dev);
 }
 
+/*
+ * Add a one-sector read or write of @data to @vq, without making it
+ * available to the device.  The request is allocated at *@req_addr.
+ */
+static uint32_t virtio_blk_add_rw_sector(QVirtioDevice *dev,
+                                         QGuestAllocator *alloc,
+                                         QVirtQueue *vq, uint32_t type,
+                                         uint64_t sector, char *data,
+                                         uint64_t *req_addr)
+{
+    QVirtioBlkReq req;
+    uint32_t free_head;
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    if (type == VIRTIO_BLK_T_OUT) {
+        memcpy(req.data, data, 512);
+    }
+
+    *req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(vq, *req_addr, 16, false, true);
+    qvirtqueue_add(vq, *req_addr + 16, 512, type == VIRTIO_BLK_T_IN, true);
+    qvirtqueue_add(vq, *req_addr + 528, 1, true, false);
+
+    return free_head;
+}
+
+/* Submit a one-sector read or write of @data on @vq and wait for it */
+static void virtio_blk_rw_sector(QVirtioDevice *dev, QGuestAllocator *alloc,
+                                 QVirtQueue *vq, uint32_t type,
+                                 uint64_t sector, char *data)
+{
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint8_t status;
+
+    free_head = virtio_blk_add_rw_sector(dev, alloc, vq, type, sector, data,
+                                         &req_addr);
+    qvirtqueue_kick(dev, vq, free_head);
+
+    qvirtio_wait_used_elem(dev, vq, free_head, NULL, QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    if (type == VIRTIO_BLK_T_IN) {
+        memread(req_addr + 16, data, 512);
+    }
+
+    guest_free(alloc, req_addr);
+}
+
+/*
+ * With iothread-vq-mapping, each virtqueue is served by its own IOThread.
+ * Data written through one virtqueue must be visible through the other.
+ */
+static void iothread_vq_mapping(void *obj, void *data,
+                                QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioPCIDevice *pdev = &blk->pci_vdev;
+    QVirtioDevice *dev = &pdev->vdev;
+    QVirtQueue *vq[2];
+    uint32_t features;
+    char *buf;
+    int i;
+
+    g_assert_cmpint(qvirtio_config_readw(dev,
+                        offsetof(struct virtio_blk_config, num_queues)),
+                    ==, 2);
+
+    features = qvirtio_get_features(dev);
+    g_assert_cmphex(features & (1u << VIRTIO_BLK_F_MQ), !=, 0);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    for (i = 0; i < 2; i++) {
+        vq[i] = qvirtqueue_setup(dev, t_alloc, i);
+    }
+    qvirtio_set_driver_ok(dev);
+
+    buf = g_malloc0(512);
+    for (i = 0; i < 2; i++) {
+        memset(buf, 0, 512);
+        sprintf(buf, "TEST%d", i);
+        virtio_blk_rw_sector(dev, t_alloc, vq[i], VIRTIO_BLK_T_OUT, i, buf);
+    }
+    for (i = 0; i < 2; i++) {
+        char expected[8];
+
+        sprintf(expected, "TEST%d", i);
+        virtio_blk_rw_sector(dev, t_alloc, vq[1 - i], VIRTIO_BLK_T_IN, i, buf);
+        g_assert_cmpstr(buf, ==, expected);
+    }
+    g_free(buf);
+
+    for (i = 0; i < 2; i++) {
+        qvirtqueue_cleanup(dev->bus, vq[i], t_alloc);
+    }
+}
+
+#define IDX_BATCH_SIZE 4
+
+/*
+ * Make several requests available with a single avail index update, so
+ * that the device pops them as one batch, and check that the avail event
+ * it publishes covers the whole batch.
+ */
+static void idx_batch(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioDevice *dev = &blk->pci_vdev.vdev;
+    QVirtQueue *vq;
+    uint64_t req_addr[IDX_BATCH_SIZE];
+    uint32_t head[IDX_BATCH_SIZE];
+    bool done[IDX_BATCH_SIZE] = { false };
+    uint32_t features;
+    uint32_t desc_idx;
+    uint16_t avail_idx;
+    uint16_t avail_event;
+    char expected[16];
+    char *buf;
+    int i, j;
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_F_NOTIFY_ON_EMPTY) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+    qvirtio_set_driver_ok(dev);
+
+    /* The first used buffer is always notified, get it out of the way */
+    buf = g_malloc0(512);
+    virtio_blk_rw_sector(dev, t_alloc, vq, VIRTIO_BLK_T_OUT, 0, buf);
+
+    for (i = 0; i < IDX_BATCH_SIZE; i++) {
+        memset(buf, 0, 512);
+        sprintf(buf, "BATCH%d", i);
+        head[i] = virtio_blk_add_rw_sector(dev, t_alloc, vq, VIRTIO_BLK_T_OUT,
+                                           i, buf, &req_addr[i]);
+    }
+
+    /* vq->avail->idx */
+    avail_idx = readw(vq->avail + 2);
+    for (i = 0; i < IDX_BATCH_SIZE; i++) {
+        /* vq->avail->ring[(avail_idx + i) % vq->size] */
+        writew(vq->avail + 4 + 2 * ((avail_idx + i) % vq->size), head[i]);
+    }
+    writew(vq->avail + 2, avail_idx + IDX_BATCH_SIZE);
+
+    /* Notify once, after the last request of the batch */
+    qvirtqueue_set_used_event(vq, avail_idx + IDX_BATCH_SIZE - 1);
+    dev->bus->virtqueue_kick(dev, vq);
+
+    qvirtio_wait_queue_isr(dev, vq, QVIRTIO_BLK_TIMEOUT_US);
+
+    /* Requests may complete in any order */
+    for (i = 0; i < IDX_BATCH_SIZE; i++) {
+        g_assert(qvirtqueue_get_buf(vq, &desc_idx, NULL));
+        for (j = 0; j < IDX_BATCH_SIZE; j++) {
+            if (head[j] == desc_idx) {
+                break;
+            }
+        }
+        g_assert_cmpint(j, <, IDX_BATCH_SIZE);
+        g_assert(!done[j]);
+        done[j] = true;
+
+        g_assert_cmpint(readb(req_addr[j] + 528), ==, 0);
+        guest_free(t_alloc, req_addr[j]);
+    }
+    g_assert(!qvirtqueue_get_buf(vq, NULL, NULL));
+
+    /* vq->used->avail_event, the next kick is expected past the batch */
+    avail_event = readw(vq->used + 4 +
+                        sizeof(struct vring_used_elem) * vq->size);
+    g_assert_cmpint(avail_event, ==, avail_idx + IDX_BATCH_SIZE);
+
+    for (i = 0; i < IDX_BATCH_SIZE; i++) {
+        sprintf(expected, "BATCH%d", i);
+        memset(buf, 0, 512);
+        qvirtqueue_set_used_event(vq, vq->last_used_idx);
+        virtio_blk_rw_sector(dev, t_alloc, vq, VIRTIO_BLK_T_IN, i, buf);
+        g_assert_cmpstr(buf, ==, expected);
+    }
+    g_free(buf);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+/*
+ * Negotiate a packed virtqueue.  The device is modern-only, see the edge
+ * options in register_virtio_blk_test().
+ */
+static QVirtQueue *virtio_blk_packed_setup(QVirtioDevice *dev,
+                                           QGuestAllocator *alloc,
+                                           bool event_idx)
+{
+    QVirtQueue *vq;
+    uint64_t features;
+
+    features = qvirtio_get_features(dev);
+    g_assert_cmphex(features & (1ull << VIRTIO_F_VERSION_1), !=, 0);
+    g_assert_cmphex(features & (1ull << VIRTIO_F_RING_PACKED), !=, 0);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_F_NOTIFY_ON_EMPTY) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    if (!event_idx) {
+        features &= ~(1u << VIRTIO_RING_F_EVENT_IDX);
+    }
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, alloc, 0);
+    g_assert(vq->packed);
+
+    qvirtio_set_driver_ok(dev);
+    return vq;
+}
+
+static void packed_ring(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioDevice *dev = &blk->pci_vdev.vdev;
+    QVirtQueue *vq;
+    char expected[16];
+    char *buf;
+    int i;
+
+    vq = virtio_blk_packed_setup(dev, t_alloc, false);
+
+    /*
+     * Each request takes three descriptors: go around the ring twice so
+     * that both wrap counter values are used, with chains that straddle
+     * the end of the ring.
+     */
+    buf = g_malloc0(512);
+    for (i = 0; i <= vq->size / 3; i++) {
+        memset(buf, 0, 512);
+        sprintf(expected, "TEST%d", i);
+        strcpy(buf, expected);
+        virtio_blk_rw_sector(dev, t_alloc, vq, VIRTIO_BLK_T_OUT, i, buf);
+
+        memset(buf, 0, 512);
+        virtio_blk_rw_sector(dev, t_alloc, vq, VIRTIO_BLK_T_IN, i, buf);
+        g_assert_cmpstr(buf, ==, expected);
+    }
+    g_free(buf);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+#define PACKED_BATCH_SIZE 4
+
+static void packed_ring_batch(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioDevice *dev = &blk->pci_vdev.vdev;
+    QVirtQueue *vq;
+    uint64_t req_addr[PACKED_BATCH_SIZE];
+    uint32_t head[PACKED_BATCH_SIZE];
+    bool done[PACKED_BATCH_SIZE] = { false };
+    char expected[16];
+    gint64 start_time;
+    uint32_t desc_idx;
+    char *buf;
+    int i, n;
+
+    vq = virtio_blk_packed_setup(dev, t_alloc, false);
+
+    buf = g_malloc0(512);
+    for (i = 0; i < PACKED_BATCH_SIZE; i++) {
+        memset(buf, 0, 512);
+        sprintf(buf, "BATCH%d", i);
+        head[i] = virtio_blk_add_rw_sector(dev, t_alloc, vq, VIRTIO_BLK_T_OUT,
+                                           i, buf, &req_addr[i]);
+    }
+
+    /*
+     * The device does not look past the first buffer while it is not
+     * available, so making them available last to first has it pop the
+     * whole batch when the first one is kicked.
+     */
+    for (i = PACKED_BATCH_SIZE - 1; i >= 0; i--) {
+        qvirtqueue_kick(dev, vq, head[i]);
+    }
+
+    /* Requests may complete in any order */
+    start_time = g_get_monotonic_time();
+    for (n = 0; n < PACKED_BATCH_SIZE; ) {
+        clock_step(100);
+        if (!qvirtqueue_get_buf(vq, &desc_idx, NULL)) {
+            g_assert(g_get_monotonic_time() - start_time <=
+                     QVIRTIO_BLK_TIMEOUT_US);
+            continue;
+        }
+        for (i = 0; i < PACKED_BATCH_SIZE; i++) {
+            if (head[i] == desc_idx) {
+                break;
+            }
+        }
+        g_assert_cmpint(i, <, PACKED_BATCH_SIZE);
+        g_assert(!done[i]);
+        done[i] = true;
+        n++;
+
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+        guest_free(t_alloc, req_addr[i]);
+    }
+
+    for (i = 0; i < PACKED_BATCH_SIZE; i++) {
+        sprintf(expected, "BATCH%d", i);
+        memset(buf, 0, 512);
+        virtio_blk_rw_sector(dev, t_alloc, vq, VIRTIO_BLK_T_IN, i, buf);
+        g_assert_cmpstr(buf, ==, expected);
+    }
+    g_free(buf);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+static void packed_ring_event(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioDevice *dev = &blk->pci_vdev.vdev;
+    QVirtQueue *vq;
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint32_t write_head;
+    uint32_t desc_idx;
+    uint16_t flags;
+    uint8_t status;
+    char *buf;
+
+    vq = virtio_blk_packed_setup(dev, t_alloc, true);
+
+    buf = g_malloc0(512);
+    strcpy(buf, "TEST");
+    virtio_blk_rw_sector(dev, t_alloc, vq, VIRTIO_BLK_T_OUT, 0, buf);
+
+    /* With event index, the device asks for kicks in descriptor mode */
+    flags = readw(vq->used + 2);
+    if (qtest_big_endian(global_qtest)) {
+        flags = bswap16(flags);
+    }
+    g_assert_cmpint(flags, ==, VRING_PACKED_EVENT_FLAG_DESC);
+
+    /* No notification expected while the driver disables them */
+    qvirtqueue_set_used_notify(vq, false);
+    free_head = virtio_blk_add_rw_sector(dev, t_alloc, vq, VIRTIO_BLK_T_OUT,
+                                         1, buf, &req_addr);
+    qvirtqueue_kick(dev, vq, free_head);
+
+    status = qvirtio_wait_status_byte_no_isr(dev, vq, req_addr + 528,
+                                             QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(status, ==, 0);
+    g_assert(qvirtqueue_get_buf(vq, &desc_idx, NULL));
+    g_assert_cmpint(desc_idx, ==, free_head);
+    guest_free(t_alloc, req_addr);
+
+    /* Notify only once the request after this one is used */
+    write_head = virtio_blk_add_rw_sector(dev, t_alloc, vq, VIRTIO_BLK_T_OUT,
+                                          2, buf, &req_addr);
+    qvirtqueue_set_used_event(vq, vq->free_head);
+    qvirtqueue_kick(dev, vq, write_head);
+
+    status = qvirtio_wait_status_byte_no_isr(dev, vq, req_addr + 528,
+                                             QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(status, ==, 0);
+    guest_free(t_alloc, req_addr);
+
+    memset(buf, 0, 512);
+    free_head = virtio_blk_add_rw_sector(dev, t_alloc, vq, VIRTIO_BLK_T_IN,
+                                         2, buf, &req_addr);
+    qvirtqueue_kick(dev, vq, free_head);
+
+    /* We get just one notification for both requests */
+    qvirtio_wait_used_elem(dev, vq, write_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    g_assert(qvirtqueue_get_buf(vq, &desc_idx, NULL));
+    g_assert_cmpint(desc_idx, ==, free_head);
+
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+    memread(req_addr + 16, buf, 512);
+    g_assert_cmpstr(buf, ==, "TEST");
+
+    guest_free(t_alloc, req_addr);
+    g_free(buf);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
 static void resize(void *obj, void *data, QGuestAllocator *t_alloc)
 {
     QVirtioBlk *blk_if = obj;
@@ -760,6 +1163,13 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_blk_test_setup_iothreads(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line, " -object iothread,id=iothread0 "
+                              "-object iothread,id=iothread1 ");
+    return virtio_blk_test_setup(cmd_line, arg);
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
@@ -774,9 +1184,30 @@ static void register_virtio_blk_test(void)
     /* tests just for virtio-blk-pci */
     qos_add_test("msix", "virtio-blk-pci", msix, &opts);
     qos_add_test("idx", "virtio-blk-pci", idx, &opts);
+    qos_add_test("idx-batch", "virtio-blk-pci", idx_batch, &opts);
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+
+    opts.before = virtio_blk_test_setup_iothreads;
+    opts.edge = (QOSGraphEdgeOptions) {
+        .extra_device_opts = "num-queues=2,len-iothread-vq-mapping=2,"
+                             "iothread-vq-mapping[0]=iothread0,"
+                             "iothread-vq-mapping[1]=iothread1",
+    };
+    qos_add_test("iothread-vq-mapping", "virtio-blk-pci",
+                 iothread_vq_mapping, &opts);
+
+    /* libqos drives modern-only devices through the virtio 1.0 layout */
+    opts.before = virtio_blk_test_setup;
+    opts.edge = (QOSGraphEdgeOptions) {
+        .extra_device_opts = "disable-legacy=on,packed=on",
+    };
+    qos_add_test("packed-ring", "virtio-blk-pci", packed_ring, &opts);
+    qos_add_test("packed-ring-batch", "virtio-blk-pci",
+                 packed_ring_batch, &opts);
+    qos_add_test("packed-ring-event", "virtio-blk-pci",
+                 packed_ring_event, &opts);
 }
 
 libqos_init(register_virtio_blk_test);
@@ -304,6 +304,11 @@ static QemuOptsList qemu_accel_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Enable/disable multi-threaded TCG",
         },
+        {
+            .name = "dirty-ring-size",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Size of the KVM dirty ring of each vCPU",
+        },
         { /* end of list */ }
     },
 };